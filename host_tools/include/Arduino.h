@@ -0,0 +1,217 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Just enough of the Arduino API to build the macropad's portable headers
+// on a PC. Time is simulated and only moves when delay() is called, a
+// program calls hostsim::advance() or reads cost hostsim::readNs, so every
+// run is deterministic.
+
+#ifndef ARDUINO_H
+
+#define ARDUINO_H
+
+#include <array>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define INPUT_PULLDOWN 3
+
+#define DEC 10
+#define HEX 16
+
+// Seeed XIAO RP2040 pin numbers, as the earlephilhower core defines them
+#define D0 26u
+#define D1 27u
+#define D2 28u
+#define D3 29u
+#define D4 6u
+#define D5 7u
+#define D6 0u
+#define D7 1u
+#define D8 2u
+#define D9 4u
+#define D10 3u
+#define PIN_LED_R 17u
+#define PIN_LED_G 16u
+#define PIN_LED_B 25u
+#define LED_BUILTIN PIN_LED_R
+#define PIN_NEOPIXEL 12u
+#define NEOPIXEL_POWER 11u
+
+//--------------------------------------------------------------------+
+// Simulated Board
+//--------------------------------------------------------------------+
+
+namespace hostsim
+{
+  inline uint64_t now = 0;                     // simulated time in microseconds
+  inline std::array<bool, 32> level = {false}; // output level of each pin
+  inline std::array<uint8_t, 32> mode = {0};   // pinMode() of each pin
+
+  // the key matrix: bit n is pressed key n, row * 3 + column
+  inline uint16_t keys = 0;
+  inline std::array<uint8_t, 3> cols = {D8, D9, D10};
+  inline std::array<uint8_t, 3> rows = {D1, D2, D3};
+
+  // How long each row takes to fall back through its pulldown once nothing
+  // holds it up, and what a digitalRead() costs. All 0 is a perfect board.
+  inline std::array<uint32_t, 3> rowFallNs = {0};
+  inline uint32_t readNs = 0;
+  inline uint32_t nowFractionNs = 0;
+  inline std::array<uint64_t, 3> highUntilNs = {0};
+
+  inline void advance(uint64_t us)
+  {
+    now += us;
+  }
+
+  inline uint64_t nowNs()
+  {
+    return now * 1000 + nowFractionNs;
+  }
+
+  inline int rowIndex(uint8_t pin)
+  {
+    for (int r = 0; r < 3; r++)
+    {
+      if (rows[r] == pin)
+        return r;
+    }
+    return -1;
+  }
+
+  // row r was just let go of, it starts falling
+  inline void release(int r)
+  {
+    highUntilNs[r] = nowNs() + rowFallNs[r];
+  }
+}
+
+inline void pinMode(uint8_t pin, uint8_t mode)
+{
+  int r = hostsim::rowIndex(pin);
+  if (r >= 0 && hostsim::mode[pin] == INPUT_PULLUP && mode != INPUT_PULLUP)
+    hostsim::release(r);
+  hostsim::mode[pin] = mode;
+}
+
+inline void digitalWrite(uint8_t pin, bool value)
+{
+  for (int c = 0; c < 3; c++)
+  {
+    if (hostsim::cols[c] != pin || !hostsim::level[pin] || value)
+      continue;
+    for (int r = 0; r < 3; r++)
+    {
+      if (hostsim::keys & (1 << (r * 3 + c)))
+        hostsim::release(r);
+    }
+  }
+  hostsim::level[pin] = value;
+}
+
+inline int digitalRead(uint8_t pin)
+{
+  hostsim::nowFractionNs += hostsim::readNs;
+  hostsim::now += hostsim::nowFractionNs / 1000;
+  hostsim::nowFractionNs %= 1000;
+  for (int r = 0; r < 3; r++)
+  {
+    if (hostsim::rows[r] != pin)
+      continue;
+    for (int c = 0; c < 3; c++)
+    {
+      if (hostsim::level[hostsim::cols[c]] && (hostsim::keys & (1 << (r * 3 + c))))
+        return HIGH;
+    }
+    if (hostsim::mode[pin] == INPUT_PULLUP || hostsim::nowNs() < hostsim::highUntilNs[r])
+      return HIGH;
+    return LOW;
+  }
+  return hostsim::level[pin];
+}
+
+inline unsigned long micros()
+{
+  return (unsigned long)hostsim::now;
+}
+
+inline unsigned long millis()
+{
+  return (unsigned long)(hostsim::now / 1000);
+}
+
+inline void delayMicroseconds(unsigned int us)
+{
+  hostsim::advance(us);
+}
+
+inline void delay(unsigned long ms)
+{
+  hostsim::advance((uint64_t)ms * 1000);
+}
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+//--------------------------------------------------------------------+
+// Serial
+//--------------------------------------------------------------------+
+
+// Serial goes straight to stdout
+class HostSerial
+{
+public:
+  void begin(unsigned long) {}
+  void flush() { fflush(stdout); }
+  int available() { return 0; }
+  int read() { return -1; }
+  int availableForWrite() { return 64; }
+  operator bool() { return true; }
+
+  size_t print(const char *s) { return fputs(s, stdout) < 0 ? 0 : strlen(s); }
+  size_t print(char c) { return fputc(c, stdout) < 0 ? 0 : 1; }
+  size_t print(double d) { return printf("%.2f", d); }
+  size_t print(long n, int base = DEC) { return base == HEX ? printf("%lX", n) : printf("%ld", n); }
+  size_t print(unsigned long n, int base = DEC) { return base == HEX ? printf("%lX", n) : printf("%lu", n); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+
+  template <typename T>
+  size_t println(T value)
+  {
+    return print(value) + print('\n');
+  }
+  template <typename T>
+  size_t println(T value, int base)
+  {
+    return print(value, base) + print('\n');
+  }
+  size_t println() { return print('\n'); }
+
+  size_t printf(const char *format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n < 0 ? 0 : n;
+  }
+};
+
+inline HostSerial Serial;
+
+#endif
@@ -0,0 +1,32 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// The PASS/FAIL lines the sims print. Their main() ends with
+// return checkExit(), so a run with a failed check exits non-zero.
+
+#ifndef CHECK_H
+
+#define CHECK_H
+
+#include <cstdio>
+
+int failures = 0;
+
+void check(const char *name, bool ok)
+{
+  printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+  if (!ok)
+    failures++;
+}
+
+int checkExit()
+{
+  return failures ? 1 : 0;
+}
+
+#endif
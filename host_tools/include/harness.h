@@ -0,0 +1,213 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// What the sims and tools share for loading configs and driving the
+// keypad code: files, a leader store in memory, the keypages and the
+// keys typed at them. The sims keep only their scenarios.
+
+#ifndef HARNESS_H
+
+#define HARNESS_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "keypad.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//--------------------------------------------------------------------+
+// Files
+//--------------------------------------------------------------------+
+
+bool readFile(const char *path, std::vector<char> &data)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+  char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+  {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+// library.json, as the drive would have it
+std::string libraryJson;
+
+int32_t readLibrary(uint32_t offset, void *data, uint32_t len)
+{
+  if (offset > libraryJson.size())
+    return -1;
+  len = std::min<uint32_t>(len, libraryJson.size() - offset);
+  memcpy(data, libraryJson.data() + offset, len);
+  return len;
+}
+
+// the leader trie, as the pad's flash would have it
+std::vector<uint8_t> leaderImage;
+int leaderBegins = 0;
+LeaderSink leaderSink = {
+    [](const LeaderHeader &header)
+    {
+      leaderBegins++;
+      leaderImage.assign(header.size, 0xff);
+      return true;
+    },
+    [](uint32_t offset, const void *data, uint32_t len) { memcpy(&leaderImage[offset], data, len); },
+    [] {}};
+
+// a "leader" section's sequences sorted by their keys, which is what makes
+// compileLeader() quick for thousands of them
+std::vector<LeaderSequence> sortLeader(JsonObject leader)
+{
+  std::vector<LeaderSequence> sorted;
+  for (auto pair : leader["sequences"].as<JsonObject>())
+  {
+    sorted.push_back({pair.key().c_str(), pair.value(), nullptr});
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const LeaderSequence &a, const LeaderSequence &b) { return strcmp(a.keys, b.keys) < 0; });
+  return sorted;
+}
+
+//--------------------------------------------------------------------+
+// Configs
+//--------------------------------------------------------------------+
+
+// a page's "leds" with everything off
+const char *ledsOff = R"("leds": {"led1": false, "led2": false, "led3": false, "ledR": false, "ledG": false, "ledB": false, "neopixel": "000000"})";
+
+int configErrors = 0;
+
+void printConfigMessage(bool error, const char *text)
+{
+  configErrors += error;
+  printf("     config %s: %s\n", error ? "error" : "warning", text);
+}
+
+std::array<Keypage, 9> store;
+
+// parses json into keypages like the device, its leader sequences too, and
+// goes to page 0
+bool load(std::string json, ConfigReport &report)
+{
+  for (int i = 0; i < 9; i++)
+  {
+    keypages[i] = &store[i];
+  }
+  ConfigSettings settings;
+  leaderImage.clear();
+  if (!parseConfigJson(json.data(), json.size(), keypages, settings, report, &leaderSink))
+    return false;
+  leader.use(checkLeaderImage(leaderImage.data(), leaderImage.size()) ? leaderImage.data() : nullptr);
+  currpage = 0;
+  return true;
+}
+
+bool load(std::string json)
+{
+  ConfigReport report;
+  report.message = printConfigMessage;
+  return load(json, report);
+}
+
+//--------------------------------------------------------------------+
+// Keys
+//--------------------------------------------------------------------+
+
+// what the keypad typed: keys it held in the report, taps it queued and text
+KeyMask held = 0;
+std::vector<std::string> typed;
+
+std::string keyText(uint8_t mod, uint8_t key)
+{
+  return std::string(mod ? "mod+" : "") + keyName(key);
+}
+
+// one run of the keypad with the keys in held
+void pass()
+{
+  resolveKeys(held);
+  for (int i = 0; i < count; i++)
+  {
+    if (keycode[i] != HID_KEY_NONE) // a blank key, nothing to the host
+      typed.push_back(keyText(modifier, keycode[i]));
+  }
+  uint8_t mod;
+  std::array<uint8_t, 6> keys;
+  while (turns.busy())
+  {
+    turns.next(mod, keys);
+    if (keys[0])
+      typed.push_back(keyText(mod, keys[0]));
+  }
+  if (typer.busy())
+  {
+    std::string text;
+    while (typer.next(mod, keys))
+    {
+      for (uint8_t key : keys)
+      {
+        if (key >= HID_KEY_A && key <= HID_KEY_Z)
+          text += 'a' + key - HID_KEY_A;
+        else if (key >= HID_KEY_1 && key <= HID_KEY_9)
+          text += '1' + key - HID_KEY_1;
+        else if (key == HID_KEY_0)
+          text += '0';
+        else if (key == HID_KEY_SPACE)
+          text += ' ';
+      }
+    }
+    typed.push_back(text);
+  }
+}
+
+// presses and lets go of keys 1 to 9, 50ms each way
+void tap(const char *keys)
+{
+  for (; *keys; keys++)
+  {
+    held |= 1 << (*keys - '1');
+    pass();
+    hostsim::advance(50000);
+    held = 0;
+    pass();
+    hostsim::advance(50000);
+  }
+}
+
+// runs the keypad for ms with nothing pressed
+void wait(uint32_t ms)
+{
+  for (uint32_t i = 0; i < ms; i++)
+  {
+    hostsim::advance(1000);
+    pass();
+  }
+}
+
+// what was typed since the last call, separated by spaces
+std::string typedText()
+{
+  std::string all;
+  for (auto &key : typed)
+  {
+    all += (all.empty() ? "" : " ") + key;
+  }
+  typed.clear();
+  return all;
+}
+
+#endif
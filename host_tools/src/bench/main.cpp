@@ -0,0 +1,359 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Microbenchmarks for the firmware's hot paths, run on the PC.
+//
+//   bench [--save file] [--compare file] [--tolerance percent] [--allocs-only]
+//
+//   --save file       write the results as a baseline
+//   --compare file    compare against a saved baseline and exit 1 if
+//                     anything got slower than the tolerance (default 25%)
+//                     or allocates more than it used to
+//   --allocs-only     only compare the allocation counts, for a baseline
+//                     made on another machine
+//
+// Each result is the best of several runs, in ns per operation, along with
+// how many heap allocations one operation makes. The allocation counts are
+// the same on any machine, bench_baseline.txt has them for
+//
+//   bench --compare bench_baseline.txt --allocs-only
+
+#include "harness.h"
+#include <chrono>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+//--------------------------------------------------------------------+
+// Allocation Counting
+//--------------------------------------------------------------------+
+
+size_t allocations = 0;
+
+#if defined(__GLIBC__)
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+
+// ArduinoJson's default allocator uses malloc, so count those too
+extern "C" void *malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+  allocations++;
+  return __libc_realloc(p, size);
+}
+#endif
+
+// the standard operator delete frees with free(), so it can stay as it is
+void *operator new(size_t size)
+{
+#if defined(__GLIBC__)
+  void *p = __libc_malloc(size);
+#else
+  void *p = malloc(size);
+#endif
+  allocations++;
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+//--------------------------------------------------------------------+
+// Harness
+//--------------------------------------------------------------------+
+
+struct Result
+{
+  std::string name;
+  double ns;
+  double allocs;
+};
+
+std::vector<Result> results;
+
+// runs op in batches until a batch takes about 20 ms, keeps the best of 5
+template <typename F>
+void bench(const std::string &name, F op)
+{
+  using clock = std::chrono::steady_clock;
+  size_t iterations = 1;
+  double best = 1e30;
+  size_t allocs = 0;
+  for (int round = 0; round < 5;)
+  {
+    size_t before = allocations;
+    auto start = clock::now();
+    for (size_t i = 0; i < iterations; i++)
+    {
+      op(i);
+    }
+    double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    allocs = allocations - before;
+    if (ns < 20e6)
+    {
+      iterations *= 2;
+      continue;
+    }
+    best = std::min(best, ns / iterations);
+    round++;
+  }
+  results.push_back({name, best, (double)allocs / iterations});
+}
+
+//--------------------------------------------------------------------+
+// Inputs
+//--------------------------------------------------------------------+
+
+// page p, its first key changing to page next, using the different kinds of binding
+std::string makePage(int p, int next)
+{
+  const char *bindings[] = {"a", "shift+b", "ctl+alt+delete", "F5", "vol_up", "key_enter", "gui+left", "compose"};
+  std::string json = "{\"page\":" + std::to_string(p) + ",\"keys\":{";
+  json += "\"1\":\"page " + std::to_string(next) + "\"";
+  for (int k = 2; k <= 9; k++)
+  {
+    json += ",\"" + std::to_string(k) + "\":\"" + bindings[(k + p) % 8] + "\"";
+  }
+  json += "},\"leds\":{\"led1\":true,\"led2\":false,\"led3\":false,"
+          "\"ledR\":false,\"ledG\":true,\"ledB\":false,\"neopixel\":\"00ff00\"}}";
+  return json;
+}
+
+// a config with pages 0 to n-1
+std::string makeConfig(int n)
+{
+  std::string json = "{\"pages\":[";
+  for (int p = 0; p < n; p++)
+  {
+    json += (p ? "," : "") + makePage(p, (p + 1) % n);
+  }
+  json += "]}";
+  return json;
+}
+
+// a library.json with n pages from 9 up, each changing to the next
+void makeLibrary(int n)
+{
+  libraryJson = "{\"pages\":[";
+  for (int p = LIBRARY_FIRST_PAGE; p < LIBRARY_FIRST_PAGE + n; p++)
+  {
+    libraryJson += (p > LIBRARY_FIRST_PAGE ? ",\n" : "\n") + makePage(p, p + 1 < LIBRARY_FIRST_PAGE + n ? p + 1 : 0);
+  }
+  libraryJson += "\n]}";
+}
+
+//--------------------------------------------------------------------+
+// Baselines
+//--------------------------------------------------------------------+
+
+bool saveBaseline(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  for (auto &r : results)
+  {
+    fprintf(f, "%s %.1f %.2f\n", r.name.c_str(), r.ns, r.allocs);
+  }
+  fclose(f);
+  return true;
+}
+
+std::map<std::string, Result> loadBaseline(const char *path)
+{
+  std::map<std::string, Result> baseline;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return baseline;
+  char line[256];
+  char name[128];
+  double ns, allocs;
+  while (fgets(line, sizeof(line), f))
+  {
+    // lines starting with # are comments
+    if (line[0] != '#' && sscanf(line, "%127s %lf %lf", name, &ns, &allocs) == 3)
+      baseline[name] = {name, ns, allocs};
+  }
+  fclose(f);
+  return baseline;
+}
+
+//--------------------------------------------------------------------+
+// Main
+//--------------------------------------------------------------------+
+
+int main(int argc, char **argv)
+{
+  const char *save = nullptr;
+  const char *compare = nullptr;
+  double tolerance = 25;
+  bool allocsOnly = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--save") && i + 1 < argc)
+      save = argv[++i];
+    else if (!strcmp(argv[i], "--compare") && i + 1 < argc)
+      compare = argv[++i];
+    else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+      tolerance = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--allocs-only"))
+      allocsOnly = true;
+    else
+    {
+      fprintf(stderr, "usage: bench [--save file] [--compare file] [--tolerance percent] [--allocs-only]\n");
+      return 2;
+    }
+  }
+
+  static std::array<Keypage, 9> store;
+  for (int i = 0; i < 9; i++)
+  {
+    keypages[i] = &store[i];
+  }
+  ConfigSettings settings;
+  ConfigReport report;
+
+  // parseConfig from 1 to 9 pages. The parser works in place, so each
+  // run gets a fresh copy (the copy is part of the time).
+  for (int n = 1; n <= 9; n++)
+  {
+    std::string json = makeConfig(n);
+    std::vector<char> buffer(json.size());
+    bench("parseConfigJson/" + std::to_string(n) + "pages", [&](size_t) {
+      memcpy(buffer.data(), json.data(), json.size());
+      if (!parseConfigJson(buffer.data(), buffer.size(), keypages, settings, report))
+        abort();
+    });
+  }
+
+  KeymapImage image;
+  bench("compileKeymap", [&](size_t) { compileKeymap(keypages, settings, image); });
+  bench("loadKeymap", [&](size_t) {
+    if (!loadKeymap(image, keypages, settings))
+      abort();
+  });
+
+  // keymap lookups: the first and last names in the table, and a miss
+  volatile uint8_t sink;
+  bench("lookupKey/first", [&](size_t) { sink = lookupKey(keymap[0].name); });
+  bench("lookupKey/last", [&](size_t) { sink = lookupKey(keymap[keymapSize - 1].name); });
+  bench("lookupKey/miss", [&](size_t) { sink = lookupKey("no_such_key"); });
+
+  // the keypad path, on a page where every key but the first sends something
+  currpage = 0;
+  bench("handleKeypress", [&](size_t i) {
+    count = 0;
+    handleKeypress(1 + i % 8);
+  });
+  bench("resolveKeys/1key", [&](size_t) { sink = resolveKeys(1 << 4); });
+  bench("resolveKeys/6keys", [&](size_t) { sink = resolveKeys(0x1f8); });
+  bench("resolveKeys/8keys", [&](size_t) { sink = resolveKeys(0x1fe); });
+
+  // typing a text binding, per report, on every layout. How many reports
+  // it takes is what sets the typing speed at one report per 1ms poll.
+  const char *sample = "Hello, this is the RP9 typing a signature.\n\tBest regards,\n  J. Smith <j.smith@example.com> (555) 010-0199";
+  std::array<double, LAYOUT_COUNT> charsPerSecond;
+  for (int layout = 0; layout < LAYOUT_COUNT; layout++)
+  {
+    TextTyper typer;
+    std::array<uint8_t, 6> keys;
+    uint8_t mod;
+    size_t reports = 0;
+    typer.start(sample, (TextLayout)layout, UNICODE_NONE);
+    while (typer.next(mod, keys))
+    {
+      reports++;
+    }
+    charsPerSecond[layout] = strlen(sample) * 1000.0 / reports;
+
+    bench(std::string("TextTyper/") + layoutNames[layout], [&](size_t) {
+      if (!typer.next(mod, keys))
+        typer.start(sample, (TextLayout)layout, UNICODE_NONE);
+      sink = keys[0];
+    });
+  }
+  (void)sink;
+
+  // library pages: indexing 200 of them, then changing between two that
+  // stay parsed, and round more than the cache holds so every change parses
+  makeLibrary(200);
+  library.read = readLibrary;
+  volatile int pages;
+  bench("PageLibrary/index200", [&](size_t) { pages = library.index(libraryJson.size()); });
+  if (pages != 200)
+    abort();
+  bench("changePage/cached", [&](size_t i) { changePage(i % 2 ? 10 : 11); });
+  bench("changePage/uncached", [&](size_t i) { changePage(LIBRARY_FIRST_PAGE + i % (LIBRARY_CACHE_PAGES + 4)); });
+  if (library.failed)
+    abort();
+  changePage(0);
+
+  std::map<std::string, Result> baseline;
+  if (compare)
+  {
+    baseline = loadBaseline(compare);
+    if (baseline.empty())
+    {
+      fprintf(stderr, "%s: no baseline in it\n", compare);
+      return 2;
+    }
+  }
+
+  int regressions = 0;
+  printf("%-28s %12s %10s %12s\n", "benchmark", "ns/op", "allocs/op", "vs baseline");
+  for (auto &r : results)
+  {
+    printf("%-28s %12.1f %10.2f", r.name.c_str(), r.ns, r.allocs);
+    auto base = baseline.find(r.name);
+    if (base != baseline.end())
+    {
+      double change = (r.ns / base->second.ns - 1) * 100;
+      bool slower = !allocsOnly && change > tolerance;
+      bool allocates = r.allocs > base->second.allocs + 0.005;
+      printf(" %+11.1f%%%s%s", change, slower ? " SLOWER" : "", allocates ? " MORE ALLOCS" : "");
+      regressions += slower || allocates;
+    }
+    printf("\n");
+  }
+
+  printf("\ntext typed at one report per 1ms:");
+  for (int layout = 0; layout < LAYOUT_COUNT; layout++)
+  {
+    printf(" %s %.0f chars/s", layoutNames[layout], charsPerSecond[layout]);
+  }
+  printf("\n");
+
+  if (save && !saveBaseline(save))
+  {
+    fprintf(stderr, "can't write %s\n", save);
+    return 2;
+  }
+  if (regressions)
+  {
+    printf("%d regression(s) against %s\n", regressions, compare);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,269 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Wires up a ring of simulated pads, each with its own loop period, over
+// serial links that take 10us a byte (1Mbaud) and can lose or garble
+// bytes. Checks that keys get to the primary and the page gets to
+// everyone quickly, and that lost frames and unplugged pads are dealt
+// with. Exits non-zero if any check fails.
+
+#include <Arduino.h>
+#include "keypad.h"
+#include "check.h"
+#include <deque>
+#include <random>
+
+#define BYTE_US (10 * 1000000 / CHAIN_BAUD)
+
+struct Byte
+{
+  uint64_t at; // when it's all in at the other end
+  uint8_t value;
+};
+
+struct Pad
+{
+  ChainLink link;
+  KeyMask keys = 0;  // what's held on it
+  int page = 0;      // primary only
+  uint32_t loopUs;   // how long its loop takes
+  uint64_t nextLoop; // when it next gets round to the chain
+  uint64_t lineFree = 0; // its TX is busy until then
+  std::deque<Byte> rx;
+  bool unplugged = false;
+};
+
+std::vector<Pad> pads;
+uint64_t now = 0;
+int sender = 0;
+std::mt19937 rng(9);
+double loss = 0;    // chance a byte is lost
+double garble = 0;  // chance a byte arrives wrong
+
+// each pad sends to the next one round the ring
+void sendBytes(const uint8_t *data, size_t len)
+{
+  Pad &from = pads[sender];
+  Pad &to = pads[(sender + 1) % pads.size()];
+  std::uniform_real_distribution<double> chance(0, 1);
+  for (size_t i = 0; i < len; i++)
+  {
+    from.lineFree = (from.lineFree > now ? from.lineFree : now) + BYTE_US;
+    if (from.unplugged || chance(rng) < loss)
+      continue;
+    uint8_t value = data[i];
+    if (chance(rng) < garble)
+      value ^= 1 << (rng() % 8);
+    to.rx.push_back({from.lineFree, value});
+  }
+}
+
+void build(int count, std::vector<uint32_t> loops)
+{
+  pads.assign(count, Pad());
+  for (int p = 0; p < count; p++)
+  {
+    pads[p].link.pad = p;
+    pads[p].link.send = sendBytes;
+    pads[p].loopUs = loops[p];
+    pads[p].nextLoop = rng() % loops[p];
+  }
+  now = 0;
+}
+
+// runs every pad's loop until the time given
+void runUntil(uint64_t until)
+{
+  while (true)
+  {
+    int next = 0;
+    for (size_t p = 1; p < pads.size(); p++)
+    {
+      if (pads[p].nextLoop < pads[next].nextLoop)
+        next = p;
+    }
+    if (pads[next].nextLoop > until)
+      break;
+    now = pads[next].nextLoop;
+    Pad &pad = pads[next];
+    sender = next;
+    while (!pad.rx.empty() && pad.rx.front().at <= now)
+    {
+      pad.link.receive(pad.rx.front().value, now / 1000);
+      pad.rx.pop_front();
+    }
+    pad.link.update(pad.keys, next ? 0 : pad.page, now / 1000);
+    pad.nextLoop += pad.loopUs;
+  }
+  now = until;
+}
+
+// how long until the primary sees pad's keys as they are now, in us
+uint64_t keyLatency(int pad)
+{
+  uint64_t start = now;
+  while (pads[0].link.keys[pad] != pads[pad].keys && now - start < 100000)
+  {
+    runUntil(now + 5);
+  }
+  return now - start;
+}
+
+uint64_t pageLatency()
+{
+  uint64_t start = now;
+  auto arrived = [&]()
+  {
+    for (size_t p = 1; p < pads.size(); p++)
+    {
+      if (pads[p].link.page != pads[0].page)
+        return false;
+    }
+    return true;
+  };
+  while (!arrived() && now - start < 100000)
+  {
+    runUntil(now + 5);
+  }
+  return now - start;
+}
+
+int main()
+{
+  // the frame survives the trip and a single flipped bit never gets through
+  uint8_t bytes[CHAIN_FRAME_SIZE];
+  encodeFrame({CHAIN_KEYS_DELTA, 2, 77, 0x1a5}, bytes);
+  FrameParser parser;
+  ChainFrame frame = {};
+  bool got = false;
+  for (auto b : bytes)
+  {
+    got = parser.feed(b, frame);
+  }
+  check("a frame decodes", got && frame.type == CHAIN_KEYS_DELTA && frame.pad == 2 && frame.seq == 77 && frame.data == 0x1a5);
+  int caught = 0;
+  for (int bit = 8; bit < CHAIN_FRAME_SIZE * 8; bit++)
+  {
+    uint8_t bad[CHAIN_FRAME_SIZE];
+    memcpy(bad, bytes, sizeof(bad));
+    bad[bit / 8] ^= 1 << (bit % 8);
+    FrameParser fresh;
+    bool any = false;
+    for (auto b : bad)
+    {
+      any |= fresh.feed(b, frame);
+    }
+    caught += !any;
+  }
+  check("every single bit error is caught", caught == (CHAIN_FRAME_SIZE - 1) * 8);
+
+  // two pads, loops of 120us and 350us
+  build(2, {120, 350});
+  runUntil(200000);
+  uint64_t worst = 0;
+  for (int i = 0; i < 200; i++)
+  {
+    pads[1].keys = rng() & 0x1ff;
+    worst = std::max(worst, keyLatency(1));
+    runUntil(now + rng() % 3000);
+  }
+  char name[100];
+  snprintf(name, sizeof(name), "two pads: keys reach the primary within 1ms (worst %lluus)", (unsigned long long)worst);
+  check(name, worst < 1000);
+
+  // three in a ring, pad 1's frames go through pad 2 on the way
+  build(3, {120, 350, 200});
+  runUntil(200000);
+  uint64_t worstKeys = 0;
+  uint64_t worstPage = 0;
+  for (int i = 0; i < 200; i++)
+  {
+    int pad = 1 + i % 2;
+    pads[pad].keys = rng() & 0x1ff;
+    worstKeys = std::max(worstKeys, keyLatency(pad));
+    pads[0].page = rng() % 9;
+    worstPage = std::max(worstPage, pageLatency());
+    runUntil(now + rng() % 3000);
+  }
+  snprintf(name, sizeof(name), "three pads: keys reach the primary within 1ms (worst %lluus)", (unsigned long long)worstKeys);
+  check(name, worstKeys < 1000);
+  snprintf(name, sizeof(name), "three pads: the page reaches everyone within 1ms (worst %lluus)", (unsigned long long)worstPage);
+  check(name, worstPage < 1000);
+
+  // a bad line: keys change every few ms, the primary's idea of them may
+  // be wrong but never for long
+  build(3, {120, 350, 200});
+  loss = 0.01;
+  garble = 0.01;
+  runUntil(200000);
+  uint64_t wrongSince[CHAIN_MAX_PADS] = {};
+  uint64_t longestWrong = 0;
+  for (int ms = 0; ms < 20000; ms++)
+  {
+    if (ms % 7 == 0)
+      pads[1 + rng() % 2].keys = rng() & 0x1ff;
+    runUntil(now + 1000);
+    for (int p = 1; p < 3; p++)
+    {
+      if (pads[0].link.keys[p] == pads[p].keys)
+        wrongSince[p] = now;
+      longestWrong = std::max(longestWrong, now - wrongSince[p]);
+    }
+  }
+  loss = garble = 0;
+  printf("     %u frames, %u lost, %u bad on the primary\n", pads[0].link.frames, pads[0].link.gaps,
+         pads[0].link.parser.crcErrors);
+  check("a bad line gets noticed", pads[0].link.gaps && pads[0].link.parser.crcErrors);
+  // a frame in ten doesn't make it, so a full state can go missing too
+  snprintf(name, sizeof(name), "lost frames are made good within a few heartbeats (worst %llums)", (unsigned long long)longestWrong / 1000);
+  check(name, longestWrong <= 3 * CHAIN_HEARTBEAT_MS * 1000);
+
+  // pad 2 is unplugged with keys held on it and on pad 1, which sends
+  // through it. Nothing gets stuck down.
+  pads[1].keys = 0x03;
+  pads[2].keys = 0x11;
+  runUntil(now + 10000);
+  bool held = pads[0].link.keys[1] == 0x03 && pads[0].link.keys[2] == 0x11;
+  pads[2].unplugged = true;
+  uint64_t unplugged = now;
+  while ((pads[0].link.keys[1] || pads[0].link.keys[2]) && now - unplugged < 1000000)
+  {
+    runUntil(now + 1000);
+  }
+  check("keys are let go when the ring is broken", held && now - unplugged <= (CHAIN_TIMEOUT_MS + 2) * 1000);
+  check("the primary knows it's on its own", !pads[0].link.active(now / 1000));
+  pads[2].unplugged = false;
+  runUntil(now + 100000);
+  check("and picks up again when it's fixed", pads[0].link.keys[1] == 0x03 && pads[0].link.keys[2] == 0x11);
+
+  // the primary types the other pads' keys from the pages they're given
+  std::array<Keypage, 9> store;
+  for (int p = 0; p < 9; p++)
+  {
+    keypages[p] = &store[p];
+    store[p].page = p;
+    store[p].padPage.fill(p);
+    store[p].pagechange.fill(NO_PAGE_CHANGE);
+    store[p].hidcode.fill(HID_KEY_A + p);
+  }
+  store[0].padPage[0] = 3;
+  store[0].hidcode[4] = HID_KEY_B;
+  store[3].pagechange[8] = 2;
+  currpage = 0;
+  resolveKeys(PadKeys{1 << 4, 1 << 0});
+  check("pads' keys come out of their own pages", count == 2 && keycode[0] == HID_KEY_B && keycode[1] == HID_KEY_A + 3);
+  resolveKeys(PadKeys{0, 1 << 8});
+  check("a page key on another pad changes everyone's page", currpage == 2 && pagechanged);
+
+  return checkExit();
+}
@@ -0,0 +1,158 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Turns a simulated encoder on D4/D5, calling the decoder for every edge
+// the way the pin change interrupt does, and checks what comes out the
+// other end: detents, key reports and wheel reports. Exits non-zero if
+// any check fails.
+
+#include <Arduino.h>
+#include "keypad.h"
+#include "check.h"
+
+QuadratureDecoder encoder;
+
+// the pins go 00, 10, 11, 01 turning clockwise (A leads) with the detent at 11
+const uint8_t sequence[4] = {0b11, 0b01, 0b00, 0b10};
+int phase = 0;
+
+void setPins(uint8_t ab)
+{
+  hostsim::level[ENCODER1_A] = ab >> 1;
+  hostsim::level[ENCODER1_B] = ab & 1;
+}
+
+// one quadrature step, one pin changes and interrupts
+void step(int direction)
+{
+  phase = (phase + direction + 4) % 4;
+  setPins(sequence[phase]);
+  encoder.update();
+}
+
+void turn(int detents)
+{
+  for (int i = 0; i < abs(detents) * ENCODER_STEPS_PER_DETENT; i++)
+  {
+    step(detents > 0 ? 1 : -1);
+  }
+}
+
+int main()
+{
+  setPins(sequence[0]);
+  encoder.begin(ENCODER1_A, ENCODER1_B);
+
+  turn(3);
+  check("three detents clockwise", encoder.takeDetents() == 3);
+  turn(-5);
+  check("five detents back", encoder.takeDetents() == -5);
+
+  // the loop was busy for a long while, none of it is lost
+  turn(1000);
+  check("1000 detents between two looks", encoder.takeDetents() == 1000);
+
+  step(1);
+  step(1);
+  int32_t half = encoder.takeDetents();
+  step(1);
+  step(1);
+  check("half a detent waits for the rest", half == 0 && encoder.takeDetents() == 1);
+
+  // contact bounce: one pin chatters between two states
+  for (int i = 0; i < 20; i++)
+  {
+    step(1);
+    step(-1);
+  }
+  check("bounce adds up to nothing", encoder.takeDetents() == 0 && encoder.steps == 0);
+
+  // keys bound to the turns, on page 0
+  Keypage page;
+  page.turnHid[ENCODER_CW] = HID_KEY_ARROW_UP;
+  page.turnHid[ENCODER_CCW] = HID_KEY_ARROW_DOWN;
+  page.turnMod[ENCODER_CCW] = KEYBOARD_MODIFIER_LEFTSHIFT;
+  keypages[0] = &page;
+  currpage = 0;
+
+  // a fast spin: every detent is a press and a release, in order
+  handleTurn(0, 3);
+  handleTurn(0, 2);
+  handleTurn(0, -2);
+  uint8_t mod;
+  std::array<uint8_t, 6> keys;
+  int ups = 0, downs = 0, reports = 0;
+  bool alternates = true;
+  bool inOrder = true;
+  while (turns.busy())
+  {
+    turns.next(mod, keys);
+    bool press = keys[0];
+    alternates &= press == !(reports & 1);
+    if (keys[0] == HID_KEY_ARROW_UP)
+    {
+      ups++;
+      inOrder &= !downs && !mod;
+    }
+    else if (keys[0] == HID_KEY_ARROW_DOWN)
+    {
+      downs++;
+      inOrder &= mod == KEYBOARD_MODIFIER_LEFTSHIFT;
+    }
+    reports++;
+  }
+  check("five up, two shift+down", ups == 5 && downs == 2 && inOrder);
+  check("a press and a release report per detent", alternates && reports == 14);
+
+  // turns keep coming while the queue is being typed
+  handleTurn(0, 1);
+  turns.next(mod, keys);
+  handleTurn(0, 1);
+  reports = 1;
+  while (turns.busy())
+  {
+    turns.next(mod, keys);
+    reports++;
+  }
+  check("turns added while typing join the run", reports == 4 && !turns.dropped);
+
+  // scrolling: detents pile up into as few wheel reports as fit
+  page.turnMouse[ENCODER_CW] = MOUSE_WHEEL_UP;
+  page.turnMouse[ENCODER_CCW] = MOUSE_WHEEL_DOWN;
+  MouseKeys mouse;
+  mouse.scroll(handleTurn(0, 40));
+  mouse.tick(0);
+  MouseReport report = mouse.send();
+  check("40 detents are one wheel report", report.wheel == 40 && !turns.busy());
+
+  mouse.scroll(handleTurn(0, -300));
+  int wheel = 0;
+  int wheelReports = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    mouse.tick(0);
+    if (mouse.pending())
+    {
+      wheel += mouse.send().wheel;
+      wheelReports++;
+    }
+  }
+  check("300 detents are three wheel reports", wheel == -300 && wheelReports == 3);
+
+  // held wheel keys and the encoder scroll together
+  mouse.scroll(handleTurn(0, 5));
+  mouse.tick(1 << MOUSE_WHEEL_UP);
+  check("encoder and wheel keys add up", mouse.send().wheel == 6);
+
+  return checkExit();
+}
@@ -0,0 +1,212 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Compiles leader sequences from a config.json into a trie the way the
+// device does, then types sequences at the keypad code: whole ones, ones
+// that are the start of longer ones, misses and timeouts. Finishes with a
+// few thousand sequences like an rp9config -l leader.bin would have.
+// Exits non-zero if any check fails.
+
+#include "harness.h"
+#include "check.h"
+#include <chrono>
+
+int main()
+{
+  std::string config = std::string(R"({
+    "pages": [
+      {"page": 0, "keys": {"1": "leader", "2": "a", "3": "b", "4": "c", "5": "e", "6": "f", "7": "g", "8": "h", "9": "page 1"}, )") +
+                       ledsOff + R"(},
+      {"page": 1, "keys": {"1": "leader", "2": "d", "3": "b", "4": "c", "5": "e", "6": "f", "7": "g", "8": "h", "9": "page 0"}, )" +
+                       ledsOff + R"(}
+    ],
+    "leader": {"timeout": 500, "sequences": {
+      "2": "x", "23": "ctl+s", "234": "text done", "5": "page 1", "99": "F5", "87654322": "z"
+    }}
+  })";
+  check("a config with leader sequences loads", load(config) && leader.loaded());
+  if (!leader.loaded())
+    return 1;
+  const LeaderHeader &header = leader.header();
+  check("and compiles them into a trie", header.sequences == 6 && header.timeoutMs == 500 && leaderBegins == 1);
+  printf("     %u sequences, %u nodes, %zu bytes\n", header.sequences, header.nodes, leaderImage.size());
+
+  tap("2");
+  check("keys work as usual without the leader", typedText() == "a");
+
+  tap("199");
+  check("a whole sequence is typed as soon as it's in", typedText() == "F5");
+  tap("2");
+  check("and keys are back to normal after", typedText() == "a");
+
+  tap("123");
+  check("a sequence that starts longer ones waits", typedText() == "");
+  wait(390); // tap() waited 100ms after the last key already
+  check("until the timeout", typedText() == "");
+  wait(20);
+  check("then it's the one typed", typedText() == "mod+s");
+
+  tap("1234");
+  check("the longest goes straight away", typedText() == "done");
+
+  tap("1237");
+  check("a key that doesn't follow types what there was", typedText() == "mod+s");
+  tap("3");
+  check("and the key that ended it does nothing else", typedText() == "b");
+
+  tap("196");
+  check("a miss with nothing to type does nothing", typedText() == "" && !leader.active());
+
+  tap("1912");
+  check("the leader again starts over", typedText() == "" && leader.active());
+  wait(600);
+  check("the start over is matched on its own", typedText() == "x");
+
+  tap("15");
+  check("a sequence can change pages", currpage == 1 && pagechanged && typedText() == "");
+  tap("2");
+  check("to that page's keys", typedText() == "d");
+  tap("9");
+
+  tap("187654322");
+  check("eight keys deep", typedText() == "z");
+
+  // the leader held down, the sequence under it
+  held = 1;
+  pass();
+  for (char key : std::string("99"))
+  {
+    held |= 1 << (key - '1');
+    pass();
+    held = 1;
+    pass();
+  }
+  held = 0;
+  pass();
+  check("with the leader held the same", typedText() == "F5");
+
+  // 2 to 9 at once fills the report, 9 still changes pages
+  held = 0x1fe;
+  pass();
+  bool full = count == 6;
+  held = 0;
+  pass();
+  check("keys past a full report still act", full && currpage == 1);
+  typedText();
+  tap("9");
+
+  // the same again doesn't write the flash
+  leaderBegins = 0;
+  check("loading the same sequences again leaves the store alone", load(config) && leaderBegins == 1);
+
+  // the device's config.json is rendered with the sequences in it, and
+  // comes back to the same trie
+  std::vector<uint8_t> first = leaderImage;
+  std::vector<char> text(CONFIG_MAX_SIZE);
+  ConfigSettings settings;
+  size_t len = renderConfigJson(keypages, settings, text.data(), text.size(), first.data());
+  check("rendered config.json has the sequences", len && strstr(text.data(), "\"234\": \"text done\""));
+  check("and compiles back into the same trie", load(std::string(text.data(), len)) && leaderImage == first);
+
+  // a host sorting them first makes the same trie, much faster
+  DynamicJsonDocument small(4096);
+  std::string json = config;
+  deserializeJson(small, json.data(), json.size());
+  std::vector<LeaderSequence> order = sortLeader(small["leader"]);
+  ConfigReport report;
+  leaderImage.clear();
+  check("sorted first they compile into the same trie",
+        compileLeader(small["leader"], &leaderSink, report, order.data()) && leaderImage == first);
+
+  // sequences that don't make sense
+  ConfigReport quiet;
+  std::string page = std::string(R"({"pages": [{"page": 0, "keys": {"1": "leader", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "a"}, )") +
+                     ledsOff + "}], ";
+  const char *bad[] = {
+      R"("leader": {"sequences": {"20": "a"}}})",
+      R"("leader": {"sequences": {"123456789": "a"}}})",
+      R"("leader": {"sequences": {"1": "leader"}}})",
+      R"("leader": {"sequences": {"1": "page 255"}}})",
+      R"("leader": {"timeout": 5, "sequences": {"1": "a"}}})",
+      R"("leader": ["1"]})",
+  };
+  int rejected = 0;
+  for (auto json : bad)
+  {
+    std::string copy = page + json;
+    ConfigSettings s;
+    rejected += !parseConfigJson(copy.data(), copy.size(), keypages, s, quiet);
+  }
+  check("bad sequences are errors", rejected == 6);
+
+  std::vector<uint8_t> broken = first;
+  broken[LEADER_HEADER_SIZE + 3] ^= 1;
+  check("a damaged trie isn't used", !checkLeaderImage(broken.data(), broken.size()) &&
+                                         !checkLeaderImage(first.data(), first.size() - 1));
+
+  // thousands of sequences: every 4 key one, some text
+  std::string big = "{\"leader\": {\"sequences\": {";
+  int sequences = 0;
+  for (int n = 0; n < 6561; n++)
+  {
+    char keys[5];
+    for (int k = 0, v = n; k < 4; k++, v /= 9)
+    {
+      keys[3 - k] = '1' + v % 9;
+    }
+    keys[4] = 0;
+    char binding[32];
+    if (n % 10 == 0)
+      snprintf(binding, sizeof(binding), "text seq %s", keys);
+    else
+      snprintf(binding, sizeof(binding), "%c", 'a' + n % 26);
+    big += std::string(sequences++ ? "," : "") + "\"" + keys + "\": \"" + binding + "\"";
+  }
+  big += "}}}";
+  DynamicJsonDocument doc(big.size() * 4 + 1024);
+  deserializeJson(doc, big.data(), big.size());
+  auto start = std::chrono::steady_clock::now();
+  leaderImage.clear();
+  std::vector<LeaderSequence> sorted = sortLeader(doc["leader"]);
+  bool compiled = compileLeader(doc["leader"], &leaderSink, quiet, sorted.data());
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  check("6561 sequences compile", compiled && checkLeaderImage(leaderImage.data(), leaderImage.size()));
+  printf("     %zu bytes of flash for %d sequences, compiled in %.0f ms\n", leaderImage.size(), sequences, ms);
+
+  LeaderMatcher matcher;
+  matcher.use(leaderImage.data());
+  bool allMatch = true;
+  for (int n = 0; n < 6561; n += 7)
+  {
+    char keys[5];
+    for (int k = 0, v = n; k < 4; k++, v /= 9)
+    {
+      keys[3 - k] = '1' + v % 9;
+    }
+    keys[4] = 0;
+    matcher.start(0);
+    const LeaderNode *node = nullptr;
+    for (int k = 0; k < 4; k++)
+    {
+      node = matcher.press(keys[k] - '1', 0);
+    }
+    if (n % 10 == 0)
+      allMatch &= node && node->action == LEADER_TEXT && !strcmp(matcher.text(*node) + 4, keys);
+    else
+      allMatch &= node && node->action == LEADER_KEY && node->value == HID_KEY_A + n % 26;
+  }
+  check("and every one matches what it's bound to", allMatch);
+  check("the matcher is the same few bytes for any number", sizeof(LeaderMatcher) <= 24);
+
+  return checkExit();
+}
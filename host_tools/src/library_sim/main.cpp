@@ -0,0 +1,213 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Indexes a library.json of 200 pages the way the device does and pages
+// through it with the keypad code: pages parsed when they're changed to,
+// the ones they change to prefetched, the cache dropping the oldest but
+// never the current page, and broken or changed files. Exits non-zero if
+// any check fails.
+
+#include "harness.h"
+#include "check.h"
+
+// the library pages' LEDs, so it shows which page they come from
+const char *pageLeds = R"("leds": {"led1": true, "led2": false, "led3": false, "ledR": false, "ledG": false, "ledB": false, "neopixel": "0000ff"})";
+
+// page p: 1 goes on to the next page, 2 types its number, 3 is a letter
+// and 9 goes home
+std::string libraryPage(int p, int last)
+{
+  char text[512];
+  snprintf(text, sizeof(text),
+           R"({"page": %d, "keys": {"1": "page %d", "2": "text page %d", "3": "%c", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "page 0"}, %s})",
+           p, p < last ? p + 1 : LIBRARY_FIRST_PAGE, p, 'a' + p % 26, pageLeds);
+  return text;
+}
+
+void makeLibrary(int first, int last)
+{
+  libraryJson = "{\"pages\": [";
+  for (int p = first; p <= last; p++)
+  {
+    libraryJson += (p > first ? ",\n  " : "\n  ") + libraryPage(p, last);
+  }
+  libraryJson += "\n]}\n";
+}
+
+// runs the background task until the library has nothing left to prefetch
+int prefetchAll()
+{
+  int steps = 0;
+  while (library.prefetching())
+  {
+    library.prefetchStep();
+    steps++;
+  }
+  return steps;
+}
+
+int cachedPages()
+{
+  int n = 0;
+  for (int p = LIBRARY_FIRST_PAGE; p <= LAST_PAGE; p++)
+  {
+    n += library.find(p) != nullptr;
+  }
+  return n;
+}
+
+int main()
+{
+  std::string config = "{\"pages\": [";
+  for (int p = 0; p < 2; p++)
+  {
+    char page[512];
+    snprintf(page, sizeof(page),
+             R"(%s{"page": %d, "keys": {"1": "page 9", "2": "page 100", "3": "page 1", "4": "page 0", "5": "x", "6": "a", "7": "a", "8": "a", "9": "page 254"}, %s})",
+             p ? ", " : "", p, ledsOff);
+    config += page;
+  }
+  config += "]}";
+  check("a config can change to library pages", load(config) && configErrors == 0);
+
+  makeLibrary(LIBRARY_FIRST_PAGE, LIBRARY_FIRST_PAGE + 199);
+  library.read = readLibrary;
+  library.message = printConfigMessage;
+  int pages = library.index(libraryJson.size());
+  check("a 200 page library.json is indexed", pages == 200 && library.has(9) && library.has(208) && !library.has(209));
+  printf("     %zu bytes, %zu bytes of RAM for the library\n", libraryJson.size(), sizeof(PageLibrary));
+  check("and nothing's parsed until it's needed", cachedPages() == 0);
+
+  tap("5");
+  check("config.json's pages work as usual", typedText() == "x" && currpage == 0);
+
+  tap("1");
+  check("a page key parses the library page", currpage == 9 && pagechanged && library.misses == 1 && cachedPages() == 1);
+  tap("3");
+  check("and its keys are used", typedText() == "j");
+  tap("2");
+  check("text on a library page", typedText() == "page 9");
+  check("its LEDs too", pageAt(currpage).leds[0] && pageAt(currpage).neopixel == 0x0000ff);
+
+  check("the page it changes to is prefetched", prefetchAll() == 1 && library.find(10) && library.prefetched == 1);
+  tap("1");
+  check("so changing to it is a hit", currpage == 10 && library.hits == 1 && library.misses == 1);
+  tap("3");
+  check("with that page's keys", typedText() == "k");
+
+  // on through more pages than the cache holds, each one prefetched
+  for (int i = 0; i < 20; i++)
+  {
+    prefetchAll();
+    tap("1");
+  }
+  check("typing nothing on the way", typedText() == "");
+  check("paging through them all hits", currpage == 30 && library.misses == 1 && library.hits == 21);
+  check("the cache keeps the newest", cachedPages() == LIBRARY_CACHE_PAGES && !library.find(9) && library.find(30) &&
+                                          library.find(25));
+
+  // prefetching plenty of others never drops the current page
+  Keypage busy;
+  for (int round = 0; round < 4; round++)
+  {
+    for (int i = 0; i < 9; i++)
+    {
+      busy.pagechange[i] = 100 + round * 9 + i;
+    }
+    library.prefetch(busy);
+    prefetchAll();
+  }
+  check("the current page is never dropped", library.find(30) == &pageAt(30) && cachedPages() == LIBRARY_CACHE_PAGES);
+  tap("3");
+  check("and still types", typedText() == "e");
+
+  // a text that's still typing when its page leaves the cache
+  changePage(40);
+  resolveKeys(2); // starts it, nothing typed yet
+  resolveKeys(0);
+  for (int p = 41; p < 41 + LIBRARY_CACHE_PAGES; p++)
+  {
+    changePage(p);
+  }
+  check("a text keeps typing after its page is dropped", !library.find(40) && typer.busy() && typedText() == "");
+  pass();
+  check("as it was", typedText() == "page 40");
+  changePage(30);
+
+  tap("9");
+  check("back to a config.json page", currpage == 0);
+  library.clearStats();
+  tap("2");
+  check("a page not parsed yet is a miss", currpage == 100 && library.misses == 1 && library.find(100));
+  tap("9");
+  tap("2");
+  check("one parsed earlier is a hit", currpage == 100 && library.hits == 1);
+  tap("9");
+
+  tap("9");
+  check("a library page that isn't there keeps the page", currpage == 0);
+
+  // the chain, raw HID and leader keys go through the same calls
+  check("pageDefined() knows library pages", pageDefined(50) && !pageDefined(254) && !pageDefined(255) &&
+                                                 pageDefined(1) && !pageDefined(2));
+  changePage(50);
+  check("changePage() to one", currpage == 50 && padKeypage(0).page == 50);
+  changePage(1);
+  check("and back", currpage == 1);
+
+  // a page that's broken is an error once it's changed to, the rest still work
+  std::string good = libraryJson;
+  std::string broken = libraryPage(20, 208);
+  broken.replace(broken.find("\"3\": "), 8, "\"3\": \"page 999\"");
+  std::string longText = libraryPage(21, 208);
+  longText.replace(longText.find("text page 21"), 12, "text " + std::string(LIBRARY_TEXT_SIZE + 10, 'z'));
+  libraryJson = "{\"pages\": [" + libraryPage(9, 208) + ", " + broken + ", " + longText + "]}";
+  configErrors = 0;
+  check("a library with broken pages still indexes", library.index(libraryJson.size()) == 3 && configErrors == 0);
+  changePage(0);
+  changePage(20);
+  check("a page with a bad key isn't changed to", currpage == 0 && configErrors == 1 && library.failed == 1);
+  changePage(21);
+  check("nor one with too much text", currpage == 0 && configErrors == 2 && library.failed == 2);
+  changePage(9);
+  check("the good ones are", currpage == 9);
+
+  configErrors = 0;
+  libraryJson = R"({"pages": [{"page": 5, "keys": {}}, {"page": 300}, {"keys": {"1": "a"}}, {"page": 12}, {"page": 12}], "page": 40})";
+  library.index(libraryJson.size());
+  check("pages numbered wrong are left out", library.pages() == 1 && library.has(12) && configErrors == 3);
+
+  // the file changed on the drive and hasn't been indexed again yet
+  libraryJson = good;
+  library.index(libraryJson.size());
+  check("indexing again drops what was parsed", cachedPages() == 0 && library.pages() == 200);
+  makeLibrary(LIBRARY_FIRST_PAGE + 1, LIBRARY_FIRST_PAGE + 200);
+  configErrors = 0;
+  changePage(0);
+  changePage(50);
+  check("a page that moved isn't parsed from the wrong place", currpage == 0 && configErrors == 1);
+  library.index(libraryJson.size());
+  changePage(50);
+  check("until it's indexed again", currpage == 50 && !library.has(9) && library.has(209));
+
+  library.clear();
+  check("without a library its pages are gone", !pageDefined(50) && library.pages() == 0);
+  tap("5");
+  check("and their keys do nothing", currpage == 50 && typedText() == "");
+
+  library.print();
+  logger.space = [] { return 1 << 16; };
+  logger.write = [](const char *data, size_t len) { fwrite(data, 1, len, stdout); };
+  logger.drain();
+  return checkExit();
+}
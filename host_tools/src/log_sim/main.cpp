@@ -0,0 +1,107 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Drains the logger into a simulated serial port that only takes a few
+// bytes at a time, or none at all, and checks nothing waits on it and
+// nothing comes out wrong. Exits non-zero if any check fails.
+
+#include <Arduino.h>
+#include "log.h"
+#include "check.h"
+#include <string>
+
+// the port: room for this many bytes until the next drain
+int room = 0;
+std::string out;
+
+int evaluated = 0;
+int sideEffect()
+{
+  return ++evaluated;
+}
+
+int main()
+{
+  logger.space = []() { return room; };
+  logger.write = [](const char *data, size_t len)
+  {
+    out.append(data, len);
+    room -= len;
+  };
+
+  hostsim::advance(1234000);
+  char name[] = "config.json";
+  LOG_INFO("%s is %u bytes, crc %x, offset %d, '%c' %u%%", name, 512u, 0xbeefu, -3, 'k', 99);
+  name[0] = 'X'; // strings are copied, so this is too late
+  LOG_WARN("no arguments");
+  room = 1000;
+  logger.drain();
+  check("records are written out as text", out == "1234 I config.json is 512 bytes, crc beef, offset -3, 'k' 99%\r\n"
+                                                  "1234 W no arguments\r\n");
+
+  // a terminal that takes 7 bytes a pass still gets every byte, in order
+  out.clear();
+  std::string expected;
+  for (int i = 0; i < 20; i++)
+  {
+    LOG_ERROR("line %u", i);
+    expected += "1234 E line " + std::to_string(i) + "\r\n";
+  }
+  int passes = 0;
+  while (!logger.empty() && passes < 1000)
+  {
+    room = 7;
+    logger.drain();
+    passes++;
+  }
+  check("a slow port gets it all a bit at a time", out == expected && passes > 20);
+
+  // nobody reading: the ring fills, the rest are counted and the gap is marked
+  out.clear();
+  room = 0;
+  uint32_t before = logger.dropped;
+  int added = 0;
+  while (logger.dropped == before)
+  {
+    LOG_INFO("filler %u", added++);
+    logger.drain();
+  }
+  LOG_INFO("lost too");
+  check("a full ring drops records without blocking", logger.dropped == before + 2 && out.empty());
+  room = 1 << 20;
+  logger.drain();
+  LOG_INFO("after");
+  logger.drain();
+  check("and says how many went missing, where they went missing",
+        out.find("filler " + std::to_string(added - 2) + "\r\n") != std::string::npos &&
+            out.find("1234 W 2 log records dropped\r\n1234 I after\r\n") != std::string::npos);
+
+  // a string longer than a record is cut short, the line still ends
+  out.clear();
+  std::string longText(300, 'a');
+  LOG_INFO("%s|%u", longText.c_str(), 5);
+  logger.drain();
+  check("long strings are cut short", out.size() < LOG_LINE_MAX && out.substr(out.size() - 2) == "\r\n");
+
+  LOG_DEBUG("compiled out %d", sideEffect());
+  check("levels below LOG_LEVEL aren't even evaluated", evaluated == 0);
+
+  uint32_t start = hostsim::now;
+  for (int i = 0; i < 1000; i++)
+  {
+    LOG_INFO("%u", i);
+  }
+  check("logging never moves the clock", hostsim::now == start);
+
+  return checkExit();
+}
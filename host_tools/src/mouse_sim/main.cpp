@@ -0,0 +1,172 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Runs the mouse keys' motion engine tick by tick the way loop() does,
+// with a host that takes one report per 1ms poll. Prints the speed
+// profile of each curve and exits non-zero if any check fails.
+
+#include <Arduino.h>
+#include "mouse.h"
+#include "check.h"
+#include <cmath>
+#include <vector>
+
+// what the host saw, one entry per 1ms poll
+struct Poll
+{
+  bool mouse; // a mouse report went out
+  MouseReport report;
+};
+
+// holds the mouse keys in held for ms polls. keyboard says whether the
+// keyboard has a report waiting every poll, to share the endpoint with.
+std::vector<Poll> run(MouseKeys &mouse, uint16_t held, int ms, bool keyboard = false)
+{
+  ReportArbiter arbiter;
+  std::vector<Poll> polls;
+  for (int i = 0; i < ms; i++)
+  {
+    mouse.tick(held);
+    Poll poll = {};
+    if (arbiter.mouseGoes(keyboard, mouse.pending()))
+    {
+      poll.mouse = true;
+      poll.report = mouse.send();
+    }
+    polls.push_back(poll);
+  }
+  return polls;
+}
+
+int32_t total(const std::vector<Poll> &polls, int8_t MouseReport::*axis, size_t from = 0, size_t to = SIZE_MAX)
+{
+  int32_t sum = 0;
+  for (size_t i = from; i < polls.size() && i < to; i++)
+  {
+    sum += polls[i].report.*axis;
+  }
+  return sum;
+}
+
+// the curve as a float, for comparing the fixed point one against
+double idealSpeed(const MouseSettings &s, double ms)
+{
+  if (ms >= s.accelMs)
+    return s.maxSpeed;
+  double u = ms / s.accelMs;
+  double f = s.curve == CURVE_QUADRATIC ? u * u : s.curve == CURVE_SMOOTH ? u * u * (3 - 2 * u) : u;
+  return s.startSpeed + (s.maxSpeed - s.startSpeed) * f;
+}
+
+int main()
+{
+  const uint16_t right = 1 << MOUSE_RIGHT;
+
+  for (int curve = 0; curve < CURVE_COUNT; curve++)
+  {
+    MouseKeys mouse;
+    mouse.settings.curve = curve;
+    const MouseSettings &s = mouse.settings;
+    int ms = s.accelMs + 400;
+    auto polls = run(mouse, right, ms);
+
+    // pixels per second over 50ms windows
+    printf("     %s: %u to %u px/s over %u ms\n     ", mouseCurveNames[curve], s.startSpeed, s.maxSpeed, s.accelMs);
+    bool rising = true;
+    bool close = true;
+    int32_t last = 0;
+    for (int t = 0; t + 50 <= ms; t += 50)
+    {
+      int32_t speed = total(polls, &MouseReport::x, t, t + 50) * 20;
+      printf(" %d", speed);
+      rising &= speed + 20 >= last; // a pixel of rounding either way
+      last = speed;
+      double ideal = 0;
+      for (int i = t; i < t + 50; i++)
+      {
+        ideal += idealSpeed(s, i) / 50;
+      }
+      close &= fabs(speed - ideal) <= 0.03 * ideal + 40;
+    }
+    printf("\n");
+
+    char name[80];
+    snprintf(name, sizeof(name), "%s: speed never drops while held", mouseCurveNames[curve]);
+    check(name, rising);
+    snprintf(name, sizeof(name), "%s: speed follows the curve", mouseCurveNames[curve]);
+    check(name, close);
+
+    double ideal = 0;
+    for (int i = 0; i < ms; i++)
+    {
+      ideal += idealSpeed(s, i) / 1000;
+    }
+    snprintf(name, sizeof(name), "%s: distance within a pixel of the curve (%d, %.1f)", mouseCurveNames[curve],
+             total(polls, &MouseReport::x), ideal);
+    check(name, fabs(total(polls, &MouseReport::x) - ideal) <= 1.5);
+  }
+
+  // at full speed a report a poll, nothing more than 127 in one
+  MouseKeys fast;
+  fast.settings.startSpeed = fast.settings.maxSpeed = 10000;
+  auto polls = run(fast, right, 100);
+  bool everyPoll = true;
+  for (auto &poll : polls)
+  {
+    everyPoll &= poll.mouse && poll.report.x == 10;
+  }
+  check("10000 px/s is 10 pixels every 1ms poll", everyPoll);
+
+  MouseKeys diagonal;
+  diagonal.settings.startSpeed = diagonal.settings.maxSpeed = 1000;
+  polls = run(diagonal, right | (1 << MOUSE_UP), 1000);
+  double length = hypot(total(polls, &MouseReport::x), total(polls, &MouseReport::y));
+  check("diagonals move as fast as straight lines", fabs(length - 1000) < 10 && total(polls, &MouseReport::y) < 0);
+
+  // the keyboard and the mouse share the endpoint: each gets every other
+  // poll and the mouse loses no motion by waiting
+  MouseKeys shared;
+  shared.settings.startSpeed = shared.settings.maxSpeed = 1000;
+  polls = run(shared, right, 1000, true);
+  int mouseReports = 0;
+  for (auto &poll : polls)
+  {
+    mouseReports += poll.mouse;
+  }
+  check("keyboard and mouse take turns", mouseReports == 500);
+  check("no motion lost while the keyboard has its turn", total(polls, &MouseReport::x) == 1000);
+
+  MouseKeys stopping;
+  run(stopping, right, 300);
+  polls = run(stopping, 0, 100);
+  check("letting go stops the cursor at once", total(polls, &MouseReport::x) == 0);
+
+  MouseKeys wheel;
+  polls = run(wheel, 1 << MOUSE_WHEEL_UP, 1);
+  check("a tap scrolls one step", total(polls, &MouseReport::wheel) == 1);
+  run(wheel, 0, 10);
+  polls = run(wheel, 1 << MOUSE_WHEEL_DOWN, 1000);
+  check("holding scrolls wheel_speed steps a second", total(polls, &MouseReport::wheel) == -(1 + wheel.settings.wheelSpeed));
+
+  MouseKeys buttons;
+  polls = run(buttons, 1 << MOUSE_BUTTON2, 5);
+  bool pressed = polls[0].mouse && polls[0].report.buttons == 2;
+  for (size_t i = 1; i < polls.size(); i++)
+  {
+    pressed &= !polls[i].mouse;
+  }
+  polls = run(buttons, 0, 5);
+  check("a button is one report down and one up", pressed && polls[0].mouse && polls[0].report.buttons == 0 && !polls[1].mouse);
+
+  return checkExit();
+}
@@ -0,0 +1,105 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Plays host software against the raw HID channel: floods it with page
+// and LED updates faster than the loop takes them, and reads key events
+// back slower than they happen. Exits non-zero if any check fails.
+
+#include <Arduino.h>
+#include "rawhid.h"
+#include "check.h"
+
+void set(RawHidChannel &raw, uint8_t flags, uint8_t page, uint8_t leds, uint8_t rgb, uint32_t color)
+{
+  uint8_t report[RAW_HID_REPORT_SIZE] = {RAW_SET, flags, page, leds, rgb, (uint8_t)(color >> 16), (uint8_t)(color >> 8), (uint8_t)color};
+  raw.receive(report, sizeof(report));
+}
+
+int main()
+{
+  RawHidChannel raw;
+  HostUpdate update;
+  check("nothing to take at first", !raw.take(update));
+
+  set(raw, RAW_PAGE | RAW_NEOPIXEL, 3, 0, 0, 0x102030);
+  check("an update is taken once", raw.take(update) && update.flags == (RAW_PAGE | RAW_NEOPIXEL) && update.page == 3 &&
+                                        update.neopixel == 0x102030 && !raw.take(update));
+
+  // a mute light blinking at 1kHz while the loop only comes round every
+  // 2ms: the loop does one update with the latest of everything
+  for (int i = 0; i < 1000; i++)
+  {
+    set(raw, RAW_LEDS, 0, i & 1 ? 0x1 : 0x0, 0, 0);
+    if (i == 500)
+      set(raw, RAW_PAGE, 5, 0, 0, 0);
+    if (i % 2 == 1)
+    {
+      bool took = raw.take(update);
+      if (i == 999)
+        check("a flood of updates is taken as one, latest wins",
+              took && update.flags == RAW_LEDS && update.leds == 1);
+    }
+  }
+  check("every update counted", raw.updates == 1002 && raw.applied == 501);
+
+  set(raw, RAW_LEDS | RAW_RGB, 0, 0x5, 0x2, 0);
+  set(raw, RAW_RELEASE | RAW_NEOPIXEL, 0, 0, 0, 0xff0000);
+  check("release drops LEDs set before it, keeps ones set with it",
+        raw.take(update) && update.flags == (RAW_RELEASE | RAW_NEOPIXEL) && update.neopixel == 0xff0000);
+
+  // key events only once the host asks for them
+  PadKeys keys = {0x01};
+  raw.keysChanged(keys, 0);
+  uint8_t report[RAW_HID_REPORT_SIZE];
+  check("no key events until asked", !raw.next(report));
+  uint8_t events[RAW_HID_REPORT_SIZE] = {RAW_EVENTS, 1};
+  raw.receive(events, sizeof(events));
+  keys = {0x101, 0, 0x02};
+  raw.keysChanged(keys, 4);
+  check("a key event has the page and every pad's keys",
+        raw.next(report) && report[0] == RAW_KEYS && report[1] == 0 && report[2] == 4 && report[3] == 0x01 &&
+            report[4] == 0x01 && report[7] == 0x02 && !raw.next(report));
+
+  // the host stops reading, the newest events are the ones kept
+  for (int i = 0; i < 40; i++)
+  {
+    keys[0] = i;
+    raw.keysChanged(keys, 0);
+  }
+  int got = 0;
+  uint8_t lastSeq = 0;
+  while (raw.next(report))
+  {
+    got++;
+    lastSeq = report[1];
+  }
+  check("a host that falls behind gets the latest events", got == RAW_EVENT_QUEUE && raw.dropped == 40 - RAW_EVENT_QUEUE &&
+                                                               lastSeq == 40 && report[3] == 39);
+
+  uint8_t query[RAW_HID_REPORT_SIZE] = {RAW_QUERY};
+  raw.receive(query, sizeof(query));
+  bool asked = raw.queried();
+  check("a query is answered once", asked && !raw.queried());
+  raw.state(2, 0x5, 0x1, 0x00ff00, RAW_LEDS);
+  check("the state report", raw.next(report) && report[0] == RAW_STATE && report[1] == 2 && report[2] == 0x5 &&
+                                report[5] == 0xff && report[7] == RAW_LEDS);
+
+  uint8_t junk[RAW_HID_REPORT_SIZE] = {0x7f};
+  raw.receive(junk, sizeof(junk));
+  raw.receive(query, 0);
+  uint8_t shortSet[3] = {RAW_SET, RAW_PAGE, 1};
+  raw.receive(shortSet, sizeof(shortSet));
+  check("unknown and short reports are turned away", raw.rejected == 2 && !raw.take(update));
+
+  return checkExit();
+}
@@ -0,0 +1,310 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Runs the keypad under the loop's scheduler, with the scan, HID and repeat
+// tasks set up like the firmware's and a background task that holds the
+// loop up now and then. Checks keys only act when they go down, keep what
+// they were bound to over a page change, and that repeats come out at the
+// times they're due however the scans fall. Exits non-zero if any check
+// fails.
+
+#include "harness.h"
+#include "scheduler.h"
+#include "check.h"
+#include <random>
+
+//--------------------------------------------------------------------+
+// The Loop
+//--------------------------------------------------------------------+
+
+struct Report
+{
+  uint64_t us;
+  uint8_t modifier;
+  std::array<uint8_t, 6> keys;
+};
+std::vector<Report> reports;
+
+Scheduler sched;
+int scanId, hidId, repeatId, slowId;
+std::mt19937 rng(47);
+int pageChanges = 0;
+bool keyPressedPreviously = false;
+uint64_t lastReportUs = 0;
+
+void send(uint8_t mod, const std::array<uint8_t, 6> &keys)
+{
+  reports.push_back({hostsim::now, mod, keys});
+  lastReportUs = hostsim::now;
+}
+
+// the matrix scan takes longer some times than others
+void scanTask()
+{
+  hostsim::advance(20 + rng() % 100);
+  sched.signal(hidId);
+}
+
+// as the firmware's, with a report going out at most once per 1ms frame
+void hidTask()
+{
+  int lastPage = currpage;
+  resolveKeys(held);
+  pageChanges += currpage != lastPage;
+  if (repeater.active())
+    sched.signal(repeatId, repeater.untilNextUs(micros()));
+  if (hostsim::now - lastReportUs < 1000)
+    return;
+
+  std::array<uint8_t, 6> keys;
+  uint8_t mod;
+  if (turns.busy())
+  {
+    turns.next(mod, keys);
+    send(mod, keys);
+    keyPressedPreviously = false;
+  }
+  else if (count)
+  {
+    send(modifier, keycode);
+    keyPressedPreviously = true;
+  }
+  else if (keyPressedPreviously)
+  {
+    keys.fill(0);
+    send(0, keys);
+    keyPressedPreviously = false;
+  }
+}
+
+void repeatTask()
+{
+  if (repeater.run(micros(), turns))
+    sched.signal(hidId);
+  if (repeater.active())
+    sched.signal(repeatId, repeater.untilNextUs(micros()));
+}
+
+// something like reading config.json, every so often
+void slowTask()
+{
+  hostsim::advance(3000);
+  sched.signal(slowId, 40000 + rng() % 20000);
+}
+
+void runFor(uint64_t us)
+{
+  uint64_t until = hostsim::now + us;
+  while (hostsim::now < until)
+  {
+    if (!sched.dispatch())
+      hostsim::advance(1);
+  }
+}
+
+// the times of the reports that press hidcode, from start on
+std::vector<uint64_t> presses(uint8_t hidcode, uint64_t start)
+{
+  std::vector<uint64_t> times;
+  for (auto &report : reports)
+  {
+    if (report.us >= start && report.keys[0] == hidcode)
+      times.push_back(report.us);
+  }
+  return times;
+}
+
+bool anyReport(uint8_t hidcode, uint64_t start)
+{
+  for (auto &report : reports)
+  {
+    for (uint8_t key : report.keys)
+    {
+      if (report.us >= start && key == hidcode)
+        return true;
+    }
+  }
+  return false;
+}
+
+// no two reports in a row have hidcode down, so the host never sees it held
+bool neverHeld(uint8_t hidcode, uint64_t start)
+{
+  bool last = false;
+  for (auto &report : reports)
+  {
+    if (report.us < start)
+      continue;
+    bool down = report.keys[0] == hidcode;
+    if (down && last)
+      return false;
+    last = down;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------+
+// Main
+//--------------------------------------------------------------------+
+
+int main()
+{
+  std::string config = std::string(R"({"pages": [
+    {"page": 0, "keys": {"1": "page 1", "2": "a", "3": "left", "4": "ctl+z", "5": "right", "6": "f", "7": "g", "8": "h", "9": "i"},
+     "repeat": {"3": {"delay": 300, "rate": 20}, "4": {"delay": 200, "rate": 10, "max_rate": 50, "accel_ms": 1000}, "5": {}}, )") +
+                       ledsOff + R"(},
+    {"page": 1, "keys": {"1": "page 0", "2": "b", "3": "mouse left", "4": "d", "5": "e", "6": "f", "7": "g", "8": "h", "9": "i"}, )" +
+                       ledsOff + "}]}";
+  check("a config with repeating keys loads", load(config));
+  check("with the delay, rates and acceleration per key",
+        store[0].repeat[2].delayMs == 300 && store[0].repeat[2].rate == 20 && store[0].repeat[2].maxRate == 20 &&
+            store[0].repeat[3].maxRate == 50 && store[0].repeat[3].accelMs == 1000 &&
+            store[0].repeat[4].delayMs == REPEAT_DELAY_MS && store[0].repeat[4].rate == REPEAT_RATE &&
+            !store[0].repeat[1].rate && !store[1].repeat[2].rate);
+
+  scanId = sched.add("scan", scanTask, 0, 250);
+  hidId = sched.add("hid", hidTask, 0, 0, 1000);
+  repeatId = sched.add("repeat", repeatTask, 0, 0, 1000);
+  slowId = sched.add("slow", slowTask, 3, 0, 100000);
+  sched.signal(slowId, 10000);
+  currpage = 0;
+  runFor(10000);
+
+  // a page key held down changes the page once, though the page it goes
+  // to has a page key under it too
+  held = 1 << 0;
+  runFor(200000);
+  check("a page key held down changes the page once", currpage == 1 && pageChanges == 1);
+  held = 0;
+  runFor(50000);
+
+  // a key held over a page change keeps what it had
+  uint64_t start = hostsim::now;
+  held = 1 << 1;
+  runFor(50000);
+  held |= 1 << 0;
+  runFor(50000);
+  check("a key keeps sending what it did when it went down", currpage == 0 && anyReport(HID_KEY_B, start) &&
+                                                                 !anyReport(HID_KEY_A, start));
+  held = 0;
+  runFor(50000);
+  start = hostsim::now;
+  held = 1 << 1;
+  runFor(50000);
+  held = 0;
+  runFor(50000);
+  check("and what the page it's on now has the next time", anyReport(HID_KEY_A, start) && !anyReport(HID_KEY_B, start));
+
+  // a repeating key held for a second: a tap straight away, then every
+  // 50 ms from 300 ms on
+  start = hostsim::now;
+  held = 1 << 2;
+  runFor(1020000);
+  held = 0;
+  runFor(500000);
+  std::vector<uint64_t> times = presses(HID_KEY_ARROW_LEFT, start);
+  check("a repeating key is tapped then repeated for as long as it's held", times.size() == 16);
+  uint64_t worst = 0;
+  for (size_t i = 0; i < times.size(); i++)
+  {
+    uint64_t due = start + (i ? 300000 + (i - 1) * 50000 : 0);
+    worst = std::max(worst, times[i] > due ? times[i] - due : due - times[i]);
+  }
+  printf("     %zu taps, worst %llu us from when it was due, %u repeat runs late\n", times.size(),
+         (unsigned long long)worst, sched.task(repeatId).missed);
+  check("each repeat goes out in the frame it's due, however the scans fall", times.size() == 16 && worst <= 4000);
+  check("the host never sees it held", neverHeld(HID_KEY_ARROW_LEFT, start));
+  check("nothing repeats once it's let go", presses(HID_KEY_ARROW_LEFT, start + 1020000 + 2000).empty());
+
+  // one that speeds up, from 10 to 50 a second over a second
+  start = hostsim::now;
+  held = 1 << 3;
+  runFor(2500000);
+  held = 0;
+  runFor(100000);
+  times = presses(HID_KEY_Z, start);
+  bool faster = times.size() > 4;
+  for (size_t i = 3; i < times.size(); i++)
+  {
+    faster &= times[i] - times[i - 1] <= times[i - 2] - times[i - 3] + 4000;
+  }
+  check("acceleration shortens the gaps", faster);
+  check("from the rate to the max rate", times.size() > 4 && times[2] - times[1] > 95000 && times[2] - times[1] < 105000 &&
+                                             times[times.size() - 1] - times[times.size() - 2] < 22000);
+  check("with its modifier", reports.size() && [&] {
+    for (auto &report : reports)
+      if (report.us >= start && report.keys[0] == HID_KEY_Z && report.modifier != KEYBOARD_MODIFIER_LEFTCTRL)
+        return false;
+    return true;
+  }());
+  if (times.size() > 2)
+    printf("     %zu taps in 2.5 s, first gap %llu ms, last %llu ms\n", times.size(),
+           (unsigned long long)(times[2] - times[1]) / 1000,
+           (unsigned long long)(times.back() - times[times.size() - 2]) / 1000);
+
+  // two at once, each on its own clock
+  start = hostsim::now;
+  held = (1 << 2) | (1 << 4);
+  runFor(600000);
+  held = 0;
+  runFor(100000);
+  check("two keys repeat side by side", presses(HID_KEY_ARROW_LEFT, start).size() == 7 &&
+                                            presses(HID_KEY_ARROW_RIGHT, start).size() == 7);
+
+  // the settings come back the same from keymap.bin and config.json
+  KeymapImage image;
+  ConfigSettings settings;
+  compileKeymap(keypages, settings, image);
+  std::array<Keypage, 9> copy;
+  std::array<Keypage *, 9> copies;
+  for (int i = 0; i < 9; i++)
+  {
+    copies[i] = &copy[i];
+  }
+  check("keymap.bin keeps them", loadKeymap(image, copies, settings) &&
+                                      !memcmp(&copy[0].repeat, &store[0].repeat, sizeof(store[0].repeat)));
+  std::vector<char> text(CONFIG_MAX_SIZE);
+  size_t len = renderConfigJson(keypages, settings, text.data(), text.size());
+  std::array<KeyRepeat, 9> before = store[0].repeat;
+  check("and so does a rendered config.json", len && strstr(text.data(), "\"repeat\": {\"3\": {\"delay\": 300") &&
+                                                  load(std::string(text.data(), len)) &&
+                                                  !memcmp(&before, &store[0].repeat, sizeof(before)));
+
+  // repeats that don't make sense
+  const char *bad[] = {
+      R"({"page": 0, "keys": {"1": "a", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "page 0"}, "repeat": {"9": {}}})",
+      R"({"page": 0, "keys": {"1": "a", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "text hi"}, "repeat": {"9": {}}})",
+      R"({"page": 0, "keys": {"1": "a", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "a"}, "repeat": {"10": {}}})",
+      R"({"page": 0, "keys": {"1": "a", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "a"}, "repeat": {"1": {"rate": 0}}})",
+      R"({"page": 0, "keys": {"1": "a", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "a"}, "repeat": {"1": {"rate": 30, "max_rate": 20}}})",
+      R"({"page": 0, "keys": {"1": "a", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "a"}, "repeat": {"1": {"rate": 500}}})",
+      R"({"page": 0, "keys": {"1": "a", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "a"}, "repeat": {"1": 20}})",
+      R"({"page": 0, "keys": {"1": "a", "2": "a", "3": "a", "4": "a", "5": "a", "6": "a", "7": "a", "8": "a", "9": "a"}, "repeat": ["1"]})",
+  };
+  int rejected = 0;
+  for (auto page : bad)
+  {
+    // the leds go inside the page object
+    std::string json = std::string("{\"pages\": [") + page;
+    json.pop_back();
+    ConfigReport quiet;
+    rejected += !load(json + ", " + ledsOff + "}]}", quiet);
+  }
+  check("bad repeats are errors", rejected == 8);
+
+  sched.print();
+  logger.space = [] { return 1 << 16; };
+  logger.write = [](const char *data, size_t len) { fwrite(data, 1, len, stdout); };
+  logger.drain();
+  return checkExit();
+}
@@ -0,0 +1,319 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// replay - runs a trace.bin from the macropad back through the firmware's
+// debouncer and keypad code and prints the keyboard reports it would send.
+//
+//   replay [--tick us] [--expect reports.txt] [--leader leader.bin] config.json|keymap.bin trace
+//
+//   --tick us       how often the firmware loop runs between snapshots (default 100)
+//   --expect file   compare the reports with a saved run and exit 1 on the first difference
+//   --leader file   the leader.bin the pad had, used when the config has no "leader"
+//
+// The trace is either a trace.bin saved with the 't' serial command, or a
+// text file with one "time_us keys page" snapshot per line (keys in hex),
+// which is handier for hand-written cases. Save the output of a good run
+// next to the trace and it becomes a regression test.
+//
+// The keypad's clock is the trace's, so keys the pad repeats itself come
+// out as the taps it would send, at the times they're due, and leader
+// sequences time out where they did. config.json's leader sequences are
+// compiled into a trie like the pad's.
+
+#include "harness.h"
+#include "trace.h"
+#include <string>
+#include <vector>
+
+std::vector<TraceRecord> records;
+std::vector<std::string> reports;
+
+void printMessage(bool error, const char *text)
+{
+  fprintf(stderr, "config %s: %s\n", error ? "error" : "warning", text);
+}
+
+// loads config.json or keymap.bin into keypages. Returns the keymap crc, or 0 if it failed.
+uint32_t loadConfig(const char *path)
+{
+  std::vector<char> data;
+  if (!readFile(path, data))
+  {
+    fprintf(stderr, "%s: can't read file\n", path);
+    return 0;
+  }
+
+  ConfigSettings settings;
+  KeymapImage image;
+  if (data.size() == sizeof(image) && ((KeymapImage *)data.data())->magic == KEYMAP_IMAGE_MAGIC)
+  {
+    memcpy(&image, data.data(), sizeof(image));
+    if (!loadKeymap(image, keypages, settings))
+    {
+      fprintf(stderr, "%s: damaged keymap\n", path);
+      return 0;
+    }
+    return image.crc;
+  }
+
+  ConfigReport report;
+  report.message = printMessage;
+  if (!parseConfigJson(data.data(), data.size(), keypages, settings, report, &leaderSink))
+    return 0;
+  compileKeymap(keypages, settings, image);
+  return image.crc;
+}
+
+// the leader sequences from leaderPath, unless the config had its own.
+// Returns false if there's a leader.bin that isn't any good.
+bool loadLeader(const char *leaderPath)
+{
+  if (leaderImage.empty() && leaderPath)
+  {
+    std::vector<char> data;
+    if (!readFile(leaderPath, data))
+    {
+      fprintf(stderr, "%s: can't read file\n", leaderPath);
+      return false;
+    }
+    leaderImage.assign(data.begin(), data.end());
+    if (!checkLeaderImage(leaderImage.data(), leaderImage.size()))
+    {
+      fprintf(stderr, "%s: damaged leader.bin or from a different firmware version\n", leaderPath);
+      return false;
+    }
+  }
+  leader.use(checkLeaderImage(leaderImage.data(), leaderImage.size()) ? leaderImage.data() : nullptr);
+  return true;
+}
+
+// reads a binary or text trace into records. header is filled in for binary ones.
+bool loadTrace(const char *path, TraceHeader &header)
+{
+  std::vector<char> data;
+  if (!readFile(path, data))
+  {
+    fprintf(stderr, "%s: can't read file\n", path);
+    return false;
+  }
+
+  if (data.size() >= sizeof(header) && ((TraceHeader *)data.data())->magic == TRACE_MAGIC)
+  {
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord) ||
+        data.size() != sizeof(header) + header.count * sizeof(TraceRecord))
+    {
+      fprintf(stderr, "%s: damaged trace or from a different firmware version\n", path);
+      return false;
+    }
+    records.resize(header.count);
+    memcpy(records.data(), data.data() + sizeof(header), header.count * sizeof(TraceRecord));
+    return true;
+  }
+
+  data.push_back(0);
+  char *line = data.data();
+  for (int n = 1; *line; n++)
+  {
+    char *next = strchr(line, '\n');
+    if (next)
+      *next++ = 0;
+    else
+      next = line + strlen(line);
+
+    unsigned long time, keys, page;
+    if (sscanf(line, " %lu %lx %lu", &time, &keys, &page) == 3)
+    {
+      records.push_back({(uint32_t)time, (KeyMask)keys, (uint8_t)page, 0});
+    }
+    else if (line[strspn(line, " \t\r")] && line[strspn(line, " \t\r")] != '#')
+    {
+      fprintf(stderr, "%s:%d: expected \"time_us keys page\"\n", path, n);
+      return false;
+    }
+    line = next;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------+
+// Replay
+//--------------------------------------------------------------------+
+
+Debouncer debouncer;
+uint32_t start;
+
+// one pass of the keypad part of loop(). Only reports (or pages) that differ
+// from the last one are kept, the firmware repeats a held report every poll.
+void step(KeyMask raw, uint32_t now)
+{
+  static std::string last = "";
+  static uint32_t polled = 0;
+  // the keypad's own timing (repeats, leader timeouts) goes by the trace
+  hostsim::now = now;
+  KeyMask keys = debouncer.update(raw, now);
+  resolveKeys(keys);
+  // the repeats that are due, as repeatTask() queues them
+  if (repeater.active())
+    repeater.run(now, turns);
+  uint8_t mod = count ? modifier : 0;
+
+  // text bindings and the taps in turns send a report every 1ms poll,
+  // text first
+  if (typer.busy() || turns.busy())
+  {
+    if (now - polled < 1000)
+      return;
+    polled = now;
+    if (typer.busy())
+      mod = typer.next(modifier, keycode) ? modifier : 0;
+    else
+    {
+      turns.next(modifier, keycode);
+      mod = modifier;
+    }
+  }
+
+  char text[64];
+  snprintf(text, sizeof(text), "page %d mod %02x keys %02x %02x %02x %02x %02x %02x", currpage, mod,
+           keycode[0], keycode[1], keycode[2], keycode[3], keycode[4], keycode[5]);
+  if (last != text)
+  {
+    last = text;
+    char line[96];
+    snprintf(line, sizeof(line), "%10u %s", now - start, text);
+    reports.push_back(line);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t tick = 100;
+  const char *expect = nullptr;
+  const char *leaderPath = nullptr;
+  std::vector<const char *> inputs;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--tick") && i + 1 < argc)
+      tick = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--expect") && i + 1 < argc)
+      expect = argv[++i];
+    else if (!strcmp(argv[i], "--leader") && i + 1 < argc)
+      leaderPath = argv[++i];
+    else
+      inputs.push_back(argv[i]);
+  }
+  if (inputs.size() != 2 || !tick)
+  {
+    fprintf(stderr, "usage: replay [--tick us] [--expect reports.txt] [--leader leader.bin] config.json|keymap.bin "
+                    "trace\n");
+    return 2;
+  }
+
+  static std::array<Keypage, 9> store;
+  for (int i = 0; i < 9; i++)
+  {
+    keypages[i] = &store[i];
+  }
+
+  uint32_t crc = loadConfig(inputs[0]);
+  TraceHeader header = {};
+  if (!crc || !loadLeader(leaderPath) || !loadTrace(inputs[1], header))
+    return 2;
+  if (records.empty())
+  {
+    fprintf(stderr, "%s: no snapshots\n", inputs[1]);
+    return 2;
+  }
+
+  if (header.magic)
+  {
+    if (header.keymapCrc && header.keymapCrc != crc)
+      fprintf(stderr, "warning: the trace was recorded with a different keymap\n");
+    if (header.debounceUs != MATRIX_DEBOUNCE_US)
+      fprintf(stderr, "warning: the trace was recorded with %u us debounce, replaying with %u\n",
+              header.debounceUs, MATRIX_DEBOUNCE_US);
+    if (header.dropped)
+      fprintf(stderr, "note: %u older snapshots were overwritten before the trace was saved\n", header.dropped);
+  }
+
+  // start as the firmware was when the oldest snapshot was taken: on its
+  // page, with those keys already settled
+  start = records[0].time;
+  currpage = records[0].page < 9 && keypages[records[0].page]->page >= 0 ? records[0].page : 0;
+  debouncer.stable = debouncer.raw = records[0].keys;
+  debouncer.acceptedAt.fill(start - MATRIX_DEBOUNCE_US);
+
+  // between snapshots the loop keeps polling with the last raw state, which
+  // is what lets the debouncer accept a change once its lockout is over
+  KeyMask raw = records[0].keys;
+  uint32_t now = start;
+  for (auto &record : records)
+  {
+    for (; (int32_t)(record.time - now) > 0; now += tick)
+    {
+      step(raw, now);
+    }
+    raw = record.keys;
+    now = record.time;
+    step(raw, now);
+    now += tick;
+  }
+  for (uint32_t end = now + 2 * MATRIX_DEBOUNCE_US; (int32_t)(end - now) > 0 || typer.busy() || turns.busy(); now += tick)
+  {
+    step(raw, now);
+  }
+
+  if (!expect)
+  {
+    for (auto &line : reports)
+    {
+      printf("%s\n", line.c_str());
+    }
+    return 0;
+  }
+
+  std::vector<char> data;
+  if (!readFile(expect, data))
+  {
+    fprintf(stderr, "%s: can't read file\n", expect);
+    return 2;
+  }
+  std::vector<std::string> expected;
+  std::string line;
+  for (char c : data)
+  {
+    if (c == '\n')
+    {
+      expected.push_back(line);
+      line.clear();
+    }
+    else if (c != '\r')
+      line += c;
+  }
+  if (!line.empty())
+    expected.push_back(line);
+
+  for (size_t i = 0; i < std::max(expected.size(), reports.size()); i++)
+  {
+    const char *want = i < expected.size() ? expected[i].c_str() : "(nothing)";
+    const char *got = i < reports.size() ? reports[i].c_str() : "(nothing)";
+    if (strcmp(want, got))
+    {
+      printf("%s:%zu: reports differ\n  expected: %s\n  got:      %s\n", expect, i + 1, want, got);
+      return 1;
+    }
+  }
+  printf("%zu reports match %s\n", reports.size(), expect);
+  return 0;
+}
@@ -0,0 +1,273 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// rp9config - checks config.json files with the firmware's own parser and
+// compiles them into the keymap.bin the macropad loads without parsing.
+//
+//   rp9config [-W] [-q] [-o keymap.bin] config.json [more.json ...]
+//   rp9config [-W] [-q] -p library.json config.json
+//   rp9config [-q] -l leader.bin sequences.json
+//
+//   -o file   write the compiled keymap (only with a single config)
+//   -p file   also check every page of a library.json (pages 9 and up),
+//             the way the macropad reads them with that config
+//   -l file   compile the "leader" section of a file of any size into the
+//             leader.bin the macropad uses when config.json has no
+//             sequences of its own (thousands of them don't fit in there)
+//   -W        treat warnings as errors
+//   -q        only print errors and warnings
+//
+// Messages look like a compiler's ("file: error: text") and the exit code
+// is 0 if every file is good, 1 if not and 2 for bad arguments.
+
+#include "harness.h"
+#include "library.h"
+#include <chrono>
+#include <vector>
+
+// ArduinoJson slot size and flash sector size on the device
+#define DEVICE_JSON_SLOT_SIZE 16
+#define DEVICE_SECTOR_SIZE 512
+
+const char *currentFile;
+
+void printMessage(bool error, const char *text)
+{
+  fprintf(stderr, "%s: %s: %s\n", currentFile, error ? "error" : "warning", text);
+}
+
+bool writeFile(const char *path, const void *data, size_t len)
+{
+  FILE *f = fopen(path, "wb");
+  bool ok = f && fwrite(data, len, 1, f) == 1;
+  if (f)
+    fclose(f);
+  if (!ok)
+    fprintf(stderr, "%s: error: can't write file\n", path);
+  return ok;
+}
+
+// -l: only the leader section, parsed with as much memory as it takes
+int compileLeaderFile(const char *path, const char *output, bool quiet)
+{
+  currentFile = path;
+  std::vector<char> data;
+  if (!readFile(path, data))
+  {
+    fprintf(stderr, "%s: error: can't read file\n", path);
+    return 1;
+  }
+  DynamicJsonDocument doc(data.size() * 4 + 1024); // the strings stay in data
+  DeserializationError error = deserializeJson(doc, data.data(), data.size());
+  if (error)
+  {
+    fprintf(stderr, "%s: error: %s\n", path, error.c_str());
+    return 1;
+  }
+  if (!doc["leader"].is<JsonObject>())
+  {
+    fprintf(stderr, "%s: error: there's no \"leader\" section\n", path);
+    return 1;
+  }
+
+  ConfigReport report;
+  report.message = printMessage;
+  leaderImage.clear();
+  auto start = std::chrono::steady_clock::now();
+  std::vector<LeaderSequence> sorted = sortLeader(doc["leader"]);
+  if (!compileLeader(doc["leader"], &leaderSink, report, sorted.data()) || !checkLeaderImage(leaderImage.data(), leaderImage.size()))
+    return 1;
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  if (!writeFile(output, leaderImage.data(), leaderImage.size()))
+    return 1;
+
+  if (!quiet)
+  {
+    const LeaderHeader &header = *(const LeaderHeader *)leaderImage.data();
+    printf("%s: ok, %u sequences, compiled in %.3f ms\n", path, header.sequences, ms);
+    printf("  flash: leader.bin %zu of %d bytes (%u nodes, %u bytes of text)\n", leaderImage.size(), LEADER_MAX_SIZE,
+           header.nodes, header.textSize);
+  }
+  return 0;
+}
+
+// -p: indexes a library.json and parses each of its pages, like the device
+// does when they're changed to
+std::vector<char> libraryData;
+
+int checkLibraryFile(const char *path, bool werror, bool quiet)
+{
+  currentFile = path;
+  libraryData.clear();
+  if (!readFile(path, libraryData))
+  {
+    fprintf(stderr, "%s: error: can't read file\n", path);
+    return 1;
+  }
+
+  // what indexing and parsing found, warnings count for -W
+  static int errors, warnings;
+  errors = warnings = 0;
+  static PageLibrary library;
+  library.message = [](bool error, const char *text)
+  {
+    (error ? errors : warnings)++;
+    printMessage(error, text);
+  };
+  library.read = [](uint32_t offset, void *data, uint32_t len) -> int32_t
+  {
+    if (offset > libraryData.size())
+      return -1;
+    len = std::min<uint32_t>(len, libraryData.size() - offset);
+    memcpy(data, libraryData.data() + offset, len);
+    return len;
+  };
+  auto start = std::chrono::steady_clock::now();
+  int pages = library.index(libraryData.size());
+  double indexMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  double worstMs = 0;
+  int good = 0;
+  for (int page = LIBRARY_FIRST_PAGE; page <= LAST_PAGE; page++)
+  {
+    if (!library.has(page))
+      continue;
+    start = std::chrono::steady_clock::now();
+    good += library.open(page) != nullptr;
+    worstMs = std::max(worstMs, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+  if (errors || good < pages || (werror && warnings))
+    return 1;
+
+  if (!quiet)
+  {
+    printf("%s: ok, %d pages, %d warnings, indexed in %.3f ms, slowest page parsed in %.3f ms\n", path, pages, warnings,
+           indexMs, worstMs);
+    printf("  RAM for the library: %zu bytes (%d pages parsed at once)\n", sizeof(PageLibrary), LIBRARY_CACHE_PAGES);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *output = nullptr;
+  const char *leaderOutput = nullptr;
+  const char *libraryPath = nullptr;
+  bool werror = false;
+  bool quiet = false;
+  bool usage = false;
+  std::vector<const char *> inputs;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      output = argv[++i];
+    else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+      leaderOutput = argv[++i];
+    else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+      libraryPath = argv[++i];
+    else if (!strcmp(argv[i], "-W"))
+      werror = true;
+    else if (!strcmp(argv[i], "-q"))
+      quiet = true;
+    else if (argv[i][0] == '-')
+      usage = true;
+    else
+      inputs.push_back(argv[i]);
+  }
+  if (usage || inputs.empty() || (output && inputs.size() > 1) || (leaderOutput && (output || inputs.size() > 1)) ||
+      (libraryPath && (leaderOutput || inputs.size() > 1)))
+  {
+    fprintf(stderr, "usage: rp9config [-W] [-q] [-o keymap.bin] config.json [more.json ...]\n"
+                    "       rp9config [-W] [-q] -p library.json config.json\n"
+                    "       rp9config [-q] -l leader.bin sequences.json\n");
+    return 2;
+  }
+  if (leaderOutput)
+    return compileLeaderFile(inputs[0], leaderOutput, quiet);
+
+  static std::array<Keypage, 9> store;
+  std::array<Keypage *, 9> pages;
+  for (int i = 0; i < 9; i++)
+  {
+    pages[i] = &store[i];
+  }
+
+  int bad = 0;
+  for (auto path : inputs)
+  {
+    currentFile = path;
+    std::vector<char> data;
+    if (!readFile(path, data))
+    {
+      fprintf(stderr, "%s: error: can't read file\n", path);
+      bad++;
+      continue;
+    }
+    if (data.size() > CONFIG_MAX_SIZE)
+    {
+      fprintf(stderr, "%s: error: file is %zu bytes, the device reads at most %d\n", path, data.size(), CONFIG_MAX_SIZE);
+      bad++;
+      continue;
+    }
+
+    ConfigSettings settings;
+    ConfigReport report;
+    report.message = printMessage;
+    auto start = std::chrono::steady_clock::now();
+    leaderImage.clear();
+    bool ok = parseConfigJson(data.data(), data.size(), pages, settings, report, &leaderSink);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    if (!ok || (werror && report.warnings))
+    {
+      bad++;
+      continue;
+    }
+
+    KeymapImage image;
+    compileKeymap(pages, settings, image);
+    if (output && !writeFile(output, &image, sizeof(image)))
+      bad++;
+    // keymap.bin only has the keys, the device would go looking for a leader.bin
+    if (output && !leaderImage.empty())
+      fprintf(stderr, "%s: warning: the leader sequences aren't in %s, compile them with -l too\n", path, output);
+
+    if (!quiet)
+    {
+      int defined = 0;
+      for (auto keypage : pages)
+      {
+        defined += keypage->page >= 0;
+      }
+      size_t sectors = (data.size() + DEVICE_SECTOR_SIZE - 1) / DEVICE_SECTOR_SIZE;
+      printf("%s: ok, %d pages, %d warnings, parsed in %.3f ms\n", path, defined, report.warnings, ms);
+      printf("  JSON memory: %zu of %d slots (%zu of %d bytes on the device)\n",
+             report.jsonSlots, CONFIG_JSON_SLOTS, report.jsonSlots * DEVICE_JSON_SLOT_SIZE, CONFIG_JSON_SLOTS * DEVICE_JSON_SLOT_SIZE);
+      printf("  RAM while parsing: %d byte config arena (%d bytes read buffer + %d bytes JSON document)\n",
+             CONFIG_MAX_SIZE + CONFIG_JSON_SLOTS * DEVICE_JSON_SLOT_SIZE + 64, CONFIG_MAX_SIZE, CONFIG_JSON_SLOTS * DEVICE_JSON_SLOT_SIZE);
+      printf("  RAM for the keymap: %zu bytes\n", sizeof(Keypage) * 9);
+      printf("  text bindings: %d of %d bytes, typed for the %s layout\n", textBindings.used, TEXT_POOL_SIZE,
+             layoutNames[textBindings.layout]);
+      printf("  flash: config.json %zu bytes (%zu sectors), keymap.bin %zu bytes\n", data.size(), sectors, sizeof(image));
+      if (!leaderImage.empty())
+        printf("  leader: %u sequences, %zu of %d bytes of flash\n", ((const LeaderHeader *)leaderImage.data())->sequences,
+               leaderImage.size(), LEADER_MAX_SIZE);
+    }
+
+    // the library's pages are parsed for the layout this config set
+    if (libraryPath)
+      bad += checkLibraryFile(libraryPath, werror, quiet);
+  }
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Runs the software fallback of the matrix scanner against a simulated
+// key matrix. Exits non-zero if any scenario fails.
+
+#include <Arduino.h>
+#include "matrix.h"
+#include "check.h"
+
+MatrixScanner scanner;
+Debouncer debouncer;
+
+// one pass of the keypad loop: scan, then debounce
+KeyMask step()
+{
+  scanner.scan();
+  return debouncer.update(scanner.state(), micros());
+}
+
+// keeps scanning for at least us microseconds and returns the last debounced state
+KeyMask runFor(uint32_t us)
+{
+  uint64_t until = hostsim::now + us;
+  KeyMask keys = 0;
+  while (hostsim::now < until)
+  {
+    keys = step();
+  }
+  return keys;
+}
+
+int main()
+{
+  scanner.begin(hostsim::cols, hostsim::rows, MATRIX_SETTLE_US);
+  check("software fallback is used on the host", !scanner.usingPio);
+
+  hostsim::keys = 0;
+  check("idle matrix reads no keys", runFor(20000) == 0);
+
+  uint64_t start = hostsim::now;
+  step();
+  printf("     one pass takes %llu us with a %u us settle time\n",
+         (unsigned long long)(hostsim::now - start), (unsigned)MATRIX_SETTLE_US);
+
+  // every key on its own, to check the row/column numbering
+  bool allKeys = true;
+  for (int i = 0; i < 9; i++)
+  {
+    hostsim::keys = 1 << i;
+    allKeys &= runFor(MATRIX_DEBOUNCE_US * 3) == (1 << i);
+    hostsim::keys = 0;
+    allKeys &= runFor(MATRIX_DEBOUNCE_US * 3) == 0;
+  }
+  check("each key maps to row * 3 + column", allKeys);
+
+  hostsim::keys = (1 << 0) | (1 << 4) | (1 << 8);
+  check("several keys at once", runFor(MATRIX_DEBOUNCE_US * 3) == hostsim::keys);
+  hostsim::keys = 0;
+  runFor(MATRIX_DEBOUNCE_US * 3);
+
+  // a contact that chatters for a few ms should come out as a single press
+  int transitions = 0;
+  KeyMask last = 0;
+  uint64_t bounceEnd = hostsim::now + 4000;
+  while (hostsim::now < bounceEnd)
+  {
+    hostsim::keys ^= 1 << 2;
+    hostsim::advance(300);
+    KeyMask keys = step();
+    transitions += (keys ^ last) ? 1 : 0;
+    last = keys;
+  }
+  hostsim::keys = 1 << 2;
+  uint64_t stableEnd = hostsim::now + MATRIX_DEBOUNCE_US * 3;
+  while (hostsim::now < stableEnd)
+  {
+    KeyMask keys = step();
+    transitions += (keys ^ last) ? 1 : 0;
+    last = keys;
+  }
+  check("bouncing press is reported once", transitions == 1 && last == (1 << 2));
+  hostsim::keys = 0;
+  runFor(MATRIX_DEBOUNCE_US * 3);
+
+  // let the ring overflow without reading it
+  for (int i = 0; i < MATRIX_RING_SIZE * 2; i++)
+  {
+    hostsim::keys = (i & 1) ? 0 : (1 << 7);
+    scanner.scan();
+  }
+  hostsim::keys = 1 << 5;
+  scanner.scan();
+  check("overrun keeps the newest snapshot", scanner.state() == (1 << 5) && scanner.overruns == 1);
+
+  // a board whose rows are slow to let go through their pulldowns, and
+  // reads that take 60ns. Key 3 (row 1, column 0) is held.
+  hostsim::rowFallNs = {1500, 4000, 2500};
+  hostsim::readNs = 60;
+  hostsim::keys = 1 << 3;
+  scanner.setSettle(1);
+  scanner.scan();
+  scanner.scan();
+  check("a settle time that's too short sees keys that aren't there", scanner.state() != (1 << 3));
+
+  SettleCalibration cal = scanner.calibrate();
+  printf("     %u ns a read, rows fall in %u/%u/%u ns, key 3 rises in %u ns, settle %u us\n", (unsigned)cal.pollNs,
+         (unsigned)cal.fallNs[0], (unsigned)cal.fallNs[1], (unsigned)cal.fallNs[2], (unsigned)cal.riseNs[3],
+         (unsigned)cal.settleUs);
+  bool timed = cal.pollNs == hostsim::readNs;
+  for (int r = 0; r < 3; r++)
+  {
+    timed &= cal.fallNs[r] >= hostsim::rowFallNs[r] && cal.fallNs[r] <= hostsim::rowFallNs[r] + 2 * cal.pollNs;
+  }
+  check("calibration times each row's fall", timed);
+  check("and the held key's rise", cal.held == (1 << 3) && cal.riseNs[3] <= 2 * cal.pollNs);
+  check("the settle time covers the slowest row with room to spare", cal.settleUs >= 2 * 4 && cal.settleUs <= 2 * 5 + 1);
+  scanner.setSettle(cal.settleUs);
+  scanner.scan();
+  scanner.scan();
+  check("and reads the matrix right", scanner.state() == (1 << 3));
+
+  hostsim::keys = 0;
+  SettleCalibration again = scanner.calibrate(&cal);
+  check("rises of keys no longer held are kept", again.held == (1 << 3) && again.riseNs[3] == cal.riseNs[3] &&
+                                                     again.settleUs == cal.settleUs);
+
+  hostsim::rowFallNs[2] = 2000000;
+  check("a row that never lets go fails calibration", scanner.calibrate().settleUs == 0);
+  hostsim::rowFallNs = {0};
+  hostsim::readNs = 0;
+  hostsim::advance(3000);
+
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return checkExit();
+}
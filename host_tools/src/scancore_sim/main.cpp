@@ -0,0 +1,160 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Plays both cores of an RP9_CORE1_SCAN build: core 1 scanning every pass,
+// the loop taking changes one per 1ms report, and the loop held up for
+// 50ms at a time the way a flash erase holds it up, once and through a
+// long write to the drive. Exits non-zero if any check fails.
+
+#include <Arduino.h>
+#include "scancore.h"
+#include "check.h"
+#include <vector>
+
+MatrixScanner scanner;
+Debouncer debouncer;
+ScanCore scanCore;
+
+// what the loop has resolved, and every state it sent the host
+KeyMask keys = 0;
+std::vector<KeyMask> sent;
+uint64_t nextReport = 0;
+
+// the loop's side, as main.cpp does it
+void loopPass()
+{
+  bool ready = hostsim::now >= nextReport;
+  ScanEvent event;
+  while (ready && scanCore.take(event))
+  {
+    bool changed = event.stable != keys;
+    keys = event.stable;
+    if (changed)
+      break;
+  }
+  if (!scanCore.pending() && keys != scanCore.latest)
+  {
+    keys = scanCore.latest;
+  }
+  if (ready && (sent.empty() || sent.back() != keys))
+  {
+    sent.push_back(keys);
+    nextReport = hostsim::now + 1000;
+  }
+}
+
+// core 1 keeps scanning until the time given, the loop runs every 100us
+// unless it's stalled
+void runUntil(uint64_t until, bool stalled)
+{
+  uint64_t nextLoop = hostsim::now;
+  while (hostsim::now < until)
+  {
+    scanner.scan();
+    scanCore.step(scanner.state(), micros(), debouncer);
+    if (!stalled && hostsim::now >= nextLoop)
+    {
+      loopPass();
+      nextLoop = hostsim::now + 100;
+    }
+  }
+}
+
+int main()
+{
+  scanner.begin(hostsim::cols, hostsim::rows, 5);
+  runUntil(20000, false);
+  check("an idle matrix queues nothing", !scanCore.pending() && sent.size() == 1 && sent[0] == 0);
+
+  // a 30ms tap, bouncing both ways, all while the loop is held up
+  uint64_t stallStart = hostsim::now;
+  runUntil(stallStart + 5000, true);
+  for (int i = 0; i < 6; i++)
+  {
+    hostsim::keys ^= 1 << 4;
+    runUntil(hostsim::now + 200, true);
+  }
+  hostsim::keys = 1 << 4;
+  runUntil(hostsim::now + 30000, true);
+  for (int i = 0; i < 6; i++)
+  {
+    hostsim::keys ^= 1 << 4;
+    runUntil(hostsim::now + 200, true);
+  }
+  hostsim::keys = 0;
+  runUntil(stallStart + 50000, true);
+  check("core 1 queued the tap while the loop was stalled", scanCore.pending() && scanCore.dropped == 0);
+
+  ScanEvent first = {};
+  ScanEvent peek = {};
+  ScanCore copy = scanCore;
+  copy.take(first);
+  bool inOrder = first.stable == (1 << 4) && first.us >= stallStart + 5000 && first.us <= stallStart + 5000 + 100;
+  while (copy.take(peek))
+  {
+    inOrder &= peek.us >= first.us;
+  }
+  check("changes carry the time they were seen", inOrder);
+
+  sent.clear();
+  runUntil(hostsim::now + 10000, false);
+  check("the tap comes out afterwards as a press and a release",
+        sent.size() == 2 && sent[0] == (1 << 4) && sent[1] == 0);
+
+  printf("     worst gap between core 1 passes %u us\n", (unsigned)scanCore.worstGapUs);
+  check("core 1 never stopped scanning", scanCore.worstGapUs < 100);
+
+  // a 256KB file copied to the drive: sector after sector erased and
+  // programmed, the loop held up for each, with a tap in the middle
+  scanCore.clearStats();
+  sent.clear();
+  uint64_t writeStart = hostsim::now;
+  for (int sector = 0; sector < 64; sector++)
+  {
+    scanCore.writing = true;
+    if (sector == 32)
+      hostsim::keys = 1 << 7;
+    runUntil(hostsim::now + 45000, true); // the erase
+    if (sector == 32)
+      hostsim::keys = 0;
+    for (int page = 0; page < 16; page++)
+    {
+      runUntil(hostsim::now + 700, true);
+    }
+    scanCore.writing = false;
+    runUntil(hostsim::now + 1000, false); // USB gets the next 4KB in
+  }
+  runUntil(hostsim::now + 10000, false);
+  printf("     %llu ms of drive writes, worst gap between core 1 passes during them %u us\n",
+         (unsigned long long)(hostsim::now - writeStart) / 1000, (unsigned)scanCore.worstWriteGapUs);
+  check("core 1 scans through a long drive write", scanCore.worstWriteGapUs > 0 && scanCore.worstWriteGapUs < 100);
+  check("and a tap during it comes out", sent.size() == 3 && sent[0] == 0 && sent[1] == (1 << 7) && sent[2] == 0);
+
+  // a flood of changes with nobody taking them: some are dropped, but the
+  // loop still ends up with the keys as they are
+  for (int i = 0; i < SCAN_QUEUE_SIZE * 2; i++)
+  {
+    hostsim::keys = 1 << (i % 9);
+    runUntil(hostsim::now + MATRIX_DEBOUNCE_US + 100, true);
+  }
+  hostsim::keys = (1 << 2) | (1 << 6);
+  runUntil(hostsim::now + MATRIX_DEBOUNCE_US + 100, true);
+  check("a full queue counts what it drops", scanCore.dropped > 0);
+  runUntil(hostsim::now + 200000, false);
+  check("and the loop catches up with the keys held now", keys == hostsim::keys && sent.back() == hostsim::keys);
+
+  scanCore.clearStats();
+  check("stats clear", scanCore.worstGapUs == 0 && scanCore.dropped == 0);
+
+  return checkExit();
+}
@@ -0,0 +1,160 @@
+/*********************************************************************
+ Author: John Scimone
+ Organization: Spark Markerspace Co
+
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
+ configure.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+// Runs the loop's scheduler with the keypad's scan and HID tasks against
+// background tasks of every length, from ones that fit between scans to a
+// 50ms flash write. Exits non-zero if any check fails.
+
+#include <Arduino.h>
+#include "scheduler.h"
+#include "check.h"
+#include <vector>
+
+Scheduler sched;
+int scanId, hidId, eventId, shortId, longId, slowId;
+
+// how long each task takes, in simulated us
+uint32_t shortUs = 100;
+uint32_t longUs = 200;
+uint32_t slowUs = 50000;
+bool sleepNext = false;
+std::vector<int> order; // ids as they ran
+
+void scanTask()
+{
+  order.push_back(scanId);
+  hostsim::advance(40);
+  if (sleepNext)
+  {
+    sleepNext = false;
+    hostsim::advance(1000000);
+    sched.asleep();
+  }
+  sched.signal(hidId);
+}
+
+void hidTask()
+{
+  order.push_back(hidId);
+  hostsim::advance(20);
+}
+
+void eventTask()
+{
+  order.push_back(eventId);
+  hostsim::advance(5);
+}
+
+void shortTask()
+{
+  order.push_back(shortId);
+  hostsim::advance(shortUs);
+}
+
+void longTask()
+{
+  order.push_back(longId);
+  hostsim::advance(longUs);
+}
+
+void slowTask()
+{
+  order.push_back(slowId);
+  hostsim::advance(slowUs);
+}
+
+// the loop, with nothing else to do in between
+void runFor(uint64_t us)
+{
+  uint64_t until = hostsim::now + us;
+  while (hostsim::now < until)
+  {
+    if (!sched.dispatch())
+      hostsim::advance(1);
+  }
+}
+
+int count(int id)
+{
+  int n = 0;
+  for (int i : order)
+    n += i == id;
+  return n;
+}
+
+int main()
+{
+  scanId = sched.add("scan", scanTask, 0, 250);
+  hidId = sched.add("hid", hidTask, 0, 0, 1000);
+  eventId = sched.add("event", eventTask, 1, 0, 10000);
+
+  runFor(100000);
+  check("a periodic task runs every period", sched.task(scanId).runs == 400);
+  check("an event task runs once per signal", sched.task(hidId).runs == 400 && count(hidId) == 400);
+  check("the HID task goes straight after the scan", order[0] == scanId && order[1] == hidId);
+  check("nothing misses with nothing else to do", !sched.task(scanId).missed && !sched.task(hidId).missed);
+  check("an event task isn't run unless signalled", !sched.task(eventId).runs);
+
+  sched.signal(eventId, 5000);
+  sched.signal(eventId, 8000);
+  runFor(4000);
+  check("a delayed signal waits", !sched.task(eventId).runs);
+  runFor(10000);
+  check("and a second signal doesn't run it twice", sched.task(eventId).runs == 1);
+
+  // a 100us background task fits in the 190us left after each scan
+  shortId = sched.add("short", shortTask, 3, 1000);
+  sched.clearStats();
+  runFor(100000);
+  printf("     short: scan worst %u us after due, short worst %u us after due\n",
+         (unsigned)sched.task(scanId).worstLateUs, (unsigned)sched.task(shortId).worstLateUs);
+  check("a task that fits never holds up the scan", !sched.task(scanId).missed && sched.task(scanId).runs == 400);
+  check("and gets its runs in", sched.task(shortId).runs == 100 && !sched.task(shortId).missed);
+
+  // 200us doesn't fit around a 60us scan every 250us. It waits out its
+  // deadline, then goes and the scan is late once for each run.
+  longId = sched.add("long", longTask, 3, 20000, 5000);
+  sched.clearStats();
+  runFor(100000);
+  printf("     long: scan missed %u, long ran %u and missed %u\n", (unsigned)sched.task(scanId).missed,
+         (unsigned)sched.task(longId).runs, (unsigned)sched.task(longId).missed);
+  check("a task that doesn't fit still runs by its deadline", sched.task(longId).runs == 5);
+  check("and only holds the scan up when it does", sched.task(scanId).missed <= sched.task(longId).runs);
+
+  // a flash write never fits: it goes when picked, the scan misses one
+  // period and picks up from there rather than running the missed ones
+  slowId = sched.add("slow", slowTask, 2, 0, 100000);
+  sched.clearStats();
+  order.clear();
+  sched.signal(slowId);
+  runFor(60000);
+  check("a task that can never fit isn't kept waiting", sched.task(slowId).runs == 1 && order[0] != slowId);
+  printf("     slow: scan worst %u us after due, missed %u\n", (unsigned)sched.task(scanId).worstLateUs,
+         (unsigned)sched.task(scanId).missed);
+  check("the scan misses once, not once per period it was held up", sched.task(scanId).missed == 1);
+  check("and the stats say how long the task took", sched.task(slowId).worstUs == 50000);
+
+  // asleep isn't late, or a long run
+  sched.clearStats();
+  sleepNext = true;
+  runFor(1200000);
+  check("time asleep isn't counted", !sched.task(scanId).missed && sched.task(scanId).worstUs < 100 &&
+                                         !sched.task(shortId).missed && !sched.task(hidId).missed);
+
+  sched.print();
+  logger.space = [] { return 1 << 16; };
+  logger.write = [](const char *data, size_t len) { fwrite(data, 1, len, stdout); };
+  logger.drain();
+
+  return checkExit();
+}
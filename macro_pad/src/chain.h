@@ -0,0 +1,295 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef CHAIN_H
+
+#define CHAIN_H
+
+#include <Arduino.h>
+#include "matrix.h"
+#include <array>
+
+// Chaining pads into one keyboard. The pads are wired in a ring, each TX
+// to the next one's RX (two pads is just TX to RX both ways). Pad 0 is the
+// primary: it types for everyone and tells the others what page it's on.
+// The secondaries only send their key changes, which the pads in between
+// pass along. Bytes go out through send() and come in through receive(),
+// main.cpp hooks them up to the UART.
+
+//--------------------------------------------------------------------+
+// Chain Config
+//--------------------------------------------------------------------+
+
+// the primary and up to three more
+#define CHAIN_MAX_PADS 4
+
+// D4 and D5, the encoder's pins, with a PIO UART on them
+#ifndef CHAIN_TX
+#define CHAIN_TX D4
+#define CHAIN_RX D5
+#endif
+
+// a frame is 60us on the wire at this rate
+#define CHAIN_BAUD 1000000
+
+// full key state and the page go out at least this often, so a lost
+// frame is made good and a pad that's gone can be noticed
+#define CHAIN_HEARTBEAT_MS 50
+// keys on a pad that hasn't been heard from for this long are let go
+#define CHAIN_TIMEOUT_MS 200
+
+#define CHAIN_SYNC 0xa5
+#define CHAIN_FRAME_SIZE 6
+
+enum ChainFrameType : uint8_t
+{
+  CHAIN_KEYS_DELTA = 1, // data: the keys that changed on the pad
+  CHAIN_KEYS_FULL,      // data: all the keys that are down on the pad
+  CHAIN_PAGE            // from the primary. data: page, pads to send full state in the high byte
+};
+
+// the keys down on each pad, [0] is the primary's own
+typedef std::array<KeyMask, CHAIN_MAX_PADS> PadKeys;
+
+//--------------------------------------------------------------------+
+// Frames
+//--------------------------------------------------------------------+
+
+// sync, type << 4 | pad, seq, data low, data high, crc
+struct ChainFrame
+{
+  uint8_t type;
+  uint8_t pad; // who sent it
+  uint8_t seq; // counts up with every frame the pad sends
+  uint16_t data;
+};
+
+// CRC-8 (polynomial 0x07), bitwise like crc32()
+uint8_t crc8(const uint8_t *data, size_t len)
+{
+  uint8_t crc = 0;
+  while (len--)
+  {
+    crc ^= *data++;
+    for (int i = 0; i < 8; i++)
+    {
+      crc = (crc << 1) ^ (crc & 0x80 ? 0x07 : 0);
+    }
+  }
+  return crc;
+}
+
+void encodeFrame(const ChainFrame &frame, uint8_t *out)
+{
+  out[0] = CHAIN_SYNC;
+  out[1] = frame.type << 4 | frame.pad;
+  out[2] = frame.seq;
+  out[3] = frame.data & 0xff;
+  out[4] = frame.data >> 8;
+  out[5] = crc8(out + 1, 4);
+}
+
+// Finds frames in a stream of bytes. Anything that isn't a whole frame
+// with a good CRC is skipped a byte at a time until one lines up again.
+class FrameParser
+{
+public:
+  uint32_t crcErrors = 0;
+
+  // true when byte finished a frame, which is put in frame
+  bool feed(uint8_t byte, ChainFrame &frame)
+  {
+    buffer[used++] = byte;
+    while (used)
+    {
+      if (buffer[0] != CHAIN_SYNC)
+      {
+        drop();
+        continue;
+      }
+      if (used < CHAIN_FRAME_SIZE)
+        return false;
+      if (crc8(&buffer[1], 4) == buffer[5])
+      {
+        frame = {(uint8_t)(buffer[1] >> 4), (uint8_t)(buffer[1] & 0x0f), buffer[2], (uint16_t)(buffer[3] | buffer[4] << 8)};
+        used = 0;
+        return true;
+      }
+      crcErrors++;
+      drop();
+    }
+    return false;
+  }
+
+private:
+  std::array<uint8_t, CHAIN_FRAME_SIZE> buffer;
+  uint8_t used = 0;
+
+  // forget the first byte, it wasn't the start of a frame
+  void drop()
+  {
+    memmove(&buffer[0], &buffer[1], --used);
+  }
+};
+
+//--------------------------------------------------------------------+
+// ChainLink Class
+//--------------------------------------------------------------------+
+
+// One pad's end of the chain. Feed it every byte that comes in with
+// receive() and call update() every loop.
+//
+// A secondary sends a delta as soon as its keys change and its full state
+// every CHAIN_HEARTBEAT_MS. The primary only takes a delta that follows on
+// from the last frame it had from that pad. If one went missing it asks
+// for the full state in its next page frame, straight away.
+class ChainLink
+{
+public:
+  uint8_t pad = 0; // 0 is the primary
+  void (*send)(const uint8_t *data, size_t len) = nullptr;
+
+  // primary: the keys down on each secondary, [0] isn't used
+  PadKeys keys = {};
+  // secondary: the primary's page, -1 until it's been heard
+  int page = -1;
+
+  // statistics
+  uint32_t frames = 0;    // good frames for us
+  uint32_t forwarded = 0; // passed on to the next pad
+  uint32_t gaps = 0;      // frames that went missing on the way
+  FrameParser parser;
+
+  void receive(uint8_t byte, uint32_t nowMs)
+  {
+    ChainFrame frame;
+    if (!parser.feed(byte, frame) || frame.pad == pad || frame.pad >= CHAIN_MAX_PADS)
+      return; // nothing yet, or it's our own frame back round the ring
+
+    if (pad)
+    {
+      // everything goes round to the next pad, only the page is for us
+      forward(frame);
+      if (frame.type != CHAIN_PAGE || frame.pad)
+        return;
+      frames++;
+      heard |= 1;
+      heardMs[0] = nowMs;
+      page = frame.data & 0xff;
+      resend |= frame.data >> 8 & (1 << pad);
+      return;
+    }
+
+    if (frame.type != CHAIN_KEYS_DELTA && frame.type != CHAIN_KEYS_FULL)
+      return;
+    frames++;
+    uint8_t bit = 1 << frame.pad;
+    heard |= bit;
+    heardMs[frame.pad] = nowMs;
+    if (frame.type == CHAIN_KEYS_FULL)
+    {
+      keys[frame.pad] = frame.data;
+      stale &= ~bit;
+    }
+    else if (!(stale & bit) && frame.seq == expected[frame.pad])
+    {
+      keys[frame.pad] ^= frame.data;
+    }
+    else
+    {
+      // the change before this one didn't make it, so this one means nothing
+      gaps += !(stale & bit);
+      stale |= bit;
+      resend = true;
+    }
+    expected[frame.pad] = frame.seq + 1;
+  }
+
+  // localKeys are this pad's debounced keys, currentPage the page it's on
+  void update(KeyMask localKeys, int currentPage, uint32_t nowMs)
+  {
+    if (pad)
+    {
+      // the full state goes out on its own clock, deltas don't put it off
+      if (localKeys != sentKeys)
+      {
+        transmit(CHAIN_KEYS_DELTA, localKeys ^ sentKeys, nowMs);
+      }
+      else if (resend || nowMs - fullMs >= CHAIN_HEARTBEAT_MS)
+      {
+        transmit(CHAIN_KEYS_FULL, localKeys, nowMs);
+        fullMs = nowMs;
+      }
+      else
+        return;
+      sentKeys = localKeys;
+      resend = false;
+      return;
+    }
+
+    // a pad that's gone quiet was probably unplugged with keys down
+    for (int p = 1; p < CHAIN_MAX_PADS; p++)
+    {
+      if ((heard & (1 << p)) && nowMs - heardMs[p] > CHAIN_TIMEOUT_MS)
+      {
+        heard &= ~(1 << p);
+        stale |= 1 << p;
+        keys[p] = 0;
+      }
+    }
+    if (currentPage != sentPage || resend || nowMs - sentMs >= CHAIN_HEARTBEAT_MS)
+    {
+      transmit(CHAIN_PAGE, currentPage | stale << 8, nowMs);
+      sentPage = currentPage;
+      resend = false;
+    }
+  }
+
+  // another pad has been heard from lately
+  bool active(uint32_t nowMs)
+  {
+    for (int p = 0; p < CHAIN_MAX_PADS; p++)
+    {
+      if ((heard & (1 << p)) && nowMs - heardMs[p] <= CHAIN_TIMEOUT_MS)
+        return true;
+    }
+    return false;
+  }
+
+private:
+  uint8_t seq = 0;
+  uint32_t sentMs = 0;
+  uint32_t fullMs = 0;   // secondary: last full keys frame
+  KeyMask sentKeys = 0;  // secondary: keys as the primary knows them
+  int sentPage = -1;     // primary
+  bool resend = false;   // send a page (primary) or full keys (secondary) now
+  uint8_t heard = 0;     // a bit for each pad heard from
+  uint8_t stale = 0xfe;  // primary: pads whose keys we can't be sure of, until a full frame
+  std::array<uint8_t, CHAIN_MAX_PADS> expected = {};
+  std::array<uint32_t, CHAIN_MAX_PADS> heardMs = {};
+
+  void transmit(uint8_t type, uint16_t data, uint32_t nowMs)
+  {
+    uint8_t bytes[CHAIN_FRAME_SIZE];
+    encodeFrame({type, pad, seq++, data}, bytes);
+    sentMs = nowMs;
+    if (send)
+      send(bytes, sizeof(bytes));
+  }
+
+  void forward(const ChainFrame &frame)
+  {
+    uint8_t bytes[CHAIN_FRAME_SIZE];
+    encodeFrame(frame, bytes);
+    forwarded++;
+    if (send)
+      send(bytes, sizeof(bytes));
+  }
+};
+
+#endif
@@ -0,0 +1,1477 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef CONFIG_H
+
+#define CONFIG_H
+
+#include <Arduino.h>
+#include "keymapping.h"
+#include "text.h"
+#include "mouse.h"
+#include "encoder.h"
+#include "chain.h"
+#include "leader.h"
+#include "repeat.h"
+#include "log.h"
+#include "ArduinoJson.h"
+#include <array>
+#include <cstdarg>
+#include <cstddef>
+#include <cstring>
+
+// The config.json parser. It works on text already in RAM, reading the
+// files and storing the keymap are up to the caller. It doesn't touch the
+// heap either: everything it needs comes out of configArena.
+
+//--------------------------------------------------------------------+
+// Config Limits
+//--------------------------------------------------------------------+
+
+// biggest config.json the device will read
+#define CONFIG_MAX_SIZE 5000
+
+// JSON memory for parsing it, counted in ArduinoJson slots so the PC needs
+// exactly as many as the RP2040 does (192 slots is 3072 bytes there)
+#define CONFIG_JSON_SLOTS 192
+#define CONFIG_JSON_CAPACITY (CONFIG_JSON_SLOTS * JSON_OBJECT_SIZE(1))
+
+// the read buffer and the JSON document, plus a little for alignment
+#define CONFIG_ARENA_SIZE (CONFIG_MAX_SIZE + CONFIG_JSON_CAPACITY + 64)
+
+// default for the optional top level "idle_timeout", in ms
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS 30000
+#endif
+
+//--------------------------------------------------------------------+
+// Config Arena
+//--------------------------------------------------------------------+
+
+// A fixed block of memory handed out front to back and given back all at
+// once, so loading a config over and over can't fragment anything.
+class Arena
+{
+public:
+  uint8_t *base;
+  size_t size;
+  size_t used = 0;
+  size_t peak = 0; // most ever used at once
+
+  Arena(uint8_t *base, size_t size) : base(base), size(size) {}
+
+  void reset()
+  {
+    used = 0;
+  }
+
+  // nullptr if it doesn't fit
+  void *allocate(size_t n)
+  {
+    n = (n + 7) & ~(size_t)7;
+    if (n > size - used)
+      return nullptr;
+    void *p = base + used;
+    used += n;
+    peak = used > peak ? used : peak;
+    return p;
+  }
+};
+
+alignas(8) uint8_t configArenaBuffer[CONFIG_ARENA_SIZE];
+Arena configArena(configArenaBuffer, sizeof(configArenaBuffer));
+
+// gives back everything allocated from the arena while it was in scope
+class ArenaScope
+{
+public:
+  ArenaScope(Arena &arena) : arena(arena), mark(arena.used) {}
+  ~ArenaScope()
+  {
+    arena.used = mark;
+  }
+
+private:
+  Arena &arena;
+  size_t mark;
+};
+
+// lets ArduinoJson take its memory pool from configArena
+struct ArenaAllocator
+{
+  void *allocate(size_t size)
+  {
+    return configArena.allocate(size);
+  }
+  void deallocate(void *) {} // the ArenaScope gives it back
+  void *reallocate(void *, size_t)
+  {
+    return nullptr; // only used by shrinkToFit(), which we don't
+  }
+};
+
+typedef BasicJsonDocument<ArenaAllocator> ConfigJsonDocument;
+
+//--------------------------------------------------------------------+
+// Keypage Class
+//--------------------------------------------------------------------+
+
+// Pages 0 to 8 come from config.json and are always loaded. The ones after
+// that, up to LAST_PAGE, come from library.json when they're needed, see
+// library.h.
+#define LAST_PAGE 254
+// pagechange for a key that doesn't change pages
+#define NO_PAGE_CHANGE 255
+
+class Keypage
+{
+public:
+  int page;                        // page number
+  std::array<int, 9> pagechange;   // which page each key changes to. NO_PAGE_CHANGE if don't change.
+  std::array<uint8_t, 9> hidcode;  // hidcode for each key on the page. 0 for no output
+  std::array<uint8_t, 9> modcode;  // modifier for each key on the page
+  std::array<uint16_t, 9> text;    // where each key's text starts in textBindings. TEXT_NONE if it has none.
+  std::array<uint8_t, 9> mouse;    // MouseAction for each key, MOUSE_NONE if it isn't a mouse key
+  std::array<KeyRepeat, 9> repeat; // how each key repeats on the pad, rate 0 to leave it to the host
+  std::array<uint8_t, ENCODER_BINDINGS> turnHid;   // hidcode for each encoder direction, see ENCODER_CW
+  std::array<uint8_t, ENCODER_BINDINGS> turnMod;   // modifier for each encoder direction
+  std::array<uint8_t, ENCODER_BINDINGS> turnMouse; // MOUSE_WHEEL_UP or _DOWN for scrolling, otherwise MOUSE_NONE
+  std::array<uint8_t, CHAIN_MAX_PADS - 1> padPage; // which page's keys each chained pad uses while on this page
+  uint16_t leader;                 // bit per key that starts a leader sequence
+  std::array<bool, 3> leds;        // board LEDs
+  std::array<bool, 3> builtinleds; // builtin RGB LEDs
+  uint32_t neopixel;               // Neopixel value
+  const char *textPool;            // what text points into, textBindings' unless it's a library page
+
+  Keypage(int page,
+          std::array<int, 9> pagechange,
+          std::array<uint8_t, 9> hidcode,
+          std::array<uint8_t, 9> modcode,
+          std::array<bool, 3> leds,
+          std::array<bool, 3> builtinleds,
+          uint32_t neopixel)
+  {
+    this->page = page;
+    this->pagechange = pagechange;
+    this->hidcode = hidcode;
+    this->modcode = modcode;
+    this->text.fill(TEXT_NONE);
+    this->mouse.fill(MOUSE_NONE);
+    this->repeat.fill(KeyRepeat());
+    this->turnHid.fill(0);
+    this->turnMod.fill(0);
+    this->turnMouse.fill(MOUSE_NONE);
+    this->padPage.fill(page);
+    this->leader = 0;
+    this->leds = leds;
+    this->builtinleds = builtinleds;
+    this->neopixel = neopixel;
+    this->textPool = textBindings.text.data();
+  }
+  Keypage() {
+    this->page = -1;
+    this->pagechange.fill(NO_PAGE_CHANGE);
+    this->hidcode = {0};
+    this->modcode = {0};
+    this->text.fill(TEXT_NONE);
+    this->mouse.fill(MOUSE_NONE);
+    this->repeat.fill(KeyRepeat());
+    this->turnHid.fill(0);
+    this->turnMod.fill(0);
+    this->turnMouse.fill(MOUSE_NONE);
+    this->padPage.fill(0);
+    this->leader = 0;
+    this->leds = {false};
+    this->builtinleds = {false};
+    this->neopixel = 0;
+    this->textPool = textBindings.text.data();
+  }
+
+  void fill(int page,
+            std::array<int, 9> pagechange,
+            std::array<uint8_t, 9> hidcode,
+            std::array<uint8_t, 9> modcode,
+            std::array<bool, 3> leds,
+            std::array<bool, 3> builtinleds,
+            uint32_t neopixel)
+  {
+    this->page = page;
+    this->pagechange = pagechange;
+    this->hidcode = hidcode;
+    this->leds = leds;
+    this->modcode = modcode;
+    this->builtinleds = builtinleds;
+    this->neopixel = neopixel;
+  }
+
+  // the whole page, at LOG_LEVEL_DEBUG
+  void print()
+  {
+    LOG_DEBUG("Page %u: neopixel %x, leds %u %u %u, builtinleds %u %u %u", page, neopixel, leds[0], leds[1], leds[2],
+              builtinleds[0], builtinleds[1], builtinleds[2]);
+    for (int i = 0; i < 9; i++)
+    {
+      LOG_DEBUG("  key %u: hidcode %u, modcode %x, pagechange %u", i + 1, hidcode[i], modcode[i], pagechange[i]);
+    }
+  }
+};
+
+//--------------------------------------------------------------------+
+// Parse Results
+//--------------------------------------------------------------------+
+
+// settings that don't belong to a page
+struct ConfigSettings
+{
+  uint32_t idleTimeoutMs = IDLE_TIMEOUT_MS;
+  MouseSettings mouse;
+  uint8_t chainPad = 0; // this pad's place in a chain, 0 is the primary
+};
+
+// Collects what the parser has to say. The firmware prints it to Serial,
+// the host tools to the terminal.
+class ConfigReport
+{
+public:
+  void (*message)(bool error, const char *text) = nullptr;
+  int errors = 0;
+  int warnings = 0;
+  size_t jsonSlots = 0; // ArduinoJson slots the document used
+
+  void error(const char *format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    say(true, format, args);
+    va_end(args);
+  }
+
+  void warning(const char *format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    say(false, format, args);
+    va_end(args);
+  }
+
+private:
+  void say(bool isError, const char *format, va_list args)
+  {
+    char text[160];
+    vsnprintf(text, sizeof(text), format, args);
+    (isError ? errors : warnings)++;
+    if (message)
+    {
+      message(isError, text);
+    }
+  }
+};
+
+//--------------------------------------------------------------------+
+// Parser
+//--------------------------------------------------------------------+
+
+// Plain bitwise CRC-32 (the zip/ethernet one), small rather than fast.
+// Pass the crc of what came before to carry on from it.
+uint32_t crc32(const void *data, size_t len, uint32_t crc = 0)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+  while (len--)
+  {
+    crc ^= *p++;
+    for (int i = 0; i < 8; i++)
+    {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void removeSpace(char *s)
+{
+  for (char *s2 = s; *s2; ++s2)
+  {
+    if (*s2 != ' ')
+      *s++ = *s2;
+  }
+  *s = 0;
+}
+
+// true for "page 0" to "page 254" (LAST_PAGE)
+bool isPageChange(const char *s)
+{
+  if (strncmp(s, "page ", 5) || !s[5] || strlen(s + 5) > 3 || (s[5] == '0' && s[6]))
+    return false;
+  for (const char *c = s + 5; *c; c++)
+  {
+    if (*c < '0' || *c > '9')
+      return false;
+  }
+  return atoi(s + 5) <= LAST_PAGE;
+}
+
+// the page a page change binding goes to
+int pageNumber(const char *s)
+{
+  return atoi(s + 5);
+}
+
+// true for "text ..." bindings, the rest of the string gets typed
+bool isText(const char *s)
+{
+  return !strncmp(s, "text ", 5);
+}
+
+// true for "mouse ..." bindings
+bool isMouse(const char *s)
+{
+  return !strncmp(s, "mouse ", 6);
+}
+
+// true for keys that start a leader sequence
+bool isLeader(const char *s)
+{
+  return !strcmp(s, "leader");
+}
+
+// index of name in names, -1 if it isn't there
+int findName(const char *name, const char **names, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (!strcmp(name, names[i]))
+      return i;
+  }
+  return -1;
+}
+
+// Parses a key binding like "ctl+alt+delete" into hidcode and modcode.
+// where names the binding in warnings, e.g. "page 2 key '5'".
+void parseKeyBinding(const char *binding, uint8_t &hidcode, uint8_t &modcode, const char *where, ConfigReport &report)
+{
+  // copy the binding so we can strip the spaces
+  char this_page_key[50];
+  strncpy(this_page_key, binding, 49);
+  this_page_key[49] = 0;
+  removeSpace(this_page_key);
+
+  // check for modifier keys anywhere in the binding
+  modcode = 0;
+  if (strstr(this_page_key, "alt"))
+  {
+    modcode += KEYBOARD_MODIFIER_LEFTALT;
+  }
+  if (strstr(this_page_key, "ctl") || strstr(this_page_key, "ctrl"))
+  {
+    modcode += KEYBOARD_MODIFIER_LEFTCTRL;
+  }
+  if (strstr(this_page_key, "shift"))
+  {
+    modcode += KEYBOARD_MODIFIER_LEFTSHIFT;
+  }
+  if (strstr(this_page_key, "gui"))
+  {
+    modcode += KEYBOARD_MODIFIER_LEFTGUI;
+  }
+
+  // find the position of the rightmost + if there is one
+  char *last_plus = std::strrchr(this_page_key, '+');
+  // if not NULL, then there was a +. Check starting from next char
+  char *keycode = (last_plus != NULL) ? &last_plus[1] : this_page_key;
+
+  // everything before it should be modifiers
+  if (last_plus != NULL)
+  {
+    *last_plus = 0;
+    for (char *mod = strtok(this_page_key, "+"); mod; mod = strtok(NULL, "+"))
+    {
+      if (strcmp(mod, "alt") && strcmp(mod, "ctl") && strcmp(mod, "ctrl") && strcmp(mod, "shift") && strcmp(mod, "gui"))
+      {
+        report.warning("%s: '%s' is not a modifier, use alt, ctl, shift or gui", where, mod);
+      }
+    }
+  }
+
+  // check each keycode to see if it matches
+  // by default if nothing matches, the default hidcode of 0 applies
+  hidcode = lookupKey(keycode);
+  if (hidcode == 0 && *keycode)
+  {
+    report.warning("%s: '%s' is not a key name, the key will only send modifiers", where, keycode);
+  }
+}
+
+//--------------------------------------------------------------------+
+// Leader Sequences
+//--------------------------------------------------------------------+
+
+// true for a sequence: the keys 1 to 9, LEADER_MAX_DEPTH of them at most
+bool isSequence(const char *s)
+{
+  size_t len = strlen(s);
+  if (!len || len > LEADER_MAX_DEPTH)
+    return false;
+  for (; *s; s++)
+  {
+    if (*s < '1' || *s > '9')
+      return false;
+  }
+  return true;
+}
+
+// A sequence and what it does, for a host that can sort them. text is
+// room for compileLeader() to keep the text bindings in.
+struct LeaderSequence
+{
+  const char *keys;
+  JsonVariant binding;
+  const char *text;
+};
+
+// Calls visit(node, binding) for each node of the trie in order, with
+// next and first filled in and binding the sequence that ends there (null
+// if it's only the start of others). With the sequences sorted by their
+// keys, the ones under a node are next to each other and each depth is one
+// pass. There's no RAM to sort them in on the device, so there every node
+// takes a pass over all of them. That's slow for thousands, but only when
+// a config is loaded.
+template <typename F>
+void walkLeader(JsonObject sequences, const LeaderSequence *sorted, uint32_t count, F visit)
+{
+  uint32_t nextChild = 1;
+  auto emit = [&](LeaderNode &node, JsonVariant binding) {
+    node.first = node.next ? nextChild : 0;
+    nextChild += __builtin_popcount(node.next);
+    visit(node, binding);
+  };
+
+  for (size_t depth = 0; depth <= LEADER_MAX_DEPTH; depth++)
+  {
+    if (sorted)
+    {
+      for (uint32_t i = 0; i < count;)
+      {
+        const char *prefix = sorted[i].keys;
+        if (strlen(prefix) < depth)
+        {
+          i++;
+          continue;
+        }
+        LeaderNode node = {};
+        JsonVariant binding;
+        for (; i < count && !strncmp(sorted[i].keys, prefix, depth); i++)
+        {
+          const char *keys = sorted[i].keys;
+          if (strlen(keys) > depth)
+            node.next |= 1 << (keys[depth] - '1');
+          else
+            binding = sorted[i].binding; // the last one wins
+        }
+        emit(node, binding);
+      }
+      continue;
+    }
+
+    const char *last = nullptr; // the node before's prefix
+    while (true)
+    {
+      // the next prefix this long, in key order
+      const char *prefix = nullptr;
+      for (auto pair : sequences)
+      {
+        const char *keys = pair.key().c_str();
+        if (strlen(keys) < depth || (last && strncmp(keys, last, depth) <= 0))
+          continue;
+        if (!prefix || strncmp(keys, prefix, depth) < 0)
+          prefix = keys;
+      }
+      if (!prefix)
+        break;
+
+      LeaderNode node = {};
+      JsonVariant binding;
+      for (auto pair : sequences)
+      {
+        const char *keys = pair.key().c_str();
+        if (strncmp(keys, prefix, depth))
+          continue;
+        if (strlen(keys) > depth)
+          node.next |= 1 << (keys[depth] - '1');
+        else
+          binding = pair.value(); // the last one wins
+      }
+      emit(node, binding);
+      last = prefix;
+    }
+  }
+}
+
+// what a sequence does, into node. Text is numbered from textSize on.
+void leaderBinding(LeaderNode &node, const char *value, uint32_t &textSize)
+{
+  if (!value)
+    return;
+  if (isText(value))
+  {
+    node.action = LEADER_TEXT;
+    node.value = textSize;
+    textSize += strlen(value + 5) + 1;
+  }
+  else if (isPageChange(value))
+  {
+    node.action = LEADER_PAGE;
+    node.value = pageNumber(value);
+  }
+  else
+  {
+    ConfigReport quiet; // the check already said everything
+    uint8_t hidcode;
+    node.action = LEADER_KEY;
+    parseKeyBinding(value, hidcode, node.modcode, "", quiet);
+    node.value = hidcode;
+  }
+}
+
+// Checks the "leader" section and with a sink, compiles its sequences
+// into a trie (see leader.h) and writes it there. sorted, if there is one,
+// is every sequence sorted by its keys (stably, so the last of a repeat
+// still wins), which makes it quick for thousands.
+bool compileLeader(JsonObject leader, const LeaderSink *sink, ConfigReport &report,
+                   LeaderSequence *sorted = nullptr)
+{
+  uint32_t timeoutMs = leader["timeout"] | (uint32_t)LEADER_TIMEOUT_MS;
+  if (timeoutMs < 100 || timeoutMs > 10000)
+  {
+    report.error("leader: 'timeout' is %lu, it must be 100 to 10000 ms", (unsigned long)timeoutMs);
+    return false;
+  }
+  if (!leader["sequences"].is<JsonObject>())
+  {
+    report.error("leader: 'sequences' must be an object of sequences and what they do, like \"123\": \"ctl+s\"");
+    return false;
+  }
+  JsonObject sequences = leader["sequences"];
+
+  uint32_t count = 0;
+  for (auto pair : sequences)
+  {
+    const char *keys = pair.key().c_str();
+    const char *value = pair.value();
+    if (!isSequence(keys))
+    {
+      report.error("leader: '%s' isn't a sequence, use the keys 1 to 9, up to %d of them", keys, LEADER_MAX_DEPTH);
+      return false;
+    }
+    if (!value || isMouse(value) || isLeader(value) || (!strncmp(value, "page ", 5) && !isPageChange(value)))
+    {
+      report.error("leader: sequence '%s' must be a key, \"page 0\" to \"page %d\" or \"text ...\"", keys, LAST_PAGE);
+      return false;
+    }
+    if (!isText(value) && !isPageChange(value))
+    {
+      char where[32];
+      snprintf(where, sizeof(where), "leader sequence '%s'", keys);
+      uint8_t hidcode, modcode;
+      parseKeyBinding(value, hidcode, modcode, where, report);
+    }
+    count++;
+  }
+
+  // the crc goes in the header, so it's worked out on the way
+  uint32_t nodes = 0;
+  uint32_t textSize = 0;
+  uint32_t crc = 0;
+  uint32_t texts = 0;
+  walkLeader(sequences, sorted, count, [&](LeaderNode &node, JsonVariant binding) {
+    leaderBinding(node, binding, textSize);
+    crc = crc32(&node, sizeof(node), crc);
+    nodes++;
+    if (sorted && node.action == LEADER_TEXT)
+      sorted[texts++].text = binding.as<const char *>() + 5;
+  });
+  // the text goes after the nodes, in their order
+  auto eachText = [&](auto use) {
+    if (sorted)
+    {
+      for (uint32_t i = 0; i < texts; i++)
+        use(sorted[i].text, strlen(sorted[i].text) + 1);
+      return;
+    }
+    walkLeader(sequences, nullptr, 0, [&](LeaderNode &, JsonVariant binding) {
+      const char *value = binding;
+      if (value && isText(value))
+        use(value + 5, strlen(value + 5) + 1);
+    });
+  };
+  eachText([&](const char *text, uint32_t len) { crc = crc32(text, len, crc); });
+
+  uint32_t size = LEADER_HEADER_SIZE + nodes * sizeof(LeaderNode) + textSize;
+  if (nodes > 0xffff || textSize > 0xffff || count > 0xffff || size > LEADER_MAX_SIZE)
+  {
+    report.error("leader: the sequences take %lu bytes of flash, the device has room for %d",
+                 (unsigned long)size, LEADER_MAX_SIZE);
+    return false;
+  }
+  if (!sink)
+    return true;
+
+  LeaderHeader header = {LEADER_IMAGE_MAGIC, LEADER_IMAGE_VERSION, (uint16_t)nodes, size, crc, timeoutMs,
+                         (uint16_t)count, (uint16_t)textSize};
+  if (!sink->begin(header))
+    return true;
+  uint32_t offset = LEADER_HEADER_SIZE;
+  textSize = 0;
+  walkLeader(sequences, sorted, count, [&](LeaderNode &node, JsonVariant binding) {
+    leaderBinding(node, binding, textSize);
+    sink->write(offset, &node, sizeof(node));
+    offset += sizeof(node);
+  });
+  eachText([&](const char *text, uint32_t len) {
+    sink->write(offset, text, len);
+    offset += len;
+  });
+  sink->write(0, &header, sizeof(header));
+  sink->end();
+  return true;
+}
+
+// true if image is a whole trie that's safe to follow, up to size bytes
+bool checkLeaderImage(const uint8_t *image, uint32_t size)
+{
+  if (size < LEADER_HEADER_SIZE)
+    return false;
+  const LeaderHeader &header = *(const LeaderHeader *)image;
+  if (header.magic != LEADER_IMAGE_MAGIC || header.version != LEADER_IMAGE_VERSION || header.size > size ||
+      !header.nodes || header.size != LEADER_HEADER_SIZE + header.nodes * sizeof(LeaderNode) + header.textSize ||
+      header.crc != crc32(image + LEADER_HEADER_SIZE, header.size - LEADER_HEADER_SIZE))
+    return false;
+  const LeaderNode *nodes = (const LeaderNode *)(image + LEADER_HEADER_SIZE);
+  for (uint32_t i = 0; i < header.nodes; i++)
+  {
+    const LeaderNode &node = nodes[i];
+    // children come after their parent, so a sequence always ends
+    if ((node.next >> 9) || (node.next && (node.first <= i || node.first + __builtin_popcount(node.next) > header.nodes)))
+      return false;
+    if (node.action > LEADER_TEXT || (node.action == LEADER_PAGE && node.value > LAST_PAGE) ||
+        (node.action == LEADER_TEXT && node.value >= header.textSize))
+      return false;
+  }
+  return !header.textSize || !image[header.size - 1];
+}
+
+//--------------------------------------------------------------------+
+// Pages
+//--------------------------------------------------------------------+
+
+// Checks one of the objects in "pages", numbered number. Text bindings
+// add to textSize. Returns false if the page is no good.
+bool checkPage(JsonObject a, int number, TextLayout layout, UnicodeEntry unicode, size_t &textSize, ConfigReport &report)
+{
+  const char *keyNames[] = {"1", "2", "3", "4", "5", "6", "7", "8", "9"};
+  const char *ledNames[] = {"led1", "led2", "led3", "ledR", "ledG", "ledB"};
+  const char *encoderNames[] = {"encoder", "encoder2"};
+  const char *directionNames[] = {"cw", "ccw"};
+
+  if (a["keys"].isNull())
+  {
+    report.error("page %d: all pages must have a 'keys' element", number);
+    return false;
+  }
+  for (auto name : keyNames)
+  {
+    if (a["keys"][name].isNull())
+    {
+      report.error("page %d: key '%s' is missing, 'keys' needs elements '1' through '9'", number, name);
+      return false;
+    }
+    if (!a["keys"][name].is<const char *>())
+    {
+      report.error("page %d: key '%s' must be a string", number, name);
+      return false;
+    }
+    const char *value = a["keys"][name];
+    if (isText(value))
+    {
+      textSize += strlen(value + 5) + 1;
+      int missing = untypeable(value + 5, layout, unicode);
+      if (missing)
+      {
+        report.warning("page %d key '%s': %d character(s) aren't on the %s layout and will be skipped, see 'unicode'",
+                       number, name, missing, layoutNames[layout]);
+      }
+      continue;
+    }
+    if (isLeader(value))
+    {
+      continue;
+    }
+    if (isMouse(value) && findName(value + 6, mouseActionNames, MOUSE_ACTIONS) < 0)
+    {
+      report.error("page %d: key '%s' is '%s', mouse keys are up, down, left, right, wheel_up, wheel_down "
+                   "and button1 to button3", number, name, value);
+      return false;
+    }
+    if (!strncmp(value, "page ", 5) && !isPageChange(value))
+    {
+      report.error("page %d: key '%s' is '%s', pages go from 0 to %d", number, name, value, LAST_PAGE);
+      return false;
+    }
+  }
+  if (a["keys"].size() != 9)
+  {
+    report.error("page %d: 'keys' must have only elements '1' through '9'", number);
+    return false;
+  }
+
+  // optional: what turning each encoder does on this page
+  for (auto encoder : encoderNames)
+  {
+    if (a[encoder].isNull())
+      continue;
+    if (!a[encoder].is<JsonObject>())
+    {
+      report.error("page %d: '%s' must be an object with 'cw' and 'ccw' bindings", number, encoder);
+      return false;
+    }
+    for (auto direction : directionNames)
+    {
+      JsonVariant binding = a[encoder][direction];
+      const char *value = binding;
+      if (binding.isNull())
+        continue;
+      if (!value || isText(value) || isPageChange(value) || isLeader(value) ||
+          (isMouse(value) && strcmp(value + 6, "wheel_up") && strcmp(value + 6, "wheel_down")))
+      {
+        report.error("page %d: %s '%s' must be a key or \"mouse wheel_up\" / \"mouse wheel_down\"", number, encoder, direction);
+        return false;
+      }
+    }
+  }
+
+  // optional: keys the pad repeats itself, see repeat.h
+  if (!a["repeat"].isNull())
+  {
+    if (!a["repeat"].is<JsonObject>())
+    {
+      report.error("page %d: 'repeat' must be an object of keys, like \"4\": {\"delay\": 300, \"rate\": 20}", number);
+      return false;
+    }
+    for (auto pair : a["repeat"].as<JsonObject>())
+    {
+      const char *name = pair.key().c_str();
+      const char *value = a["keys"][name];
+      if (!value)
+      {
+        report.error("page %d: 'repeat' has '%s', it must be keys '1' through '9'", number, name);
+        return false;
+      }
+      if (isText(value) || isPageChange(value) || isLeader(value) || isMouse(value))
+      {
+        report.error("page %d: key '%s' is '%s', only keys can repeat", number, name, value);
+        return false;
+      }
+      JsonObject repeat = pair.value();
+      int delay = repeat["delay"] | REPEAT_DELAY_MS;
+      int rate = repeat["rate"] | REPEAT_RATE;
+      int maxRate = repeat["max_rate"] | rate;
+      int accelMs = repeat["accel_ms"] | 0;
+      if (repeat.isNull() || delay < 0 || delay > 10000 || rate < 1 || maxRate < rate || maxRate > REPEAT_MAX_RATE ||
+          accelMs < 0 || accelMs > 10000)
+      {
+        report.error("page %d: repeat '%s' must be an object with 'delay' and 'accel_ms' 0 to 10000 ms, and 'rate' "
+                     "and 'max_rate' 1 to %d a second with 'max_rate' at least 'rate'", number, name, REPEAT_MAX_RATE);
+        return false;
+      }
+    }
+  }
+
+  // optional: pages the chained pads use, pad 1 first
+  if (!a["pad_pages"].isNull())
+  {
+    JsonArray padPages = a["pad_pages"];
+    bool valid = a["pad_pages"].is<JsonArray>() && padPages.size() <= CHAIN_MAX_PADS - 1;
+    for (JsonVariant padPage : padPages)
+    {
+      int value = padPage;
+      valid &= padPage.is<int>() && value >= 0 && value <= 8;
+    }
+    if (!valid)
+    {
+      report.error("page %d: 'pad_pages' must be a list of up to %d page numbers", number, CHAIN_MAX_PADS - 1);
+      return false;
+    }
+  }
+
+  if (a["leds"].isNull())
+  {
+    report.error("page %d: all pages must have a 'leds' element", number);
+    return false;
+  }
+  for (auto name : ledNames)
+  {
+    if (a["leds"][name].isNull())
+    {
+      report.error("page %d: '%s' is missing, all leds must be included under the 'leds' key", number, name);
+      return false;
+    }
+    if (!a["leds"][name].is<bool>())
+    {
+      report.warning("page %d: '%s' should be true or false", number, name);
+    }
+  }
+  const char *neopixel = a["leds"]["neopixel"];
+  char *end = nullptr;
+  if (!neopixel || !*neopixel || strtoul(neopixel, &end, 16) > 0xffffff || *end)
+  {
+    report.error("page %d: 'neopixel' must be a hex color like \"ff0000\"", number);
+    return false;
+  }
+  return true;
+}
+
+// Fills keypage from a page checkPage() passed. Text bindings are copied to
+// text from textUsed on. definedPages has a bit for each of pages 0 to 8
+// there are, to warn about changing to one that isn't.
+void fillPage(JsonObject page, Keypage &keypage, char *text, uint16_t &textUsed, uint16_t definedPages,
+              ConfigReport &report)
+{
+  const char *keyNames[] = {"1", "2", "3", "4", "5", "6", "7", "8", "9"};
+  const char *ledNames[] = {"led1", "led2", "led3", "ledR", "ledG", "ledB"};
+  const char *encoderNames[] = {"encoder", "encoder2"};
+  const char *directionNames[] = {"cw", "ccw"};
+
+  int page_page = page["page"]; // the current page number
+  keypage.page = page_page;
+  keypage.textPool = text;
+
+  JsonObject page_keys = page["keys"];
+  JsonObject page_leds = page["leds"];
+  for (int i = 0; i < 3; i++)
+  {
+    keypage.leds[i] = page_leds[ledNames[i]];            // all leds
+    keypage.builtinleds[i] = page_leds[ledNames[i + 3]]; // all builtin RGBs
+  }
+  keypage.neopixel = strtoul(page_leds["neopixel"], nullptr, 16); // Xiao RP2040 builtin Neopixel
+
+  // chained pads follow along on the same page unless told otherwise
+  keypage.padPage.fill(page_page);
+  int pad = 0;
+  for (int padPage : page["pad_pages"].as<JsonArray>())
+  {
+    keypage.padPage[pad++] = padPage;
+    if (!(definedPages & (1 << padPage)))
+    {
+      report.warning("page %d: pad %d uses page %d, which is not defined", page_page, pad, padPage);
+    }
+  }
+
+  // assign all the things in each keypage
+  for (int j = 0; j < 9; j++)
+  {
+    const char *page_key = page_keys[keyNames[j]];
+
+    // text gets copied out of the JSON, it's gone with the next load
+    if (isText(page_key))
+    {
+      size_t size = strlen(page_key + 5) + 1;
+      memcpy(&text[textUsed], page_key + 5, size);
+      keypage.text[j] = textUsed;
+      keypage.pagechange[j] = NO_PAGE_CHANGE;
+      textUsed += size;
+      continue;
+    }
+    if (isMouse(page_key))
+    {
+      keypage.mouse[j] = findName(page_key + 6, mouseActionNames, MOUSE_ACTIONS);
+      keypage.pagechange[j] = NO_PAGE_CHANGE;
+      continue;
+    }
+    if (isLeader(page_key))
+    {
+      keypage.leader |= 1 << j;
+      keypage.pagechange[j] = NO_PAGE_CHANGE;
+      continue;
+    }
+
+    // check if it's a page change assignment
+    if (isPageChange(page_key))
+    {
+      keypage.pagechange[j] = pageNumber(page_key);
+      // library pages are only looked for when they're needed
+      if (keypage.pagechange[j] < 9 && !(definedPages & (1 << keypage.pagechange[j])))
+      {
+        report.warning("page %d key '%s': changes to page %d, which is not defined", page_page, keyNames[j], keypage.pagechange[j]);
+      }
+      continue;
+    }
+
+    // determine what hidcode applies
+    keypage.pagechange[j] = NO_PAGE_CHANGE; // no page change :)
+    char where[24];
+    snprintf(where, sizeof(where), "page %d key '%s'", page_page, keyNames[j]);
+    parseKeyBinding(page_key, keypage.hidcode[j], keypage.modcode[j], where, report);
+  }
+
+  // the encoders take key bindings or scroll the mouse wheel
+  for (int e = 0; e < ENCODER_BINDINGS / 2; e++)
+  {
+    for (int d = 0; d < 2; d++)
+    {
+      const char *binding = page[encoderNames[e]][directionNames[d]];
+      if (!binding)
+        continue;
+      int slot = e * 2 + d;
+      if (isMouse(binding))
+      {
+        keypage.turnMouse[slot] = findName(binding + 6, mouseActionNames, MOUSE_ACTIONS);
+        continue;
+      }
+      char where[32];
+      snprintf(where, sizeof(where), "page %d %s '%s'", page_page, encoderNames[e], directionNames[d]);
+      parseKeyBinding(binding, keypage.turnHid[slot], keypage.turnMod[slot], where, report);
+    }
+  }
+
+  // keys the pad repeats, leaving out whatever checkPage() let default
+  for (auto pair : page["repeat"].as<JsonObject>())
+  {
+    JsonObject repeat = pair.value();
+    KeyRepeat &out = keypage.repeat[atoi(pair.key().c_str()) - 1];
+    out.delayMs = repeat["delay"] | REPEAT_DELAY_MS;
+    out.rate = repeat["rate"] | REPEAT_RATE;
+    out.maxRate = repeat["max_rate"] | out.rate;
+    out.accelMs = repeat["accel_ms"] | 0;
+  }
+}
+
+// Parses a config.json held in json (which gets modified, the strings are
+// used in place) into pages. Returns true if successful, false if failed.
+// Nothing in pages is touched unless the whole file checks out. The leader
+// sequences are compiled into leaderSink, if there is one.
+bool parseConfigJson(char *json, size_t len, std::array<Keypage *, 9> &pages, ConfigSettings &settings, ConfigReport &report,
+                     const LeaderSink *leaderSink = nullptr)
+{
+  // Json Document for parsing, from the arena
+  ArenaScope scope(configArena);
+  ConfigJsonDocument doc(CONFIG_JSON_CAPACITY);
+  DeserializationError error = deserializeJson(doc, json, len);
+  report.jsonSlots = doc.memoryUsage() / JSON_OBJECT_SIZE(1);
+
+  // detect parsing error
+  if (error == DeserializationError::NoMemory)
+  {
+    report.error("config.json is too big, it needs more than the %d JSON slots the device has", CONFIG_JSON_SLOTS);
+    return false;
+  }
+  if (error)
+  {
+    report.error("config.json is not valid JSON: %s", error.c_str());
+    return false;
+  }
+
+  // Config checks!
+  if (doc["pages"].isNull())
+  {
+    report.error("config.json has no top level 'pages' array");
+    return false;
+  }
+  JsonArray pageArray = doc["pages"].as<JsonArray>();
+  if (pageArray.size() < 1)
+  {
+    report.error("'pages' array must have at least one element");
+    return false;
+  }
+
+  // optional: the host's keyboard layout and how to type what isn't on it
+  const char *layoutName = doc["layout"] | layoutNames[LAYOUT_US];
+  int layout = findName(layoutName, layoutNames, LAYOUT_COUNT);
+  if (layout < 0)
+  {
+    report.error("'layout' is '%s', it must be us, uk, de or fr", layoutName);
+    return false;
+  }
+  const char *unicodeName = doc["unicode"] | unicodeNames[UNICODE_NONE];
+  int unicode = findName(unicodeName, unicodeNames, UNICODE_COUNT);
+  if (unicode < 0)
+  {
+    report.error("'unicode' is '%s', it must be none, linux, windows or mac", unicodeName);
+    return false;
+  }
+
+  // optional: how mouse keys move, all numbers are whole pixels, steps or ms
+  MouseSettings mouse;
+  JsonObject mouseObject = doc["mouse"];
+  mouse.startSpeed = mouseObject["start_speed"] | mouse.startSpeed;
+  mouse.maxSpeed = mouseObject["max_speed"] | mouse.maxSpeed;
+  mouse.accelMs = mouseObject["accel_ms"] | mouse.accelMs;
+  mouse.wheelSpeed = mouseObject["wheel_speed"] | mouse.wheelSpeed;
+  const char *curveName = mouseObject["curve"] | mouseCurveNames[mouse.curve];
+  int curve = findName(curveName, mouseCurveNames, CURVE_COUNT);
+  if (curve < 0)
+  {
+    report.error("mouse: 'curve' is '%s', it must be linear, quadratic or smooth", curveName);
+    return false;
+  }
+  mouse.curve = curve;
+  if (!mouse.startSpeed || mouse.maxSpeed < mouse.startSpeed || mouse.maxSpeed > 10000 || mouse.accelMs > 10000 ||
+      !mouse.wheelSpeed || mouse.wheelSpeed > 200)
+  {
+    report.error("mouse: speeds must be 1 to 10000 with 'max_speed' at least 'start_speed', 'accel_ms' up to 10000 "
+                 "and 'wheel_speed' 1 to 200");
+    return false;
+  }
+
+  // optional: where this pad is in a chain of them
+  int chainPad = doc["chain"]["pad"] | 0;
+  if (chainPad < 0 || chainPad >= CHAIN_MAX_PADS)
+  {
+    report.error("chain: 'pad' is %d, it must be 0 (the primary) to %d", chainPad, CHAIN_MAX_PADS - 1);
+    return false;
+  }
+
+  // optional: sequences typed after a leader key
+  JsonVariant leader = doc["leader"];
+  if (!leader.isNull())
+  {
+    if (!leader.is<JsonObject>())
+    {
+      report.error("'leader' must be an object with 'sequences' and an optional 'timeout'");
+      return false;
+    }
+    if (!compileLeader(leader.as<JsonObject>(), nullptr, report))
+      return false;
+  }
+
+  bool zeropageExists = false;
+  uint16_t definedPages = 0;
+  size_t textSize = 0;
+  int index = 0;
+  for (JsonObject a : pageArray)
+  {
+    if (a["page"].isNull() || !a["page"].is<int>())
+    {
+      report.error("pages[%d]: all pages must have a numeric 'page' element", index);
+      return false;
+    }
+    int number = a["page"];
+    if (number < 0 || number > 8)
+    {
+      report.error("pages[%d]: 'page' is %d, page element values must be 0 to 8", index, number);
+      return false;
+    }
+    if (definedPages & (1 << number))
+    {
+      report.warning("pages[%d]: page %d is defined more than once, the last one wins", index, number);
+    }
+    definedPages |= 1 << number;
+
+    if (!checkPage(a, number, (TextLayout)layout, (UnicodeEntry)unicode, textSize, report))
+      return false;
+
+    if (number == 0)
+    {
+      zeropageExists = true;
+    }
+    index++;
+  }
+  if (!zeropageExists)
+  {
+    report.error("A page numbered '0' must exist");
+    return false;
+  }
+  if (textSize > TEXT_POOL_SIZE)
+  {
+    report.error("the 'text' bindings take %d bytes together, the device has room for %d", (int)textSize, TEXT_POOL_SIZE);
+    return false;
+  }
+
+  // start from blank pages so nothing is left over from the last config
+  for (auto keypage : pages)
+  {
+    *keypage = Keypage();
+  }
+  textBindings.layout = (TextLayout)layout;
+  textBindings.unicode = (UnicodeEntry)unicode;
+  textBindings.used = 0;
+
+  // Fun fact: keypages are 0-indexed and everything else isn't
+  for (JsonObject page : pageArray)
+  {
+    fillPage(page, *pages[(int)page["page"]], textBindings.text.data(), textBindings.used, definedPages, report);
+  }
+
+  // optional: how long to wait before idling, 0 disables idle mode
+  settings.idleTimeoutMs = doc["idle_timeout"] | (uint32_t)IDLE_TIMEOUT_MS;
+  settings.mouse = mouse;
+  settings.chainPad = chainPad;
+
+  // the trie goes last, once the rest is in
+  if (!leader.isNull() && leaderSink)
+  {
+    ConfigReport quiet; // everything was said above
+    compileLeader(leader.as<JsonObject>(), leaderSink, quiet);
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------+
+// Compiled Keymap
+//--------------------------------------------------------------------+
+
+// keymap.bin: the parsed config in a form the device loads with a memcpy.
+// Fixed size and little endian, so the PC and the RP2040 agree on it.
+#define KEYMAP_IMAGE_MAGIC 0x39505253 // "SRP9"
+#define KEYMAP_IMAGE_VERSION 8
+
+struct KeymapImagePage
+{
+  int8_t page;                       // page number, -1 if the page isn't defined
+  uint8_t leds;                      // bits 0-2 board LEDs, bits 3-5 builtin RGB
+  std::array<uint8_t, 9> pagechange; // NO_PAGE_CHANGE if don't change
+  std::array<uint8_t, 9> hidcode;
+  std::array<uint8_t, 9> modcode;
+  uint8_t reserved;
+  uint16_t leader; // bit per leader key
+  uint32_t neopixel;
+  std::array<uint16_t, 9> text; // offset into KeymapImage::text, TEXT_NONE if none
+  std::array<uint8_t, 9> mouse;
+  uint8_t reserved2;
+  std::array<uint8_t, ENCODER_BINDINGS> turnHid;
+  std::array<uint8_t, ENCODER_BINDINGS> turnMod;
+  std::array<uint8_t, ENCODER_BINDINGS> turnMouse;
+  std::array<uint8_t, CHAIN_MAX_PADS - 1> padPage;
+  uint8_t reserved3;
+  std::array<KeyRepeat, 9> repeat;
+  uint16_t reserved4;
+};
+static_assert(sizeof(KeymapImagePage) == 136, "keymap.bin layout changed");
+
+struct KeymapImage
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;  // sizeof(KeymapImage)
+  uint32_t crc;   // CRC-32 of everything after this field
+  uint32_t idleTimeoutMs;
+  std::array<KeymapImagePage, 9> pages;
+  uint8_t layout;
+  uint8_t unicode;
+  uint16_t textSize;
+  MouseSettings mouse;
+  std::array<char, TEXT_POOL_SIZE> text; // the text bindings, 0 terminated
+  uint8_t chainPad;
+  std::array<uint8_t, 3> reserved;
+};
+static_assert(sizeof(KeymapImage) == 1768, "keymap.bin layout changed");
+
+uint32_t keymapImageCrc(const KeymapImage &image)
+{
+  return crc32(&image.idleTimeoutMs, sizeof(KeymapImage) - offsetof(KeymapImage, idleTimeoutMs));
+}
+
+void compileKeymap(const std::array<Keypage *, 9> &pages, const ConfigSettings &settings, KeymapImage &image)
+{
+  memset((void *)&image, 0, sizeof(image)); // padding and all, it goes into the crc
+  image.magic = KEYMAP_IMAGE_MAGIC;
+  image.version = KEYMAP_IMAGE_VERSION;
+  image.size = sizeof(KeymapImage);
+  image.idleTimeoutMs = settings.idleTimeoutMs;
+  for (int p = 0; p < 9; p++)
+  {
+    const Keypage &keypage = *pages[p];
+    KeymapImagePage &out = image.pages[p];
+    out.page = keypage.page;
+    for (int i = 0; i < 9; i++)
+    {
+      out.pagechange[i] = keypage.pagechange[i];
+      out.hidcode[i] = keypage.hidcode[i];
+      out.modcode[i] = keypage.modcode[i];
+      out.text[i] = keypage.text[i];
+      out.mouse[i] = keypage.mouse[i];
+      out.repeat[i] = keypage.repeat[i];
+    }
+    out.turnHid = keypage.turnHid;
+    out.turnMod = keypage.turnMod;
+    out.turnMouse = keypage.turnMouse;
+    out.padPage = keypage.padPage;
+    out.leader = keypage.leader;
+    for (int i = 0; i < 3; i++)
+    {
+      out.leds |= keypage.leds[i] << i;
+      out.leds |= keypage.builtinleds[i] << (i + 3);
+    }
+    out.neopixel = keypage.neopixel;
+  }
+  image.layout = textBindings.layout;
+  image.unicode = textBindings.unicode;
+  image.textSize = textBindings.used;
+  image.mouse = settings.mouse;
+  image.chainPad = settings.chainPad;
+  memcpy(image.text.data(), textBindings.text.data(), textBindings.used);
+  image.crc = keymapImageCrc(image);
+}
+
+// returns true if the image was good and got loaded into pages
+bool loadKeymap(const KeymapImage &image, std::array<Keypage *, 9> &pages, ConfigSettings &settings)
+{
+  if (image.magic != KEYMAP_IMAGE_MAGIC || image.version != KEYMAP_IMAGE_VERSION ||
+      image.size != sizeof(KeymapImage) || image.crc != keymapImageCrc(image) || image.pages[0].page != 0 ||
+      image.layout >= LAYOUT_COUNT || image.unicode >= UNICODE_COUNT || image.textSize > TEXT_POOL_SIZE ||
+      image.mouse.curve >= CURVE_COUNT || image.chainPad >= CHAIN_MAX_PADS ||
+      (image.textSize && image.text[image.textSize - 1]))
+    return false;
+  for (auto &in : image.pages)
+  {
+    for (auto text : in.text)
+    {
+      if (text != TEXT_NONE && text >= image.textSize)
+        return false;
+    }
+    for (auto mouse : in.mouse)
+    {
+      if (mouse != MOUSE_NONE && mouse >= MOUSE_ACTIONS)
+        return false;
+    }
+    for (auto padPage : in.padPage)
+    {
+      if (padPage > 8)
+        return false;
+    }
+    if (in.leader >> 9)
+      return false;
+    for (auto &repeat : in.repeat)
+    {
+      if (repeat.rate && (repeat.maxRate < repeat.rate || repeat.maxRate > REPEAT_MAX_RATE))
+        return false;
+    }
+    for (auto mouse : in.turnMouse)
+    {
+      if (mouse != MOUSE_NONE && mouse != MOUSE_WHEEL_UP && mouse != MOUSE_WHEEL_DOWN)
+        return false;
+    }
+  }
+
+  for (int p = 0; p < 9; p++)
+  {
+    const KeymapImagePage &in = image.pages[p];
+    Keypage &keypage = *pages[p];
+    keypage.page = in.page;
+    for (int i = 0; i < 9; i++)
+    {
+      keypage.pagechange[i] = in.pagechange[i];
+      keypage.hidcode[i] = in.hidcode[i];
+      keypage.modcode[i] = in.modcode[i];
+      keypage.text[i] = in.text[i];
+      keypage.mouse[i] = in.mouse[i];
+      keypage.repeat[i] = in.repeat[i];
+    }
+    keypage.turnHid = in.turnHid;
+    keypage.turnMod = in.turnMod;
+    keypage.turnMouse = in.turnMouse;
+    keypage.padPage = in.padPage;
+    keypage.leader = in.leader;
+    for (int i = 0; i < 3; i++)
+    {
+      keypage.leds[i] = in.leds & (1 << i);
+      keypage.builtinleds[i] = in.leds & (1 << (i + 3));
+    }
+    keypage.neopixel = in.neopixel;
+  }
+  textBindings.layout = (TextLayout)image.layout;
+  textBindings.unicode = (UnicodeEntry)image.unicode;
+  textBindings.used = image.textSize;
+  memcpy(textBindings.text.data(), image.text.data(), image.textSize);
+  settings.idleTimeoutMs = image.idleTimeoutMs;
+  settings.mouse = image.mouse;
+  settings.chainPad = image.chainPad;
+  return true;
+}
+
+//--------------------------------------------------------------------+
+// Writing config.json
+//--------------------------------------------------------------------+
+
+// Turns pages back into config.json text, for when there is no file to
+// read it from. leader is a checked trie to write out the sequences from,
+// if there is one. Returns the length, or 0 if it didn't fit in size.
+size_t renderConfigJson(const std::array<Keypage *, 9> &pages, const ConfigSettings &settings, char *out, size_t size,
+                        const uint8_t *leader = nullptr)
+{
+  const char *ledNames[] = {"led1", "led2", "led3", "ledR", "ledG", "ledB"};
+  const char *encoderNames[] = {"encoder", "encoder2"};
+  size_t used = 0;
+  auto print = [&](const char *format, auto... args)
+  {
+    if (used < size)
+      used += snprintf(out + used, size - used, format, args...);
+  };
+  auto printKey = [&](uint8_t hidcode, uint8_t mod)
+  {
+    print("%s%s%s%s", mod & KEYBOARD_MODIFIER_LEFTCTRL ? "ctl+" : "", mod & KEYBOARD_MODIFIER_LEFTALT ? "alt+" : "",
+          mod & KEYBOARD_MODIFIER_LEFTSHIFT ? "shift+" : "", mod & KEYBOARD_MODIFIER_LEFTGUI ? "gui+" : "");
+    const char *name = keyName(hidcode);
+    print("%s\"", hidcode && name ? name : "");
+  };
+  // JSON escapes for quotes, backslashes and control characters, UTF-8 stays as it is
+  auto printText = [&](const char *text)
+  {
+    print("text ");
+    for (const char *c = text; *c; c++)
+    {
+      if (*c == '"' || *c == '\\')
+        print("\\%c", *c);
+      else if (*c == '\n')
+        print("\\n");
+      else if ((uint8_t)*c < ' ')
+        print("\\u%04x", *c);
+      else
+        print("%c", *c);
+    }
+    print("\"");
+  };
+
+  print("{\n  \"idle_timeout\": %lu,", (unsigned long)settings.idleTimeoutMs);
+  print("\n  \"layout\": \"%s\",", layoutNames[textBindings.layout]);
+  print("\n  \"unicode\": \"%s\",", unicodeNames[textBindings.unicode]);
+  const MouseSettings &mouse = settings.mouse;
+  print("\n  \"mouse\": {\"start_speed\": %u, \"max_speed\": %u, \"accel_ms\": %u, \"curve\": \"%s\", \"wheel_speed\": %u},",
+        mouse.startSpeed, mouse.maxSpeed, mouse.accelMs, mouseCurveNames[mouse.curve], mouse.wheelSpeed);
+  if (settings.chainPad)
+    print("\n  \"chain\": {\"pad\": %d},", settings.chainPad);
+
+  // the sequences depth first, which is key order
+  if (leader)
+  {
+    LeaderMatcher trie;
+    trie.use(leader);
+    print("\n  \"leader\": {\"timeout\": %lu, \"sequences\": {", (unsigned long)trie.header().timeoutMs);
+    char keys[LEADER_MAX_DEPTH + 1];
+    bool any = false;
+    auto visit = [&](auto &self, uint16_t index, int depth) -> void
+    {
+      const LeaderNode &node = trie.node(index);
+      if (node.action != LEADER_NONE)
+      {
+        keys[depth] = 0;
+        print("%s\n    \"%s\": \"", any ? "," : "", keys);
+        any = true;
+        if (node.action == LEADER_TEXT)
+          printText(trie.text(node));
+        else if (node.action == LEADER_PAGE)
+          print("page %d\"", node.value);
+        else
+          printKey(node.value, node.modcode);
+      }
+      uint16_t child = node.first;
+      for (int key = 0; key < 9 && depth < LEADER_MAX_DEPTH; key++)
+      {
+        if (!(node.next & (1 << key)))
+          continue;
+        keys[depth] = '1' + key;
+        self(self, child++, depth + 1);
+      }
+    };
+    visit(visit, 0, 0);
+    print("}},");
+  }
+  print("\n  \"pages\": [");
+  bool first = true;
+  for (auto keypage : pages)
+  {
+    if (keypage->page < 0)
+      continue;
+    print("%s\n    {\n      \"page\": %d,\n      \"keys\": {", first ? "" : ",", keypage->page);
+    first = false;
+
+    for (int i = 0; i < 9; i++)
+    {
+      print("%s\"%d\": \"", i ? ", " : "", i + 1);
+      if (keypage->text[i] != TEXT_NONE)
+      {
+        printText(&textBindings.text[keypage->text[i]]);
+        continue;
+      }
+      if (keypage->leader & (1 << i))
+      {
+        print("leader\"");
+        continue;
+      }
+      if (keypage->mouse[i] != MOUSE_NONE)
+      {
+        print("mouse %s\"", mouseActionNames[keypage->mouse[i]]);
+        continue;
+      }
+      if (keypage->pagechange[i] != NO_PAGE_CHANGE)
+      {
+        print("page %d\"", keypage->pagechange[i]);
+        continue;
+      }
+      printKey(keypage->hidcode[i], keypage->modcode[i]);
+    }
+    print("},");
+
+    // pad pages only if a pad doesn't just follow along
+    bool follows = true;
+    for (auto padPage : keypage->padPage)
+    {
+      follows &= padPage == keypage->page;
+    }
+    if (!follows)
+    {
+      print("\n      \"pad_pages\": [%d, %d, %d],", keypage->padPage[0], keypage->padPage[1], keypage->padPage[2]);
+    }
+
+    // encoder directions with nothing bound are left out
+    for (int e = 0; e < ENCODER_BINDINGS / 2; e++)
+    {
+      bool any = false;
+      for (int d = 0; d < 2; d++)
+      {
+        int slot = e * 2 + d;
+        if (!keypage->turnHid[slot] && !keypage->turnMod[slot] && keypage->turnMouse[slot] == MOUSE_NONE)
+          continue;
+        print(any ? ", " : "\n      \"%s\": {", encoderNames[e]);
+        any = true;
+        print("\"%s\": \"", d ? "ccw" : "cw");
+        if (keypage->turnMouse[slot] != MOUSE_NONE)
+          print("mouse %s\"", mouseActionNames[keypage->turnMouse[slot]]);
+        else
+          printKey(keypage->turnHid[slot], keypage->turnMod[slot]);
+      }
+      if (any)
+        print("},");
+    }
+
+    // only the keys that repeat, with everything spelled out
+    bool anyRepeat = false;
+    for (int i = 0; i < 9; i++)
+    {
+      const KeyRepeat &r = keypage->repeat[i];
+      if (!r.rate)
+        continue;
+      print(anyRepeat ? ", " : "\n      \"repeat\": {");
+      anyRepeat = true;
+      print("\"%d\": {\"delay\": %u, \"rate\": %u, \"max_rate\": %u, \"accel_ms\": %u}", i + 1, r.delayMs, r.rate,
+            r.maxRate, r.accelMs);
+    }
+    if (anyRepeat)
+      print("},");
+
+    print("\n      \"leds\": {");
+    for (int i = 0; i < 6; i++)
+    {
+      print("\"%s\": %s, ", ledNames[i], (i < 3 ? keypage->leds[i] : keypage->builtinleds[i - 3]) ? "true" : "false");
+    }
+    print("\"neopixel\": \"%06lx\"}\n    }", (unsigned long)keypage->neopixel);
+  }
+  print("\n  ]\n}\n");
+  return used < size ? used : 0;
+}
+
+#endif
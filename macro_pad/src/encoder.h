@@ -0,0 +1,176 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef ENCODER_H
+
+#define ENCODER_H
+
+#include <Arduino.h>
+#include <array>
+
+// Rotary encoders. Every edge on either pin interrupts and moves the
+// decoder through the quadrature sequence, so loop() never polls them and
+// a fast spin can't slip past it. loop() picks up whole detents whenever
+// it gets round to it.
+
+//--------------------------------------------------------------------+
+// Encoder Config
+//--------------------------------------------------------------------+
+
+// D4 and D5 (SDA and SCL) are the only pins the pad doesn't use, unless
+// the chain (RP9_CHAIN) has them. A second encoder needs two pins taken off
+// something else (say the board LEDs in main.h), then build with
+// -DENCODER2_A=<pin> -DENCODER2_B=<pin>.
+#if !defined(ENCODER1_A) && !defined(RP9_CHAIN)
+#define ENCODER1_A D4
+#define ENCODER1_B D5
+#endif
+
+#if defined(ENCODER2_A) && defined(ENCODER2_B)
+#define ENCODER_COUNT 2
+#elif defined(ENCODER1_A)
+#define ENCODER_COUNT 1
+#else
+#define ENCODER_COUNT 0
+#endif
+
+// quadrature steps from one detent to the next, 4 on most (EC11 style) encoders
+#ifndef ENCODER_STEPS_PER_DETENT
+#define ENCODER_STEPS_PER_DETENT 4
+#endif
+
+// encoder bindings in a Keypage, two per encoder: [encoder * 2 + ENCODER_CW or ENCODER_CCW]
+#define ENCODER_CW 0
+#define ENCODER_CCW 1
+#define ENCODER_BINDINGS 4
+
+// how many runs of turns can wait to be typed
+#define TURN_QUEUE_SIZE 8
+
+//--------------------------------------------------------------------+
+// QuadratureDecoder Class
+//--------------------------------------------------------------------+
+
+class QuadratureDecoder
+{
+public:
+  uint8_t pinA;
+  uint8_t pinB;
+  volatile int32_t steps = 0; // quadrature steps not taken as detents yet, clockwise positive
+  volatile uint32_t invalid = 0; // both pins changed between two interrupts
+
+  void begin(uint8_t a, uint8_t b)
+  {
+    pinA = a;
+    pinB = b;
+    pinMode(pinA, INPUT_PULLUP);
+    pinMode(pinB, INPUT_PULLUP);
+    state = read();
+  }
+
+  // from the pin change interrupt
+  void update()
+  {
+    // [last state][new state]: +1 a step clockwise, -1 back, 0 no change or a skipped step
+    static const int8_t table[16] = {0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0};
+    uint8_t now = read();
+    int8_t step = table[state << 2 | now];
+    steps = steps + step;
+    invalid = invalid + (!step && now != state);
+    state = now;
+  }
+
+  // whole detents since the last call, the part of one that's left stays
+  int32_t takeDetents()
+  {
+    noInterrupts();
+    int32_t detents = steps / ENCODER_STEPS_PER_DETENT;
+    steps = steps - detents * ENCODER_STEPS_PER_DETENT;
+    interrupts();
+    return detents;
+  }
+
+private:
+  uint8_t state = 0; // A in bit 1, B in bit 0
+
+  uint8_t read()
+  {
+    return digitalRead(pinA) << 1 | digitalRead(pinB);
+  }
+};
+
+//--------------------------------------------------------------------+
+// TurnKeys Class
+//--------------------------------------------------------------------+
+
+// Turns bound to keys, waiting to be typed. Each detent is a press and a
+// release, and they go out back to back however many piled up. Runs of
+// the same binding share a queue entry.
+class TurnKeys
+{
+public:
+  uint32_t dropped = 0; // detents that didn't fit in the queue
+
+  void add(uint8_t hidcode, uint8_t modcode, uint32_t detents)
+  {
+    if (!detents)
+      return;
+    Turn *last = queued ? &queue[(first + queued - 1) % TURN_QUEUE_SIZE] : nullptr;
+    if (last && last->hidcode == hidcode && last->modcode == modcode)
+    {
+      last->count += detents;
+      return;
+    }
+    if (queued == TURN_QUEUE_SIZE)
+    {
+      dropped += detents;
+      return;
+    }
+    queue[(first + queued++) % TURN_QUEUE_SIZE] = {hidcode, modcode, detents};
+  }
+
+  bool busy()
+  {
+    return queued;
+  }
+
+  // the next report, a press or the release after it
+  void next(uint8_t &modifier, std::array<uint8_t, 6> &keys)
+  {
+    keys.fill(0);
+    Turn &turn = queue[first];
+    if (pressed)
+    {
+      modifier = 0;
+      pressed = false;
+      if (!--turn.count)
+      {
+        first = (first + 1) % TURN_QUEUE_SIZE;
+        queued--;
+      }
+      return;
+    }
+    modifier = turn.modcode;
+    keys[0] = turn.hidcode;
+    pressed = true;
+  }
+
+private:
+  struct Turn
+  {
+    uint8_t hidcode;
+    uint8_t modcode;
+    uint32_t count; // detents
+  };
+  std::array<Turn, TURN_QUEUE_SIZE> queue;
+  uint8_t first = 0;
+  uint8_t queued = 0;
+  bool pressed = false; // the first turn's key is down
+};
+
+#endif
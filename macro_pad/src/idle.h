@@ -0,0 +1,136 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef IDLE_H
+
+#define IDLE_H
+
+#include <Arduino.h>
+#include "matrix.h"
+#include "log.h"
+
+//--------------------------------------------------------------------+
+// IdleMode Class
+//--------------------------------------------------------------------+
+
+// While idle every column is driven high, so pressing any key pulls its
+// row up. The rows get rising edge interrupts and the core sleeps until
+// one fires (USB keeps being serviced from its own interrupt meanwhile).
+class IdleMode
+{
+public:
+  uint32_t timeoutMs = 0;    // how long nothing has to be pressed, 0 never sleeps. Comes from the config.
+  uint32_t lastActivity = 0; // millis() of the last time a key was down
+
+  // statistics
+  uint32_t sleeps = 0;          // how many times we went idle
+  uint32_t windowStart = 0;     // millis() when the statistics were last printed
+  uint32_t windowSleptMs = 0;   // time spent asleep since then
+  uint32_t lastLatencyUs = 0;   // row edge to first keyboard report, last wake
+  uint32_t maxLatencyUs = 0;    // same, worst case
+  bool waitingForReport = false;
+
+  // call whenever a key is down
+  void activity()
+  {
+    lastActivity = millis();
+  }
+
+  bool due()
+  {
+    return timeoutMs && millis() - lastActivity >= timeoutMs;
+  }
+
+  // Parks the scanner and sleeps until a row edge, or until wakeFlag is
+  // set by someone else (e.g. the host wrote to the flash).
+  void sleep(MatrixScanner &scanner, const bool &wakeFlag)
+  {
+    woken = false;
+    scanner.park();
+    for (auto row : scanner.rows)
+    {
+      attachInterrupt(digitalPinToInterrupt(row), onRowEdge, RISING);
+    }
+
+    // a key may have gone down before the interrupts were armed
+    bool held = false;
+    for (auto row : scanner.rows)
+    {
+      held |= digitalRead(row);
+    }
+
+    uint32_t start = millis();
+    if (!held)
+    {
+      sleeps++;
+      while (!woken && !*(volatile const bool *)&wakeFlag)
+      {
+#if defined(ARDUINO_ARCH_RP2040)
+        __wfi();
+#endif
+        yield();
+      }
+      windowSleptMs += millis() - start;
+    }
+
+    for (auto row : scanner.rows)
+    {
+      detachInterrupt(digitalPinToInterrupt(row));
+    }
+    scanner.unpark();
+    activity();
+    waitingForReport = woken;
+  }
+
+  // call right after sending a keyboard report. Returns true if that was
+  // the first report since waking up and the latency has been measured.
+  bool reported()
+  {
+    if (!waitingForReport)
+      return false;
+    waitingForReport = false;
+    lastLatencyUs = micros() - wokenAt;
+    if (lastLatencyUs > maxLatencyUs)
+    {
+      maxLatencyUs = lastLatencyUs;
+    }
+    return true;
+  }
+
+  // prints what idling bought us since the last call
+  void print(uint32_t scanPeriodUs)
+  {
+    uint32_t window = millis() - windowStart;
+    uint32_t awake = window ? 100 - (uint64_t)windowSleptMs * 100 / window : 100;
+    LOG_INFO("Idle: %u sleeps, CPU awake %u%% of the last %u ms", sleeps, awake, window);
+    LOG_INFO("Wake to report latency: %u us, worst %u us, scan period %u us", lastLatencyUs, maxLatencyUs, scanPeriodUs);
+    windowStart = millis();
+    windowSleptMs = 0;
+  }
+
+  // for other interrupts that should end a sleep too, like the encoders
+  static void wake()
+  {
+    onRowEdge();
+  }
+
+private:
+  static inline volatile bool woken = false;
+  static inline volatile uint32_t wokenAt = 0;
+
+  static void onRowEdge()
+  {
+    if (!woken)
+    {
+      wokenAt = micros();
+      woken = true;
+    }
+  }
+};
+
+#endif
@@ -11,140 +11,179 @@
 #define KEYMAPPING_H
 
 #include "Adafruit_TinyUSB.h"
-#include <map>
+#include <cstring>
 
-std::map<const char*, uint8_t> keymap;
-void setupKeymap()
+// key names for config.json and their hidcodes. Keep this sorted by name
+// (plain strcmp order, so capitals first) - lookupKey() is a binary search.
+struct KeyName
 {
-    keymap["a"] = HID_KEY_A;
-    keymap["b"] = HID_KEY_B;
-    keymap["c"] = HID_KEY_C;
-    keymap["d"] = HID_KEY_D;
-    keymap["e"] = HID_KEY_E;
-    keymap["f"] = HID_KEY_F;
-    keymap["g"] = HID_KEY_G;
-    keymap["h"] = HID_KEY_H;
-    keymap["i"] = HID_KEY_I;
-    keymap["j"] = HID_KEY_J;
-    keymap["k"] = HID_KEY_K;
-    keymap["l"] = HID_KEY_L;
-    keymap["m"] = HID_KEY_M;
-    keymap["n"] = HID_KEY_N;
-    keymap["o"] = HID_KEY_O;
-    keymap["p"] = HID_KEY_P;
-    keymap["q"] = HID_KEY_Q;
-    keymap["r"] = HID_KEY_R;
-    keymap["s"] = HID_KEY_S;
-    keymap["t"] = HID_KEY_T;
-    keymap["u"] = HID_KEY_U;
-    keymap["v"] = HID_KEY_V;
-    keymap["w"] = HID_KEY_W;
-    keymap["x"] = HID_KEY_X;
-    keymap["y"] = HID_KEY_Y;
-    keymap["z"] = HID_KEY_Z;
-
-    keymap["grave"] = HID_KEY_GRAVE;
-    keymap["1"] = HID_KEY_1;
-    keymap["2"] = HID_KEY_2;
-    keymap["3"] = HID_KEY_3;
-    keymap["4"] = HID_KEY_4;
-    keymap["5"] = HID_KEY_5;
-    keymap["6"] = HID_KEY_6;
-    keymap["7"] = HID_KEY_7;
-    keymap["8"] = HID_KEY_8;
-    keymap["9"] = HID_KEY_9;
-    keymap["0"] = HID_KEY_0;
-    keymap["minus"] = HID_KEY_MINUS;
-    keymap["equal"] = HID_KEY_EQUAL;
-    keymap["backspace"] = HID_KEY_BACKSPACE;
-
-    keymap["left_bracket"] = HID_KEY_BRACKET_LEFT;
-    keymap["right_bracket"] = HID_KEY_BRACKET_RIGHT;
-    keymap["backslash"] = HID_KEY_BACKSLASH;
-    keymap["semicolon"] = HID_KEY_SEMICOLON;
-    keymap["apostrophe"] = HID_KEY_APOSTROPHE;
-    keymap["comma"] = HID_KEY_COMMA;
-    keymap["period"] = HID_KEY_PERIOD;
-    keymap["slash"] = HID_KEY_SLASH;
-
-    keymap["F1"] = HID_KEY_F1;
-    keymap["F2"] = HID_KEY_F2;
-    keymap["F3"] = HID_KEY_F3;
-    keymap["F4"] = HID_KEY_F4;
-    keymap["F5"] = HID_KEY_F5;
-    keymap["F6"] = HID_KEY_F6;
-    keymap["F7"] = HID_KEY_F7;
-    keymap["F8"] = HID_KEY_F8;
-    keymap["F9"] = HID_KEY_F9;
-    keymap["F10"] = HID_KEY_F10;
-    keymap["F11"] = HID_KEY_F11;
-    keymap["F12"] = HID_KEY_F12;
-    keymap["F13"] = HID_KEY_F13;
-    keymap["F14"] = HID_KEY_F14;
-    keymap["F15"] = HID_KEY_F15;
-    keymap["F16"] = HID_KEY_F16;
-    keymap["F17"] = HID_KEY_F17;
-    keymap["F18"] = HID_KEY_F18;
-    keymap["F19"] = HID_KEY_F19;
-    keymap["F20"] = HID_KEY_F20;
-    keymap["F21"] = HID_KEY_F21;
-    keymap["F22"] = HID_KEY_F22;
-    keymap["F23"] = HID_KEY_F23;
-    keymap["F24"] = HID_KEY_F24;
-
-    keymap["escape"] = HID_KEY_ESCAPE;
-    keymap["enter"] = HID_KEY_ENTER;
-    keymap["space"] = HID_KEY_SPACE;
-
-    keymap["print_screen"] = HID_KEY_PRINT_SCREEN;
-    keymap["scroll_lock"] = HID_KEY_SCROLL_LOCK;
-    keymap["pause"] = HID_KEY_PAUSE;
-
-    keymap["insert"] = HID_KEY_INSERT;
-    keymap["delete"] = HID_KEY_DELETE;
-    keymap["home"] = HID_KEY_HOME;
-    keymap["end"] = HID_KEY_END;
-    keymap["page_up"] = HID_KEY_PAGE_UP;
-    keymap["page_down"] = HID_KEY_PAGE_DOWN;
-    keymap["num_lock"] = HID_KEY_NUM_LOCK;
-
-    keymap["key_0"] = HID_KEY_KEYPAD_0;
-    keymap["key_1"] = HID_KEY_KEYPAD_1;
-    keymap["key_2"] = HID_KEY_KEYPAD_2;
-    keymap["key_3"] = HID_KEY_KEYPAD_3;
-    keymap["key_4"] = HID_KEY_KEYPAD_4;
-    keymap["key_5"] = HID_KEY_KEYPAD_5;
-    keymap["key_6"] = HID_KEY_KEYPAD_6;
-    keymap["key_7"] = HID_KEY_KEYPAD_7;
-    keymap["key_8"] = HID_KEY_KEYPAD_8;
-    keymap["key_9"] = HID_KEY_KEYPAD_9;
-    keymap["key_plus"] = HID_KEY_KEYPAD_ADD;
-    keymap["key_comma"] = HID_KEY_KEYPAD_COMMA;
-    keymap["key_period"] = HID_KEY_KEYPAD_DECIMAL;
-    keymap["key_slash"] = HID_KEY_KEYPAD_DIVIDE;
-    keymap["key_enter"] = HID_KEY_KEYPAD_ENTER;
-    keymap["key_equal"] = HID_KEY_KEYPAD_EQUAL;
-    keymap["key_equal_sign"] = HID_KEY_KEYPAD_EQUAL_SIGN;
-    keymap["key_asterisk"] = HID_KEY_KEYPAD_MULTIPLY;
-    keymap["key_minus"] = HID_KEY_KEYPAD_SUBTRACT;
-
-    keymap["up"] = HID_KEY_ARROW_UP;
-    keymap["down"] = HID_KEY_ARROW_DOWN;
-    keymap["left"] = HID_KEY_ARROW_LEFT;
-    keymap["right"] = HID_KEY_ARROW_RIGHT;
+    const char *name;
+    uint8_t hidcode;
+};
+
+constexpr KeyName keymap[] = {
+    {"0",               HID_KEY_0},
+    {"1",               HID_KEY_1},
+    {"2",               HID_KEY_2},
+    {"3",               HID_KEY_3},
+    {"4",               HID_KEY_4},
+    {"5",               HID_KEY_5},
+    {"6",               HID_KEY_6},
+    {"7",               HID_KEY_7},
+    {"8",               HID_KEY_8},
+    {"9",               HID_KEY_9},
+    {"F1",              HID_KEY_F1},
+    {"F10",             HID_KEY_F10},
+    {"F11",             HID_KEY_F11},
+    {"F12",             HID_KEY_F12},
+    {"F13",             HID_KEY_F13},
+    {"F14",             HID_KEY_F14},
+    {"F15",             HID_KEY_F15},
+    {"F16",             HID_KEY_F16},
+    {"F17",             HID_KEY_F17},
+    {"F18",             HID_KEY_F18},
+    {"F19",             HID_KEY_F19},
+    {"F2",              HID_KEY_F2},
+    {"F20",             HID_KEY_F20},
+    {"F21",             HID_KEY_F21},
+    {"F22",             HID_KEY_F22},
+    {"F23",             HID_KEY_F23},
+    {"F24",             HID_KEY_F24},
+    {"F3",              HID_KEY_F3},
+    {"F4",              HID_KEY_F4},
+    {"F5",              HID_KEY_F5},
+    {"F6",              HID_KEY_F6},
+    {"F7",              HID_KEY_F7},
+    {"F8",              HID_KEY_F8},
+    {"F9",              HID_KEY_F9},
+    {"a",               HID_KEY_A},
+    {"apostrophe",      HID_KEY_APOSTROPHE},
+    {"b",               HID_KEY_B},
+    {"backslash",       HID_KEY_BACKSLASH},
+    {"backspace",       HID_KEY_BACKSPACE},
+    {"c",               HID_KEY_C},
+    {"comma",           HID_KEY_COMMA},
+    {"compose",         HID_KEY_APPLICATION},
+    {"copy",            HID_KEY_COPY},
+    {"cut",             HID_KEY_CUT},
+    {"d",               HID_KEY_D},
+    {"delete",          HID_KEY_DELETE},
+    {"down",            HID_KEY_ARROW_DOWN},
+    {"e",               HID_KEY_E},
+    {"end",             HID_KEY_END},
+    {"enter",           HID_KEY_ENTER},
+    {"equal",           HID_KEY_EQUAL},
+    {"escape",          HID_KEY_ESCAPE},
+    {"f",               HID_KEY_F},
+    {"find",            HID_KEY_FIND},
+    {"g",               HID_KEY_G},
+    {"grave",           HID_KEY_GRAVE},
+    {"h",               HID_KEY_H},
+    {"home",            HID_KEY_HOME},
+    {"i",               HID_KEY_I},
+    {"insert",          HID_KEY_INSERT},
+    {"j",               HID_KEY_J},
+    {"k",               HID_KEY_K},
+    {"key_0",           HID_KEY_KEYPAD_0},
+    {"key_1",           HID_KEY_KEYPAD_1},
+    {"key_2",           HID_KEY_KEYPAD_2},
+    {"key_3",           HID_KEY_KEYPAD_3},
+    {"key_4",           HID_KEY_KEYPAD_4},
+    {"key_5",           HID_KEY_KEYPAD_5},
+    {"key_6",           HID_KEY_KEYPAD_6},
+    {"key_7",           HID_KEY_KEYPAD_7},
+    {"key_8",           HID_KEY_KEYPAD_8},
+    {"key_9",           HID_KEY_KEYPAD_9},
+    {"key_asterisk",    HID_KEY_KEYPAD_MULTIPLY},
+    {"key_comma",       HID_KEY_KEYPAD_COMMA},
+    {"key_enter",       HID_KEY_KEYPAD_ENTER},
+    {"key_equal",       HID_KEY_KEYPAD_EQUAL},
+    {"key_equal_sign",  HID_KEY_KEYPAD_EQUAL_SIGN},
+    {"key_minus",       HID_KEY_KEYPAD_SUBTRACT},
+    {"key_period",      HID_KEY_KEYPAD_DECIMAL},
+    {"key_plus",        HID_KEY_KEYPAD_ADD},
+    {"key_slash",       HID_KEY_KEYPAD_DIVIDE},
+    {"l",               HID_KEY_L},
+    {"left",            HID_KEY_ARROW_LEFT},
+    {"left_bracket",    HID_KEY_BRACKET_LEFT},
+    {"m",               HID_KEY_M},
+    {"minus",           HID_KEY_MINUS},
+    {"mute",            HID_KEY_MUTE},
+    {"n",               HID_KEY_N},
+    {"num_lock",        HID_KEY_NUM_LOCK},
+    {"o",               HID_KEY_O},
+    {"p",               HID_KEY_P},
+    {"page_down",       HID_KEY_PAGE_DOWN},
+    {"page_up",         HID_KEY_PAGE_UP},
+    {"paste",           HID_KEY_PASTE},
+    {"pause",           HID_KEY_PAUSE},
+    {"period",          HID_KEY_PERIOD},
+    {"power",           HID_KEY_POWER},
+    {"print_screen",    HID_KEY_PRINT_SCREEN},
+    {"q",               HID_KEY_Q},
+    {"r",               HID_KEY_R},
+    {"right",           HID_KEY_ARROW_RIGHT},
+    {"right_bracket",   HID_KEY_BRACKET_RIGHT},
+    {"s",               HID_KEY_S},
+    {"scroll_lock",     HID_KEY_SCROLL_LOCK},
+    {"semicolon",       HID_KEY_SEMICOLON},
+    {"slash",           HID_KEY_SLASH},
+    {"space",           HID_KEY_SPACE},
+    {"t",               HID_KEY_T},
+    {"u",               HID_KEY_U},
+    {"undo",            HID_KEY_UNDO},
+    {"up",              HID_KEY_ARROW_UP},
+    {"v",               HID_KEY_V},
+    {"vol_down",        HID_KEY_VOLUME_DOWN},
+    {"vol_up",          HID_KEY_VOLUME_UP},
+    {"w",               HID_KEY_W},
+    {"x",               HID_KEY_X},
+    {"y",               HID_KEY_Y},
+    {"z",               HID_KEY_Z},
+};
+
+const size_t keymapSize = sizeof(keymap) / sizeof(keymap[0]);
+
+constexpr int keymapCompare(const char *a, const char *b)
+{
+    return *a != *b ? (unsigned char)*a - (unsigned char)*b : *a ? keymapCompare(a + 1, b + 1) : 0;
+}
 
-    keymap["undo"] = HID_KEY_UNDO;
-    keymap["cut"] = HID_KEY_CUT;
-    keymap["copy"] = HID_KEY_COPY;
-    keymap["paste"] = HID_KEY_PASTE;
-    keymap["find"] = HID_KEY_FIND;
+constexpr bool keymapSorted(size_t i = 1)
+{
+    return i >= sizeof(keymap) / sizeof(keymap[0]) ||
+           (keymapCompare(keymap[i - 1].name, keymap[i].name) < 0 && keymapSorted(i + 1));
+}
+static_assert(keymapSorted(), "keymap must be sorted by name");
 
-    keymap["mute"] = HID_KEY_MUTE;
-    keymap["vol_up"] = HID_KEY_VOLUME_UP;
-    keymap["vol_down"] = HID_KEY_VOLUME_DOWN;
+// returns the hidcode for a key name, 0 if there isn't one
+uint8_t lookupKey(const char *name)
+{
+    size_t low = 0;
+    size_t high = keymapSize;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        int order = strcmp(name, keymap[mid].name);
+        if (order == 0)
+            return keymap[mid].hidcode;
+        if (order < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return 0;
+}
 
-    keymap["power"] = HID_KEY_POWER;
-    keymap["compose"] = HID_KEY_APPLICATION;
+// the other way round: a name for a hidcode, nullptr if there isn't one
+const char *keyName(uint8_t hidcode)
+{
+    for (auto &k : keymap)
+    {
+        if (k.hidcode == hidcode)
+            return k.name;
+    }
+    return nullptr;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,258 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef KEYPAD_H
+
+#define KEYPAD_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "matrix.h"
+#include "text.h"
+#include "mouse.h"
+#include "encoder.h"
+#include "chain.h"
+#include "leader.h"
+#include "library.h"
+#include "repeat.h"
+#include <array>
+
+// Turns debounced keys into what goes in the next keyboard report, which
+// main.cpp sends.
+
+// stores the keypages parsed by core 0
+std::array<Keypage *, 9> keypages;
+// pages 9 and up, parsed from library.json as they're needed
+PageLibrary library;
+// a library page's text is typed from here, the page can leave the cache
+// before it's done
+std::array<char, LIBRARY_TEXT_SIZE> libraryText;
+
+// the current page number
+int currpage;
+// the last page number
+bool pagechanged;
+
+// the list of keycodes to send - never more than 6 per the spec!
+std::array<uint8_t, 6> keycode;
+// how many keys were pressed
+uint8_t count;
+// modifier key collector
+uint8_t modifier;
+// the keys that were down last time on each pad, so text only starts on a press
+PadKeys lastKeys;
+// the page each key went down on, it does what it does there until it's let go
+std::array<std::array<uint8_t, 9>, CHAIN_MAX_PADS> keyPages;
+
+// types the text bindings, its reports go out instead of the keys'
+TextTyper typer;
+// the mouse keys that are down, a bit per MouseAction
+uint16_t mouseHeld;
+// encoder turns bound to keys, waiting to be typed, and repeated keys' taps
+TurnKeys turns;
+// taps the keys with a "repeat" while they're held
+KeyRepeater repeater;
+// follows the sequence after a leader key, through the trie in flash
+LeaderMatcher leader;
+// the keys that went into it on each pad, which do nothing else until let go
+PadKeys leaderKeys;
+
+// Page number page, which must be the current page or one of pages 0 to
+// 8. A library page that's gone (the library changed) is a blank page.
+Keypage &pageAt(int page)
+{
+  if (page < LIBRARY_FIRST_PAGE)
+    return *keypages[page];
+  static Keypage blank;
+  Keypage *keypage = library.find(page);
+  return keypage ? *keypage : blank;
+}
+
+// the page a pad's keys are on
+int padPageNumber(int pad)
+{
+  // a chained pad uses whichever page the current page gives it
+  return pad ? pageAt(currpage).padPage[pad - 1] : currpage;
+}
+
+Keypage &padKeypage(int pad)
+{
+  return pageAt(padPageNumber(pad));
+}
+
+// true if there's a page numbered page to change to, a library page is
+// parsed if it isn't already
+bool pageDefined(int page)
+{
+  if (page < LIBRARY_FIRST_PAGE)
+    return page >= 0 && keypages[page]->page >= 0;
+  return page <= LAST_PAGE && library.open(page);
+}
+
+// Changes to page. A library page has to be there for it, one from
+// config.json doesn't. The library starts on the pages it can go to next.
+void changePage(int page)
+{
+  if (page >= LIBRARY_FIRST_PAGE ? !library.open(page) : (library.leave(), false))
+    return;
+  int lastpage = currpage;
+  currpage = page;
+  pagechanged = lastpage != currpage;
+  library.prefetch(pageAt(currpage));
+}
+
+// does what a finished leader sequence says. Keys are tapped, a press
+// and a release, like an encoder detent.
+void leaderAction(const LeaderNode *node)
+{
+  if (!node)
+    return;
+  if (node->action == LEADER_KEY)
+  {
+    turns.add(node->value, node->modcode, 1);
+  }
+  else if (node->action == LEADER_TEXT)
+  {
+    typer.start(leader.text(*node), textBindings.layout, textBindings.unicode);
+  }
+  else if (node->action == LEADER_PAGE)
+  {
+    changePage(node->value);
+  }
+}
+
+// i is the key that was pressed, on pad (0 for this one)
+void handleKeypress(int i, int pad = 0)
+{
+  // Everything a key does happens on the page it went down on. A page key
+  // held down doesn't then do what the new page has under it, and a key
+  // held across a page change keeps sending what it did.
+  bool pressed = !(lastKeys[pad] & (1 << i));
+  if (pressed)
+    keyPages[pad][i] = padPageNumber(pad);
+  Keypage &keypage = pageAt(keyPages[pad][i]);
+
+  // text keys start typing when they go down, holding them does nothing more
+  if (keypage.text[i] != TEXT_NONE)
+  {
+    if (pressed)
+    {
+      const char *text = &keypage.textPool[keypage.text[i]];
+      if (keypage.textPool != textBindings.text.data())
+      {
+        strncpy(libraryText.data(), text, libraryText.size() - 1);
+        text = libraryText.data();
+      }
+      typer.start(text, textBindings.layout, textBindings.unicode);
+    }
+  }
+  else if (keypage.mouse[i] != MOUSE_NONE)
+  {
+    mouseHeld |= 1 << keypage.mouse[i];
+  }
+  // a leader key starts a sequence when it goes down, see resolveKeys()
+  else if (keypage.leader & (1 << i))
+  {
+    if (pressed)
+    {
+      leader.start(millis());
+    }
+  }
+  // if we're not supposed to change pages, get the HID code
+  else if (keypage.pagechange[i] == NO_PAGE_CHANGE)
+  {
+    // the pad repeats it, it's tapped and never held in the report
+    if (keypage.repeat[i].rate)
+    {
+      if (pressed)
+        repeater.press(pad, i, keypage.hidcode[i], keypage.modcode[i], keypage.repeat[i], micros(), turns);
+      return;
+    }
+    // 6 is max keycode per report per the HID specification. Keys past
+    // that still do everything else when they go down.
+    if (count < 6)
+    {
+      keycode[count++] = keypage.hidcode[i];
+      modifier = keypage.modcode[i];
+    }
+  }
+  // otherwise, change pages :) once, when it goes down
+  else if (pressed)
+  {
+    changePage(keypage.pagechange[i]);
+  }
+}
+
+// fills keycode, count and modifier from the keys that are down on every
+// pad. Returns count.
+uint8_t resolveKeys(const PadKeys &pads)
+{
+  // clear keycode buffer
+  keycode.fill(0);
+  count = 0;
+  modifier = 0;
+  mouseHeld = 0;
+
+  uint32_t now = millis();
+  leaderAction(leader.expire(now));
+
+  for (int pad = 0; pad < CHAIN_MAX_PADS; pad++)
+  {
+    for (int i = 0; i < 9; i++)
+    {
+      if (pads[pad] & (1 << i))
+      {
+        // while a sequence is going every key that goes down is part of
+        // it, another leader key starts it over
+        if (leader.active() && !(lastKeys[pad] & (1 << i)))
+        {
+          leaderKeys[pad] |= 1 << i;
+          if (padKeypage(pad).leader & (1 << i))
+            leader.start(now);
+          else
+            leaderAction(leader.press(i, now));
+        }
+        if (leaderKeys[pad] & (1 << i))
+          continue;
+        handleKeypress(i, pad);
+      }
+    }
+  }
+  for (int pad = 0; pad < CHAIN_MAX_PADS; pad++)
+  {
+    leaderKeys[pad] &= pads[pad];
+  }
+  repeater.release(pads);
+  lastKeys = pads;
+  return count;
+}
+
+// same, for a pad on its own
+uint8_t resolveKeys(KeyMask keys)
+{
+  return resolveKeys(PadKeys{keys});
+}
+
+// detents is how far encoder turned since last time, clockwise positive.
+// Key bindings get queued in turns, scrolling is returned as wheel steps.
+int32_t handleTurn(int encoder, int32_t detents)
+{
+  if (!detents)
+    return 0;
+  int slot = encoder * 2 + (detents > 0 ? ENCODER_CW : ENCODER_CCW);
+  uint32_t steps = detents > 0 ? detents : -detents;
+  Keypage &keypage = pageAt(currpage);
+  uint8_t mouse = keypage.turnMouse[slot];
+  if (mouse != MOUSE_NONE)
+    return mouse == MOUSE_WHEEL_UP ? steps : -(int32_t)steps;
+  if (keypage.turnHid[slot] || keypage.turnMod[slot])
+    turns.add(keypage.turnHid[slot], keypage.turnMod[slot], steps);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,182 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef LEADER_H
+
+#define LEADER_H
+
+#include <Arduino.h>
+#include <cstring>
+
+// Leader key sequences. A key bound to "leader" starts one, and the next
+// few key presses (keys 1 to 9, on any pad) pick a binding out of the
+// "leader" section of config.json. The sequences are compiled into a trie
+// (see compileLeader() in config.h) that stays in flash and is read from
+// there, so the RAM it takes is the same for one sequence or thousands.
+//
+// The trie is an array of nodes, one per distinct prefix, in breadth
+// first order. A node has a bit per key that continues a sequence and the
+// index of the first of those children, the rest follow it in key order,
+// so the child for a key is first + the number of bits below that key's.
+// That's one lookup per key press however many sequences there are.
+
+//--------------------------------------------------------------------+
+// Leader Config
+//--------------------------------------------------------------------+
+
+// default for "timeout": how long after a key the sequence is given up
+// on, or if it's a whole sequence and the start of longer ones, taken
+#define LEADER_TIMEOUT_MS 1000
+
+// longest sequence, in keys
+#define LEADER_MAX_DEPTH 8
+
+// biggest compiled trie, it has this much flash to itself
+#define LEADER_MAX_SIZE (128 * 1024)
+
+#define LEADER_IMAGE_MAGIC 0x4441454c // "LEAD"
+#define LEADER_IMAGE_VERSION 1
+
+// The header has the first flash page to itself, so it can be written
+// last. Until it is the image isn't valid, whatever happens halfway.
+#define LEADER_HEADER_SIZE 256
+
+enum LeaderAction
+{
+  LEADER_NONE, // only the start of longer sequences
+  LEADER_KEY,  // tap value (a hidcode) with modcode
+  LEADER_PAGE, // change to page value
+  LEADER_TEXT  // type the text at value in the image's text
+};
+
+struct LeaderHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t nodes;    // nodes[0] is where every sequence starts
+  uint32_t size;     // of the whole image, header and all
+  uint32_t crc;      // of the nodes and the text
+  uint32_t timeoutMs;
+  uint16_t sequences;
+  uint16_t textSize;
+};
+
+struct LeaderNode
+{
+  uint16_t next;   // bit n if key n + 1 continues a sequence
+  uint16_t first;  // index of the child for the lowest key in next
+  uint8_t action;  // LeaderAction
+  uint8_t modcode; // for LEADER_KEY
+  uint16_t value;
+};
+static_assert(sizeof(LeaderHeader) <= LEADER_HEADER_SIZE && sizeof(LeaderNode) == 8, "leader.bin layout changed");
+
+// where a compiled trie goes: begin() with the header, then write() for
+// the nodes and text front to back, then the header at 0, then end()
+struct LeaderSink
+{
+  // false to leave it out, e.g. the same image is already there
+  bool (*begin)(const LeaderHeader &header) = nullptr;
+  void (*write)(uint32_t offset, const void *data, uint32_t len) = nullptr;
+  void (*end)() = nullptr;
+};
+
+//--------------------------------------------------------------------+
+// LeaderMatcher Class
+//--------------------------------------------------------------------+
+
+// Follows one sequence at a time through a trie. press() and expire()
+// return the node whose binding to do once a sequence is over, nullptr
+// if there isn't one yet (or it ended without matching anything).
+class LeaderMatcher
+{
+public:
+  uint32_t matched = 0; // sequences that did something
+
+  // a checked image (see checkLeaderImage()), nullptr for none
+  void use(const uint8_t *image)
+  {
+    this->image = image;
+    on = false;
+  }
+
+  bool loaded()
+  {
+    return image;
+  }
+
+  const LeaderHeader &header()
+  {
+    return *(const LeaderHeader *)image;
+  }
+
+  const LeaderNode &node(uint16_t index)
+  {
+    return ((const LeaderNode *)(image + LEADER_HEADER_SIZE))[index];
+  }
+
+  const char *text(const LeaderNode &node)
+  {
+    return (const char *)(image + LEADER_HEADER_SIZE + header().nodes * sizeof(LeaderNode) + node.value);
+  }
+
+  // the leader key went down, starting over if a sequence was going
+  void start(uint32_t now)
+  {
+    on = image;
+    at = 0;
+    lastMs = now;
+  }
+
+  bool active()
+  {
+    return on;
+  }
+
+  // key is 0 to 8. A key that doesn't continue any sequence ends it, with
+  // the longest one it did match if there is one.
+  const LeaderNode *press(int key, uint32_t now)
+  {
+    if (!on)
+      return nullptr;
+    const LeaderNode &from = node(at);
+    if (!(from.next & (1 << key)))
+      return finish(from);
+    at = from.first + __builtin_popcount(from.next & ((1 << key) - 1));
+    lastMs = now;
+    const LeaderNode &reached = node(at);
+    if (reached.next)
+      return nullptr; // longer ones start with it, wait for the next key or the timeout
+    return finish(reached);
+  }
+
+  // nothing was pressed for the timeout
+  const LeaderNode *expire(uint32_t now)
+  {
+    if (!on || now - lastMs < header().timeoutMs)
+      return nullptr;
+    return finish(node(at));
+  }
+
+private:
+  const uint8_t *image = nullptr;
+  bool on = false;
+  uint16_t at = 0; // the node reached so far
+  uint32_t lastMs = 0;
+
+  const LeaderNode *finish(const LeaderNode &reached)
+  {
+    on = false;
+    if (reached.action == LEADER_NONE)
+      return nullptr;
+    matched++;
+    return &reached;
+  }
+};
+
+#endif
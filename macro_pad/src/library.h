@@ -0,0 +1,450 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef LIBRARY_H
+
+#define LIBRARY_H
+
+#include <Arduino.h>
+#include "config.h"
+#include <array>
+
+// Pages 9 to LAST_PAGE, from a library.json of any size on the drive. It
+// has a "pages" array like config.json's, and isn't parsed as a whole:
+// index() goes through it once when it changes and notes where each page's
+// object is. A page is only read and parsed when something changes to it,
+// into a small cache that drops the page used longest ago. The pages the
+// current one can change to are loaded in the background, see prefetch(),
+// so changing to them usually finds them ready.
+
+//--------------------------------------------------------------------+
+// Library Config
+//--------------------------------------------------------------------+
+
+#define LIBRARY_FIRST_PAGE 9
+
+// pages parsed at once, the current one and the most recently used
+#define LIBRARY_CACHE_PAGES 6
+
+// text bindings on one library page, all together
+#define LIBRARY_TEXT_SIZE 256
+
+// longest page object in library.json, it's read in one go
+#define LIBRARY_PAGE_MAX_SIZE 2048
+
+// where a page is in library.json
+struct PageSpan
+{
+  uint32_t offset;
+  uint16_t length; // 0 if the page isn't there
+};
+
+// a parsed library page
+struct LibraryPage
+{
+  int page = -1;     // -1 if the slot is empty
+  uint32_t used = 0; // when it was last used, in uses
+  Keypage keys;
+  std::array<char, LIBRARY_TEXT_SIZE> text;
+};
+
+//--------------------------------------------------------------------+
+// PageLibrary Class
+//--------------------------------------------------------------------+
+
+// Only use it from the loop. Parsing takes configArena for a moment, like
+// loading a config does.
+class PageLibrary
+{
+public:
+  // reads len bytes of library.json from offset, returns how many it read
+  int32_t (*read)(uint32_t offset, void *data, uint32_t len) = nullptr;
+  // what's wrong with a page, like ConfigReport::message
+  void (*message)(bool error, const char *text) = nullptr;
+
+  // statistics, since clearStats(). A switch is open() of a page that
+  // isn't the current one.
+  uint32_t hits = 0;        // switches to a page already parsed
+  uint32_t misses = 0;      // ones that had to read and parse it
+  uint32_t hitTotalUs = 0;
+  uint32_t hitWorstUs = 0;
+  uint32_t missTotalUs = 0;
+  uint32_t missWorstUs = 0;
+  uint32_t prefetched = 0;  // parsed before anything changed to them
+  uint32_t failed = 0;      // couldn't be read or parsed
+
+  // Notes where each page of a library.json of size bytes is. Returns how
+  // many pages it has. Drops whatever was parsed from the last one.
+  int index(uint32_t size)
+  {
+    clear();
+    Scan scan;
+    uint8_t chunk[256];
+    for (uint32_t at = 0; at < size;)
+    {
+      int32_t n = read ? read(at, chunk, std::min<uint32_t>(sizeof(chunk), size - at)) : -1;
+      if (n <= 0)
+      {
+        say(true, "library.json: can't read it");
+        clear();
+        return 0;
+      }
+      for (int32_t i = 0; i < n; i++)
+      {
+        step(scan, chunk[i], at + i);
+      }
+      at += n;
+    }
+    return count;
+  }
+
+  // forgets the library, there isn't one
+  void clear()
+  {
+    for (auto &span : spans)
+    {
+      span = {0, 0};
+    }
+    for (auto &slot : cache)
+    {
+      slot.page = -1;
+    }
+    count = 0;
+    wanted = 0;
+    current = -1;
+  }
+
+  // the number of pages in the library
+  int pages()
+  {
+    return count;
+  }
+
+  bool has(int page)
+  {
+    return page >= LIBRARY_FIRST_PAGE && page <= LAST_PAGE && spans[page - LIBRARY_FIRST_PAGE].length;
+  }
+
+  // the page if it's parsed already, nullptr if not
+  Keypage *find(int page)
+  {
+    LibraryPage *slot = cached(page);
+    return slot ? &slot->keys : nullptr;
+  }
+
+  // The page, parsed now if it isn't already. It becomes the current page,
+  // which is never dropped to make room for another. nullptr if it's not
+  // in the library or it's broken.
+  Keypage *open(int page)
+  {
+    uint32_t start = micros();
+    bool switching = page != current;
+    LibraryPage *slot = cached(page);
+    bool hit = slot;
+    if (!slot)
+      slot = load(page);
+    if (!slot)
+      return nullptr;
+    slot->used = ++uses;
+    current = page;
+
+    if (switching)
+    {
+      uint32_t took = micros() - start;
+      if (hit)
+      {
+        hits++;
+        hitTotalUs += took;
+        hitWorstUs = std::max(hitWorstUs, took);
+      }
+      else
+      {
+        misses++;
+        missTotalUs += took;
+        missWorstUs = std::max(missWorstUs, took);
+      }
+    }
+    return &slot->keys;
+  }
+
+  // A page from config.json is the current one now, nothing in here needs
+  // keeping for it.
+  void leave()
+  {
+    current = -1;
+  }
+
+  // Queues the library pages that from's keys change to, for prefetchStep()
+  // to parse before they're needed. No more than fit alongside the current
+  // page.
+  void prefetch(const Keypage &from)
+  {
+    wanted = 0;
+    for (int target : from.pagechange)
+    {
+      if (!has(target) || cached(target) || wanted >= LIBRARY_CACHE_PAGES - 1)
+        continue;
+      bool queued = false;
+      for (int i = 0; i < wanted; i++)
+      {
+        queued |= queue[i] == target;
+      }
+      if (!queued)
+        queue[wanted++] = target;
+    }
+  }
+
+  // there's a page waiting to be prefetched
+  bool prefetching()
+  {
+    return wanted;
+  }
+
+  // Parses the next page prefetch() queued. Returns true if there are more.
+  bool prefetchStep()
+  {
+    if (!wanted)
+      return false;
+    int page = queue[--wanted];
+    if (!cached(page) && load(page))
+      prefetched++;
+    return wanted;
+  }
+
+  void print()
+  {
+    int parsed = 0;
+    for (auto &slot : cache)
+    {
+      parsed += slot.page >= 0;
+    }
+    LOG_INFO("Library: %u pages, %u parsed, %u prefetched, %u broken", count, parsed, prefetched, failed);
+    LOG_INFO("Library: changing to a parsed page %u times, %u us on average, worst %u us", hits,
+             hits ? hitTotalUs / hits : 0, hitWorstUs);
+    LOG_INFO("Library: changing to a page not parsed yet %u times, %u us on average, worst %u us", misses,
+             misses ? missTotalUs / misses : 0, missWorstUs);
+  }
+
+  void clearStats()
+  {
+    hits = misses = hitTotalUs = hitWorstUs = missTotalUs = missWorstUs = prefetched = failed = 0;
+  }
+
+private:
+  std::array<PageSpan, LAST_PAGE + 1 - LIBRARY_FIRST_PAGE> spans;
+  std::array<LibraryPage, LIBRARY_CACHE_PAGES> cache;
+  int count = 0;
+  uint32_t uses = 0;
+  int current = -1; // the library page in use, -1 for none
+  std::array<uint8_t, LIBRARY_CACHE_PAGES - 1> queue;
+  int wanted = 0; // pages in queue
+
+  // where index() is in the JSON. Only the "pages" array and the "page"
+  // numbers in it matter, the rest is skipped over.
+  struct Scan
+  {
+    int depth = 0;       // objects and arrays we're in
+    bool inString = false;
+    bool escaped = false;
+    char key[8];         // the string just read, cut short
+    int keyLength = 0;
+    bool keyDone = false; // a string ended and nothing else has come since
+    int pagesDepth = 0;  // depth inside the "pages" array, 0 if not in it
+    uint32_t start = 0;  // where the page object being read started
+    int number = -1;     // its "page"
+    bool inNumber = false;
+  };
+
+  void step(Scan &scan, uint8_t c, uint32_t at)
+  {
+    if (scan.inString)
+    {
+      if (scan.escaped)
+        scan.escaped = false;
+      else if (c == '\\')
+        scan.escaped = true;
+      else if (c == '"')
+      {
+        scan.inString = false;
+        scan.keyDone = true;
+        return;
+      }
+      if (scan.keyLength < (int)sizeof(scan.key))
+        scan.key[scan.keyLength] = c;
+      scan.keyLength++;
+      return;
+    }
+
+    bool space = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    if (scan.inNumber)
+    {
+      if (c >= '0' && c <= '9')
+      {
+        scan.number = std::min(std::max(scan.number, 0) * 10 + (c - '0'), 9999);
+        return;
+      }
+      if (space && scan.number < 0)
+        return;
+      scan.inNumber = false;
+    }
+    if (space)
+      return;
+
+    bool isKey = scan.keyDone && c == ':';
+    scan.keyDone = false;
+    if (isKey)
+    {
+      // "pages" at the top, "page" in an object in it
+      if (scan.depth == 1 && keyIs(scan, "pages"))
+        scan.pagesDepth = -1; // its array is next
+      else if (scan.pagesDepth && scan.depth == scan.pagesDepth + 1 && keyIs(scan, "page"))
+      {
+        scan.number = -1;
+        scan.inNumber = true;
+      }
+      return;
+    }
+
+    if (scan.pagesDepth == -1 && c != '[')
+      scan.pagesDepth = 0; // "pages" isn't an array
+    if (c == '"')
+    {
+      scan.inString = true;
+      scan.keyLength = 0;
+    }
+    else if (c == '{' || c == '[')
+    {
+      scan.depth++;
+      if (scan.pagesDepth == -1)
+        scan.pagesDepth = scan.depth;
+      else if (c == '{' && scan.pagesDepth && scan.depth == scan.pagesDepth + 1)
+      {
+        scan.start = at;
+        scan.number = -1;
+      }
+    }
+    else if (c == '}' || c == ']')
+    {
+      if (c == '}' && scan.pagesDepth && scan.depth == scan.pagesDepth + 1)
+        found(scan.number, scan.start, at + 1 - scan.start);
+      if (scan.depth == scan.pagesDepth)
+        scan.pagesDepth = 0;
+      scan.depth--;
+    }
+  }
+
+  bool keyIs(const Scan &scan, const char *name)
+  {
+    return scan.keyLength == (int)strlen(name) && !strncmp(scan.key, name, scan.keyLength);
+  }
+
+  void found(int page, uint32_t offset, uint32_t length)
+  {
+    if (page < 0)
+    {
+      say(true, "library.json: a page at byte %lu has no 'page' number", (unsigned long)offset);
+      return;
+    }
+    if (page < LIBRARY_FIRST_PAGE || page > LAST_PAGE)
+    {
+      say(true, "library.json: a page numbered %d, library pages must be %d to %d", page, LIBRARY_FIRST_PAGE,
+          LAST_PAGE);
+      return;
+    }
+    if (length > LIBRARY_PAGE_MAX_SIZE)
+    {
+      say(true, "library.json: page %d is %lu bytes, they can be %d at most", page, (unsigned long)length,
+          LIBRARY_PAGE_MAX_SIZE);
+      return;
+    }
+    PageSpan &span = spans[page - LIBRARY_FIRST_PAGE];
+    if (span.length)
+      say(false, "library.json: page %d is there more than once, the last one wins", page);
+    else
+      count++;
+    span = {offset, (uint16_t)length};
+  }
+
+  LibraryPage *cached(int page)
+  {
+    for (auto &slot : cache)
+    {
+      if (slot.page == page && page >= 0)
+        return &slot;
+    }
+    return nullptr;
+  }
+
+  // reads and parses page into the slot used longest ago, other than the
+  // current page's
+  LibraryPage *load(int page)
+  {
+    if (!has(page) || !read)
+      return nullptr;
+    LibraryPage *slot = nullptr;
+    for (auto &candidate : cache)
+    {
+      if (candidate.page == current && current >= 0)
+        continue;
+      if (!slot || candidate.page < 0 || (slot->page >= 0 && candidate.used < slot->used))
+        slot = &candidate;
+      if (slot->page < 0)
+        break;
+    }
+
+    const PageSpan &span = spans[page - LIBRARY_FIRST_PAGE];
+    ArenaScope scope(configArena);
+    char *json = (char *)configArena.allocate(span.length);
+    ConfigJsonDocument doc(CONFIG_JSON_CAPACITY);
+    ConfigReport report;
+    report.message = message;
+    size_t textSize = 0;
+    if (!json || read(span.offset, json, span.length) != (int32_t)span.length ||
+        deserializeJson(doc, json, span.length) || (doc["page"] | -1) != page)
+    {
+      say(true, "library.json: page %d can't be read, has the file changed?", page);
+      failed++;
+      return nullptr;
+    }
+    if (!checkPage(doc.as<JsonObject>(), page, textBindings.layout, textBindings.unicode, textSize, report) ||
+        textSize > LIBRARY_TEXT_SIZE)
+    {
+      if (textSize > LIBRARY_TEXT_SIZE)
+        say(true, "library.json: page %d has %d bytes of text, a page can have %d", page, (int)textSize,
+            LIBRARY_TEXT_SIZE);
+      failed++;
+      return nullptr;
+    }
+
+    // the slot is only given up once the page is good
+    slot->page = -1;
+    slot->keys = Keypage();
+    uint16_t textUsed = 0;
+    fillPage(doc.as<JsonObject>(), slot->keys, slot->text.data(), textUsed, 0x1ff, report);
+    slot->page = page;
+    slot->used = ++uses;
+    return slot;
+  }
+
+  void say(bool error, const char *format, ...)
+  {
+    ConfigReport report;
+    report.message = message;
+    char text[160];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (error)
+      report.error("%s", text);
+    else
+      report.warning("%s", text);
+  }
+};
+
+#endif
@@ -0,0 +1,280 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef LOG_H
+
+#define LOG_H
+
+#include <Arduino.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <type_traits>
+
+// Logging that never waits on the serial port. LOG_INFO("x is %u", x) and
+// friends only copy the format pointer and the arguments into a RAM ring,
+// which takes a few us. The text is made and written by drain(), which the
+// loop calls every pass and which only writes as much as the CDC endpoint
+// has room for. If the ring fills up (nobody reading, or a slow terminal)
+// new records are dropped and counted, and a line saying how many goes in
+// where they would have been once there's room again.
+//
+// Formats take %d, %u, %x, %c and %s, all 32 bits at most. Strings are
+// copied into the record, so they don't have to outlive the call.
+// Anything below LOG_LEVEL compiles to nothing, arguments and all.
+
+//--------------------------------------------------------------------+
+// Log Config
+//--------------------------------------------------------------------+
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// bytes of records waiting to be written, must be a power of two
+#define LOG_RING_SIZE 2048
+// a record can't be bigger than this, strings in it are cut short to fit
+#define LOG_RECORD_MAX 128
+// longest line drain() makes
+#define LOG_LINE_MAX 192
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logger.add(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) logger.add(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) logger.add(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logger.add(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+//--------------------------------------------------------------------+
+// Logger Class
+//--------------------------------------------------------------------+
+
+// A record is its length, the level, millis(), the format pointer, then
+// each argument in order: 4 bytes for a number, the characters and a 0
+// for a string. Only call add() from the loop, not from interrupts.
+class Logger
+{
+public:
+  // where drain() writes, and how much it can write without waiting.
+  // Nothing is written until they're set.
+  int (*space)() = nullptr;
+  void (*write)(const char *data, size_t len) = nullptr;
+
+  // statistics
+  uint32_t records = 0; // added
+  uint32_t dropped = 0; // didn't fit in the ring
+
+  template <typename... Args>
+  void add(uint8_t level, const char *format, Args... args)
+  {
+    uint8_t record[LOG_RECORD_MAX];
+    size_t len = 1;
+    record[len++] = level;
+    uint32_t ms = millis();
+    memcpy(&record[len], &ms, 4);
+    len += 4;
+    memcpy(&record[len], &format, sizeof(format));
+    len += sizeof(format);
+    (put(record, len, args), ...);
+    record[0] = len;
+    records++;
+
+    // a record with no format says how many went missing before this one
+    if (missed)
+    {
+      uint8_t marker[1 + 1 + 4 + sizeof(format) + 4] = {sizeof(marker), LOG_LEVEL_WARN};
+      memcpy(&marker[2], &ms, 4);
+      memcpy(&marker[6 + sizeof(format)], &missed, 4);
+      if (!push(marker, sizeof(marker)))
+      {
+        dropped++;
+        missed++;
+        return;
+      }
+      missed = 0;
+    }
+    if (!push(record, len))
+    {
+      dropped++;
+      missed++;
+    }
+  }
+
+  // writes out what it can without blocking
+  void drain()
+  {
+    if (!space || !write)
+      return;
+    while (true)
+    {
+      if (sent == lineLength && !nextLine())
+        return;
+      int room = space();
+      if (room <= 0)
+        return;
+      size_t n = std::min<size_t>(room, lineLength - sent);
+      write(&line[sent], n);
+      sent += n;
+    }
+  }
+
+  // nothing is waiting to be written
+  bool empty()
+  {
+    return head == tail && sent == lineLength && !missed;
+  }
+
+private:
+  std::array<uint8_t, LOG_RING_SIZE> ring;
+  uint32_t head = 0;
+  uint32_t tail = 0;
+  uint32_t missed = 0; // dropped since the last record that made it
+  char line[LOG_LINE_MAX];
+  size_t lineLength = 0;
+  size_t sent = 0; // of line
+
+  bool push(const uint8_t *record, size_t len)
+  {
+    if (LOG_RING_SIZE - (head - tail) < len)
+      return false;
+    for (size_t i = 0; i < len; i++)
+    {
+      ring[head++ & (LOG_RING_SIZE - 1)] = record[i];
+    }
+    return true;
+  }
+
+  void put(uint8_t *record, size_t &len, const char *text)
+  {
+    while (*text && len < LOG_RECORD_MAX - 1)
+    {
+      record[len++] = *text++;
+    }
+    record[len++] = 0;
+  }
+
+  void put(uint8_t *record, size_t &len, char *text)
+  {
+    put(record, len, (const char *)text);
+  }
+
+  template <typename T>
+  void put(uint8_t *record, size_t &len, T value)
+  {
+    static_assert((std::is_integral_v<T> || std::is_enum_v<T>) && sizeof(T) <= 4, "log numbers are 32 bits at most");
+    uint32_t bits = (uint32_t)value;
+    if (len + 4 > LOG_RECORD_MAX)
+      return;
+    memcpy(&record[len], &bits, 4);
+    len += 4;
+  }
+
+  // makes the next line to write, false if there isn't one
+  bool nextLine()
+  {
+    lineLength = sent = 0;
+    if (head == tail)
+      return false;
+
+    uint8_t record[LOG_RECORD_MAX];
+    size_t len = ring[tail & (LOG_RING_SIZE - 1)];
+    for (size_t i = 0; i < len; i++)
+    {
+      record[i] = ring[tail++ & (LOG_RING_SIZE - 1)];
+    }
+    uint32_t ms;
+    const char *format;
+    memcpy(&ms, &record[2], 4);
+    memcpy(&format, &record[6], sizeof(format));
+    append("%lu %c ", (unsigned long)ms, "DIWE"[record[1]]);
+
+    size_t at = 6 + sizeof(format);
+    if (!format)
+    {
+      uint32_t missing;
+      memcpy(&missing, &record[at], 4);
+      append("%lu log records dropped\r\n", (unsigned long)missing);
+      return true;
+    }
+    for (const char *f = format; *f; f++)
+    {
+      if (*f != '%' || !f[1])
+      {
+        appendChar(*f);
+        continue;
+      }
+      char kind = *++f;
+      if (kind == '%')
+      {
+        appendChar('%');
+      }
+      else if (kind == 's')
+      {
+        const char *text = at < len ? (const char *)&record[at] : "";
+        append("%s", text);
+        at += strnlen(text, len - std::min(at, len)) + 1;
+      }
+      else
+      {
+        uint32_t value = 0;
+        if (at + 4 <= len)
+          memcpy(&value, &record[at], 4);
+        at += 4;
+        if (kind == 'd')
+          append("%ld", (long)(int32_t)value);
+        else if (kind == 'x')
+          append("%lx", (unsigned long)value);
+        else if (kind == 'c')
+          appendChar(value);
+        else
+          append("%lu", (unsigned long)value);
+      }
+    }
+    lineLength = std::min(lineLength, sizeof(line) - 3); // long lines lose their end, not the newline
+    append("\r\n");
+    return true;
+  }
+
+  template <typename... Args>
+  void append(const char *format, Args... args)
+  {
+    int n = snprintf(&line[lineLength], sizeof(line) - lineLength, format, args...);
+    lineLength = std::min(lineLength + std::max(n, 0), sizeof(line) - 1);
+  }
+
+  void appendChar(char c)
+  {
+    if (lineLength < sizeof(line) - 1)
+      line[lineLength++] = c;
+  }
+};
+
+// the one everyone logs to
+inline Logger logger;
+
+#endif
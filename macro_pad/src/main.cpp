@@ -16,6 +16,14 @@
 // Setup and Loop initialize the device and watch for config file changes. When the config file changes, core1 is restarted
 void setup()
 {
+  ramStats.paintStack();
+
+  // the keypages live in keypageStore for good
+  for (int i = 0; i < 9; i++)
+  {
+    keypages[i] = &keypageStore[i];
+  }
+
   flash.begin();
 
   pinMode(LED_BUILTIN, OUTPUT);
@@ -27,26 +35,26 @@ void setup()
   usb_msc.setReadWriteCallback(msc_read_cb, msc_write_cb, msc_flush_cb);
 
   // Set disk size, block size should be 512 regardless of spi flash page size
+#if defined(RP9_VIRTUAL_FAT)
+  usb_msc.setCapacity(VFAT_SECTORS, VFAT_SECTOR_SIZE);
+  usb_msc.setStartStopCallback(msc_start_stop_cb);
+#else
   usb_msc.setCapacity(flash.size() / 512, 512);
+#endif
 
-  // MSC is ready for read/write
-  usb_msc.setUnitReady(true);
+  // the drive isn't ready until bootStep() has mounted the file system
+  usb_msc.setUnitReady(false);
 
   usb_msc.begin();
 
-  setupKeymap();
-
   // Set up rows and columns
-  for (auto col : cols)
-  {
-    pinMode(col, OUTPUT);
-    digitalWrite(col, false);
-  }
+  scanner.begin(cols, rows, MATRIX_SETTLE_US);
+  calibrateSettle();
+  bootTimes.settleUs = settleCal.settleUs;
+  bootTimes.scanSettleUs = scanner.settleUs;
 
-  for (auto row : rows)
-  {
-    pinMode(row, INPUT_PULLDOWN);
-  }
+  beginEncoders();
+  beginChain();
 
   // Set up LEDs
   for (auto led : leds)
@@ -65,28 +73,34 @@ void setup()
   pinMode(NEOPIXEL_POWER, OUTPUT);
   digitalWrite(NEOPIXEL_POWER, true);
 
-  // Init file system on the flash
-  fs_formatted = fatfs.begin(&flash);
+  // pick up the press counts from last time
+  usageStore.load(usage.counts);
 
   // Notes: following commented-out functions has no affect on ESP32
   usb_hid.setReportDescriptor(desc_hid_report, sizeof(desc_hid_report));
 
   usb_hid.begin();
 
+  usb_raw.setReportCallback(NULL, raw_set_report_cb);
+  usb_raw.begin();
+
   Serial.begin(9600);
-  if (!fs_formatted)
-  {
-    Serial.println("Failed to init files system, flash may not be formatted");
-  }
 
-  Serial.println("Spark_RP9 Macropad");
-  Serial.print("JEDEC ID: 0x");
-  Serial.println(flash.getJEDECID(), HEX);
-  Serial.print("Flash size: ");
-  Serial.print(flash.size() / 1024);
-  Serial.println(" KB");
-  fs_changed = true; // to print contents initially
-  invalidConfig = true;
+  // log lines go out from the loop as the port has room for them
+  logger.space = []() { return Serial.availableForWrite(); };
+  logger.write = [](const char *data, size_t len) { Serial.write((const uint8_t *)data, len); };
+
+  LOG_INFO("Spark_RP9 Macropad");
+  LOG_INFO("JEDEC ID: 0x%x", flash.getJEDECID());
+  LOG_INFO("Flash size: %u KB", flash.size() / 1024);
+
+  // Start typing with the keymap from last time. The drive and config.json
+  // are brought up by bootStep() once the loop is already scanning.
+  invalidConfig = !loadStoredKeymap();
+  useLeaderStore();
+  fs_changed = false;
+  bootStage = BOOT_MOUNT;
+  bootTimes.keymapUs = micros();
 
   currpage = 0;
   pagechanged = true;
@@ -95,186 +109,363 @@ void setup()
   np.begin();           // INITIALIZE NeoPixel strip object (REQUIRED)
   np.show();            // Turn OFF all pixels ASAP
   np.setBrightness(20); // Set BRIGHTNESS to about 1/5 (max = 255)
+
+  // the scan and HID tasks are guaranteed their turn, the rest fit around them
+  scanId = sched.add("scan", scanTask, 0, SCAN_PERIOD_US);
+  hidId = sched.add("hid", hidTask, 0, 0, HID_DEADLINE_US);
+  repeatId = sched.add("repeat", repeatTask, 0, 0, HID_DEADLINE_US);
+  sched.add("leds", ledTask, 1, LED_PERIOD_US);
+  sched.add("serial", serialTask, 2, SERIAL_PERIOD_US);
+  bootId = sched.add("boot", bootTask, 2, 0, SLOW_TASK_DEADLINE_US);
+  configId = sched.add("config", configTask, 2, 0, SLOW_TASK_DEADLINE_US);
+  sched.add("log", logTask, 3, LOG_PERIOD_US);
+  sched.add("housekeeping", housekeepingTask, 3, HOUSEKEEPING_PERIOD_US);
+  saveId = sched.add("save", saveTask, 3, 0, SLOW_TASK_DEADLINE_US);
+  pageId = sched.add("page", pageTask, 3, 0, PAGE_TASK_DEADLINE_US);
+  sched.signal(bootId);
+
+  keypadUs = micros();
+#if defined(RP9_CORE1_SCAN)
+  scanCore.start();
+#endif
+}
+
+#if defined(RP9_CORE1_SCAN)
+// core 1 does nothing but scan, from RAM, so a flash write can't stop it
+void setup1()
+{
+  scanCore.run(scanner, debouncer);
 }
+#endif
 
+// everything happens in the tasks set up at the end of setup()
 void loop()
 {
-  if (fs_changed || invalidConfig)
+  sched.dispatch();
+}
+
+//--------------------------------------------------------------------+
+// Tasks
+//--------------------------------------------------------------------+
+
+////////////////////////////////////
+// THE KEYPAD PORTION OF THE LOOP //
+////////////////////////////////////
+
+// the matrix, the encoders and the other pads, then the HID task sends it
+void scanTask()
+{
+  keypadGapUs = max(keypadGapUs, (uint32_t)(micros() - keypadUs));
+  keypadUs = micros();
+
+#if defined(RP9_CORE1_SCAN)
+  // Core 1 has done the scanning and debouncing. While the host is
+  // listening the changes are taken one per report, so the ones that
+  // queued up during a flash write each get sent.
+  static KeyMask keys = 0;
+  bool listening = TinyUSBDevice.mounted() && !TinyUSBDevice.suspended();
+  ScanEvent event;
+  while ((!listening || usb_hid.ready()) && scanCore.take(event))
   {
-    delay(500); // refresh every 5 seconds
-    fs_changed = false;
+    tracer.record(event.us, event.raw, currpage);
+    bool changed = event.stable != keys;
+    keys = event.stable;
+    if (listening && changed)
+      break;
+  }
+  // anything that didn't fit in the queue
+  if (!scanCore.pending() && keys != scanCore.latest)
+  {
+    keys = scanCore.latest;
+  }
+#else
+  // grab the latest matrix snapshots (into the trace too) and let the bouncing settle
+  scanner.scan();
+  KeyMask raw;
+  while (scanner.read(raw))
+  {
+    tracer.record(micros(), raw, currpage);
+  }
+  KeyMask keys = debouncer.update(scanner.state(), micros());
+#endif
+  usage.update(keys, currpage);
 
-    // check if host formatted disk
-    if (!fs_formatted)
+  // whatever the encoders turned since last time, however fast. Turns
+  // bound to keys queue up, scrolling goes out with the next mouse report.
+  for (int e = 0; e < ENCODER_COUNT; e++)
+  {
+    int32_t detents = encoders[e].takeDetents();
+    if (detents)
     {
-      fs_formatted = fatfs.begin(&flash);
+      idleMode.activity();
+      mouseKeys.scroll(handleTurn(e, detents));
     }
+  }
 
-    // skip if still not formatted
-    if (!fs_formatted)
-      return;
+  // the other pads' keys join ours, or ours go off to the primary
+  padKeys = {keys};
+  chainStep(padKeys);
 
-    if (!root.open("/"))
-    {
-      Serial.println("open root failed");
-      return;
-    }
+  // a chained pad stays awake, the others' frames come through it
+  keypadQuiet = !keys && !keyPressedPreviously && !typer.busy() && !turns.busy() && !mouseKeys.pending() &&
+                !chain.active(millis());
+  if (keys)
+  {
+    idleMode.activity();
+  }
+  else if (keypadQuiet && idleMode.due())
+  {
+    // nothing held for a while - sleep until a row edge wakes us up
+#if defined(RP9_CORE1_SCAN)
+    scanCore.pause();
+    idleMode.sleep(scanner, fs_changed);
+    scanCore.resume();
+#else
+    idleMode.sleep(scanner, fs_changed);
+#endif
+    keypadUs = micros(); // asleep isn't a gap
+    sched.asleep();
+    return;
+  }
 
-    Serial.println("Trying to open config.json");
+  sched.signal(hidId);
+}
 
-    // Serial.println("Flash contents:");
-    // root.ls(LS_R | LS_DATE | LS_SIZE);
-    if (file.open("/config.json"))
-    {
-      if (parseConfig(file))
-      {
-        invalidConfig = false;
-        currpage = 0;
-        blinkGreen(8);
-        pagechanged = true;
-      }
-      else
-      {
-        invalidConfig = true;
-        blinkRed(1);
-      }
-      file.close();
-    }
+// resolves the keys and sends whatever report is next
+void hidTask()
+{
+  if (!bootTimes.usbUs && TinyUSBDevice.mounted())
+  {
+    bootTimes.usbUs = micros();
+  }
 
-    root.close();
+  // whatever the host sent over raw HID since last time
+  takeHostUpdate();
+
+  resolveKeys(padKeys);
+  serviceRawHid(padKeys);
+  // the repeats go by the clock, not by how often this runs
+  if (repeater.active())
+    sched.signal(repeatId, repeater.untilNextUs(micros()));
+  // a page change (or a new library) leaves pages to get ready
+  if (library.prefetching() && !sched.pending(pageId))
+    sched.signal(pageId);
+
+  // the mouse moves on its own clock. If the loop was held up the ticks
+  // it missed are dropped, rather than jumping the cursor.
+  if (micros() - mouseTickUs >= MOUSE_TICK_US)
+  {
+    mouseTickUs = micros();
+    mouseKeys.tick(mouseHeld);
   }
-  else
+
+  // Remote wakeup
+  if (TinyUSBDevice.suspended() && (count || typer.busy() || turns.busy() || mouseHeld || mouseKeys.pending()))
   {
-    ////////////////////////////////////
-    // THE KEYPAD PORTION OF THE LOOP //
-    ////////////////////////////////////
+    // Wake up host if we are in suspend mode
+    // and REMOTE_WAKEUP feature is enabled by host
+    TinyUSBDevice.remoteWakeup();
+  }
 
-    // used to avoid send multiple consecutive zero report for keyboard
-    static bool keyPressedPreviously = false;
+  // skip if hid is not ready e.g still transferring previous report
+  if (!usb_hid.ready())
+    return;
 
-    // clear keycode buffer
-    keycode.fill(0);
-    count = 0;
+  // the keyboard has something to send while keys are down or still need letting go
+  bool keyboardWaiting = typer.busy() || turns.busy() || count || keyPressedPreviously;
+  if (arbiter.mouseGoes(keyboardWaiting, mouseKeys.pending()))
+  {
+    MouseReport report = mouseKeys.send();
+    usb_hid.mouseReport(RID_MOUSE, report.buttons, report.x, report.y, report.wheel, 0);
+    return;
+  }
 
-    // if we changed keypages, adjust LEDs and stuff
-    if (pagechanged)
+  // a text binding is being typed, the other keys wait. The typer lets
+  // go of everything itself when it's done.
+  if (typer.busy())
+  {
+    if (typer.next(modifier, keycode))
     {
-      for (int i = 0; i < sizeof(leds); i++)
-      {
-        digitalWrite(leds[i], !keypages.at(currpage)->leds[i]); // note I invert logic because LEDs are active low
-      }
-
-      for (int i = 0; i < sizeof(rgbLeds); i++)
-      {
-        digitalWrite(rgbLeds[i], !keypages.at(currpage)->builtinleds[i]); // note I invert logic because LEDs are active low
-      }
-      np.setPixelColor(0, keypages.at(currpage)->neopixel);
-      np.show();
-      pagechanged = false;
+      usb_hid.keyboardReport(RID_KEYBOARD, modifier, keycode.data());
     }
+    keyPressedPreviously = false;
+    return;
+  }
 
-    // scol = selected column
-    for (auto scol : cols)
-    {
-      // set each column to on or off
-      for (auto col : cols)
-      {
-        if (col == scol)
-        {
-          digitalWrite(col, true);
-        }
-        else
-        {
-          digitalWrite(col, false);
-        }
-      }
-      // check each row
-      for (auto row : rows)
-      {
-        // needed to prevent inaccurate key reading
-        delay(2);
-        // and now - I present to you the big ugly if else block!
-        if (digitalRead(row))
-        {
-          if (row == ROW1 && scol == COL1)
-          {
-            handleKeypress(0);
-          }
-          else if (row == ROW1 && scol == COL2)
-          {
-            handleKeypress(1);
-          }
-          else if (row == ROW1 && scol == COL3)
-          {
-            handleKeypress(2);
-          }
-          else if (row == ROW2 && scol == COL1)
-          {
-            handleKeypress(3);
-          }
-          else if (row == ROW2 && scol == COL2)
-          {
-            handleKeypress(4);
-          }
-          else if (row == ROW2 && scol == COL3)
-          {
-            handleKeypress(5);
-          }
-          else if (row == ROW3 && scol == COL1)
-          {
-            handleKeypress(6);
-          }
-          else if (row == ROW3 && scol == COL2)
-          {
-            handleKeypress(7);
-          }
-          else if (row == ROW3 && scol == COL3)
-          {
-            handleKeypress(8);
-          }
-          // 6 is max keycode per report per the HID specification
-          if (count == 6)
-            break;
-        }
-      }
-    }
+  // a key press and release per detent turned, keys that are held get
+  // sent again after
+  if (turns.busy())
+  {
+    turns.next(modifier, keycode);
+    usb_hid.keyboardReport(RID_KEYBOARD, modifier, keycode.data());
+    keyPressedPreviously = false;
+    return;
+  }
 
-    // Remote wakeup
-    if (TinyUSBDevice.suspended() && count)
+  if (count)
+  {
+    // Send report if there is key pressed
+    keyPressedPreviously = true;
+    usb_hid.keyboardReport(RID_KEYBOARD, modifier, keycode.data());
+    modifier = 0;
+
+    if (!bootTimes.firstReportUs)
     {
-      // Wake up host if we are in suspend mode
-      // and REMOTE_WAKEUP feature is enabled by host
-      TinyUSBDevice.remoteWakeup();
+      bootTimes.firstReportUs = micros();
+      printBootTimes();
     }
 
-    // skip if hid is not ready e.g still transferring previous report
-    if (!usb_hid.ready())
-      return;
-
-    if (count)
+    // how long did that take, if we just woke up?
+    if (idleMode.reported())
     {
-      // Send report if there is key pressed
-      uint8_t const report_id = 0;
-
-      keyPressedPreviously = true;
-      usb_hid.keyboardReport(report_id, modifier, keycode.data());
-      modifier = 0;
+      idleMode.print(sched.task(scanId).periodUs);
     }
-    else
+  }
+  else
+  {
+    // Send All-zero report to indicate there are no keys pressed
+    // Most of the time this is the case, however we don't need
+    // to send zero report every loop(), only a key is pressed
+    // in previous loop()
+    if (keyPressedPreviously)
     {
-      // Send All-zero report to indicate there are no keys pressed
-      // Most of the time this is the case, however we don't need
-      // to send zero report every loop(), only a key is pressed
-      // in previous loop()
-      if (keyPressedPreviously)
-      {
-        keyPressedPreviously = false;
-        usb_hid.keyboardRelease(0);
-      }
+      keyPressedPreviously = false;
+      usb_hid.keyboardRelease(RID_KEYBOARD);
     }
   }
 }
 
+// if we changed keypages, adjust LEDs and stuff. LEDs the host has
+// taken over show what it says instead.
+void ledTask()
+{
+  if (blink.led >= 0)
+    playBlink();
+  if (!pagechanged)
+    return;
+
+  for (int i = 0; i < sizeof(leds); i++)
+  {
+    bool on = hostState.flags & RAW_LEDS ? hostState.leds & (1 << i) : pageAt(currpage).leds[i];
+    digitalWrite(leds[i], !on); // note I invert logic because LEDs are active low
+  }
+
+  // a blink has them until it's done, then they're set again
+  for (int i = 0; blink.led < 0 && i < sizeof(rgbLeds); i++)
+  {
+    bool on = hostState.flags & RAW_RGB ? hostState.rgb & (1 << i) : pageAt(currpage).builtinleds[i];
+    digitalWrite(rgbLeds[i], !on); // note I invert logic because LEDs are active low
+  }
+
+  // the neopixel takes a while to write, only when it changes
+  static uint32_t shownColor = 0xffffffff;
+  uint32_t color = hostState.flags & RAW_NEOPIXEL ? hostState.neopixel : pageAt(currpage).neopixel;
+  if (color != shownColor)
+  {
+    np.setPixelColor(0, color);
+    np.show();
+    shownColor = color;
+  }
+  pagechanged = false;
+}
+
+void serialTask()
+{
+  handleSerial();
+}
+
+void logTask()
+{
+  logger.drain();
+}
+
+// one boot stage a run, so the keypad gets a go in between
+void bootTask()
+{
+  bootStep();
+  if (bootStage != BOOT_DONE)
+    sched.signal(bootId);
+}
+
+// reads the config the host wrote, or tries the broken one again
+void configTask()
+{
+  fs_changed = false;
+
+  if (!openDrive())
+    return;
+
+  LOG_INFO("Trying to open config.json");
+
+  // Serial.println("Flash contents:");
+  // root.ls(LS_R | LS_DATE | LS_SIZE);
+  ConfigResult result = loadConfigFiles();
+  if (result == CONFIG_LOADED)
+  {
+    rememberKeymap();
+    invalidConfig = false;
+    currpage = 0;
+    startBlink(1, 8, 100, 100); // green
+    pagechanged = true;
+  }
+  else if (result == CONFIG_FAILED)
+  {
+    invalidConfig = true;
+    startBlink(0, 1, 200, 250); // red
+  }
+
+  closeDrive();
+}
+
+// notices what needs doing and signals the task that does it
+void housekeepingTask()
+{
+#if defined(RP9_VIRTUAL_FAT)
+  // the host let go of the drive, next time it gets the current keymap
+  if (vdriveEjected)
+  {
+    vdriveEjected = false;
+    startVirtualDrive();
+  }
+#endif
+
+  // the host wrote the drive, or the config we have is broken
+  if ((fs_changed || invalidConfig) && bootStage == BOOT_DONE && !sched.pending(configId))
+  {
+    sched.signal(configId, CONFIG_HOLDOFF_US);
+  }
+
+  // saving stops everything for a while, so only do it with nothing held
+  if (keypadQuiet && usage.due(millis()) && !sched.pending(saveId))
+  {
+    sched.signal(saveId);
+  }
+}
+
+void saveTask()
+{
+  // a key could have gone down since it was signalled
+  if (keypadQuiet)
+    saveUsage();
+}
+
+// taps for the keys the pad repeats, each at the time it's due, then
+// again for the next one
+void repeatTask()
+{
+  if (repeater.run(micros(), turns))
+    sched.signal(hidId);
+  if (repeater.active())
+    sched.signal(repeatId, repeater.untilNextUs(micros()));
+}
+
+// one library page at a time, so the scan gets a look in between
+void pageTask()
+{
+  if (library.prefetchStep())
+    sched.signal(pageId);
+}
+
 //------------------------------------------------------------------+
 // Mass Storage Class callback functions
 //------------------------------------------------------------------+
@@ -284,9 +475,21 @@ void loop()
 // return number of copied bytes (must be multiple of block size)
 int32_t msc_read_cb(uint32_t lba, void *buffer, uint32_t bufsize)
 {
+#if defined(RP9_VIRTUAL_FAT)
+  for (uint32_t i = 0; i < bufsize / VFAT_SECTOR_SIZE; i++)
+  {
+    vdrive.read(lba + i, (uint8_t *)buffer + i * VFAT_SECTOR_SIZE);
+  }
+  return bufsize;
+#else
   // Note: SPIFLash Block API: readBlocks/writeBlocks/syncBlocks
   // already include 4K sector caching internally. We don't need to cache it, yahhhh!!
-  return flash.readBlocks(lba, (uint8_t *)buffer, bufsize / 512) ? bufsize : -1;
+  if (!flash.readBlocks(lba, (uint8_t *)buffer, bufsize / 512))
+    return -1;
+
+  overlayStats(lba, (uint8_t *)buffer, bufsize / 512);
+  return bufsize;
+#endif
 }
 
 // Callback invoked when received WRITE10 command.
@@ -294,314 +497,952 @@ int32_t msc_read_cb(uint32_t lba, void *buffer, uint32_t bufsize)
 // return number of written bytes (must be multiple of block size)
 int32_t msc_write_cb(uint32_t lba, uint8_t *buffer, uint32_t bufsize)
 {
+#if defined(RP9_VIRTUAL_FAT)
+  // nothing goes to flash, loadConfigFiles() picks config.json out of these
+  for (uint32_t i = 0; i < bufsize / VFAT_SECTOR_SIZE; i++)
+  {
+    vdrive.write(lba + i, buffer + i * VFAT_SECTOR_SIZE, millis());
+  }
+  return bufsize;
+#else
   // Note: SPIFLash Block API: readBlocks/writeBlocks/syncBlocks
   // already include 4K sector caching internally. We don't need to cache it, yahhhh!!
-  return flash.writeBlocks(lba, buffer, bufsize / 512) ? bufsize : -1;
+
+  // if the host writes over stats.json it isn't ours any more
+  if (statsMapped && lba <= statsLastBlock && lba + bufsize / 512 > statsFirstBlock)
+  {
+    statsMapped = false;
+  }
+
+  // timed for 'g', a whole sector erases and programs when the cache moves on
+  uint32_t start = micros();
+#if defined(RP9_CORE1_SCAN)
+  scanCore.writing = true;
+#endif
+  bool ok = flash.writeBlocks(lba, buffer, bufsize / 512);
+#if defined(RP9_CORE1_SCAN)
+  scanCore.writing = false;
+#endif
+  driveBlocks += bufsize / 512;
+  driveWorstUs = max(driveWorstUs, (uint32_t)(micros() - start));
+  return ok ? bufsize : -1;
+#endif
 }
 
 // Callback invoked when WRITE10 command is completed (status received and accepted by host).
 // used to flush any pending cache.
 void msc_flush_cb(void)
 {
+#if defined(RP9_VIRTUAL_FAT)
+  fs_changed = true;
+#else
+  uint32_t start = micros();
+#if defined(RP9_CORE1_SCAN)
+  scanCore.writing = true;
+#endif
   flash.syncBlocks();
+#if defined(RP9_CORE1_SCAN)
+  scanCore.writing = false;
+#endif
+  driveWorstUs = max(driveWorstUs, (uint32_t)(micros() - start));
 
   // clear file system's cache to force refresh
   fatfs.cacheClear();
 
   fs_changed = true;
+#endif
 }
 
+#if defined(RP9_VIRTUAL_FAT)
+// Callback invoked on SCSI START STOP UNIT, e.g. when the host ejects the drive
+bool msc_start_stop_cb(uint8_t power_condition, bool start, bool load_eject)
+{
+  if (load_eject && !start)
+  {
+    vdriveEjected = true;
+  }
+  return true;
+}
+#endif
+
 //------------------------------------------------------------------+
 // Functions
 //------------------------------------------------------------------+
 
-void removeSpace(char *s)
+// parser errors and warnings go to Serial
+void printConfigMessage(bool error, const char *text)
+{
+  if (error)
+    LOG_ERROR("config error: %s", text);
+  else
+    LOG_WARN("config warning: %s", text);
+}
+
+// returns true is successful, false if failed
+bool parseConfig(FatFile configfile)
+{
+  // buffer for reading the config file (one byte per character), from the
+  // arena like everything else the parser needs
+  configArena.reset();
+  char *rdbuf = (char *)configArena.allocate(CONFIG_MAX_SIZE);
+  // read the file!
+  LOG_INFO("Trying to read config.json");
+  int bytesRead = configfile.read(rdbuf, CONFIG_MAX_SIZE);
+
+  // check that we read the whole thing!
+  if (bytesRead < 0 || (uint32_t)bytesRead < configfile.fileSize())
+  {
+    LOG_ERROR("could not read entire config.json file");
+    return false;
+  }
+  return parseConfigText(rdbuf, bytesRead);
+}
+
+// parses config.json text that's already in memory into keypages
+bool parseConfigText(char *rdbuf, size_t bytesRead)
+{
+  // parsing time
+  LOG_INFO("Trying to parse data");
+  ConfigSettings settings;
+  ConfigReport report;
+  report.message = printConfigMessage;
+  if (!parseConfigJson(rdbuf, bytesRead, keypages, settings, report, &leaderSink))
+  {
+    return false;
+  }
+  applySettings(settings);
+  typer.stop(); // what it was typing has been replaced
+  repeater.clear();
+
+  LOG_INFO("config.json parsed successfully");
+  ramStats.print();
+  return true;
+}
+
+// loads a keymap.bin made by the host config compiler. Returns true if successful.
+bool loadKeymapFile(FatFile keymapfile)
 {
-  for (char *s2 = s; *s2; ++s2)
+  KeymapImage image;
+  if (keymapfile.read(&image, sizeof(image)) != sizeof(image))
+  {
+    LOG_ERROR("keymap.bin is too short");
+    return false;
+  }
+
+  ConfigSettings settings;
+  if (!loadKeymap(image, keypages, settings))
   {
-    if (*s2 != ' ')
-      *s++ = *s2;
+    LOG_ERROR("keymap.bin is damaged or from a different firmware version");
+    return false;
   }
-  *s = 0;
+  applySettings(settings);
+  typer.stop();
+  repeater.clear();
+
+  LOG_INFO("keymap.bin loaded successfully");
+  return true;
 }
 
-// i is the key that was pressed
-void handleKeypress(int i)
+// One step of the boot that happens after setup(), so the keyboard is
+// already working off the stored keymap while the drive comes up.
+void bootStep()
 {
-  // if we're not supposed to change pages, get the HID code
-  if (keypages[currpage]->pagechange[i] == 69) // 69 means no page change
+  switch (bootStage)
   {
-    keycode[count++] = keypages[currpage]->hidcode[i];
-    modifier = keypages[currpage]->modcode[i];
+  case BOOT_MOUNT:
+#if defined(RP9_VIRTUAL_FAT)
+    startVirtualDrive();
+#else
+    fs_formatted = fatfs.begin(&flash);
+    if (!fs_formatted)
+    {
+      LOG_ERROR("Failed to init files system, flash may not be formatted");
+    }
+    setupStatsFile();
+#endif
+    usb_msc.setUnitReady(true);
+    bootTimes.driveUs = micros();
+    bootStage = BOOT_CONFIG;
+    break;
+
+  case BOOT_CONFIG:
+    bootStage = BOOT_DONE;
+    if (invalidConfig)
+    {
+      // no stored keymap, the normal config path in loop() takes over
+      fs_changed = true;
+      break;
+    }
+
+    // the drive may have a different config than the one we booted with -
+    // a broken one is reported but we keep typing with the stored keymap
+    // (never with RP9_VIRTUAL_FAT, its config.json is made from the stored keymap)
+    if (fs_formatted)
+    {
+      ConfigResult result = loadConfigFiles();
+      if (result == CONFIG_LOADED && rememberKeymap())
+      {
+        currpage = 0;
+        pagechanged = true;
+        startBlink(1, 8, 100, 100); // green
+      }
+      else if (result == CONFIG_FAILED)
+      {
+        startBlink(0, 1, 200, 250); // red, a failed load leaves keypages alone
+      }
+    }
+    bootTimes.configUs = micros();
+    break;
+
+  case BOOT_DONE:
+    break;
   }
-  // otherwise, change pages :)
+}
+
+void printBootTimes()
+{
+  LOG_INFO("Boot: keymap at %u ms, USB at %u ms, drive at %u ms, config checked at %u ms, first report at %u ms",
+           bootTimes.keymapUs / 1000, bootTimes.usbUs / 1000, bootTimes.driveUs / 1000, bootTimes.configUs / 1000,
+           bootTimes.firstReportUs / 1000);
+  if (bootTimes.settleUs)
+    LOG_INFO("Boot: settle calibrated to %u us", bootTimes.settleUs);
   else
+    LOG_WARN("Boot: settle calibration failed, is a row stuck? Scanning with %u us", bootTimes.scanSettleUs);
+}
+
+// config.json wins, a precompiled keymap.bin is used if there isn't one
+ConfigResult loadConfigFiles()
+{
+#if defined(RP9_VIRTUAL_FAT)
+  // wait for the host to finish writing
+  if (millis() - vdrive.lastWrite < 500)
+  {
+    fs_changed = true;
+    return CONFIG_UNCHANGED;
+  }
+
+  configArena.reset();
+  char *rdbuf = (char *)configArena.allocate(CONFIG_MAX_SIZE);
+  noInterrupts(); // no writes coming in halfway through
+  int32_t size = vdrive.readFile("config.json", (uint8_t *)rdbuf, CONFIG_MAX_SIZE);
+  interrupts();
+  if (size == VFAT_FILE_BROKEN)
+  {
+    // too big, or the host wrote more than scratch holds before we got to it
+    LOG_ERROR("config.json is on the drive but can't be read back (%u sectors dropped so far)", vdrive.dropped);
+    return CONFIG_FAILED;
+  }
+  if (size < 0)
+    return CONFIG_MISSING;
+
+  // the host writes often (timestamps, index files...) without touching config.json
+  uint32_t crc = crc32(rdbuf, size);
+  if (crc == vconfigCrc)
+    return CONFIG_UNCHANGED;
+  vconfigCrc = crc;
+  leaderInConfig = false;
+  if (!parseConfigText(rdbuf, size))
+    return CONFIG_FAILED;
+  // there's nowhere for a leader.bin on this drive
+  if (!leaderInConfig)
+    clearLeaderStore();
+  return CONFIG_LOADED;
+#else
+  leaderInConfig = false;
+  bool opened = file.open("/config.json");
+  bool loaded = opened && parseConfig(file);
+  if (!opened)
   {
-    int lastpage = currpage;
-    currpage = keypages[currpage]->pagechange[i];
-    pagechanged = (lastpage == currpage) ? false : true;
+    opened = file.open("/keymap.bin");
+    loaded = opened && loadKeymapFile(file);
   }
+  if (!opened)
+    return CONFIG_MISSING;
+
+  file.close();
+  // lots of sequences come precompiled in a leader.bin
+  if (loaded && !leaderInConfig)
+    loadLeaderFile();
+  // the library's pages are checked against this config's layout
+  if (loaded)
+    indexLibrary();
+  return loaded ? CONFIG_LOADED : CONFIG_FAILED;
+#endif
 }
 
-// returns true is successful, false if failed
-bool parseConfig(FatFile configfile)
+// Gets the drive ready for the host: mounts the FAT on the flash, or with
+// RP9_VIRTUAL_FAT there's nothing to mount. Returns false if it can't.
+bool openDrive()
 {
-  // tracks if we've allocated memory for keypages
-  static bool memAllocated = false;
-
-  // these are some basic config checks we can do
-  bool allPagesHaveAKeysElement = true;
-  bool allPagesHaveAPageElement = true;
-  bool allPagesHaveALedsElement = true;
-  bool allPagesHaveNineKeys = true;
-  bool allPagesHaveAllLeds = true;
-  bool noPagesBiggerThanEight = true;
-  bool zeropageExists = false;
-
-  // buffer for reading the config file (one byte per character)
-  char rdbuf[5000];
-  char *rdbuf_p = &rdbuf[0];
-  // keep track of how many bytes we actually read
-  int bytesRead = 0;
-  // Json Document for parsing
-  DynamicJsonDocument doc(3072);
-  // read the file!
-  Serial.println("Trying to read config.json");
-  Serial.flush();
-  while (configfile.read(&rdbuf[bytesRead], 1) == 1)
+#if defined(RP9_VIRTUAL_FAT)
+  return true;
+#else
+  // check if host formatted disk
+  if (!fs_formatted)
   {
-    bytesRead++;
+    fs_formatted = fatfs.begin(&flash);
   }
 
-  // check that we read the whole thing!
-  if (bytesRead < configfile.fileSize())
+  // skip if still not formatted
+  if (!fs_formatted)
+    return false;
+
+  if (!root.open("/"))
   {
-    Serial.println("could not read entire config.json file");
-    Serial.flush();
-    delay(100);
+    LOG_ERROR("open root failed");
     return false;
   }
 
-  // parsing time
-  Serial.println("Trying to parse data");
-  Serial.flush();
-  DeserializationError error = deserializeJson(doc, rdbuf, bytesRead);
+  // the host may have moved stats.json around
+  mapStatsFile();
+  return true;
+#endif
+}
 
-  // detect parsing error
-  if (error)
+void closeDrive()
+{
+#if !defined(RP9_VIRTUAL_FAT)
+  root.close();
+#endif
+}
+
+#if defined(RP9_VIRTUAL_FAT)
+// (Re)builds the virtual drive: config.json written out from keypages and stats.json
+void startVirtualDrive()
+{
+  vconfigSize = invalidConfig ? 0
+                              : renderConfigJson(keypages, currentSettings(), vconfigText, sizeof(vconfigText),
+                                                 leader.loaded() ? leaderStore.data() : nullptr);
+  vconfigCrc = crc32(vconfigText, vconfigSize);
+
+  vfiles[0] = {"config.json", false, vconfigSize, readVirtualConfig};
+  vfiles[1] = {"stats.json", true, STATS_FILE_SIZE, readVirtualStats};
+  noInterrupts();
+  vdrive.begin(vfiles.data(), vfiles.size());
+  interrupts();
+}
+
+void readVirtualConfig(uint32_t offset, uint8_t *sector)
+{
+  if (offset < vconfigSize)
+  {
+    memcpy(sector, vconfigText + offset, min(vconfigSize - offset, (uint32_t)VFAT_SECTOR_SIZE));
+  }
+}
+
+void readVirtualStats(uint32_t offset, uint8_t *sector)
+{
+  static char text[STATS_FILE_SIZE];
+  if (offset == 0)
+  {
+    usage.render(text, sizeof(text), keypages);
+  }
+  memcpy(sector, text + offset, VFAT_SECTOR_SIZE);
+}
+#endif
+
+// the keymap in keypages as a keymap.bin image
+void compileCurrentKeymap(KeymapImage &image)
+{
+  compileKeymap(keypages, currentSettings(), image);
+}
+
+// puts the settings from a config to work
+void applySettings(const ConfigSettings &settings)
+{
+  idleMode.timeoutMs = settings.idleTimeoutMs;
+  mouseKeys.settings = settings.mouse;
+  chain.pad = settings.chainPad;
+}
+
+// the settings in use, as a config would have them
+ConfigSettings currentSettings()
+{
+  ConfigSettings settings;
+  settings.idleTimeoutMs = idleMode.timeoutMs;
+  settings.mouse = mouseKeys.settings;
+  settings.chainPad = chain.pad;
+  return settings;
+}
+
+// loads the keymap saved by rememberKeymap(). Returns false if there isn't one.
+bool loadStoredKeymap()
+{
+  KeymapImage image;
+  ConfigSettings settings;
+  if (!keymapStore.load(image) || !loadKeymap(image, keypages, settings))
+    return false;
+  applySettings(settings);
+  return true;
+}
+
+// Saves the current keymap for the next boot. Returns true if it was
+// different from the saved one.
+bool rememberKeymap()
+{
+  // two images would be a lot of stack with the text in them
+  static KeymapImage image;
+  compileCurrentKeymap(image);
+  static KeymapImage stored;
+  if (keymapStore.load(stored) && stored.crc == image.crc)
+    return false;
+
+  if (!keymapStore.save(image))
   {
-    Serial.print("deserializeJson() failed: ");
-    Serial.println(error.c_str());
+    LOG_WARN("couldn't save the keymap for next boot");
+  }
+  return true;
+}
+
+// The sink compileLeader() writes config.json's sequences through, straight
+// into the leader store
+bool leaderBegin(const LeaderHeader &header)
+{
+  leaderInConfig = true;
+  return prepareLeaderStore(header);
+}
+
+void leaderWrite(uint32_t offset, const void *data, uint32_t len)
+{
+  leaderStore.write(offset, data, len);
+}
+
+void leaderEnd()
+{
+  leaderStore.flush();
+  if (!useLeaderStore())
+    LOG_ERROR("couldn't write the leader sequences to flash");
+}
+
+// Gets the leader store ready for a new trie. False if it's already there
+// (and in use), or if there's no room for it.
+bool prepareLeaderStore(const LeaderHeader &header)
+{
+  if (leader.loaded() && !memcmp(leaderStore.data(), &header, sizeof(header)))
     return false;
+  leader.use(nullptr); // nothing reads the flash while it's erased
+  return leaderStore.erase(header.size);
+}
+
+// starts matching with the stored trie, if there's a good one
+bool useLeaderStore()
+{
+  bool good = storeUsable(leaderStore.offset) && checkLeaderImage(leaderStore.data(), leaderStore.size);
+  leader.use(good ? leaderStore.data() : nullptr);
+  if (good)
+    LOG_INFO("%u leader sequences", leader.header().sequences);
+  return good;
+}
+
+// the config has no sequences any more
+void clearLeaderStore()
+{
+  if (!leader.loaded())
+    return;
+  leader.use(nullptr);
+  leaderStore.erase(LEADER_HEADER_SIZE);
+}
+
+// Copies a leader.bin made by rp9config -l into the leader store, for more
+// sequences than fit in config.json. Without one the store is cleared.
+void loadLeaderFile()
+{
+  FatFile leaderfile;
+  if (!leaderfile.open("/leader.bin"))
+  {
+    clearLeaderStore();
+    return;
+  }
+
+  LeaderHeader header;
+  if (leaderfile.read(&header, sizeof(header)) != sizeof(header) || header.magic != LEADER_IMAGE_MAGIC ||
+      header.version != LEADER_IMAGE_VERSION || header.size != leaderfile.fileSize() || header.size > leaderStore.size)
+  {
+    LOG_ERROR("leader.bin is damaged or from a different firmware version");
   }
-  Serial.println("No problem parsing file");
-  // allocate memory for all the keypages - ONLY ONCE EVER
-  if (!memAllocated)
+  else if (prepareLeaderStore(header))
   {
-    for (int y = 0; y < 9; y++)
+    // the body a page at a time, the header last so it's only good once it's all there
+    uint8_t buffer[FLASH_PAGE_SIZE];
+    leaderfile.seekSet(LEADER_HEADER_SIZE);
+    for (uint32_t at = LEADER_HEADER_SIZE; at < header.size; at += sizeof(buffer))
     {
-      keypages[y] = new Keypage();
+      int n = leaderfile.read(buffer, sizeof(buffer));
+      if (n <= 0)
+        break;
+      leaderStore.write(at, buffer, n);
     }
-    memAllocated = true;
-    Serial.println("memory allocated for keypages");
+    leaderStore.write(0, &header, sizeof(header));
+    leaderStore.flush();
+    if (!useLeaderStore())
+      LOG_ERROR("leader.bin is damaged");
   }
-  else
+  leaderfile.close();
+}
+
+// Notes where the pages in /library.json are, see library.h. The file
+// stays open for reading them. Returns how many pages it has.
+int indexLibrary()
+{
+  libraryFile.close();
+  if (!libraryFile.open("/library.json"))
   {
-    Serial.println("skipping memory allocation");
+    library.clear();
+    return 0;
   }
+  library.read = readLibrary;
+  library.message = printConfigMessage;
+  uint32_t start = micros();
+  int pages = library.index(libraryFile.fileSize());
+  LOG_INFO("library.json: %d pages, indexed in %u us", pages, micros() - start);
+  // page 0 is where a new config starts
+  library.prefetch(*keypages[0]);
+  return pages;
+}
+
+int32_t readLibrary(uint32_t offset, void *data, uint32_t len)
+{
+  if (!libraryFile.seekSet(offset))
+    return -1;
+  return libraryFile.read(data, len);
+}
+
+// single letter commands from the serial monitor
+void handleSerial()
+{
+  if (!Serial.available())
+    return;
 
-  // Config checks!
-  if (doc["pages"].isNull())
+  switch (Serial.read())
   {
-    Serial.println("config.json has no top level 'pages' array");
+  case 't':
+    saveTrace();
+    break;
+  case 'm':
+    ramStats.print();
+    break;
+  case 'b':
+    printBootTimes();
+    break;
+  case 'c':
+    printChainStats();
+    break;
+  case 's':
+    calibrateSettle();
+    printSettle();
+    break;
+  case 'g':
+    printScanGaps();
+    break;
+  case 'p':
+    printTasks();
+    break;
+  case 'l':
+    library.print();
+    library.clearStats();
+    break;
+  }
+}
+
+// writes the recent key trace to /trace.bin for the host replay tool
+bool saveTrace()
+{
+#if defined(RP9_VIRTUAL_FAT)
+  Serial.println("trace.bin needs the flash drive, it isn't saved with RP9_VIRTUAL_FAT");
+  return false;
+#else
+  if (!fs_formatted)
     return false;
+
+  // the crc lets the replay tool check it's using the same keymap
+  uint32_t keymapCrc = 0;
+  if (!invalidConfig)
+  {
+    KeymapImage image;
+    compileCurrentKeymap(image);
+    keymapCrc = image.crc;
   }
-  if (doc["pages"].as<JsonArray>().size() < 1)
+
+  FatFile tracefile;
+  if (!tracefile.open("/trace.bin", O_WRONLY | O_CREAT | O_TRUNC))
   {
-    Serial.println("'pages' array must have at least one element");
+    Serial.println("can't create trace.bin");
     return false;
   }
-  for (auto a : doc["pages"].as<JsonArray>())
+  bool saved = tracer.save(tracefile, keymapCrc);
+  tracefile.close();
+  flash.syncBlocks();
+
+  Serial.print(saved ? "trace.bin saved, " : "trace.bin write failed, ");
+  Serial.print(min(tracer.head, (uint32_t)TRACE_SIZE));
+  Serial.println(" records. Eject and replug the drive to see it");
+  return saved;
+#endif
+}
+
+// Makes sure there's a contiguous stats.json of the right size. Only done
+// at boot, before the host has the drive mounted.
+void setupStatsFile()
+{
+  if (!fs_formatted)
+    return;
+
+  FatFile statsfile;
+  if (statsfile.open("/stats.json", O_RDONLY))
   {
-    if (a["keys"].isNull())
+    uint32_t first, last;
+    bool good = statsfile.fileSize() == STATS_FILE_SIZE && statsfile.contiguousRange(&first, &last);
+    if (!good)
     {
-      Serial.println("All pages must have a 'keys' element");
-      return false;
+      statsfile.attrib(0);
     }
-    if (a["keys"]["1"].isNull() || a["keys"]["2"].isNull() || a["keys"]["3"].isNull() ||
-        a["keys"]["4"].isNull() || a["keys"]["5"].isNull() || a["keys"]["6"].isNull() ||
-        a["keys"]["7"].isNull() || a["keys"]["8"].isNull() || a["keys"]["9"].isNull() || a["keys"].size() != 9)
+    statsfile.close();
+    if (!good)
     {
-      Serial.println("All pages must have only elements '1' through '9' under 'keys'");
-      return false;
+      fatfs.remove("/stats.json");
     }
-    if (a["page"].isNull())
-    {
-      Serial.println("All pages must have a 'page' element");
-      return false;
-    }
-    if (a["page"] > 8)
-    {
-      Serial.println("Page element values must be less than 9");
-      return false;
-    }
-    if (a["leds"].isNull())
+  }
+
+  if (!fatfs.exists("/stats.json"))
+  {
+    if (statsfile.createContiguous("/stats.json", STATS_FILE_SIZE))
     {
-      Serial.println("All pages must have a 'leds' element");
-      return false;
+      statsfile.attrib(FS_ATTRIB_READ_ONLY);
+      statsfile.close();
+      flash.syncBlocks();
     }
-    if (a["leds"]["led1"].isNull() || a["leds"]["led2"].isNull() || a["leds"]["led3"].isNull() ||
-        a["leds"]["ledR"].isNull() || a["leds"]["ledG"].isNull() || a["leds"]["ledB"].isNull() ||
-        a["leds"]["neopixel"].isNull())
+    else
     {
-      Serial.println("All leds must be included in each page under the 'leds' key");
-      return false;
+      LOG_WARN("can't create stats.json");
     }
-    if (a["page"] == 0)
+  }
+  mapStatsFile();
+}
+
+// finds which blocks stats.json is in, so msc_read_cb can fill them in
+void mapStatsFile()
+{
+  statsMapped = false;
+  FatFile statsfile;
+  if (!statsfile.open("/stats.json", O_RDONLY))
+    return;
+  statsMapped = statsfile.fileSize() == STATS_FILE_SIZE &&
+                statsfile.contiguousRange(&statsFirstBlock, &statsLastBlock) &&
+                statsLastBlock - statsFirstBlock + 1 == STATS_FILE_SIZE / 512;
+  statsfile.close();
+}
+
+// replaces any stats.json blocks in a read with the current counts
+void overlayStats(uint32_t lba, uint8_t *buffer, uint32_t blocks)
+{
+  if (!statsMapped || lba > statsLastBlock || lba + blocks <= statsFirstBlock)
+    return;
+
+  // render once per read of the file, so a press mid-copy can't mix two renders
+  static char text[STATS_FILE_SIZE];
+  static bool rendered = false;
+  if (!rendered || (lba <= statsFirstBlock && statsFirstBlock < lba + blocks))
+  {
+    usage.render(text, sizeof(text), keypages);
+    rendered = true;
+  }
+  for (uint32_t i = 0; i < blocks; i++)
+  {
+    uint32_t block = lba + i;
+    if (block >= statsFirstBlock && block <= statsLastBlock)
     {
-      zeropageExists = true;
+      memcpy(buffer + i * 512, text + (block - statsFirstBlock) * 512, 512);
     }
   }
-  if (!zeropageExists)
+}
+
+// checkpoints the press counts to flash
+void saveUsage()
+{
+  // even if it failed, wait for the next checkpoint rather than retrying every loop
+  bool saved = usageStore.save(usage.counts);
+  usage.checkpointed(millis());
+  if (!saved)
   {
-    Serial.println("A page numbered '0' must exist");
-    return false;
+    LOG_WARN("couldn't save the press counts");
+  }
+}
+
+// Decoding happens on every edge of either pin, loop() only collects the
+// detents. A turn also ends an idle sleep.
+void beginEncoders()
+{
+#if ENCODER_COUNT > 0
+  encoders[0].begin(ENCODER1_A, ENCODER1_B);
+  attachInterrupt(digitalPinToInterrupt(ENCODER1_A), onEncoder1, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(ENCODER1_B), onEncoder1, CHANGE);
+#endif
+#if ENCODER_COUNT > 1
+  encoders[1].begin(ENCODER2_A, ENCODER2_B);
+  attachInterrupt(digitalPinToInterrupt(ENCODER2_A), onEncoder2, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(ENCODER2_B), onEncoder2, CHANGE);
+#endif
+}
+
+#if ENCODER_COUNT > 0
+void onEncoder1()
+{
+  encoders[0].update();
+  IdleMode::wake();
+}
+#endif
+
+#if ENCODER_COUNT > 1
+void onEncoder2()
+{
+  encoders[1].update();
+  IdleMode::wake();
+}
+#endif
+
+// the chain runs on a PIO UART, the hardware ones can't reach D4 and D5
+void beginChain()
+{
+#if defined(RP9_CHAIN)
+  chainSerial.begin(CHAIN_BAUD);
+  chain.send = [](const uint8_t *data, size_t len) { chainSerial.write(data, len); };
+#endif
+}
+
+// Trades frames with the other pads. pads comes in with this pad's keys
+// and goes out with the keys to type here: everyone's on the primary,
+// nothing on a secondary, which follows the primary's page instead.
+void chainStep(PadKeys &pads)
+{
+#if defined(RP9_CHAIN)
+  uint32_t now = millis();
+  while (chainSerial.available())
+  {
+    chain.receive(chainSerial.read(), now);
   }
+  chain.update(pads[0], currpage, now);
 
-  // Fun fact: keypages are 0-indexed and everything else isn't
-  for (JsonObject page : doc["pages"].as<JsonArray>())
+  if (!chain.pad)
+  {
+    for (int p = 1; p < CHAIN_MAX_PADS; p++)
+    {
+      pads[p] = chain.keys[p];
+    }
+    return;
+  }
+  pads[0] = 0;
+  if (chain.page >= 0 && chain.page != currpage && pageDefined(chain.page))
   {
-    // regex used to determine if a key should switch pages
-    std::string pagePattern = "^page [0-9]$";
-    std::regex pageRegex(pagePattern);
+    changePage(chain.page);
+  }
+#endif
+}
 
-    // regex to identify modifier keys
-    std::string altPattern = "(.*)(alt)(.*)";
-    std::regex altRegex(altPattern.c_str());
-    std::string ctlPattern = "(.*)(ctl)(.*)";
-    std::regex ctlRegex(ctlPattern.c_str());
-    std::string shiftPattern = "(.*)(shift)(.*)";
-    std::regex shiftRegex(shiftPattern.c_str());
-    std::string guiPattern = "(.*)(gui)(.*)";
-    std::regex guiRegex(guiPattern.c_str());
+void printChainStats()
+{
+  Serial.print("Chain: pad ");
+  Serial.print(chain.pad);
+  Serial.print(chain.active(millis()) ? ", linked" : ", alone");
+  Serial.print(", ");
+  Serial.print(chain.frames);
+  Serial.print(" frames, ");
+  Serial.print(chain.forwarded);
+  Serial.print(" forwarded, ");
+  Serial.print(chain.gaps);
+  Serial.print(" lost, ");
+  Serial.print(chain.parser.crcErrors);
+  Serial.println(" bad");
+}
 
-    int page_page = page["page"]; // the current page number
+// Times the matrix lines and scans as fast as they allow. If they can't be
+// timed the last good result is used, or MATRIX_SETTLE_US. Only saved when
+// it changes, so booting doesn't wear the flash.
+void calibrateSettle()
+{
+#if defined(RP9_CORE1_SCAN)
+  scanCore.pause();
+#endif
+  SettleCalibration stored;
+  bool haveStored = settleStore.load(stored) && stored.settleUs;
+  settleCal = scanner.calibrate(haveStored ? &stored : nullptr);
+  if (settleCal.settleUs)
+    scanner.setSettle(settleCal.settleUs);
+  else if (haveStored)
+    scanner.setSettle(stored.settleUs);
+#if defined(RP9_CORE1_SCAN)
+  scanCore.resume();
+#endif
+  if (settleCal.settleUs && (!haveStored || stored.settleUs != settleCal.settleUs || stored.held != settleCal.held))
+    settleStore.save(settleCal);
+}
 
-    JsonObject page_keys = page["keys"];
-    const char *page_key_array[] = {page_keys["1"], page_keys["2"], page_keys["3"],
-                                    page_keys["4"], page_keys["5"], page_keys["6"],
-                                    page_keys["7"], page_keys["8"], page_keys["9"]}; // all keys
+// worst time between scan passes since last asked. Copy a big file to the
+// drive first to see what a flash write does to it.
+void printScanGaps()
+{
+  Serial.print("Scan gaps: loop worst ");
+  Serial.print(keypadGapUs);
+  Serial.print(" us");
+#if defined(RP9_CORE1_SCAN)
+  Serial.print(", core 1 worst ");
+  Serial.print(scanCore.worstGapUs);
+  Serial.print(" us over ");
+  Serial.print(scanCore.passes);
+  Serial.print(" passes, ");
+  Serial.print(scanCore.dropped);
+  Serial.print(" changes dropped");
+#endif
+  Serial.println();
+  Serial.print("Drive writes: ");
+  Serial.print(driveBlocks);
+  Serial.print(" blocks, worst ");
+  Serial.print(driveWorstUs);
+  Serial.print(" us");
+#if defined(RP9_VIRTUAL_FAT)
+  Serial.print(", ");
+  Serial.print(vdrive.dropped);
+  Serial.print(" sectors dropped from scratch");
+#endif
+#if defined(RP9_CORE1_SCAN)
+  Serial.print(", core 1 worst gap during them ");
+  Serial.print(scanCore.worstWriteGapUs);
+  Serial.print(" us");
+  scanCore.clearStats();
+#endif
+  Serial.println();
+  keypadGapUs = 0;
+  driveBlocks = 0;
+  driveWorstUs = 0;
+}
 
-    JsonObject page_leds = page["leds"];
-    const char *page_leds_neopixel = page_leds["neopixel"];                             // Xiao RP2040 builtin Neopixel
-    bool page_leds_array[] = {page_leds["led1"], page_leds["led2"], page_leds["led3"]}; // all leds
-    bool page_rgb_array[] = {page_leds["ledR"], page_leds["ledG"], page_leds["ledB"]};  // all builtin RGBs
+// how long each task takes and how often it's late, since last asked
+void printTasks()
+{
+  sched.print();
+  sched.clearStats();
+}
 
-    keypages[page_page]->page = page_page;
-    // assign all the things in each keypage
-    for (int j = 0; j < (sizeof(page_key_array) / sizeof(page_key_array[0])); j++)
+void printSettle()
+{
+  Serial.print("Settle: ");
+  Serial.print(scanner.settleUs);
+  Serial.print(" us");
+  if (!settleCal.settleUs)
+    Serial.print(" (calibration failed, is a row stuck?)");
+  Serial.print(", a read takes ");
+  Serial.print(settleCal.pollNs);
+  Serial.println(" ns");
+  for (int r = 0; r < 3; r++)
+  {
+    Serial.print("  row ");
+    Serial.print(r + 1);
+    Serial.print(" falls in ");
+    Serial.print(settleCal.fallNs[r]);
+    Serial.print(" ns, rises in");
+    bool any = false;
+    for (int c = 0; c < 3; c++)
     {
-      // check if it's a page change assignment
-      if (std::regex_match(page_key_array[j], pageRegex))
-      {
-        keypages[page_page]->pagechange[j] = page_key_array[j][5] - 0x30; // ascii to integer
-      }
-      // determine what hidcode or page change applies
-      else
-      {
-        keypages[page_page]->pagechange[j] = 69; // no page change :)
-
-        // copy the page_key so we can strip the spaces
-        char this_page_key[50];
-        strncpy(this_page_key, page_key_array[j], 49);
-        removeSpace(this_page_key);
-
-        // check for modifier keys
-        if (std::regex_match(this_page_key, altRegex))
-        {
-          keypages[page_page]->modcode[j] += KEYBOARD_MODIFIER_LEFTALT;
-        }
-        if (std::regex_match(this_page_key, ctlRegex))
-        {
-          keypages[page_page]->modcode[j] += KEYBOARD_MODIFIER_LEFTCTRL;
-        }
-        if (std::regex_match(this_page_key, shiftRegex))
-        {
-          keypages[page_page]->modcode[j] += KEYBOARD_MODIFIER_LEFTSHIFT;
-        }
-        if (std::regex_match(this_page_key, guiRegex))
-        {
-          keypages[page_page]->modcode[j] += KEYBOARD_MODIFIER_LEFTGUI;
-        }
-
-        // find the position of the rightmost + if there is one
-        char *last_plus = std::strrchr(this_page_key, '+');
-        char *keycode;
-        // if not NULL, then there was a +. Check starting from next char
-        if (last_plus != NULL)
-        {
-          keycode = &last_plus[1];
-        }
-        else
-        {
-          keycode = this_page_key;
-        }
-        // check each keycode to see if it matches
-        for (auto k : keymap)
-        {
-          if (!strcmp(keycode, k.first))
-          {
-            keypages[page_page]->hidcode[j] = k.second;
-            break;
-          }
-        }
-        // by default if nothing matches, the default hidcode of 0 applies
-
-        // copy the led config in
-        std::copy(std::begin(page_leds_array),
-                  std::end(page_leds_array),
-                  keypages[page_page]->leds.begin());
-        // copy the builtin led config in
-        std::copy(std::begin(page_rgb_array),
-                  std::end(page_rgb_array),
-                  keypages[page_page]->builtinleds.begin());
-        // copy the neopixel config in
-        keypages[page_page]->neopixel = std::stoi(page_leds_neopixel, nullptr, 16);
-      }
+      int k = r * 3 + c;
+      if (!(settleCal.held & (1 << k)))
+        continue;
+      Serial.print(" ");
+      Serial.print(settleCal.riseNs[k]);
+      Serial.print(" (key ");
+      Serial.print(k + 1);
+      Serial.print(")");
+      any = true;
     }
+    Serial.println(any ? " ns" : " ? (hold its keys and send 's')");
   }
-  Serial.println("config.json parsed successfully");
-  return true;
 }
 
-// n is how many times.
-void blinkGreen(int n)
+// Raw HID OUT reports. Only merged here, the loop does the work.
+void raw_set_report_cb(uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize)
+{
+  (void)report_id;
+  (void)report_type;
+  rawHid.receive(buffer, bufsize);
+  IdleMode::wake(); // so it happens now, not at the next key press
+}
+
+// puts the host's latest page and LED settings to work
+void takeHostUpdate()
+{
+  HostUpdate update;
+  if (!rawHid.take(update))
+    return;
+
+  if (update.flags & RAW_RELEASE)
+    hostState.flags = 0;
+  if (update.flags & RAW_LEDS)
+    hostState.leds = update.leds;
+  if (update.flags & RAW_RGB)
+    hostState.rgb = update.rgb;
+  if (update.flags & RAW_NEOPIXEL)
+    hostState.neopixel = update.neopixel;
+  hostState.flags |= update.flags & (RAW_LEDS | RAW_RGB | RAW_NEOPIXEL);
+
+  if ((update.flags & RAW_PAGE) && pageDefined(update.page))
+    changePage(update.page);
+  pagechanged = true;
+}
+
+// key events and answers for the host, on the raw HID endpoint
+void serviceRawHid(const PadKeys &pads)
 {
-  for (int i = 0; i < 3; i++)
+  static PadKeys lastPads;
+  static int lastPage = -1;
+  if (pads != lastPads || currpage != lastPage)
+  {
+    rawHid.keysChanged(pads, currpage);
+    lastPads = pads;
+    lastPage = currpage;
+  }
+
+  if (rawHid.queried())
   {
-    digitalWrite(rgbLeds[i], true);
+    const Keypage &page = pageAt(currpage);
+    uint8_t ledBits = 0;
+    uint8_t rgbBits = 0;
+    for (int i = 0; i < 3; i++)
+    {
+      ledBits |= page.leds[i] << i;
+      rgbBits |= page.builtinleds[i] << i;
+    }
+    rawHid.state(currpage, hostState.flags & RAW_LEDS ? hostState.leds : ledBits,
+                 hostState.flags & RAW_RGB ? hostState.rgb : rgbBits,
+                 hostState.flags & RAW_NEOPIXEL ? hostState.neopixel : page.neopixel, hostState.flags);
   }
-  for (int i = 0; i < n; i++)
+
+  uint8_t report[RAW_HID_REPORT_SIZE];
+  if (usb_raw.ready() && rawHid.next(report))
   {
-    digitalWrite(rgbLeds[1], false);
-    delay(100);
-    digitalWrite(rgbLeds[1], true);
-    delay(100);
+    usb_raw.sendReport(0, report, sizeof(report));
   }
 }
 
-// n is how many times.
-void blinkRed(int n)
+// Blinks rgbLeds[led] times times with the others off. Returns straight
+// away, the LED task plays it.
+void startBlink(int led, int times, uint32_t onMs, uint32_t offMs)
+{
+  blink = {led, times, onMs, offMs, millis()};
+}
+
+// sets the RGB LEDs for where the blink is now, and hands them back to the
+// page once it's over
+void playBlink()
 {
-  for (int i = 0; i < 3; i++)
+  uint32_t period = blink.onMs + blink.offMs;
+  uint32_t at = millis() - blink.startMs;
+  if (at >= period * blink.times)
   {
-    digitalWrite(rgbLeds[i], true);
+    blink.led = -1;
+    pagechanged = true;
+    return;
   }
-  for (int i = 0; i < n; i++)
+  for (int i = 0; i < sizeof(rgbLeds); i++)
   {
-    digitalWrite(rgbLeds[0], false);
-    delay(200);
-    digitalWrite(rgbLeds[0], true);
-    delay(250);
+    bool on = i == blink.led && at % period < blink.onMs;
+    digitalWrite(rgbLeds[i], !on); // active low
   }
-}
\ No newline at end of file
+}
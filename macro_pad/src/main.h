@@ -14,20 +14,57 @@
 #include "SdFat.h"
 #include "Adafruit_SPIFlash.h"
 #include "keymapping.h"
-#include "ArduinoJson.h"
+#include "config.h"
+#include "pins.h"
+#include "matrix.h"
+#include "scancore.h"
+#include "idle.h"
+#include "trace.h"
+#include "stats.h"
+#include "store.h"
+#include "ramstats.h"
+#include "vfat.h"
+#include "keypad.h"
+#include "chain.h"
+#include "rawhid.h"
+#include "scheduler.h"
 #include <Adafruit_NeoPixel.h>
 #include <array>
-#include <regex>
 
 //--------------------------------------------------------------------+
 // MSC External Flash Config
 //--------------------------------------------------------------------+
 
 #if defined(ARDUINO_ARCH_RP2040)
+// The library's own erase and write would stop core 1 (or not, depending
+// on its version) without asking. The drive's go through storeErase() and
+// storeProgram() instead, like the firmware's own records, so an
+// RP9_CORE1_SCAN build keeps scanning through them.
+class DriveFlashTransport : public Adafruit_FlashTransport_RP2040
+{
+public:
+  bool eraseCommand(uint8_t command, uint32_t addr) override
+  {
+    uint32_t len = command == SFLASH_CMD_ERASE_BLOCK ? FLASH_BLOCK_SIZE : FLASH_SECTOR_SIZE;
+    if (!check_addr(addr + len))
+      return false;
+    storeErase(_start_addr + addr, len);
+    return true;
+  }
+
+  bool writeMemory(uint32_t addr, uint8_t const *data, uint32_t len) override
+  {
+    if (!check_addr(addr + len))
+      return false;
+    storeProgram(_start_addr + addr, data, len);
+    return true;
+  }
+};
+
 // RP2040 use same flash device that store code.
 // Therefore there is no need to specify the SPI and SS
 // Use default (no-args) constructor to be compatible with CircuitPython partition scheme
-Adafruit_FlashTransport_RP2040 flashTransport;
+DriveFlashTransport flashTransport;
 
 // For generic usage:
 //    Adafruit_FlashTransport_RP2040 flashTransport(start_address, size)
@@ -56,15 +93,51 @@ bool fs_changed;
 // HID Config
 //--------------------------------------------------------------------+
 
+// Report IDs
+enum
+{
+  RID_KEYBOARD = 1,
+  RID_MOUSE,
+};
+
 // HID report descriptor using TinyUSB's template
-// Single Report (no ID) descriptor
+// Keyboard and mouse reports, told apart by report ID
 uint8_t const desc_hid_report[] =
     {
-        TUD_HID_REPORT_DESC_KEYBOARD()};
+        TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(RID_KEYBOARD)),
+        TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(RID_MOUSE))};
 
 // USB HID object. For ESP32 these values cannot be changed after this declaration
 // desc report, desc len, protocol, interval, use out endpoint
-Adafruit_USBD_HID usb_hid(desc_hid_report, sizeof(desc_hid_report), HID_ITF_PROTOCOL_NONE, 2, false);
+// 1ms so text bindings and mouse keys get a report through every frame
+Adafruit_USBD_HID usb_hid(desc_hid_report, sizeof(desc_hid_report), HID_ITF_PROTOCOL_NONE, 1, false);
+
+// The raw HID channel, a vendor interface with its own endpoints so the
+// host's traffic never waits behind the keyboard's or holds it up
+uint8_t const desc_raw_report[] =
+    {
+        TUD_HID_REPORT_DESC_GENERIC_INOUT(RAW_HID_REPORT_SIZE)};
+Adafruit_USBD_HID usb_raw(desc_raw_report, sizeof(desc_raw_report), HID_ITF_PROTOCOL_NONE, 1, true);
+
+//--------------------------------------------------------------------+
+// Task Config
+//--------------------------------------------------------------------+
+
+// what the loop's tasks are, see scheduler.h. The scan and HID tasks come
+// first, the rest only go where they fit between them.
+#define SCAN_PERIOD_US 250     // the matrix, encoders and chain
+#define HID_DEADLINE_US 1000   // reports, after each scan. One USB frame.
+#define LED_PERIOD_US 10000    // page LEDs and the NeoPixel
+#define SERIAL_PERIOD_US 20000 // commands from the serial monitor
+#define LOG_PERIOD_US 2000     // writing out log lines
+#define HOUSEKEEPING_PERIOD_US 100000
+// config.json is read this long after the host last wrote the drive, so
+// it has usually finished writing
+#define CONFIG_HOLDOFF_US 500000
+// the slow ones, reading the drive and writing the flash
+#define SLOW_TASK_DEADLINE_US 100000
+// parsing a library page the current one can change to
+#define PAGE_TASK_DEADLINE_US 20000
 
 //--------------------------------------------------------------------+
 // Prototypes
@@ -72,143 +145,214 @@ Adafruit_USBD_HID usb_hid(desc_hid_report, sizeof(desc_hid_report), HID_ITF_PROT
 int32_t msc_read_cb(uint32_t, void *, uint32_t);
 int32_t msc_write_cb(uint32_t, uint8_t *, uint32_t);
 void msc_flush_cb(void);
-void removeSpace(char *);
-void handleKeypress(int);
+void raw_set_report_cb(uint8_t, hid_report_type_t, uint8_t const *, uint16_t);
+void takeHostUpdate();
+void serviceRawHid(const PadKeys &);
 bool parseConfig(FatFile);
-void blinkGreen(int);
-void blinkRed(int);
+bool loadKeymapFile(FatFile);
+bool parseConfigText(char *, size_t);
+void applySettings(const ConfigSettings &);
+ConfigSettings currentSettings();
+bool openDrive();
+void closeDrive();
 
-//--------------------------------------------------------------------+
-// Other Stuff
-//--------------------------------------------------------------------+
+enum ConfigResult
+{
+  CONFIG_MISSING, // neither config.json nor keymap.bin
+  CONFIG_LOADED,
+  CONFIG_FAILED,
+  CONFIG_UNCHANGED // virtual drive only, nothing new was written
+};
+ConfigResult loadConfigFiles();
 
-#define COL1 D8
-#define COL2 D9
-#define COL3 D10
-#define ROW1 D1
-#define ROW2 D2
-#define ROW3 D3
-#define LED1 D0
-#define LED2 D6
-#define LED3 D7
-// PIN_LED_R
-// PIN_LED_G
-// PIN_LED_B
-// PIN_NEOPIXEL
-// NEOPIXEL_POWER
-
-std::array<uint8_t, 3> cols = {COL1, COL2, COL3};
-std::array<uint8_t, 3> rows = {ROW1, ROW2, ROW3};
-std::array<uint8_t, 3> leds = {LED1, LED2, LED3};
-std::array<uint8_t, 3> rgbLeds = {PIN_LED_R, PIN_LED_G, PIN_LED_B};
+void printConfigMessage(bool, const char *);
+void bootStep();
+void printBootTimes();
+void compileCurrentKeymap(KeymapImage &);
+bool loadStoredKeymap();
+bool rememberKeymap();
+bool leaderBegin(const LeaderHeader &);
+void leaderWrite(uint32_t, const void *, uint32_t);
+void leaderEnd();
+bool prepareLeaderStore(const LeaderHeader &);
+bool useLeaderStore();
+void clearLeaderStore();
+void loadLeaderFile();
+int indexLibrary();
+int32_t readLibrary(uint32_t, void *, uint32_t);
+void handleSerial();
+bool saveTrace();
+void setupStatsFile();
+void mapStatsFile();
+void overlayStats(uint32_t, uint8_t *, uint32_t);
+void saveUsage();
+#if defined(RP9_VIRTUAL_FAT)
+bool msc_start_stop_cb(uint8_t, bool, bool);
+void startVirtualDrive();
+void readVirtualConfig(uint32_t, uint8_t *);
+void readVirtualStats(uint32_t, uint8_t *);
+#endif
+void beginEncoders();
+#if ENCODER_COUNT > 0
+void onEncoder1();
+#endif
+#if ENCODER_COUNT > 1
+void onEncoder2();
+#endif
+void beginChain();
+void chainStep(PadKeys &);
+void printChainStats();
+void calibrateSettle();
+void printScanGaps();
+void printSettle();
+void printTasks();
+void scanTask();
+void hidTask();
+void ledTask();
+void serialTask();
+void logTask();
+void bootTask();
+void configTask();
+void housekeepingTask();
+void saveTask();
+void pageTask();
+void repeatTask();
+void startBlink(int, int, uint32_t, uint32_t);
+void playBlink();
 
 //--------------------------------------------------------------------+
-// Keypage Class
+// Other Stuff
 //--------------------------------------------------------------------+
-class Keypage
-{
-public:
-  int page;                        // page number
-  std::array<int, 9> pagechange;   // which page each key changes to. 69 if don't change.
-  std::array<uint8_t, 9> hidcode;  // hidcode for each key on the page. 0 for no output
-  std::array<uint8_t, 9> modcode;  // modifier for each key on the page
-  std::array<bool, 3> leds;        // board LEDs
-  std::array<bool, 3> builtinleds; // builtin RGB LEDs
-  uint32_t neopixel;               // Neopixel value
-
-  Keypage(int page,
-          std::array<int, 9> pagechange,
-          std::array<uint8_t, 9> hidcode,
-          std::array<uint8_t, 9> modcode,
-          std::array<bool, 3> leds,
-          std::array<bool, 3> builtinleds,
-          uint32_t neopixel)
-  {
-    this->page = page;
-    this->pagechange = pagechange;
-    this->hidcode = hidcode;
-    this->modcode = modcode;
-    this->leds = leds;
-    this->builtinleds = builtinleds;
-    this->neopixel = neopixel;
-  }
-  Keypage() {
-    this->page = -1;
-    this->pagechange = {69};
-    this->hidcode = {0};
-    this->modcode = {0};
-    this->leds = {false};
-    this->builtinleds = {false};
-    this->neopixel = 0;
-  }
 
-  void fill(int page,
-            std::array<int, 9> pagechange,
-            std::array<uint8_t, 9> hidcode,
-            std::array<uint8_t, 9> modcode,
-            std::array<bool, 3> leds,
-            std::array<bool, 3> builtinleds,
-            uint32_t neopixel)
-  {
-    this->page = page;
-    this->pagechange = pagechange;
-    this->hidcode = hidcode;
-    this->leds = leds;
-    this->modcode = modcode;
-    this->builtinleds = builtinleds;
-    this->neopixel = neopixel;
-  }
+// scans the key matrix, in software or on the PIO
+MatrixScanner scanner;
+// filters switch bounce out of the scanner's snapshots
+Debouncer debouncer;
+#if defined(RP9_CORE1_SCAN)
+// runs the scanner and debouncer on core 1, from RAM
+ScanCore scanCore;
+#endif
+// longest time between two passes of the keypad loop, since 'g'
+uint32_t keypadGapUs;
+uint32_t keypadUs;
+// blocks the host wrote to the drive and the longest write or flush, since 'g'
+uint32_t driveBlocks;
+uint32_t driveWorstUs;
+// the keys of every pad as of the last scan, for the HID task
+PadKeys padKeys;
+// nothing is held or waiting to be sent, so the flash can be written
+bool keypadQuiet;
+// used to avoid sending multiple consecutive zero reports for the keyboard
+bool keyPressedPreviously;
+// runs the loop's tasks, and their ids
+Scheduler sched;
+int scanId;
+int hidId;
+int bootId;
+int configId;
+int saveId;
+int pageId;
+int repeatId;
+// stops scanning while nothing is pressed
+IdleMode idleMode;
+// cursor, wheel and buttons from the mouse keys
+MouseKeys mouseKeys;
+uint32_t mouseTickUs;
+// whose report goes next when the keyboard and the mouse both have one
+ReportArbiter arbiter;
+// the rotary encoders, decoded in their pin change interrupts
+std::array<QuadratureDecoder, ENCODER_COUNT> encoders;
+// page and LED updates from the host, and key events back
+RawHidChannel rawHid;
+// the LEDs the host has taken over (flags) and what it set them to
+HostUpdate hostState;
+// the link to the other pads, if they're chained
+ChainLink chain;
+#if defined(RP9_CHAIN)
+SerialPIO chainSerial(CHAIN_TX, CHAIN_RX, 256);
+#endif
+// the last TRACE_SIZE matrix snapshots, for replaying on the PC
+TraceRecorder tracer;
+// key press counters, saved to their own flash sector now and then
+UsageStats usage;
+FlashRecord<UsageCounts> usageStore(STATS_STORE_OFFSET, STATS_STORE_MAGIC);
 
-  void print()
-  {
-    Serial.print("Page: ");
-    Serial.println(this->page);
-    Serial.println("Pagechange: ");
-    for (int i = 0; i < 9; i++){
-      Serial.println(this->pagechange[i]);
-    }
-        Serial.println("hidcode: ");
-    for (int i = 0; i < 9; i++){
-      Serial.println(this->hidcode[i]);
-    }
-        Serial.println("leds: ");
-    for (int i = 0; i < 3; i++){
-      Serial.println(this->leds[i]);
-    }
-        Serial.println("modcode: ");
-    for (int i = 0; i < 9; i++){
-      Serial.println(this->modcode[i]);
-    }
-        Serial.println("builtinleds: ");
-    for (int i = 0; i < 3; i++){
-      Serial.println(this->builtinleds[i]);
-    }
-    Serial.print("Neopixel: ");
-    Serial.println(this->neopixel);
-  }
-};
+// the blocks of stats.json on the drive, while we know where they are
+bool statsMapped;
+uint32_t statsFirstBlock;
+uint32_t statsLastBlock;
 
 // tracks if a good config is loaded
 bool invalidConfig;
 
-// stores the keypages parsed by core 0
-std::array<Keypage *, 9> keypages;
+// one of the RGB LEDs blinking over the page's, played by the LED task so
+// nothing waits for it
+struct LedBlink
+{
+  int led = -1; // in rgbLeds, -1 when there's none
+  int times;
+  uint32_t onMs;
+  uint32_t offMs;
+  uint32_t startMs;
+};
+LedBlink blink;
 
 Adafruit_NeoPixel np(1, PIN_NEOPIXEL, NEO_GRB + NEO_KHZ800);
 
-// the current page number
-int currpage;
-// the last page number
-bool pagechanged;
+// the keymap from the last good config, so we can type before the drive is up
+FlashRecord<KeymapImage> keymapStore(KEYMAP_STORE_OFFSET, KEYMAP_STORE_MAGIC);
+
+// the leader sequences' trie, matched straight out of the flash
+FlashArea leaderStore(LEADER_STORE_OFFSET, LEADER_MAX_SIZE);
+LeaderSink leaderSink = {leaderBegin, leaderWrite, leaderEnd};
+// the config being loaded had a "leader" section
+bool leaderInConfig;
+
+// library.json, kept open for the library to read pages from
+FatFile libraryFile;
+
+// this unit's matrix timings, measured at boot and with 's'
+SettleCalibration settleCal;
+FlashRecord<SettleCalibration> settleStore(SETTLE_STORE_OFFSET, SETTLE_STORE_MAGIC);
+
+// what setup() leaves for loop() to do
+enum BootStage
+{
+  BOOT_MOUNT,  // mount the file system and make the drive ready
+  BOOT_CONFIG, // check config.json against the stored keymap
+  BOOT_DONE
+};
+BootStage bootStage;
+
+// micros() when each part of the boot was done, and the settle time
+// calibrated on the way
+struct BootTimes
+{
+  uint32_t keymapUs;
+  uint32_t usbUs; // host configured us
+  uint32_t driveUs;
+  uint32_t configUs;
+  uint32_t firstReportUs;
+  uint32_t settleUs;     // 0 if the calibration failed
+  uint32_t scanSettleUs; // what the scan went with
+};
+BootTimes bootTimes;
+
+#if defined(RP9_VIRTUAL_FAT)
+// The USB drive is made up in RAM instead of being the FAT on the flash.
+// config.json on it is written out from the stored keymap.
+VirtualDrive vdrive;
+std::array<VirtualFile, 2> vfiles;
+char vconfigText[CONFIG_MAX_SIZE];
+uint32_t vconfigSize;
+uint32_t vconfigCrc; // of the config.json we last loaded or made
+volatile bool vdriveEjected;
+#endif
 
-// the list of keycodes to send - never more than 6 per the spec!
-std::array<uint8_t, 6> keycode;
-// how many keys were pressed
-uint8_t count;
-// modifier key collector
-uint8_t modifier;
+// what keypages points at
+std::array<Keypage, 9> keypageStore;
 
-// whether we've allocated memory for keypages
-bool memallocated;
+// arena, stack and heap high water marks
+RamStats ramStats;
 
 #endif
@@ -0,0 +1,601 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef MATRIX_H
+
+#define MATRIX_H
+
+#include <Arduino.h>
+#include <algorithm>
+#include <array>
+
+#if defined(ARDUINO_ARCH_RP2040)
+#include "hardware/gpio.h"
+#include "hardware/timer.h"
+// code that has to keep running while the flash is written, see scancore.h
+#define RAM_FUNC(group) __not_in_flash(group)
+#else
+#define RAM_FUNC(group)
+#endif
+
+#if defined(RP9_PIO_SCAN) && defined(ARDUINO_ARCH_RP2040)
+#include "hardware/pio.h"
+#include "hardware/pio_instructions.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+#define MATRIX_HAS_PIO 1
+#endif
+
+//--------------------------------------------------------------------+
+// Matrix Config
+//--------------------------------------------------------------------+
+
+// how long to wait after driving a column before sampling the rows
+#ifndef MATRIX_SETTLE_US
+#if defined(MATRIX_HAS_PIO)
+#define MATRIX_SETTLE_US 10
+#else
+#define MATRIX_SETTLE_US 2000
+#endif
+#endif
+
+// settle calibration: each line is timed this many times and the quickest
+// kept, since an interrupt halfway through can only make it look slower
+#define MATRIX_CALIBRATE_SAMPLES 8
+// a row that takes longer than this to settle is broken, calibration gives up
+#define MATRIX_CALIBRATE_LIMIT_US 500
+// the settle time is twice the slowest line, plus this
+#define MATRIX_CALIBRATE_MARGIN_US 1
+
+// a key has to hold still this long before its state is accepted
+#ifndef MATRIX_DEBOUNCE_US
+#define MATRIX_DEBOUNCE_US 5000
+#endif
+
+// number of snapshots kept in the ring buffer - must be a power of two
+#define MATRIX_RING_BITS 6
+#define MATRIX_RING_SIZE (1 << MATRIX_RING_BITS)
+
+// bit n is key n, numbered like handleKeypress(): row * 3 + column
+typedef uint16_t KeyMask;
+
+// what MatrixScanner::calibrate() measured, times in nanoseconds
+struct SettleCalibration
+{
+  uint32_t pollNs;                // one digitalRead() of a row
+  std::array<uint32_t, 3> fallNs; // each row falling back through its pulldown
+  std::array<uint32_t, 9> riseNs; // each held key pulling its row up
+  KeyMask held;                   // the keys riseNs has times for
+  uint16_t reserved;
+  uint32_t settleUs; // what it all comes to, 0 if a row never settled
+};
+
+//--------------------------------------------------------------------+
+// MatrixScanner Class
+//--------------------------------------------------------------------+
+
+// Produces a snapshot of the 3x3 matrix every time it changes. With
+// RP9_PIO_SCAN a PIO state machine cycles the columns and a DMA channel
+// copies changed snapshots into the ring, so the CPU only consumes them.
+// Otherwise scan() does the same job in software.
+class MatrixScanner
+{
+public:
+  std::array<uint8_t, 3> cols;
+  std::array<uint8_t, 3> rows;
+  uint32_t settleUs; // column to row settle time
+  bool usingPio;     // false if we fell back to the software scan
+  uint32_t overruns; // snapshots lost because nobody read them in time
+
+  void begin(const std::array<uint8_t, 3> &cols, const std::array<uint8_t, 3> &rows, uint32_t settleUs)
+  {
+    this->cols = cols;
+    this->rows = rows;
+    this->settleUs = settleUs;
+    this->usingPio = false;
+    this->readIndex = 0;
+    this->writeIndex = 0;
+    this->lastRaw = 0xffffffff;
+    this->current = 0;
+    this->overruns = 0;
+
+    for (auto col : cols)
+    {
+      pinMode(col, OUTPUT);
+      digitalWrite(col, false);
+    }
+
+    for (auto row : rows)
+    {
+      pinMode(row, INPUT_PULLDOWN);
+    }
+
+#if defined(MATRIX_HAS_PIO)
+    this->usingPio = beginPio();
+#endif
+  }
+
+  // runs one pass over the matrix in software. Does nothing when the PIO does the work.
+  void scan()
+  {
+    if (usingPio)
+      return;
+
+    uint32_t raw = 0;
+    for (int c = 0; c < 3; c++)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        digitalWrite(cols[i], i == c);
+      }
+      delayMicroseconds(settleUs);
+      for (int r = 0; r < 3; r++)
+      {
+        if (digitalRead(rows[r]))
+        {
+          raw |= 1 << (r * 3 + c);
+        }
+      }
+    }
+    for (auto col : cols)
+    {
+      digitalWrite(col, false);
+    }
+
+    // only changed snapshots go in the ring, same as the PIO program
+    if (raw != lastRaw)
+    {
+      lastRaw = raw;
+      ring[writeIndex & (MATRIX_RING_SIZE - 1)] = raw;
+      writeIndex++;
+    }
+  }
+
+#if defined(ARDUINO_ARCH_RP2040)
+  // The same pass as scan() for core 1, which has to run from RAM: SIO and
+  // the timer are used directly, the Arduino calls live in flash. Returns
+  // the keys rather than putting them in the ring.
+  RAM_FUNC("matrix") KeyMask scanFromRam()
+  {
+    KeyMask raw = 0;
+    for (int c = 0; c < 3; c++)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        gpio_put(cols[i], i == c);
+      }
+      uint32_t start = time_us_32();
+      while (time_us_32() - start <= settleUs)
+        ;
+      for (int r = 0; r < 3; r++)
+      {
+        if (gpio_get(rows[r]))
+        {
+          raw |= 1 << (r * 3 + c);
+        }
+      }
+    }
+    for (auto col : cols)
+    {
+      gpio_put(col, false);
+    }
+    return raw;
+  }
+#endif
+
+  // pops the next changed snapshot. Returns false if there is none.
+  bool read(KeyMask &keys)
+  {
+#if defined(MATRIX_HAS_PIO)
+    if (usingPio)
+    {
+      writeIndex = pioWriteIndex();
+    }
+#endif
+    if (readIndex == writeIndex)
+      return false;
+
+    // if we fell a whole ring behind, skip to the oldest snapshot still in there
+    if (writeIndex - readIndex > MATRIX_RING_SIZE)
+    {
+      overruns++;
+      readIndex = writeIndex - MATRIX_RING_SIZE;
+    }
+
+    uint32_t raw = ring[readIndex & (MATRIX_RING_SIZE - 1)];
+    readIndex++;
+#if defined(MATRIX_HAS_PIO)
+    keys = usingPio ? pioToKeys(raw) : raw;
+#else
+    keys = raw;
+#endif
+    current = keys;
+    return true;
+  }
+
+  // stops scanning and drives every column, so any key pulls its row high
+  void park()
+  {
+#if defined(MATRIX_HAS_PIO)
+    if (usingPio)
+    {
+      pio_sm_set_enabled(pio, sm, false);
+    }
+#endif
+    for (auto col : cols)
+    {
+      pinMode(col, OUTPUT);
+      digitalWrite(col, true);
+    }
+  }
+
+  // back to scanning after park()
+  void unpark()
+  {
+    for (auto col : cols)
+    {
+      digitalWrite(col, false);
+    }
+#if defined(MATRIX_HAS_PIO)
+    if (usingPio)
+    {
+      for (auto col : cols)
+      {
+        pio_gpio_init(pio, col);
+      }
+      pio_sm_set_enabled(pio, sm, true);
+    }
+#endif
+  }
+
+  // changes the settle time and carries on scanning with it
+  void setSettle(uint32_t us)
+  {
+    settleUs = us;
+    restart();
+  }
+
+  // Finds how long this unit's lines really take. Each row is charged with
+  // its pullup and timed falling back through the pulldown, which is what
+  // the previous column leaves behind. Keys that are held get their rise
+  // timed too, rises for keys that aren't are kept from previous. Scanning
+  // stops while it runs and carries on with the old settle time after.
+  SettleCalibration calibrate(const SettleCalibration *previous = nullptr)
+  {
+    stop();
+    for (auto col : cols)
+    {
+      pinMode(col, OUTPUT);
+      digitalWrite(col, false);
+    }
+
+    SettleCalibration cal = {};
+
+    // what a read costs, from a row that stays low with every column off
+    const uint32_t timed = 1000;
+    uint32_t start = micros();
+    uint32_t reads = pollWhile(rows[0], LOW, timed);
+    cal.pollNs = std::max<uint32_t>((micros() - start) * 1000 / std::max<uint32_t>(reads, 1), 1);
+    uint32_t limit = MATRIX_CALIBRATE_LIMIT_US * 1000 / cal.pollNs;
+
+    bool settled = true;
+    for (int r = 0; r < 3; r++)
+    {
+      uint32_t fastest = limit;
+      for (int s = 0; s < MATRIX_CALIBRATE_SAMPLES; s++)
+      {
+        pinMode(rows[r], INPUT_PULLUP);
+        uint32_t charge = pollWhile(rows[r], LOW, limit);
+        if (charge >= limit)
+          break; // something is holding it down
+        delayMicroseconds(charge * cal.pollNs / 1000 + 1); // all the way up
+        pinMode(rows[r], INPUT_PULLDOWN);
+        fastest = std::min(fastest, pollWhile(rows[r], HIGH, limit));
+      }
+      pinMode(rows[r], INPUT_PULLDOWN);
+      settled &= fastest < limit;
+      cal.fallNs[r] = (fastest + 1) * cal.pollNs;
+    }
+
+    // which keys are held, given all the time in the world
+    KeyMask held = 0;
+    for (int c = 0; c < 3; c++)
+    {
+      digitalWrite(cols[c], true);
+      delayMicroseconds(MATRIX_CALIBRATE_LIMIT_US);
+      for (int r = 0; r < 3; r++)
+      {
+        if (digitalRead(rows[r]))
+          held |= 1 << (r * 3 + c);
+      }
+      digitalWrite(cols[c], false);
+    }
+
+    for (int k = 0; k < 9; k++)
+    {
+      if (!(held & (1 << k)))
+        continue;
+      uint8_t col = cols[k % 3];
+      uint8_t row = rows[k / 3];
+      uint32_t fastest = limit;
+      for (int s = 0; s < MATRIX_CALIBRATE_SAMPLES; s++)
+      {
+        pollWhile(row, HIGH, limit);
+        digitalWrite(col, true);
+        fastest = std::min(fastest, pollWhile(row, LOW, limit));
+        digitalWrite(col, false);
+      }
+      if (fastest < limit)
+      {
+        cal.held |= 1 << k;
+        cal.riseNs[k] = (fastest + 1) * cal.pollNs;
+      }
+    }
+    if (previous)
+    {
+      for (int k = 0; k < 9; k++)
+      {
+        if ((previous->held & (1 << k)) && !(cal.held & (1 << k)))
+        {
+          cal.held |= 1 << k;
+          cal.riseNs[k] = previous->riseNs[k];
+        }
+      }
+    }
+
+    uint32_t worst = *std::max_element(cal.fallNs.begin(), cal.fallNs.end());
+    for (int k = 0; k < 9; k++)
+    {
+      if (cal.held & (1 << k))
+        worst = std::max(worst, cal.riseNs[k]);
+    }
+    if (settled)
+    {
+      cal.settleUs = (2 * worst + 999) / 1000 + MATRIX_CALIBRATE_MARGIN_US;
+    }
+
+    restart();
+    return cal;
+  }
+
+  // consumes everything pending and returns the newest snapshot
+  KeyMask state()
+  {
+    KeyMask keys;
+    while (read(keys))
+      ;
+    return current;
+  }
+
+private:
+  alignas(MATRIX_RING_SIZE * sizeof(uint32_t)) std::array<uint32_t, MATRIX_RING_SIZE> ring;
+  uint32_t readIndex;
+  uint32_t writeIndex;
+  uint32_t lastRaw;
+  KeyMask current;
+
+  // reads pin until it isn't level any more, at most limit times. Returns how many reads it stayed level.
+  static uint32_t pollWhile(uint8_t pin, int level, uint32_t limit)
+  {
+    uint32_t n = 0;
+    while (n < limit && digitalRead(pin) == level)
+      n++;
+    return n;
+  }
+
+  // stops scanning, leaving the pins to us
+  void stop()
+  {
+#if defined(MATRIX_HAS_PIO)
+    if (usingPio)
+    {
+      pio_sm_set_enabled(pio, sm, false);
+    }
+#endif
+  }
+
+  // scanning again after stop(), with the current settle time
+  void restart()
+  {
+    for (auto col : cols)
+    {
+      digitalWrite(col, false);
+    }
+#if defined(MATRIX_HAS_PIO)
+    if (usingPio)
+    {
+      // back to the top of the program, where it pulls the settle cycles
+      pio_sm_set_enabled(pio, sm, false);
+      pio_sm_clear_fifos(pio, sm);
+      pio_sm_restart(pio, sm);
+      pio_sm_exec(pio, sm, pio_encode_jmp(offset));
+      for (auto col : cols)
+      {
+        pio_gpio_init(pio, col);
+      }
+      pio_sm_put_blocking(pio, sm, settleCycles());
+      pio_sm_set_enabled(pio, sm, true);
+    }
+#endif
+  }
+
+#if defined(MATRIX_HAS_PIO)
+  PIO pio;
+  uint sm;
+  uint offset;
+  int dmaChan;
+  pio_program_t program;
+  std::array<uint16_t, 32> instructions;
+
+  // the PIO program shifts rows in left, column by column: bits 8-6 are COL1, 2-0 are COL3
+  static KeyMask pioToKeys(uint32_t raw)
+  {
+    KeyMask keys = 0;
+    for (int c = 0; c < 3; c++)
+    {
+      for (int r = 0; r < 3; r++)
+      {
+        if (raw & (1 << ((2 - c) * 3 + r)))
+        {
+          keys |= 1 << (r * 3 + c);
+        }
+      }
+    }
+    return keys;
+  }
+
+  uint32_t pioWriteIndex()
+  {
+    uint32_t written = (dma_channel_hw_addr(dmaChan)->write_addr - (uint32_t)ring.data()) / sizeof(uint32_t);
+    // the DMA address wraps inside the ring, so add whole laps from our own counter
+    uint32_t index = (writeIndex & ~(MATRIX_RING_SIZE - 1)) | written;
+    if (index < writeIndex)
+    {
+      index += MATRIX_RING_SIZE;
+    }
+    // re-arm once the (very long) transfer count runs out
+    if (!dma_channel_is_busy(dmaChan))
+    {
+      dma_channel_set_trans_count(dmaChan, 0xffffffff, true);
+    }
+    return index;
+  }
+
+  // The program below, as pioasm would write it. SET drives COL1-COL3,
+  // IN samples ROW1-ROW3, Y holds the last snapshot pushed.
+  //
+  //     pull block           ; settle cycles -> OSR, kept for good
+  //     mov y, ~null         ; make sure the first snapshot gets pushed
+  // .wrap_target
+  //     set pins, <col>      ; these four are repeated
+  //     mov x, osr           ; once per column
+  // settle:
+  //     jmp x-- settle
+  //     in pins, 3
+  //     mov x, isr
+  //     jmp x!=y changed
+  //     mov isr, null        ; nothing new, throw it away
+  // .wrap
+  // changed:
+  //     mov y, x
+  //     push noblock
+  //     jmp wrap_target
+  bool beginPio()
+  {
+    // SET and IN both need their pins next to each other
+    uint8_t colBase = std::min({cols[0], cols[1], cols[2]});
+    if (std::max({cols[0], cols[1], cols[2]}) - colBase != 2)
+      return false;
+    if (rows[1] != rows[0] + 1 || rows[2] != rows[0] + 2)
+      return false;
+
+    uint n = 0;
+    instructions[n++] = pio_encode_pull(false, true);
+    instructions[n++] = pio_encode_mov_not(pio_y, pio_null);
+    uint wrapTarget = n;
+    for (auto col : cols)
+    {
+      instructions[n++] = pio_encode_set(pio_pins, 1 << (col - colBase));
+      instructions[n++] = pio_encode_mov(pio_x, pio_osr);
+      instructions[n] = pio_encode_jmp_x_dec(n);
+      n++;
+      instructions[n++] = pio_encode_in(pio_pins, 3);
+    }
+    instructions[n++] = pio_encode_mov(pio_x, pio_isr);
+    uint jmpChanged = n++;
+    instructions[n++] = pio_encode_mov(pio_isr, pio_null);
+    uint wrap = n - 1;
+    instructions[jmpChanged] = pio_encode_jmp_x_ne_y(n);
+    instructions[n++] = pio_encode_mov(pio_y, pio_x);
+    instructions[n++] = pio_encode_push(false, false);
+    instructions[n++] = pio_encode_jmp(wrapTarget);
+
+    program = {};
+    program.instructions = instructions.data();
+    program.length = n;
+    program.origin = -1;
+
+    // the NeoPixel library also wants a state machine, so take whatever is free
+    pio = pio1;
+    if (!pio_can_add_program(pio, &program))
+    {
+      pio = pio0;
+      if (!pio_can_add_program(pio, &program))
+        return false;
+    }
+    int freeSm = pio_claim_unused_sm(pio, false);
+    if (freeSm < 0)
+      return false;
+    sm = freeSm;
+    offset = pio_add_program(pio, &program);
+
+    for (int i = 0; i < 3; i++)
+    {
+      pio_gpio_init(pio, colBase + i);
+    }
+    pio_sm_set_consecutive_pindirs(pio, sm, colBase, 3, true);
+
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + wrapTarget, offset + wrap);
+    sm_config_set_set_pins(&c, colBase, 3);
+    sm_config_set_in_pins(&c, rows[0]);
+    sm_config_set_in_shift(&c, false, false, 32);
+    pio_sm_init(pio, sm, offset, &c);
+
+    dmaChan = dma_claim_unused_channel(true);
+    dma_channel_config d = dma_channel_get_default_config(dmaChan);
+    channel_config_set_transfer_data_size(&d, DMA_SIZE_32);
+    channel_config_set_read_increment(&d, false);
+    channel_config_set_write_increment(&d, true);
+    channel_config_set_ring(&d, true, MATRIX_RING_BITS + 2); // ring size in bytes, as a power of two
+    channel_config_set_dreq(&d, pio_get_dreq(pio, sm, false));
+    dma_channel_configure(dmaChan, &d, ring.data(), &pio->rxf[sm], 0xffffffff, true);
+
+    pio_sm_put_blocking(pio, sm, settleCycles());
+    pio_sm_set_enabled(pio, sm, true);
+    return true;
+  }
+
+  uint32_t settleCycles()
+  {
+    return (uint64_t)clock_get_hz(clk_sys) * settleUs / 1000000;
+  }
+#endif
+};
+
+//--------------------------------------------------------------------+
+// Debouncer Class
+//--------------------------------------------------------------------+
+
+// Eager per-key debounce: a change is taken as soon as it is seen, then
+// that key is ignored for MATRIX_DEBOUNCE_US so its bounce can't undo it.
+// Being eager keeps a press from waiting on the debounce time.
+class Debouncer
+{
+public:
+  KeyMask stable = 0; // debounced keys
+  KeyMask raw = 0;    // last raw snapshot
+  std::array<uint32_t, 9> acceptedAt = {0};
+
+  RAM_FUNC("matrix") KeyMask update(KeyMask keys, uint32_t now)
+  {
+    raw = keys;
+    KeyMask differs = raw ^ stable;
+    for (int i = 0; i < 9; i++)
+    {
+      if ((differs & (1 << i)) && now - acceptedAt[i] >= MATRIX_DEBOUNCE_US)
+      {
+        stable ^= 1 << i;
+        acceptedAt[i] = now;
+      }
+    }
+    return stable;
+  }
+};
+
+#endif
@@ -0,0 +1,215 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef MOUSE_H
+
+#define MOUSE_H
+
+#include <Arduino.h>
+#include <array>
+
+// Mouse keys: keys that move the cursor, turn the wheel or click. The
+// motion runs on its own 1ms tick in fixed point, no floats and no waiting.
+
+//--------------------------------------------------------------------+
+// Mouse Config
+//--------------------------------------------------------------------+
+
+// how often the motion is worked out, the same as the HID poll interval
+#define MOUSE_TICK_US 1000
+
+// Keypage::mouse for keys that aren't mouse keys
+#define MOUSE_NONE 0xff
+
+// what a "mouse ..." binding does, also its bit in the held mask
+enum MouseAction : uint8_t
+{
+  MOUSE_UP,
+  MOUSE_DOWN,
+  MOUSE_LEFT,
+  MOUSE_RIGHT,
+  MOUSE_WHEEL_UP,
+  MOUSE_WHEEL_DOWN,
+  MOUSE_BUTTON1,
+  MOUSE_BUTTON2,
+  MOUSE_BUTTON3,
+  MOUSE_ACTIONS
+};
+const char *mouseActionNames[] = {"up", "down", "left", "right", "wheel_up", "wheel_down", "button1", "button2", "button3"};
+
+// how the speed goes from start to max while a direction is held
+enum MouseCurve : uint8_t
+{
+  CURVE_LINEAR,
+  CURVE_QUADRATIC, // slow for a while, good for small moves
+  CURVE_SMOOTH,    // eases in and out
+  CURVE_COUNT
+};
+const char *mouseCurveNames[] = {"linear", "quadratic", "smooth"};
+
+// from the optional top level "mouse" object in config.json
+struct MouseSettings
+{
+  uint16_t startSpeed = 200; // pixels per second as soon as a direction goes down
+  uint16_t maxSpeed = 1600;  // pixels per second after accelMs
+  uint16_t accelMs = 600;
+  uint8_t curve = CURVE_QUADRATIC;
+  uint8_t wheelSpeed = 20; // wheel steps per second
+};
+
+struct MouseReport
+{
+  uint8_t buttons;
+  int8_t x;
+  int8_t y;
+  int8_t wheel;
+};
+
+//--------------------------------------------------------------------+
+// MouseKeys Class
+//--------------------------------------------------------------------+
+
+// Turns the held mouse keys into reports. tick() runs every MOUSE_TICK_US
+// and adds that tick's motion to the pending report. Motion that doesn't
+// fit in a report, or comes while the keyboard has the endpoint, waits for
+// the next one, so none of it gets lost.
+class MouseKeys
+{
+public:
+  MouseSettings settings;
+
+  // pixels per second after ms of holding a direction
+  uint32_t speedAt(uint32_t ms)
+  {
+    if (ms >= settings.accelMs || settings.maxSpeed <= settings.startSpeed)
+      return settings.maxSpeed;
+
+    // how far along the curve, 0 to 65535 of the way there
+    uint64_t u = ms * 65536 / settings.accelMs;
+    uint64_t f = u;
+    if (settings.curve == CURVE_QUADRATIC)
+      f = u * u >> 16;
+    else if (settings.curve == CURVE_SMOOTH)
+      f = (u * u >> 16) * (3 * 65536 - 2 * u) >> 16; // 3u^2 - 2u^3
+    return settings.startSpeed + ((settings.maxSpeed - settings.startSpeed) * f >> 16);
+  }
+
+  // held has a bit per MouseAction
+  void tick(uint16_t held)
+  {
+    int dx = !!(held & (1 << MOUSE_RIGHT)) - !!(held & (1 << MOUSE_LEFT));
+    int dy = !!(held & (1 << MOUSE_DOWN)) - !!(held & (1 << MOUSE_UP));
+    if (dx || dy)
+    {
+      // 16.16 pixels this tick, diagonals as fast as straight lines (181/256 is 1/sqrt 2)
+      int32_t step = perTick(speedAt(moveMs++));
+      if (dx && dy)
+        step = step * 181 >> 8;
+      moveX += dx * step;
+      moveY += dy * step;
+    }
+    else
+    {
+      moveMs = 0;
+      moveX = moveY = 0;
+    }
+
+    int dw = !!(held & (1 << MOUSE_WHEEL_UP)) - !!(held & (1 << MOUSE_WHEEL_DOWN));
+    if (dw)
+    {
+      // the first step right away, so a tap always scrolls
+      if (!wheelMs++)
+        moveWheel = dw * 65536;
+      moveWheel += dw * perTick(settings.wheelSpeed);
+    }
+    else
+    {
+      wheelMs = 0;
+      moveWheel = 0;
+    }
+
+    take(moveX, report.x);
+    take(moveY, report.y);
+    take(moveWheel, report.wheel);
+    take(turnWheel, report.wheel);
+    report.buttons = held >> MOUSE_BUTTON1 & 0x07;
+  }
+
+  // wheel steps from an encoder, they go out with the next ticks however
+  // many came at once
+  void scroll(int32_t steps)
+  {
+    turnWheel += steps * 65536;
+  }
+
+  // a report has something in it the host hasn't had
+  bool pending()
+  {
+    return report.x || report.y || report.wheel || report.buttons != sentButtons;
+  }
+
+  // the pending report, cleared for the next
+  MouseReport send()
+  {
+    MouseReport out = report;
+    sentButtons = report.buttons;
+    report.x = report.y = report.wheel = 0;
+    return out;
+  }
+
+private:
+  MouseReport report = {};
+  uint8_t sentButtons = 0;
+  uint32_t moveMs = 0; // how long a direction has been held
+  uint32_t wheelMs = 0;
+  int32_t moveX = 0; // 16.16 pixels not reported yet
+  int32_t moveY = 0;
+  int32_t moveWheel = 0;
+  int32_t turnWheel = 0; // 16.16 steps from scroll()
+
+  // a speed per second as 16.16 per tick, rounded
+  static int32_t perTick(uint32_t perSecond)
+  {
+    return (perSecond * 65536 + 1000000 / MOUSE_TICK_US / 2) / (1000000 / MOUSE_TICK_US);
+  }
+
+  // moves the whole pixels of move into out, as many as fit
+  static void take(int32_t &move, int8_t &out)
+  {
+    int32_t whole = move / 65536;
+    int32_t room = whole > 0 ? 127 - out : -127 - out;
+    if (whole > 0 ? whole > room : whole < room)
+      whole = room;
+    out += whole;
+    move -= whole * 65536;
+  }
+};
+
+//--------------------------------------------------------------------+
+// ReportArbiter Class
+//--------------------------------------------------------------------+
+
+// The keyboard and the mouse share one interrupt endpoint, a report at a
+// time. When both have one waiting they take turns.
+class ReportArbiter
+{
+public:
+  // true if the mouse goes next
+  bool mouseGoes(bool keyboardWaiting, bool mouseWaiting)
+  {
+    if (!keyboardWaiting || !mouseWaiting)
+      return mouseWaiting;
+    mouseTurn = !mouseTurn;
+    return !mouseTurn;
+  }
+
+private:
+  bool mouseTurn = false;
+};
+
+#endif
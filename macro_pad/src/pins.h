@@ -0,0 +1,39 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef PINS_H
+
+#define PINS_H
+
+#include <Arduino.h>
+#include <array>
+
+// How the RP9 board is wired to the XIAO. The factory test firmware in
+// test_code uses this too, so there's only one copy.
+
+#define COL1 D8
+#define COL2 D9
+#define COL3 D10
+#define ROW1 D1
+#define ROW2 D2
+#define ROW3 D3
+#define LED1 D0
+#define LED2 D6
+#define LED3 D7
+// PIN_LED_R
+// PIN_LED_G
+// PIN_LED_B
+// PIN_NEOPIXEL
+// NEOPIXEL_POWER
+
+std::array<uint8_t, 3> cols = {COL1, COL2, COL3};
+std::array<uint8_t, 3> rows = {ROW1, ROW2, ROW3};
+std::array<uint8_t, 3> leds = {LED1, LED2, LED3};
+std::array<uint8_t, 3> rgbLeds = {PIN_LED_R, PIN_LED_G, PIN_LED_B};
+
+#endif
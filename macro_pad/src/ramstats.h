@@ -0,0 +1,69 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef RAMSTATS_H
+
+#define RAMSTATS_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "log.h"
+#include <malloc.h>
+
+// ends of the core 0 stack, from the linker script
+extern "C" uint32_t __StackBottom;
+extern "C" uint32_t __StackTop;
+
+#define STACK_PAINT 0xa5a5a5a5
+
+//--------------------------------------------------------------------+
+// RamStats Class
+//--------------------------------------------------------------------+
+
+// High water marks for the config arena, the stack and the heap. The
+// stack is painted with a pattern at boot and the deepest word that got
+// overwritten shows how far it has grown.
+class RamStats
+{
+public:
+  // call first thing in setup(), before the stack gets deep
+  void paintStack()
+  {
+    uint32_t here;
+    for (uint32_t *p = &__StackBottom; p < &here - 16; p++)
+    {
+      *p = STACK_PAINT;
+    }
+  }
+
+  uint32_t stackSize()
+  {
+    return (uint8_t *)&__StackTop - (uint8_t *)&__StackBottom;
+  }
+
+  // deepest the stack has been, in bytes
+  uint32_t stackPeak()
+  {
+    uint32_t *p = &__StackBottom;
+    while (p < &__StackTop && *p == STACK_PAINT)
+    {
+      p++;
+    }
+    return (uint8_t *)&__StackTop - (uint8_t *)p;
+  }
+
+  void print()
+  {
+    // newlib never gives heap back, so its arena is the peak
+    LOG_INFO("RAM: config arena %u of %u bytes, stack %u of %u bytes, heap %u bytes used (%u peak) of %u bytes",
+             configArena.peak, configArena.size, stackPeak(), stackSize(), rp2040.getUsedHeap(), mallinfo().arena,
+             rp2040.getTotalHeap());
+  }
+};
+
+#endif
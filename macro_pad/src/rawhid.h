@@ -0,0 +1,222 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef RAWHID_H
+
+#define RAWHID_H
+
+#include <Arduino.h>
+#include "chain.h"
+#include <array>
+#include <cstring>
+
+// The raw HID channel: a vendor defined HID interface of its own, so host
+// software (a stream deck app, a mute indicator) can set the page and the
+// LEDs many times a second and hear about key presses, without the serial
+// port or the drive. The USB side is in main.cpp, this is just the
+// protocol.
+//
+// Every report is RAW_HID_REPORT_SIZE bytes, the first one the command.
+//
+// host to pad:
+//   RAW_SET      flags, page, leds, rgb, neopixel r, g, b
+//                flags say which of the rest to use. leds and rgb are a bit
+//                per LED (led1 = bit 0), 1 is on. RAW_RELEASE hands the LEDs
+//                back to the page.
+//   RAW_EVENTS   1 to get a RAW_KEYS report for every key change, 0 to stop
+//   RAW_QUERY    answered with RAW_STATE
+// pad to host:
+//   RAW_KEYS     seq, page, then each pad's keys, 2 bytes little endian
+//   RAW_STATE    page, leds, rgb, neopixel r, g, b, which LEDs the host has
+//                (the RAW_SET flags), updates taken so far (4 bytes)
+
+//--------------------------------------------------------------------+
+// Raw HID Config
+//--------------------------------------------------------------------+
+
+#define RAW_HID_REPORT_SIZE 32
+
+// key events waiting for the host, the oldest go if it doesn't keep up
+#define RAW_EVENT_QUEUE 16
+
+enum RawCommand : uint8_t
+{
+  RAW_SET = 0x01,
+  RAW_EVENTS = 0x02,
+  RAW_QUERY = 0x03,
+  RAW_KEYS = 0x81,
+  RAW_STATE = 0x83
+};
+
+// RAW_SET flags
+enum RawFlags : uint8_t
+{
+  RAW_PAGE = 0x01,
+  RAW_LEDS = 0x02,
+  RAW_RGB = 0x04,
+  RAW_NEOPIXEL = 0x08,
+  RAW_RELEASE = 0x10, // applied first, so LEDs can be released and set again in one go
+};
+
+// what the host asked for, RAW_SET by RAW_SET
+struct HostUpdate
+{
+  uint8_t flags;
+  uint8_t page;
+  uint8_t leds;
+  uint8_t rgb;
+  uint32_t neopixel;
+};
+
+//--------------------------------------------------------------------+
+// RawHidChannel Class
+//--------------------------------------------------------------------+
+
+// receive() runs in the USB stack's OUT report callback and only merges
+// what came in. The loop takes the merged update once a pass, so however
+// many the host sends in a poll interval the pad does the work once, with
+// the last value of each.
+class RawHidChannel
+{
+public:
+  bool events = false; // the host wants RAW_KEYS
+
+  // statistics
+  uint32_t updates = 0;   // RAW_SETs received
+  uint32_t applied = 0;   // times the loop took them
+  uint32_t dropped = 0;   // key events the host never got
+  uint32_t rejected = 0;  // reports we didn't understand
+
+  // from the OUT report callback
+  void receive(const uint8_t *report, size_t len)
+  {
+    if (!len)
+      return;
+    switch (report[0])
+    {
+    case RAW_SET:
+    {
+      if (len < 8)
+        break;
+      uint8_t flags = report[1];
+      if (flags & RAW_RELEASE)
+      {
+        pending.flags = (pending.flags & ~(RAW_LEDS | RAW_RGB | RAW_NEOPIXEL)) | RAW_RELEASE;
+      }
+      if (flags & RAW_PAGE)
+        pending.page = report[2];
+      if (flags & RAW_LEDS)
+        pending.leds = report[3];
+      if (flags & RAW_RGB)
+        pending.rgb = report[4];
+      if (flags & RAW_NEOPIXEL)
+        pending.neopixel = (uint32_t)report[5] << 16 | report[6] << 8 | report[7];
+      pending.flags |= flags;
+      updates++;
+      return;
+    }
+    case RAW_EVENTS:
+      if (len < 2)
+        break;
+      events = report[1];
+      return;
+    case RAW_QUERY:
+      queryAsked = true;
+      return;
+    }
+    rejected++;
+  }
+
+  // what's come in since the last call, false if nothing has
+  bool take(HostUpdate &update)
+  {
+    noInterrupts();
+    update = pending;
+    pending.flags = 0;
+    interrupts();
+    if (!update.flags)
+      return false;
+    applied++;
+    return true;
+  }
+
+  // true once after a RAW_QUERY
+  bool queried()
+  {
+    bool asked = queryAsked;
+    queryAsked = false;
+    return asked;
+  }
+
+  // call when the keys or the page change
+  void keysChanged(const PadKeys &keys, uint8_t page)
+  {
+    if (!events)
+      return;
+    Report &report = push();
+    report[0] = RAW_KEYS;
+    report[1] = seq++;
+    report[2] = page;
+    for (int p = 0; p < CHAIN_MAX_PADS; p++)
+    {
+      report[3 + p * 2] = keys[p] & 0xff;
+      report[4 + p * 2] = keys[p] >> 8;
+    }
+  }
+
+  // the answer to RAW_QUERY
+  void state(uint8_t page, uint8_t leds, uint8_t rgb, uint32_t neopixel, uint8_t hostFlags)
+  {
+    Report &report = push();
+    report[0] = RAW_STATE;
+    report[1] = page;
+    report[2] = leds;
+    report[3] = rgb;
+    report[4] = neopixel >> 16;
+    report[5] = neopixel >> 8;
+    report[6] = neopixel;
+    report[7] = hostFlags;
+    memcpy(&report[8], &applied, 4);
+  }
+
+  // the next IN report for the host, false if there's none
+  bool next(uint8_t *out)
+  {
+    if (!queued)
+      return false;
+    memcpy(out, queue[first].data(), RAW_HID_REPORT_SIZE);
+    first = (first + 1) % RAW_EVENT_QUEUE;
+    queued--;
+    return true;
+  }
+
+private:
+  typedef std::array<uint8_t, RAW_HID_REPORT_SIZE> Report;
+  HostUpdate pending = {};
+  volatile bool queryAsked = false;
+  std::array<Report, RAW_EVENT_QUEUE> queue;
+  uint8_t first = 0;
+  uint8_t queued = 0;
+  uint8_t seq = 0; // lets the host see it missed some
+
+  // a blank report at the back of the queue, the oldest goes if it's full
+  Report &push()
+  {
+    if (queued == RAW_EVENT_QUEUE)
+    {
+      first = (first + 1) % RAW_EVENT_QUEUE;
+      queued--;
+      dropped++;
+    }
+    Report &report = queue[(first + queued++) % RAW_EVENT_QUEUE];
+    report.fill(0);
+    return report;
+  }
+};
+
+#endif
@@ -0,0 +1,171 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef REPEAT_H
+
+#define REPEAT_H
+
+#include <Arduino.h>
+#include "chain.h"
+#include "encoder.h"
+#include <array>
+
+// Auto-repeat made by the pad instead of the host. A key with a "repeat"
+// in config.json isn't held in the keyboard report, where the host's own
+// typematic repeat would take over. It's tapped when it goes down, again
+// after delayMs, then rate times a second, speeding up to maxRate over
+// accelMs, for as long as it's held.
+//
+// Each repeat is due a set time after the last one was due, all the way
+// back to the key going down, not after the last one happened to run. A
+// late scan or report doesn't push the rest back, and one that's very late
+// still gets its taps in.
+
+//--------------------------------------------------------------------+
+// Repeat Config
+//--------------------------------------------------------------------+
+
+// keys repeating at once, across all the chained pads
+#define REPEAT_MAX_KEYS 4
+
+// defaults for a "repeat" that leaves them out
+#define REPEAT_DELAY_MS 300
+#define REPEAT_RATE 20
+
+// A tap is two reports, a press and a release, at one per 1ms poll. This
+// leaves room for the other keys.
+#define REPEAT_MAX_RATE 100
+
+// how a key repeats, all zero for one that doesn't
+struct KeyRepeat
+{
+  uint16_t delayMs; // from the key going down to the first repeat
+  uint8_t rate;     // repeats a second at first, 0 if it doesn't repeat
+  uint8_t maxRate;  // repeats a second after accelMs, at least rate
+  uint16_t accelMs; // from the first repeat to maxRate, 0 for none
+};
+static_assert(sizeof(KeyRepeat) == 6, "keymap.bin layout changed");
+
+//--------------------------------------------------------------------+
+// KeyRepeater Class
+//--------------------------------------------------------------------+
+
+// The taps go into a TurnKeys queue, like an encoder's detents. Only use
+// it from the loop.
+class KeyRepeater
+{
+public:
+  uint32_t repeats = 0; // taps made after the first, ever
+
+  // A repeating key went down at nowUs, sending hidcode with modcode. Taps
+  // it once straight away. A key that doesn't fit with the ones already
+  // repeating only gets the one tap.
+  void press(int pad, int key, uint8_t hidcode, uint8_t modcode, const KeyRepeat &repeat, uint32_t nowUs,
+             TurnKeys &taps)
+  {
+    taps.add(hidcode, modcode, 1);
+    for (auto &slot : slots)
+    {
+      if (slot.repeat.rate)
+        continue;
+      slot = {(uint8_t)pad, (uint8_t)key, hidcode, modcode, repeat, nowUs + repeat.delayMs * 1000, 0};
+      slot.firstUs = slot.dueUs;
+      return;
+    }
+  }
+
+  // stops the keys that aren't held any more
+  void release(const PadKeys &held)
+  {
+    for (auto &slot : slots)
+    {
+      if (slot.repeat.rate && !(held[slot.pad] & (1 << slot.key)))
+        slot.repeat.rate = 0;
+    }
+  }
+
+  // forgets every key, e.g. the keymap changed under them
+  void clear()
+  {
+    for (auto &slot : slots)
+    {
+      slot.repeat.rate = 0;
+    }
+  }
+
+  bool active()
+  {
+    for (auto &slot : slots)
+    {
+      if (slot.repeat.rate)
+        return true;
+    }
+    return false;
+  }
+
+  // us from nowUs until the next repeat is due, 0 if it's due already.
+  // Only meaningful while active().
+  uint32_t untilNextUs(uint32_t nowUs)
+  {
+    int32_t soonest = INT32_MAX;
+    for (auto &slot : slots)
+    {
+      if (slot.repeat.rate)
+        soonest = std::min(soonest, (int32_t)(slot.dueUs - nowUs));
+    }
+    return std::max<int32_t>(soonest, 0);
+  }
+
+  // Adds the taps that are due by nowUs. Returns how many.
+  uint32_t run(uint32_t nowUs, TurnKeys &taps)
+  {
+    uint32_t added = 0;
+    for (auto &slot : slots)
+    {
+      if (!slot.repeat.rate)
+        continue;
+      uint32_t due = 0;
+      while ((int32_t)(nowUs - slot.dueUs) >= 0)
+      {
+        due++;
+        slot.dueUs += intervalUs(slot);
+      }
+      taps.add(slot.hidcode, slot.modcode, due);
+      added += due;
+    }
+    repeats += added;
+    return added;
+  }
+
+private:
+  struct Slot
+  {
+    uint8_t pad;
+    uint8_t key;
+    uint8_t hidcode;
+    uint8_t modcode;
+    KeyRepeat repeat; // rate 0 if the slot is free
+    uint32_t dueUs;   // the next repeat
+    uint32_t firstUs; // the first repeat, where the speeding up starts
+  };
+  std::array<Slot, REPEAT_MAX_KEYS> slots = {};
+
+  // from the repeat that's due to the one after, going linearly from rate
+  // to maxRate over accelMs
+  uint32_t intervalUs(const Slot &slot)
+  {
+    const KeyRepeat &r = slot.repeat;
+    uint32_t rate = r.rate;
+    uint32_t sinceMs = (slot.dueUs - slot.firstUs) / 1000;
+    if (r.maxRate > r.rate)
+      rate = sinceMs >= r.accelMs ? r.maxRate : r.rate + (r.maxRate - r.rate) * sinceMs / r.accelMs;
+    return 1000000 / rate;
+  }
+};
+
+#endif
@@ -0,0 +1,178 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef SCANCORE_H
+
+#define SCANCORE_H
+
+#include <Arduino.h>
+#include "matrix.h"
+#include <array>
+
+// Scanning on core 1, from RAM (RP9_CORE1_SCAN). Erasing or programming
+// the flash stops everything that runs from it, and msc_write_cb does a
+// lot of that during a config upload, holding the loop up for tens of ms
+// at a time. Core 1 runs nothing but the scan and debounce, all of it in
+// RAM, so it carries on regardless and queues every change with the time
+// it was seen. The loop works through the queue once it gets going again,
+// so a tap made while the flash was busy still comes out as a press and a
+// release, just late.
+
+#if defined(RP9_CORE1_SCAN) && defined(RP9_PIO_SCAN)
+#error "RP9_CORE1_SCAN scans in software on core 1, leave out RP9_PIO_SCAN"
+#endif
+
+//--------------------------------------------------------------------+
+// Scan Core Config
+//--------------------------------------------------------------------+
+
+// changes waiting for the loop, must be a power of two. A flash erase
+// is ~50ms, bouncing keys make a few dozen changes in that time at most.
+#define SCAN_QUEUE_SIZE 64
+
+// orders the queue's writes between the cores, inline so it runs from RAM
+#if defined(ARDUINO_ARCH_RP2040)
+#define SCAN_BARRIER() __dmb()
+#else
+#define SCAN_BARRIER() __sync_synchronize()
+#endif
+
+struct ScanEvent
+{
+  KeyMask raw;    // what the matrix read
+  KeyMask stable; // after debouncing
+  uint32_t us;    // when
+};
+
+//--------------------------------------------------------------------+
+// ScanCore Class
+//--------------------------------------------------------------------+
+
+// Core 1 calls step() (or run(), which calls it forever), the loop on
+// core 0 calls take(). Each side only writes its own end of the queue.
+class ScanCore
+{
+public:
+  // written by core 1
+  volatile KeyMask latest = 0;      // debounced keys as of the last pass
+  volatile uint32_t passes = 0;
+  volatile uint32_t worstGapUs = 0; // longest time from one pass to the next
+  volatile uint32_t dropped = 0;    // changes the queue had no room for
+  // set by core 0 while it writes the drive, and the longest gap then
+  volatile bool writing = false;
+  volatile uint32_t worstWriteGapUs = 0;
+
+  // core 1: one pass's keys, read at now
+  RAM_FUNC("scancore") void step(KeyMask raw, uint32_t now, Debouncer &debouncer)
+  {
+    uint32_t gap = now - lastUs;
+    if (passes && gap > worstGapUs)
+      worstGapUs = gap;
+    if (passes && writing && gap > worstWriteGapUs)
+      worstWriteGapUs = gap;
+    lastUs = now;
+    passes = passes + 1;
+
+    KeyMask stable = debouncer.update(raw, now);
+    if (raw != lastRaw || stable != latest)
+    {
+      if (head - tail < SCAN_QUEUE_SIZE)
+      {
+        queue[head & (SCAN_QUEUE_SIZE - 1)] = {raw, stable, now};
+        SCAN_BARRIER(); // the event is there before head says so
+        head = head + 1;
+      }
+      else
+      {
+        dropped = dropped + 1;
+      }
+      lastRaw = raw;
+    }
+    latest = stable;
+  }
+
+#if defined(ARDUINO_ARCH_RP2040)
+  // core 1: waits for start(), then scans until the power goes
+  RAM_FUNC("scancore") void run(MatrixScanner &scanner, Debouncer &debouncer)
+  {
+    while (!started)
+      ;
+    while (true)
+    {
+      if (pauseAsked)
+      {
+        paused = true;
+        while (pauseAsked)
+          ;
+        paused = false;
+        lastUs = time_us_32(); // the time paused isn't a gap
+      }
+      KeyMask raw = scanner.scanFromRam();
+      step(raw, time_us_32(), debouncer);
+    }
+  }
+#endif
+
+  // core 0: lets run() go, once the scanner is set up
+  void start()
+  {
+    started = true;
+  }
+
+  // core 0: core 1 leaves the pins alone until resume(), for sleeping or
+  // calibrating. Returns once it has stopped.
+  void pause()
+  {
+    pauseAsked = true;
+    while (started && !paused)
+      ;
+  }
+
+  void resume()
+  {
+    pauseAsked = false;
+  }
+
+  // core 0: the oldest change not taken yet. False if there isn't one.
+  bool take(ScanEvent &event)
+  {
+    if (tail == head)
+      return false;
+    SCAN_BARRIER();
+    event = queue[tail & (SCAN_QUEUE_SIZE - 1)];
+    SCAN_BARRIER(); // copied out before core 1 can reuse the slot
+    tail = tail + 1;
+    return true;
+  }
+
+  // core 0: there are changes waiting
+  bool pending()
+  {
+    return tail != head;
+  }
+
+  // core 0: back to measuring from now
+  void clearStats()
+  {
+    worstGapUs = 0;
+    worstWriteGapUs = 0;
+    dropped = 0;
+  }
+
+private:
+  std::array<ScanEvent, SCAN_QUEUE_SIZE> queue;
+  volatile uint32_t head = 0; // core 1
+  volatile uint32_t tail = 0; // core 0
+  volatile bool started = false;
+  volatile bool pauseAsked = false;
+  volatile bool paused = false;
+  uint32_t lastUs = 0;    // core 1
+  KeyMask lastRaw = 0;    // core 1
+};
+
+#endif
@@ -0,0 +1,207 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef SCHEDULER_H
+
+#define SCHEDULER_H
+
+#include <Arduino.h>
+#include "log.h"
+#include <algorithm>
+#include <array>
+
+// What the loop runs. Each task is a function that does a bit of work and
+// returns. A periodic task is due every periodUs, an event task only after
+// something signal()s it. dispatch() picks the most urgent due task (lowest
+// priority number, then the one due longest), runs it and times it.
+//
+// Nothing is preempted, a task that's running holds up everything else. To
+// keep the keypad on time a task only starts if its longest run so far
+// fits before every periodic task above it is next due. If it doesn't fit
+// it waits, letting smaller ones go first, until it's past its own
+// deadline and goes anyway. A task that
+// could never fit (reading config.json, writing the flash) isn't made to
+// wait for nothing, it goes as soon as it's picked. Either way the keypad
+// task it held up counts a missed deadline.
+
+//--------------------------------------------------------------------+
+// Scheduler Config
+//--------------------------------------------------------------------+
+
+#define SCHED_MAX_TASKS 12
+
+struct Task
+{
+  const char *name;
+  void (*run)();
+  uint8_t priority;    // 0 goes first
+  uint32_t periodUs;   // 0 to only run when signalled
+  uint32_t deadlineUs; // from when it's due to when it's done
+  bool pending;        // periodic ones always are
+  uint32_t dueUs;
+  uint32_t longestUs;  // ever, what the fit check goes by
+
+  // statistics, since clearStats()
+  uint32_t runs;
+  uint32_t worstUs;     // longest run
+  uint32_t worstLateUs; // longest from due to done
+  uint32_t missed;      // runs done after their deadline
+};
+
+//--------------------------------------------------------------------+
+// Scheduler Class
+//--------------------------------------------------------------------+
+
+// Only use it from the loop, not from interrupts or the other core.
+class Scheduler
+{
+public:
+  // Returns the id to signal() it with. The deadline defaults to the
+  // period. Periodic tasks are first due straight away.
+  int add(const char *name, void (*run)(), uint8_t priority, uint32_t periodUs, uint32_t deadlineUs = 0)
+  {
+    if (count >= SCHED_MAX_TASKS)
+      return -1;
+    Task &t = tasks[count];
+    t = {};
+    t.name = name;
+    t.run = run;
+    t.priority = priority;
+    t.periodUs = periodUs;
+    t.deadlineUs = deadlineUs ? deadlineUs : periodUs;
+    t.pending = periodUs != 0;
+    t.dueUs = micros();
+    return count++;
+  }
+
+  // The task runs once, delayUs from now. Signalling it again before then
+  // can bring it forward but doesn't put it back. A task can signal itself
+  // to run again.
+  void signal(int id, uint32_t delayUs = 0)
+  {
+    if (id < 0 || id >= count)
+      return;
+    Task &t = tasks[id];
+    uint32_t due = micros() + delayUs;
+    if (!t.pending || (int32_t)(due - t.dueUs) < 0)
+      t.dueUs = due;
+    t.pending = true;
+  }
+
+  // it's been signalled and hasn't run yet
+  bool pending(int id)
+  {
+    return id >= 0 && id < count && tasks[id].pending;
+  }
+
+  // Runs the most urgent task that's due and can go now. One that's
+  // waiting for a gap doesn't hold up the ones that fit. False if nothing
+  // ran.
+  bool dispatch()
+  {
+    uint32_t now = micros();
+    Task *next = nullptr;
+    for (int i = 0; i < count; i++)
+    {
+      Task &t = tasks[i];
+      if (!t.pending || (int32_t)(now - t.dueUs) < 0 || !fits(t, now))
+        continue;
+      if (!next || t.priority < next->priority ||
+          (t.priority == next->priority && (int32_t)(t.dueUs - next->dueUs) < 0))
+        next = &t;
+    }
+    if (!next)
+      return false;
+
+    Task &t = *next;
+    runningDue = t.dueUs;
+    startUs = now;
+    t.pending = t.periodUs != 0;
+    if (t.periodUs)
+      t.dueUs += t.periodUs;
+    t.run();
+
+    uint32_t end = micros();
+    uint32_t took = end - startUs;
+    uint32_t late = end - runningDue;
+    t.runs++;
+    t.longestUs = std::max(t.longestUs, took);
+    t.worstUs = std::max(t.worstUs, took);
+    t.worstLateUs = std::max(t.worstLateUs, late);
+    if (late > t.deadlineUs)
+      t.missed++;
+    // a periodic task that fell a whole period behind starts over from
+    // now, the runs it missed are dropped rather than run back to back
+    if (t.periodUs && (int32_t)(end - t.dueUs) >= 0)
+      t.dueUs = end;
+    return true;
+  }
+
+  // The running task was asleep until now. That isn't part of its run
+  // time, and nothing is late because of it.
+  void asleep()
+  {
+    uint32_t now = micros();
+    startUs = now;
+    runningDue = now;
+    for (int i = 0; i < count; i++)
+    {
+      if (tasks[i].pending && (int32_t)(now - tasks[i].dueUs) > 0)
+        tasks[i].dueUs = now;
+    }
+  }
+
+  void print()
+  {
+    for (int i = 0; i < count; i++)
+    {
+      Task &t = tasks[i];
+      LOG_INFO("Task %s: %u runs, worst %u us, worst %u us after due, %u missed deadlines", t.name, t.runs, t.worstUs,
+               t.worstLateUs, t.missed);
+    }
+  }
+
+  // back to measuring from now. The fit check keeps what it learnt.
+  void clearStats()
+  {
+    for (int i = 0; i < count; i++)
+    {
+      tasks[i].runs = tasks[i].worstUs = tasks[i].worstLateUs = tasks[i].missed = 0;
+    }
+  }
+
+  const Task &task(int id)
+  {
+    return tasks[id];
+  }
+
+private:
+  std::array<Task, SCHED_MAX_TASKS> tasks;
+  int count = 0;
+  uint32_t startUs = 0;    // of the running task
+  uint32_t runningDue = 0; // when the running task was due
+
+  // t's longest run ends before each periodic task above it is next due,
+  // or it never could, or t has waited past its deadline already
+  bool fits(const Task &t, uint32_t now)
+  {
+    if (now - t.dueUs > t.deadlineUs)
+      return true;
+    for (int i = 0; i < count; i++)
+    {
+      const Task &above = tasks[i];
+      if (above.priority >= t.priority || !above.periodUs || t.longestUs > above.periodUs)
+        continue;
+      if ((int32_t)(above.dueUs - now) < (int32_t)t.longestUs)
+        return false;
+    }
+    return true;
+  }
+};
+
+#endif
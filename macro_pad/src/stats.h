@@ -0,0 +1,118 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef STATS_H
+
+#define STATS_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "matrix.h"
+#include <array>
+
+//--------------------------------------------------------------------+
+// Stats Config
+//--------------------------------------------------------------------+
+
+// stats.json is a fixed size file, one flash sector. Its contents are made
+// up whenever the host reads it, the bytes on the flash are never used.
+#define STATS_FILE_SIZE 4096
+
+// how often the counters may be saved to flash. Each save uses one slot of
+// the stats sector and it's only erased when they're all used.
+#define STATS_CHECKPOINT_MS (15 * 60 * 1000)
+
+struct UsageCounts
+{
+  std::array<std::array<uint32_t, 9>, 9> presses; // [page][key]
+};
+
+//--------------------------------------------------------------------+
+// UsageStats Class
+//--------------------------------------------------------------------+
+
+// Counts key presses per page. update() runs every loop but only does any
+// counting on the loop a key goes down.
+class UsageStats
+{
+public:
+  UsageCounts counts = {};
+  bool dirty = false;          // counted since the last checkpoint
+  uint32_t lastCheckpoint = 0; // millis()
+  KeyMask lastKeys = 0;
+
+  // keys are the debounced keys, page is the page they were pressed on
+  void update(KeyMask keys, int page)
+  {
+    KeyMask pressed = keys & ~lastKeys;
+    lastKeys = keys;
+    // only config.json's pages are counted, not the library's
+    if (!pressed || page >= (int)counts.presses.size())
+      return;
+    for (int i = 0; i < 9; i++)
+    {
+      counts.presses[page][i] += (pressed >> i) & 1;
+    }
+    dirty = true;
+  }
+
+  bool due(uint32_t nowMs)
+  {
+    return dirty && nowMs - lastCheckpoint >= STATS_CHECKPOINT_MS;
+  }
+
+  void checkpointed(uint32_t nowMs)
+  {
+    dirty = false;
+    lastCheckpoint = nowMs;
+  }
+
+  // Writes stats.json into out, padded with spaces to exactly size bytes.
+  // Pages that are defined or have ever been used are listed.
+  void render(char *out, size_t size, const std::array<Keypage *, 9> &pages)
+  {
+    size_t used = 0;
+    auto print = [&](const char *format, auto... args)
+    {
+      if (used < size)
+        used += snprintf(out + used, size - used, format, args...);
+    };
+
+    uint32_t total = 0;
+    print("{\n  \"pages\": [");
+    bool first = true;
+    for (int p = 0; p < 9; p++)
+    {
+      uint32_t sum = 0;
+      for (auto n : counts.presses[p])
+      {
+        sum += n;
+      }
+      bool defined = pages[p] && pages[p]->page >= 0;
+      if (!defined && !sum)
+        continue;
+      total += sum;
+
+      print("%s\n    {\"page\": %d, \"presses\": [", first ? "" : ",", p);
+      for (int i = 0; i < 9; i++)
+      {
+        print("%s%lu", i ? ", " : "", (unsigned long)counts.presses[p][i]);
+      }
+      print("]}");
+      first = false;
+    }
+    print("\n  ],\n  \"total\": %lu\n}\n", (unsigned long)total);
+
+    // snprintf leaves a 0 behind - spaces are still valid JSON
+    used = used < size ? used : size - 1;
+    memset(out + used, ' ', size - used);
+    out[size - 1] = '\n';
+  }
+};
+
+#endif
@@ -0,0 +1,259 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef STORE_H
+
+#define STORE_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "hardware/flash.h"
+#include <algorithm>
+
+//--------------------------------------------------------------------+
+// Store Layout
+//--------------------------------------------------------------------+
+
+// Flash the firmware keeps to itself, outside the USB drive. flashTransport
+// uses the CircuitPython layout where the drive starts 1MB in, so the
+// sectors just below that are free as long as the firmware is smaller.
+#define STORE_END (1024 * 1024)
+
+// one sector each
+#define STATS_STORE_OFFSET (STORE_END - FLASH_SECTOR_SIZE)
+#define STATS_STORE_MAGIC 0x54415453 // "STAT"
+#define KEYMAP_STORE_OFFSET (STORE_END - 2 * FLASH_SECTOR_SIZE)
+#define KEYMAP_STORE_MAGIC 0x4d59454b // "KEYM"
+#define SETTLE_STORE_OFFSET (STORE_END - 3 * FLASH_SECTOR_SIZE)
+#define SETTLE_STORE_MAGIC 0x4c544553 // "SETL"
+
+// the leader sequences' trie, below those
+#define LEADER_STORE_OFFSET (STORE_END - 3 * FLASH_SECTOR_SIZE - LEADER_MAX_SIZE)
+static_assert(LEADER_MAX_SIZE % FLASH_SECTOR_SIZE == 0 && LEADER_HEADER_SIZE % FLASH_PAGE_SIZE == 0,
+              "the leader store is whole sectors, its header whole pages");
+
+extern "C" uint8_t __flash_binary_end;
+
+// false if the firmware has grown into the store at offset
+bool storeUsable(uint32_t offset)
+{
+  return (uint32_t)&__flash_binary_end - XIP_BASE <= offset;
+}
+
+// Nothing may run from flash while it's being written. With
+// RP9_CORE1_SCAN core 1 only runs from RAM, so it carries on. The drive's
+// writes come through here too, see DriveFlashTransport.
+void storeErase(uint32_t offset, uint32_t len)
+{
+  noInterrupts();
+#if !defined(RP9_CORE1_SCAN)
+  rp2040.idleOtherCore();
+#endif
+  flash_range_erase(offset, len);
+#if !defined(RP9_CORE1_SCAN)
+  rp2040.resumeOtherCore();
+#endif
+  interrupts();
+}
+
+void storeProgram(uint32_t offset, const uint8_t *data, uint32_t len)
+{
+  noInterrupts();
+#if !defined(RP9_CORE1_SCAN)
+  rp2040.idleOtherCore();
+#endif
+  flash_range_program(offset, data, len);
+#if !defined(RP9_CORE1_SCAN)
+  rp2040.resumeOtherCore();
+#endif
+  interrupts();
+}
+
+//--------------------------------------------------------------------+
+// FlashRecord Class
+//--------------------------------------------------------------------+
+
+// Keeps the latest copy of a T in one flash sector. The sector is split
+// into page aligned slots and each save goes into the next empty one, so
+// it only gets erased once every slots() saves. The newest slot with a
+// good crc wins, so losing power halfway through a save is harmless.
+template <typename T>
+class FlashRecord
+{
+public:
+  uint32_t offset; // from the start of flash
+  uint32_t magic;
+  uint32_t erases = 0; // since boot
+
+  FlashRecord(uint32_t offset, uint32_t magic) : offset(offset), magic(magic) {}
+
+  // false if the firmware has grown into the store
+  bool usable()
+  {
+    return storeUsable(offset);
+  }
+
+  static constexpr int slots()
+  {
+    return FLASH_SECTOR_SIZE / SLOT_SIZE;
+  }
+
+  // copies the newest saved T into data. Returns false if there isn't one.
+  bool load(T &data)
+  {
+    int newest = find();
+    if (newest < 0)
+      return false;
+    memcpy(&data, &slot(newest)->data, sizeof(T));
+    return true;
+  }
+
+  bool save(const T &data)
+  {
+    if (!usable())
+      return false;
+
+    int newest = find();
+    uint32_t seq = newest < 0 ? 0 : slot(newest)->seq + 1;
+
+    // next empty slot after the newest one, or start over on a fresh sector
+    int next = newest + 1;
+    bool erase = next >= slots() || !erased(next);
+    if (erase)
+      next = 0;
+
+    alignas(4) static uint8_t buffer[SLOT_SIZE];
+    memset(buffer, 0xff, sizeof(buffer));
+    Slot &out = *(Slot *)buffer;
+    out.magic = magic;
+    out.seq = seq;
+    memcpy(&out.data, &data, sizeof(T));
+    out.crc = crc32(&out, offsetof(Slot, crc));
+
+    if (erase)
+      storeErase(offset, FLASH_SECTOR_SIZE);
+    storeProgram(offset + next * SLOT_SIZE, buffer, SLOT_SIZE);
+
+    erases += erase;
+    return find() == next;
+  }
+
+private:
+  struct Slot
+  {
+    uint32_t magic;
+    uint32_t seq;
+    T data;
+    uint32_t crc; // of everything before it
+  };
+  static constexpr size_t SLOT_SIZE = (sizeof(Slot) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+  static_assert(SLOT_SIZE <= FLASH_SECTOR_SIZE, "record doesn't fit in a sector");
+
+  const Slot *slot(int i)
+  {
+    return (const Slot *)(XIP_BASE + offset + i * SLOT_SIZE);
+  }
+
+  bool erased(int i)
+  {
+    const uint32_t *p = (const uint32_t *)slot(i);
+    for (size_t n = 0; n < SLOT_SIZE / 4; n++)
+    {
+      if (p[n] != 0xffffffff)
+        return false;
+    }
+    return true;
+  }
+
+  // index of the newest good slot, or -1
+  int find()
+  {
+    if (!usable())
+      return -1;
+    int newest = -1;
+    for (int i = 0; i < slots(); i++)
+    {
+      const Slot *s = slot(i);
+      if (s->magic == magic && s->crc == crc32(s, offsetof(Slot, crc)) &&
+          (newest < 0 || (int32_t)(s->seq - slot(newest)->seq) > 0))
+        newest = i;
+    }
+    return newest;
+  }
+};
+
+//--------------------------------------------------------------------+
+// FlashArea Class
+//--------------------------------------------------------------------+
+
+// Sectors holding one image that's written whole, like the leader trie,
+// and read in place through the XIP window.
+class FlashArea
+{
+public:
+  uint32_t offset; // from the start of flash
+  uint32_t size;
+
+  FlashArea(uint32_t offset, uint32_t size) : offset(offset), size(size) {}
+
+  const uint8_t *data()
+  {
+    return (const uint8_t *)(XIP_BASE + offset);
+  }
+
+  // Erases enough sectors for bytes, a sector at a time so interrupts get
+  // a look in between. False if they don't fit.
+  bool erase(uint32_t bytes)
+  {
+    if (!storeUsable(offset) || bytes > size)
+      return false;
+    for (uint32_t at = 0; at < bytes; at += FLASH_SECTOR_SIZE)
+    {
+      storeErase(offset + at, FLASH_SECTOR_SIZE);
+    }
+    page = -1;
+    return true;
+  }
+
+  // Collects writes into whole pages and programs each once it's moved
+  // past it. Each page can only be written once after erase(), so write
+  // front to back, or jump back only to pages not written yet.
+  void write(uint32_t at, const void *data, uint32_t len)
+  {
+    const uint8_t *from = (const uint8_t *)data;
+    while (len && at < size)
+    {
+      int32_t index = at / FLASH_PAGE_SIZE;
+      if (index != page)
+      {
+        flush();
+        memset(buffer, 0xff, sizeof(buffer));
+        page = index;
+      }
+      uint32_t n = std::min<uint32_t>(len, FLASH_PAGE_SIZE - at % FLASH_PAGE_SIZE);
+      memcpy(&buffer[at % FLASH_PAGE_SIZE], from, n);
+      at += n;
+      from += n;
+      len -= n;
+    }
+  }
+
+  // programs the page that's still being collected
+  void flush()
+  {
+    if (page >= 0)
+      storeProgram(offset + page * FLASH_PAGE_SIZE, buffer, FLASH_PAGE_SIZE);
+    page = -1;
+  }
+
+private:
+  alignas(4) uint8_t buffer[FLASH_PAGE_SIZE];
+  int32_t page = -1;
+};
+
+#endif
@@ -0,0 +1,601 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef TEXT_H
+
+#define TEXT_H
+
+#include <Arduino.h>
+#include "Adafruit_TinyUSB.h"
+#include <array>
+
+// Text bindings: keys that type a whole string. The string is turned into
+// key strokes for the host's keyboard layout while it's being typed, and
+// the strokes are packed into as few keyboard reports as the host allows.
+
+//--------------------------------------------------------------------+
+// Text Config
+//--------------------------------------------------------------------+
+
+// room for the text of all text bindings together, terminating 0s included
+#define TEXT_POOL_SIZE 512
+
+// Keypage::text for keys that don't type text
+#define TEXT_NONE 0xffff
+
+// Different keys pressed in one report. Hosts handle the keys of a report
+// in order, 1 gives every character its own report for any that don't.
+#ifndef TEXT_KEYS_PER_REPORT
+#define TEXT_KEYS_PER_REPORT 6
+#endif
+
+// the host's keyboard layout, the text is typed as it would be on it
+enum TextLayout : uint8_t
+{
+  LAYOUT_US,
+  LAYOUT_UK,
+  LAYOUT_DE,
+  LAYOUT_FR,
+  LAYOUT_COUNT
+};
+const char *layoutNames[] = {"us", "uk", "de", "fr"};
+
+// how characters that aren't on the layout get typed, if at all
+enum UnicodeEntry : uint8_t
+{
+  UNICODE_NONE,
+  UNICODE_LINUX,   // ctrl+shift+u, hex, space (GTK and IBus)
+  UNICODE_WINDOWS, // hold alt, keypad +, hex (needs EnableHexNumpad in the registry)
+  UNICODE_MAC,     // hold option, hex (needs the Unicode Hex Input source)
+  UNICODE_COUNT
+};
+const char *unicodeNames[] = {"none", "linux", "windows", "mac"};
+
+// the texts of all the text bindings and how to type them
+struct TextBindings
+{
+  TextLayout layout = LAYOUT_US;
+  UnicodeEntry unicode = UNICODE_NONE;
+  uint16_t used = 0; // bytes of text
+  std::array<char, TEXT_POOL_SIZE> text = {};
+};
+
+TextBindings textBindings;
+
+//--------------------------------------------------------------------+
+// Layout Tables
+//--------------------------------------------------------------------+
+
+// where a character is on a layout. A dead key only types its accent
+// when space comes after it.
+struct LayoutKey
+{
+  uint8_t key;
+  uint8_t modifier;
+  bool dead;
+};
+
+struct LayoutExtra
+{
+  uint16_t codepoint;
+  LayoutKey at;
+};
+
+// characters past ASCII a layout can have
+#define LAYOUT_EXTRAS 16
+
+struct LayoutTable
+{
+  std::array<LayoutKey, 95> ascii = {}; // ' ' to '~'
+  std::array<LayoutExtra, LAYOUT_EXTRAS> extras = {};
+  uint8_t extraCount = 0;
+
+  constexpr void put(uint16_t c, uint8_t key, uint8_t modifier = 0, bool dead = false)
+  {
+    if (c >= ' ' && c <= '~')
+    {
+      ascii[c - ' '] = {key, modifier, dead};
+      return;
+    }
+    for (uint8_t i = 0; i < extraCount; i++)
+    {
+      if (extras[i].codepoint == c)
+      {
+        extras[i].at = {key, modifier, dead};
+        return;
+      }
+    }
+    extras[extraCount++] = {c, {key, modifier, dead}}; // too many won't compile
+  }
+
+  // nullptr if c isn't on the layout
+  constexpr const LayoutKey *find(uint32_t c) const
+  {
+    if (c >= ' ' && c <= '~')
+      return &ascii[c - ' '];
+    for (uint8_t i = 0; i < extraCount; i++)
+    {
+      if (extras[i].codepoint == c)
+        return &extras[i].at;
+    }
+    return nullptr;
+  }
+
+  // every printable ASCII character can be typed
+  constexpr bool complete() const
+  {
+    for (auto &k : ascii)
+    {
+      if (!k.key)
+        return false;
+    }
+    return true;
+  }
+};
+
+constexpr uint8_t LAYOUT_SHIFT = KEYBOARD_MODIFIER_LEFTSHIFT;
+constexpr uint8_t LAYOUT_ALTGR = KEYBOARD_MODIFIER_RIGHTALT;
+
+// the letters, in QWERTY order, with their capitals on shift
+constexpr void putLetters(LayoutTable &t, const char *qwerty)
+{
+  for (int i = 0; i < 26; i++)
+  {
+    t.put(qwerty[i], HID_KEY_A + i);
+    t.put(qwerty[i] - 'a' + 'A', HID_KEY_A + i, LAYOUT_SHIFT);
+  }
+}
+
+// the number row, 1 to 0, unshifted and shifted
+constexpr void putNumberRow(LayoutTable &t, const uint16_t *plain, const uint16_t *shifted)
+{
+  for (int i = 0; i < 10; i++)
+  {
+    t.put(plain[i], HID_KEY_1 + i);
+    t.put(shifted[i], HID_KEY_1 + i, LAYOUT_SHIFT);
+  }
+}
+
+constexpr LayoutTable usLayout()
+{
+  LayoutTable t;
+  const uint16_t digits[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9', '0'};
+  const uint16_t shifted[] = {'!', '@', '#', '$', '%', '^', '&', '*', '(', ')'};
+  putLetters(t, "abcdefghijklmnopqrstuvwxyz");
+  putNumberRow(t, digits, shifted);
+  t.put(' ', HID_KEY_SPACE);
+
+  const char plain[] = "-=[]\\;'`,./";
+  const char shift[] = "_+{}|:\"~<>?";
+  const uint8_t keys[] = {HID_KEY_MINUS, HID_KEY_EQUAL, HID_KEY_BRACKET_LEFT, HID_KEY_BRACKET_RIGHT,
+                          HID_KEY_BACKSLASH, HID_KEY_SEMICOLON, HID_KEY_APOSTROPHE, HID_KEY_GRAVE,
+                          HID_KEY_COMMA, HID_KEY_PERIOD, HID_KEY_SLASH};
+  for (int i = 0; i < 11; i++)
+  {
+    t.put(plain[i], keys[i]);
+    t.put(shift[i], keys[i], LAYOUT_SHIFT);
+  }
+  return t;
+}
+
+// US with the ISO keys and a few moved symbols
+constexpr LayoutTable ukLayout()
+{
+  LayoutTable t = usLayout();
+  t.put('"', HID_KEY_2, LAYOUT_SHIFT);
+  t.put(0xa3, HID_KEY_3, LAYOUT_SHIFT); // £
+  t.put(0x20ac, HID_KEY_4, LAYOUT_ALTGR); // €
+  t.put('@', HID_KEY_APOSTROPHE, LAYOUT_SHIFT);
+  t.put('#', HID_KEY_EUROPE_1);
+  t.put('~', HID_KEY_EUROPE_1, LAYOUT_SHIFT);
+  t.put('\\', HID_KEY_EUROPE_2);
+  t.put('|', HID_KEY_EUROPE_2, LAYOUT_SHIFT);
+  t.put(0xac, HID_KEY_GRAVE, LAYOUT_SHIFT); // ¬
+  return t;
+}
+
+// German QWERTZ
+constexpr LayoutTable deLayout()
+{
+  LayoutTable t;
+  const uint16_t digits[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9', '0'};
+  const uint16_t shifted[] = {'!', '"', 0xa7, '$', '%', '&', '/', '(', ')', '='};
+  putLetters(t, "abcdefghijklmnopqrstuvwxzy");
+  putNumberRow(t, digits, shifted);
+  t.put(' ', HID_KEY_SPACE);
+
+  t.put(0xdf, HID_KEY_MINUS); // ß
+  t.put('?', HID_KEY_MINUS, LAYOUT_SHIFT);
+  t.put('\\', HID_KEY_MINUS, LAYOUT_ALTGR);
+  t.put(0xb4, HID_KEY_EQUAL, 0, true); // ´
+  t.put('`', HID_KEY_EQUAL, LAYOUT_SHIFT, true);
+  t.put(0xfc, HID_KEY_BRACKET_LEFT); // ü
+  t.put(0xdc, HID_KEY_BRACKET_LEFT, LAYOUT_SHIFT);
+  t.put('+', HID_KEY_BRACKET_RIGHT);
+  t.put('*', HID_KEY_BRACKET_RIGHT, LAYOUT_SHIFT);
+  t.put('~', HID_KEY_BRACKET_RIGHT, LAYOUT_ALTGR);
+  t.put('#', HID_KEY_EUROPE_1);
+  t.put('\'', HID_KEY_EUROPE_1, LAYOUT_SHIFT);
+  t.put(0xf6, HID_KEY_SEMICOLON); // ö
+  t.put(0xd6, HID_KEY_SEMICOLON, LAYOUT_SHIFT);
+  t.put(0xe4, HID_KEY_APOSTROPHE); // ä
+  t.put(0xc4, HID_KEY_APOSTROPHE, LAYOUT_SHIFT);
+  t.put('^', HID_KEY_GRAVE, 0, true);
+  t.put(0xb0, HID_KEY_GRAVE, LAYOUT_SHIFT); // °
+  t.put(',', HID_KEY_COMMA);
+  t.put(';', HID_KEY_COMMA, LAYOUT_SHIFT);
+  t.put('.', HID_KEY_PERIOD);
+  t.put(':', HID_KEY_PERIOD, LAYOUT_SHIFT);
+  t.put('-', HID_KEY_SLASH);
+  t.put('_', HID_KEY_SLASH, LAYOUT_SHIFT);
+  t.put('<', HID_KEY_EUROPE_2);
+  t.put('>', HID_KEY_EUROPE_2, LAYOUT_SHIFT);
+  t.put('|', HID_KEY_EUROPE_2, LAYOUT_ALTGR);
+
+  t.put('@', HID_KEY_Q, LAYOUT_ALTGR);
+  t.put(0x20ac, HID_KEY_E, LAYOUT_ALTGR); // €
+  t.put(0xb5, HID_KEY_M, LAYOUT_ALTGR);   // µ
+  t.put(0xb2, HID_KEY_2, LAYOUT_ALTGR);   // ²
+  t.put(0xb3, HID_KEY_3, LAYOUT_ALTGR);   // ³
+  t.put('{', HID_KEY_7, LAYOUT_ALTGR);
+  t.put('[', HID_KEY_8, LAYOUT_ALTGR);
+  t.put(']', HID_KEY_9, LAYOUT_ALTGR);
+  t.put('}', HID_KEY_0, LAYOUT_ALTGR);
+  return t;
+}
+
+// French AZERTY, as on Windows (~ and ` are dead keys there)
+constexpr LayoutTable frLayout()
+{
+  LayoutTable t;
+  const uint16_t plain[] = {'&', 0xe9, '"', '\'', '(', '-', 0xe8, '_', 0xe7, 0xe0}; // é è ç à
+  const uint16_t digits[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9', '0'};
+  putLetters(t, "qbcdefghijklmnoparstuvzxyw");
+  putNumberRow(t, plain, digits);
+  t.put(' ', HID_KEY_SPACE);
+  t.put('m', HID_KEY_SEMICOLON);
+  t.put('M', HID_KEY_SEMICOLON, LAYOUT_SHIFT);
+  t.put(',', HID_KEY_M);
+  t.put('?', HID_KEY_M, LAYOUT_SHIFT);
+
+  t.put(')', HID_KEY_MINUS);
+  t.put(0xb0, HID_KEY_MINUS, LAYOUT_SHIFT); // °
+  t.put(']', HID_KEY_MINUS, LAYOUT_ALTGR);
+  t.put('=', HID_KEY_EQUAL);
+  t.put('+', HID_KEY_EQUAL, LAYOUT_SHIFT);
+  t.put('}', HID_KEY_EQUAL, LAYOUT_ALTGR);
+  t.put(0xa8, HID_KEY_BRACKET_LEFT, LAYOUT_SHIFT, true); // ¨
+  t.put('$', HID_KEY_BRACKET_RIGHT);
+  t.put(0xa3, HID_KEY_BRACKET_RIGHT, LAYOUT_SHIFT); // £
+  t.put(0xa4, HID_KEY_BRACKET_RIGHT, LAYOUT_ALTGR); // ¤
+  t.put('*', HID_KEY_EUROPE_1);
+  t.put(0xb5, HID_KEY_EUROPE_1, LAYOUT_SHIFT); // µ
+  t.put(0xf9, HID_KEY_APOSTROPHE);             // ù
+  t.put('%', HID_KEY_APOSTROPHE, LAYOUT_SHIFT);
+  t.put(0xb2, HID_KEY_GRAVE); // ²
+  t.put(';', HID_KEY_COMMA);
+  t.put('.', HID_KEY_COMMA, LAYOUT_SHIFT);
+  t.put(':', HID_KEY_PERIOD);
+  t.put('/', HID_KEY_PERIOD, LAYOUT_SHIFT);
+  t.put('!', HID_KEY_SLASH);
+  t.put(0xa7, HID_KEY_SLASH, LAYOUT_SHIFT); // §
+  t.put('<', HID_KEY_EUROPE_2);
+  t.put('>', HID_KEY_EUROPE_2, LAYOUT_SHIFT);
+
+  t.put(0x20ac, HID_KEY_E, LAYOUT_ALTGR); // €
+  t.put('~', HID_KEY_2, LAYOUT_ALTGR, true);
+  t.put('#', HID_KEY_3, LAYOUT_ALTGR);
+  t.put('{', HID_KEY_4, LAYOUT_ALTGR);
+  t.put('[', HID_KEY_5, LAYOUT_ALTGR);
+  t.put('|', HID_KEY_6, LAYOUT_ALTGR);
+  t.put('`', HID_KEY_7, LAYOUT_ALTGR, true);
+  t.put('\\', HID_KEY_8, LAYOUT_ALTGR);
+  t.put('^', HID_KEY_9, LAYOUT_ALTGR); // not dead, unlike the one next to p
+  t.put('@', HID_KEY_0, LAYOUT_ALTGR);
+  return t;
+}
+
+// built by the compiler, they live in flash
+constexpr std::array<LayoutTable, LAYOUT_COUNT> layouts = {usLayout(), ukLayout(), deLayout(), frLayout()};
+
+constexpr bool layoutsComplete()
+{
+  for (auto &layout : layouts)
+  {
+    if (!layout.complete())
+      return false;
+  }
+  return true;
+}
+static_assert(layoutsComplete(), "every layout must have all of printable ASCII");
+
+//--------------------------------------------------------------------+
+// Characters To Strokes
+//--------------------------------------------------------------------+
+
+// A key and the modifiers held for it. Key 0 is a break: everything is
+// let go before the next stroke.
+struct KeyStroke
+{
+  uint8_t modifier;
+  uint8_t key;
+};
+
+// most strokes one character can take (option + a surrogate pair on a Mac)
+#define TEXT_MAX_STROKES 10
+
+// Decodes one UTF-8 character from text. Returns its length in bytes, and
+// 0xfffd in c for anything malformed.
+int decodeUtf8(const char *text, uint32_t &c)
+{
+  const uint8_t *s = (const uint8_t *)text;
+  int length = s[0] < 0x80 ? 1 : (s[0] & 0xe0) == 0xc0 ? 2 : (s[0] & 0xf0) == 0xe0 ? 3 : (s[0] & 0xf8) == 0xf0 ? 4 : 0;
+  if (!length)
+  {
+    c = 0xfffd;
+    return 1;
+  }
+  c = length == 1 ? s[0] : s[0] & (0x3f >> (length - 1));
+  for (int i = 1; i < length; i++)
+  {
+    if ((s[i] & 0xc0) != 0x80)
+    {
+      c = 0xfffd;
+      return i;
+    }
+    c = (c << 6) | (s[i] & 0x3f);
+  }
+  return length;
+}
+
+// writes c into out in hex, padded to at least digits digits. Returns how many it wrote.
+int hexDigits(uint32_t c, int digits, char *out)
+{
+  int n = 0;
+  for (int shift = 28; shift >= 0; shift -= 4)
+  {
+    if (n || (c >> shift) || shift < digits * 4)
+      out[n++] = "0123456789abcdef"[(c >> shift) & 0xf];
+  }
+  return n;
+}
+
+// Fills out with the strokes that type c. Returns how many, 0 if it can't be typed.
+int charStrokes(uint32_t c, TextLayout layout, UnicodeEntry unicode, KeyStroke *out)
+{
+  const LayoutTable &table = layouts[layout];
+  if (c == '\n' || c == '\t')
+  {
+    out[0] = {0, c == '\n' ? (uint8_t)HID_KEY_ENTER : (uint8_t)HID_KEY_TAB};
+    return 1;
+  }
+  const LayoutKey *at = table.find(c);
+  if (at && at->key)
+  {
+    out[0] = {at->modifier, at->key};
+    if (!at->dead)
+      return 1;
+    out[1] = {0, HID_KEY_SPACE};
+    return 2;
+  }
+
+  if (c == 0xfffd || c > 0x10ffff)
+    return 0;
+  char hex[8];
+  int n = 0;
+  switch (unicode)
+  {
+  case UNICODE_LINUX:
+    // the digits are read through the host's layout
+    out[n++] = {KEYBOARD_MODIFIER_LEFTCTRL | KEYBOARD_MODIFIER_LEFTSHIFT, HID_KEY_U};
+    for (int i = 0, digits = hexDigits(c, 4, hex); i < digits; i++)
+    {
+      const LayoutKey *digit = table.find(hex[i]);
+      out[n++] = {digit->modifier, digit->key};
+    }
+    out[n++] = {0, HID_KEY_SPACE};
+    return n;
+
+  case UNICODE_WINDOWS:
+    // the numbers on the keypad, the letters wherever the layout has them
+    if (c > 0xffff)
+      return 0;
+    out[n++] = {KEYBOARD_MODIFIER_LEFTALT, HID_KEY_KEYPAD_ADD};
+    for (int i = 0, digits = hexDigits(c, 4, hex); i < digits; i++)
+    {
+      uint8_t key = hex[i] <= '9' ? (hex[i] == '0' ? HID_KEY_KEYPAD_0 : HID_KEY_KEYPAD_1 + hex[i] - '1')
+                                  : table.find(hex[i])->key;
+      out[n++] = {KEYBOARD_MODIFIER_LEFTALT, key};
+    }
+    out[n++] = {0, 0};
+    return n;
+
+  case UNICODE_MAC:
+    // Unicode Hex Input is a layout of its own, always US, and only takes
+    // 4 digits at a time so the rest of the planes go as surrogate pairs
+    if (c > 0xffff)
+    {
+      c -= 0x10000;
+      c = ((0xd800 + (c >> 10)) << 16) | (0xdc00 + (c & 0x3ff));
+    }
+    for (int i = 0, digits = hexDigits(c, 4, hex); i < digits; i++)
+    {
+      out[n++] = {KEYBOARD_MODIFIER_LEFTALT, layouts[LAYOUT_US].find(hex[i])->key};
+    }
+    out[n++] = {0, 0};
+    return n;
+
+  default:
+    return 0;
+  }
+}
+
+// how many characters of text can't be typed, they'd be skipped
+int untypeable(const char *text, TextLayout layout, UnicodeEntry unicode)
+{
+  KeyStroke strokes[TEXT_MAX_STROKES];
+  int missing = 0;
+  while (*text)
+  {
+    uint32_t c;
+    text += decodeUtf8(text, c);
+    missing += !charStrokes(c, layout, unicode, strokes);
+  }
+  return missing;
+}
+
+//--------------------------------------------------------------------+
+// TextTyper Class
+//--------------------------------------------------------------------+
+
+// Types one text binding, a report at a time. Up to TEXT_KEYS_PER_REPORT
+// different keys with the same modifiers go down together, and the next
+// group replaces them in the following report. A report with nothing
+// pressed only goes in between when a key has to be pressed again or the
+// modifiers change.
+class TextTyper
+{
+public:
+  void start(const char *text, TextLayout layout, UnicodeEntry unicode)
+  {
+    this->text = text;
+    this->layout = layout;
+    this->unicode = unicode;
+    queued = 0;
+  }
+
+  // drops the rest of the text, whatever is held still gets let go
+  void stop()
+  {
+    text = nullptr;
+    queued = 0;
+  }
+
+  bool busy()
+  {
+    return (text && *text) || queued || held();
+  }
+
+  // The next report to send. Returns false once there's nothing left.
+  bool next(uint8_t &modifier, std::array<uint8_t, 6> &keys)
+  {
+    keys.fill(0);
+    refill();
+    while (queued && !queue[first].key && !held())
+    {
+      pop(); // a break with nothing to let go of
+      refill();
+    }
+    if (!queued)
+    {
+      if (!held())
+        return false;
+      modifier = 0;
+      release(0);
+      return true;
+    }
+
+    KeyStroke stroke = queue[first];
+    if (!stroke.key)
+    {
+      pop();
+      modifier = 0;
+      release(0);
+      return true;
+    }
+    if (held() && (stroke.modifier != heldModifier || isHeld(stroke.key)))
+    {
+      // let go, with the modifiers for what comes next already down
+      modifier = stroke.modifier;
+      release(modifier);
+      return true;
+    }
+
+    // different keys with the same modifiers, none of them down right now
+    modifier = stroke.modifier;
+    uint8_t n = 0;
+    while (queued && n < TEXT_KEYS_PER_REPORT)
+    {
+      stroke = queue[first];
+      if (!stroke.key || stroke.modifier != modifier || isHeld(stroke.key) || inReport(keys, n, stroke.key))
+        break;
+      keys[n++] = stroke.key;
+      pop();
+      refill();
+    }
+    heldKeys = keys;
+    heldModifier = modifier;
+    return true;
+  }
+
+private:
+  const char *text = nullptr; // the next character to turn into strokes
+  TextLayout layout = LAYOUT_US;
+  UnicodeEntry unicode = UNICODE_NONE;
+
+  // strokes waiting for a report, as a ring
+  std::array<KeyStroke, 16> queue;
+  uint8_t first = 0;
+  uint8_t queued = 0;
+
+  // what the last report had down
+  std::array<uint8_t, 6> heldKeys = {};
+  uint8_t heldModifier = 0;
+
+  // keeps enough strokes queued to fill a report
+  void refill()
+  {
+    while (text && *text && queued < TEXT_KEYS_PER_REPORT)
+    {
+      uint32_t c;
+      text += decodeUtf8(text, c);
+      KeyStroke strokes[TEXT_MAX_STROKES];
+      int n = charStrokes(c, layout, unicode, strokes); // can't type it, skip it
+      for (int i = 0; i < n; i++)
+      {
+        queue[(first + queued++) % queue.size()] = strokes[i];
+      }
+    }
+  }
+
+  void pop()
+  {
+    first = (first + 1) % queue.size();
+    queued--;
+  }
+
+  bool held()
+  {
+    return heldKeys[0] || heldModifier;
+  }
+
+  bool isHeld(uint8_t key)
+  {
+    return inReport(heldKeys, 6, key);
+  }
+
+  static bool inReport(const std::array<uint8_t, 6> &keys, uint8_t n, uint8_t key)
+  {
+    for (uint8_t i = 0; i < n; i++)
+    {
+      if (keys[i] == key)
+        return true;
+    }
+    return false;
+  }
+
+  void release(uint8_t modifier)
+  {
+    heldKeys.fill(0);
+    heldModifier = modifier;
+  }
+};
+
+static_assert(TEXT_KEYS_PER_REPORT - 1 + TEXT_MAX_STROKES <= 16, "TextTyper's queue is too small");
+
+#endif
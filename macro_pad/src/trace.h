@@ -0,0 +1,91 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef TRACE_H
+
+#define TRACE_H
+
+#include <Arduino.h>
+#include "matrix.h"
+#include <array>
+
+//--------------------------------------------------------------------+
+// Trace Format
+//--------------------------------------------------------------------+
+
+// trace.bin is a TraceHeader followed by count TraceRecords, oldest first.
+// Both are little endian with fixed layouts so the host replay can read them.
+#define TRACE_MAGIC 0x54395052 // "RP9T"
+#define TRACE_VERSION 1
+
+// number of records kept in RAM - must be a power of two
+#define TRACE_BITS 10
+#define TRACE_SIZE (1 << TRACE_BITS)
+
+// one raw matrix snapshot, as the scanner produced it
+struct TraceRecord
+{
+  uint32_t time; // micros()
+  KeyMask keys;  // raw, not debounced
+  uint8_t page;  // currpage at the time
+  uint8_t reserved;
+};
+static_assert(sizeof(TraceRecord) == 8, "trace.bin layout changed");
+
+struct TraceHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t recordSize; // sizeof(TraceRecord)
+  uint32_t count;      // records that follow
+  uint32_t dropped;    // older records that were overwritten before saving
+  uint32_t debounceUs; // MATRIX_DEBOUNCE_US of the firmware that recorded it
+  uint32_t keymapCrc;  // crc of the compiled keymap in use, to spot config mismatches
+};
+static_assert(sizeof(TraceHeader) == 24, "trace.bin layout changed");
+
+//--------------------------------------------------------------------+
+// TraceRecorder Class
+//--------------------------------------------------------------------+
+
+// Keeps the last TRACE_SIZE matrix snapshots in a ring. record() is a
+// masked store and an increment, cheap enough to leave on all the time.
+class TraceRecorder
+{
+public:
+  std::array<TraceRecord, TRACE_SIZE> ring;
+  uint32_t head = 0; // total records ever written
+
+  void record(uint32_t time, KeyMask keys, uint8_t page)
+  {
+    ring[head & (TRACE_SIZE - 1)] = {time, keys, page, 0};
+    head++;
+  }
+
+  // writes the ring to file, oldest first. File just needs write(const void *, size_t).
+  template <typename File>
+  bool save(File &file, uint32_t keymapCrc)
+  {
+    uint32_t count = head < TRACE_SIZE ? head : TRACE_SIZE;
+    TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord), count,
+                          head - count, MATRIX_DEBOUNCE_US, keymapCrc};
+    if ((size_t)file.write(&header, sizeof(header)) != sizeof(header))
+      return false;
+
+    // the oldest record is at head, unless the ring hasn't wrapped yet
+    uint32_t first = (head - count) & (TRACE_SIZE - 1);
+    uint32_t toEnd = TRACE_SIZE - first < count ? TRACE_SIZE - first : count;
+    size_t bytes = toEnd * sizeof(TraceRecord);
+    if ((size_t)file.write(&ring[first], bytes) != bytes)
+      return false;
+    bytes = (count - toEnd) * sizeof(TraceRecord);
+    return !bytes || (size_t)file.write(&ring[0], bytes) == bytes;
+  }
+};
+
+#endif
@@ -0,0 +1,433 @@
+/*********************************************************************
+ See main.cpp for full header-text.
+
+ MIT license, check LICENSE for more information
+ Copyright (c) 2022 John Scimone
+ All text above must be included in any redistribution
+*********************************************************************/
+
+#ifndef VFAT_H
+
+#define VFAT_H
+
+#include <Arduino.h>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+
+// A small FAT12 drive that only exists in RAM. The boot sector is made up
+// on every read, the FAT and root directory are built by begin() and the
+// files' contents come from callbacks. Whatever the host writes lands in
+// RAM too, so the flash never sees FAT bookkeeping and formatting the
+// drive just resets this view. main.cpp's MSC callbacks call read() and
+// write().
+
+//--------------------------------------------------------------------+
+// Drive Layout
+//--------------------------------------------------------------------+
+
+#define VFAT_SECTOR_SIZE 512
+#define VFAT_SECTORS 256 // 128 KB, one sector per cluster
+#define VFAT_ROOT_ENTRIES 64
+
+// sector 0 is the boot sector, then two copies of the FAT, the root
+// directory and the data area, which starts with cluster 2
+#define VFAT_FAT_START 1
+#define VFAT_ROOT_START 3
+#define VFAT_ROOT_SECTORS (VFAT_ROOT_ENTRIES * 32 / VFAT_SECTOR_SIZE)
+#define VFAT_DATA_START (VFAT_ROOT_START + VFAT_ROOT_SECTORS)
+#define VFAT_CLUSTERS (VFAT_SECTORS - VFAT_DATA_START)
+
+// data sectors written by the host that we hold on to
+#define VFAT_SCRATCH_SECTORS 24
+
+// what VirtualDrive::readFile() returns when it has no file to give
+#define VFAT_FILE_MISSING -1 // there's no such file
+#define VFAT_FILE_BROKEN -2  // too big, or it lost sectors to a full scratch
+
+static_assert((VFAT_CLUSTERS + 2) * 3 / 2 <= VFAT_SECTOR_SIZE, "FAT doesn't fit in one sector");
+
+//--------------------------------------------------------------------+
+// VirtualFile
+//--------------------------------------------------------------------+
+
+struct VirtualFile
+{
+  const char *name; // up to 13 characters, gets a long file name entry
+  bool readOnly;
+  uint32_t size;
+  // fills one sector of the file, offset is a multiple of VFAT_SECTOR_SIZE
+  void (*read)(uint32_t offset, uint8_t *sector);
+  uint16_t firstCluster; // set by begin()
+};
+
+//--------------------------------------------------------------------+
+// VirtualDrive Class
+//--------------------------------------------------------------------+
+
+class VirtualDrive
+{
+public:
+  uint32_t lastWrite = 0; // millis() of the last sector the host wrote
+  uint32_t writes = 0;    // sectors written since begin()
+  uint32_t dropped = 0;   // written sectors forgotten because scratch was full
+
+  // lays the files out one after the other and builds the FAT and root directory
+  bool begin(VirtualFile *files, int count)
+  {
+    this->files = files;
+    this->count = count;
+    fat.fill(0);
+    root.fill(0);
+    for (auto &s : scratch)
+    {
+      s.lba = 0; // never a data sector
+    }
+    writes = dropped = 0;
+
+    // media byte and end of chain marker in the first two entries
+    setEntry(0, 0xff8);
+    setEntry(1, 0xfff);
+
+    // the volume label comes first
+    uint8_t *entry = root.data();
+    memcpy(entry, "RP9        ", 11);
+    entry[11] = 0x08;
+
+    uint16_t cluster = 2;
+    for (int f = 0; f < count && 2 * f + 2 < VFAT_ROOT_ENTRIES; f++)
+    {
+      VirtualFile &file = files[f];
+      if (strlen(file.name) > 13)
+        return false;
+      uint16_t clusters = (file.size + VFAT_SECTOR_SIZE - 1) / VFAT_SECTOR_SIZE;
+      if (cluster + clusters > VFAT_CLUSTERS + 2)
+        return false;
+      file.firstCluster = clusters ? cluster : 0;
+      for (uint16_t c = 0; c < clusters; c++)
+      {
+        setEntry(cluster + c, c + 1 < clusters ? cluster + c + 1 : 0xfff);
+      }
+
+      // a long name entry, then the short name NAME~N.EXT it belongs to
+      uint8_t *lfn = root.data() + (2 * f + 1) * 32;
+      entry = lfn + 32;
+      shortName(file.name, f + 1, entry);
+      longName(file.name, checksum(entry), lfn);
+      entry[11] = file.readOnly ? 0x01 : 0x00;
+      put16(entry + 24, VFAT_DATE);
+      put16(entry + 18, VFAT_DATE);
+      put16(entry + 16, VFAT_DATE);
+      put16(entry + 26, file.firstCluster);
+      put32(entry + 28, file.size);
+      cluster += clusters;
+    }
+    return true;
+  }
+
+  void read(uint32_t lba, uint8_t *sector)
+  {
+    memset(sector, 0, VFAT_SECTOR_SIZE);
+    if (lba == 0)
+    {
+      bootSector(sector);
+    }
+    else if (lba < VFAT_ROOT_START)
+    {
+      memcpy(sector, fat.data(), VFAT_SECTOR_SIZE);
+    }
+    else if (lba < VFAT_DATA_START)
+    {
+      memcpy(sector, root.data() + (lba - VFAT_ROOT_START) * VFAT_SECTOR_SIZE, VFAT_SECTOR_SIZE);
+    }
+    else if (lba < VFAT_SECTORS)
+    {
+      dataSector(lba, sector);
+    }
+  }
+
+  void write(uint32_t lba, const uint8_t *sector, uint32_t now)
+  {
+    lastWrite = now;
+    writes++;
+    if (lba == 0 || lba >= VFAT_SECTORS)
+    {
+      // the boot sector is always made up, so formatting changes nothing
+    }
+    else if (lba < VFAT_ROOT_START)
+    {
+      memcpy(fat.data(), sector, VFAT_SECTOR_SIZE); // both copies are the same one
+    }
+    else if (lba < VFAT_DATA_START)
+    {
+      memcpy(root.data() + (lba - VFAT_ROOT_START) * VFAT_SECTOR_SIZE, sector, VFAT_SECTOR_SIZE);
+    }
+    else
+    {
+      Scratch *s = findScratch(lba);
+      if (!s)
+      {
+        // take the oldest slot
+        s = &scratch[nextScratch];
+        nextScratch = (nextScratch + 1) % VFAT_SCRATCH_SECTORS;
+        dropped += s->lba != 0;
+        s->lba = lba;
+      }
+      memcpy(s->data, sector, VFAT_SECTOR_SIZE);
+    }
+  }
+
+  // Copies the file called name (as the host left the drive, matched on
+  // its long name without caring about case) into out. Returns its size,
+  // VFAT_FILE_MISSING or VFAT_FILE_BROKEN.
+  int32_t readFile(const char *name, uint8_t *out, size_t size)
+  {
+    char found[14] = "";
+    for (int e = 0; e < VFAT_ROOT_ENTRIES; e++)
+    {
+      const uint8_t *entry = root.data() + e * 32;
+      if (entry[0] == 0)
+        break;
+      if (entry[0] == 0xe5)
+      {
+        found[0] = 0;
+        continue;
+      }
+      if (entry[11] == 0x0f)
+      {
+        // only single entry long names (13 characters) are of interest
+        found[0] = 0;
+        if (entry[0] == 0x41)
+          readLongName(entry, found);
+        continue;
+      }
+      if ((entry[11] & 0x18) || !matches(name, found, entry))
+      {
+        found[0] = 0;
+        continue;
+      }
+
+      uint32_t fileSize = get32(entry + 28);
+      if (fileSize > size)
+        return VFAT_FILE_BROKEN;
+      uint16_t cluster = get16(entry + 26);
+      uint8_t sector[VFAT_SECTOR_SIZE];
+      for (uint32_t done = 0; done < fileSize; done += VFAT_SECTOR_SIZE)
+      {
+        if (cluster < 2 || cluster >= VFAT_CLUSTERS + 2)
+          return VFAT_FILE_BROKEN;
+        uint32_t lba = VFAT_DATA_START + cluster - 2;
+        if (!findScratch(lba) && !ownedBy(lba))
+          return VFAT_FILE_BROKEN; // written by the host and forgotten since
+        dataSector(lba, sector);
+        memcpy(out + done, sector, fileSize - done < VFAT_SECTOR_SIZE ? fileSize - done : VFAT_SECTOR_SIZE);
+        cluster = getEntry(cluster);
+      }
+      return fileSize;
+    }
+    return VFAT_FILE_MISSING;
+  }
+
+private:
+  // 2022-01-01, the date on everything
+  static constexpr uint16_t VFAT_DATE = ((2022 - 1980) << 9) | (1 << 5) | 1;
+
+  struct Scratch
+  {
+    uint32_t lba;
+    uint8_t data[VFAT_SECTOR_SIZE];
+  };
+
+  VirtualFile *files = nullptr;
+  int count = 0;
+  std::array<uint8_t, VFAT_SECTOR_SIZE> fat;
+  std::array<uint8_t, VFAT_ROOT_SECTORS * VFAT_SECTOR_SIZE> root;
+  std::array<Scratch, VFAT_SCRATCH_SECTORS> scratch;
+  int nextScratch = 0;
+
+  // where the 13 characters of a long name entry go
+  static constexpr uint8_t LFN_OFFSETS[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+  // NAME~N.EXT, upper case, space padded
+  static void shortName(const char *name, int n, uint8_t *entry)
+  {
+    memset(entry, ' ', 11);
+    const char *dot = strrchr(name, '.');
+    size_t base = dot ? dot - name : strlen(name);
+    for (size_t i = 0; i < base && i < 6; i++)
+    {
+      entry[i] = toupper(name[i]);
+    }
+    entry[base < 6 ? base : 6] = '~';
+    entry[(base < 6 ? base : 6) + 1] = '0' + n;
+    for (int i = 0; dot && dot[i + 1] && i < 3; i++)
+    {
+      entry[8 + i] = toupper(dot[i + 1]);
+    }
+  }
+
+  static uint8_t checksum(const uint8_t *shortName)
+  {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+    {
+      sum = ((sum & 1) << 7) + (sum >> 1) + shortName[i];
+    }
+    return sum;
+  }
+
+  static void longName(const char *name, uint8_t sum, uint8_t *entry)
+  {
+    entry[0] = 0x41; // first and last
+    entry[11] = 0x0f;
+    entry[13] = sum;
+    size_t len = strlen(name);
+    for (size_t i = 0; i < 13; i++)
+    {
+      uint16_t c = i < len ? name[i] : i == len ? 0 : 0xffff;
+      put16(entry + LFN_OFFSETS[i], c);
+    }
+  }
+
+  static void readLongName(const uint8_t *entry, char *name)
+  {
+    for (size_t i = 0; i < 13; i++)
+    {
+      uint16_t c = get16(entry + LFN_OFFSETS[i]);
+      name[i] = c < 0x80 ? c : '?';
+      if (!c)
+        break;
+    }
+    name[13] = 0;
+  }
+
+  // against the long name if there was one, otherwise the 8.3 name
+  static bool matches(const char *name, const char *longName, const uint8_t *entry)
+  {
+    char shortText[13];
+    if (!*longName)
+    {
+      int n = 0;
+      for (int i = 0; i < 8 && entry[i] != ' '; i++)
+        shortText[n++] = entry[i];
+      if (entry[8] != ' ')
+        shortText[n++] = '.';
+      for (int i = 8; i < 11 && entry[i] != ' '; i++)
+        shortText[n++] = entry[i];
+      shortText[n] = 0;
+      longName = shortText;
+    }
+    return !strcasecmp(name, longName);
+  }
+
+  static void put16(uint8_t *p, uint16_t v)
+  {
+    p[0] = v;
+    p[1] = v >> 8;
+  }
+
+  static void put32(uint8_t *p, uint32_t v)
+  {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+  }
+
+  static uint16_t get16(const uint8_t *p)
+  {
+    return p[0] | p[1] << 8;
+  }
+
+  static uint32_t get32(const uint8_t *p)
+  {
+    return get16(p) | (uint32_t)get16(p + 2) << 16;
+  }
+
+  // FAT12 packs two 12 bit entries into three bytes
+  void setEntry(uint16_t cluster, uint16_t value)
+  {
+    uint8_t *p = fat.data() + cluster * 3 / 2;
+    if (cluster & 1)
+    {
+      p[0] = (p[0] & 0x0f) | (value << 4);
+      p[1] = value >> 4;
+    }
+    else
+    {
+      p[0] = value;
+      p[1] = (p[1] & 0xf0) | ((value >> 8) & 0x0f);
+    }
+  }
+
+  uint16_t getEntry(uint16_t cluster)
+  {
+    uint16_t v = get16(fat.data() + cluster * 3 / 2);
+    return cluster & 1 ? v >> 4 : v & 0xfff;
+  }
+
+  Scratch *findScratch(uint32_t lba)
+  {
+    for (auto &s : scratch)
+    {
+      if (s.lba == lba)
+        return &s;
+    }
+    return nullptr;
+  }
+
+  // the file that begin() put in this sector, if any
+  VirtualFile *ownedBy(uint32_t lba)
+  {
+    uint16_t cluster = lba - VFAT_DATA_START + 2;
+    for (int f = 0; f < count; f++)
+    {
+      uint16_t clusters = (files[f].size + VFAT_SECTOR_SIZE - 1) / VFAT_SECTOR_SIZE;
+      if (files[f].firstCluster && cluster >= files[f].firstCluster && cluster < files[f].firstCluster + clusters)
+        return &files[f];
+    }
+    return nullptr;
+  }
+
+  // what the host wrote there, or else the file that was there, or else zeros
+  void dataSector(uint32_t lba, uint8_t *sector)
+  {
+    Scratch *s = findScratch(lba);
+    if (s)
+    {
+      memcpy(sector, s->data, VFAT_SECTOR_SIZE);
+      return;
+    }
+    memset(sector, 0, VFAT_SECTOR_SIZE);
+    VirtualFile *file = ownedBy(lba);
+    if (file)
+    {
+      file->read((lba - VFAT_DATA_START + 2 - file->firstCluster) * VFAT_SECTOR_SIZE, sector);
+    }
+  }
+
+  void bootSector(uint8_t *sector)
+  {
+    const uint8_t jump[] = {0xeb, 0x3c, 0x90};
+    memcpy(sector, jump, 3);
+    memcpy(sector + 3, "MSDOS5.0", 8);
+    put16(sector + 11, VFAT_SECTOR_SIZE);
+    sector[13] = 1; // sectors per cluster
+    put16(sector + 14, VFAT_FAT_START); // reserved sectors
+    sector[16] = 2; // FATs
+    put16(sector + 17, VFAT_ROOT_ENTRIES);
+    put16(sector + 19, VFAT_SECTORS);
+    sector[21] = 0xf8; // fixed disk
+    put16(sector + 22, 1); // sectors per FAT
+    put16(sector + 24, 1); // sectors per track
+    put16(sector + 26, 1); // heads
+    sector[36] = 0x80; // drive number
+    sector[38] = 0x29; // extended boot signature
+    put32(sector + 39, 0x52503921); // volume serial
+    memcpy(sector + 43, "RP9        ", 11);
+    memcpy(sector + 54, "FAT12   ", 8);
+    sector[510] = 0x55;
+    sector[511] = 0xaa;
+  }
+};
+
+#endif
@@ -2,8 +2,8 @@
  Author: John Scimone
  Organization: Spark Markerspace Co
 
- This software is for the Spark_RP9 - a simple 9-key macropad built 
- around the RP2040 that an electronics beginner can assemble and 
+ This software is for the Spark_RP9 - a simple 9-key macropad built
+ around the RP2040 that an electronics beginner can assemble and
  configure.
 
  MIT license, check LICENSE for more information
@@ -12,26 +12,137 @@
 *********************************************************************/
 
 #include <Arduino.h>
-#include <xiaorp2040.h>
+#include "pins.h"
+#include "matrix.h"
 #include <Adafruit_NeoPixel.h>
+#include <math.h>
 
-//------------- Neopixel -------------//
-#ifdef PIN_NEOPIXEL
-// How many NeoPixels are attached to the Arduino?
-// use on-board defined NEOPIXEL_NUM if existed
-#ifndef NEOPIXEL_NUM
-#define NEOPIXEL_NUM 1
-#endif
-Adafruit_NeoPixel pixels = Adafruit_NeoPixel(NEOPIXEL_NUM, PIN_NEOPIXEL, NEO_GRB + NEO_KHZ800);
-#endif
+// Factory self-test and timing characterization. Checks the LEDs and the
+// NeoPixel, times this board's matrix lines, then scans as fast as they
+// allow and times every key's bounce and the scan loop itself. Everything
+// goes out over serial as one JSON object per line, with "test" saying what
+// it is, so a script can collect results from a whole batch of pads:
+//
+//   {"test":"led","name":"LED1","pin":26,"ok":true}
+//   {"test":"neopixel","show_us":34,"theory_us":30,"ok":null,"visual":true}
+//   {"test":"settle","poll_ns":64,"settle_us":10,"ok":true}
+//   {"test":"row","row":1,"fall_ns":1500}
+//   {"test":"rise","key":4,"rise_ns":70}
+//   {"test":"bounce","key":4,"edge":"press","bounce_us":830,"edges":5,"glitch":false}
+//   {"test":"scan","passes":812000,"mean_ns":12300,"min_ns":12100,"max_ns":19800,"stddev_ns":90,"theory_ns":11900}
+//   {"test":"bounce_summary","key":4,"count":20,"max_us":1900,"mean_us":700,"glitches":0}
+//
+// An "ok" of null means nothing here can tell, someone has to look.
+// Keys and rows are numbered from 1, like on the board. Send 'l' to test
+// the LEDs again, 's' to time the lines again (hold keys to get their rise
+// times) and 'b' for the bounce summary of every key.
 
-uint8_t cols[] = {D8, D9, D10};
-uint8_t rows[] = {D1, D2, D3};
+// a key that hasn't changed for this long has stopped bouncing
+#define BOUNCE_QUIET_US 20000
 
-uint8_t led_blink_counter;
-uint8_t led_index = 0;
+// how often the scan timing goes out
+#define SCAN_REPORT_MS 10000
 
-uint8_t builtin_leds[] = {LED_BUILTIN_R, LED_BUILTIN_G, LED_BUILTIN_B};
+// 24 bits at 800kHz
+#define NEOPIXEL_THEORY_US 30
+
+Adafruit_NeoPixel pixels(1, PIN_NEOPIXEL, NEO_GRB + NEO_KHZ800);
+
+MatrixScanner scanner;
+SettleCalibration settle;
+
+// one key's bounce, from its first edge until it goes quiet
+struct Bounce
+{
+  bool active;
+  bool press; // the first edge was a press
+  uint32_t firstUs;
+  uint32_t lastUs;
+  uint16_t edges;
+
+  // every bounce so far
+  uint32_t count;
+  uint32_t maxUs;
+  uint64_t totalUs;
+  uint32_t glitches; // it ended where it started, noise rather than a press
+};
+std::array<Bounce, 9> bounces;
+KeyMask lastRaw;
+
+// time between scan passes since the last report, in cycles
+struct ScanTiming
+{
+  uint32_t passes;
+  uint32_t minCycles;
+  uint32_t maxCycles;
+  uint64_t total;
+  double squares;
+  uint32_t lastCycle; // start of the pass before, 0 to skip the next one
+  uint32_t reportMs;
+};
+ScanTiming scanTiming;
+
+void testLeds();
+void testSettle();
+void trackBounce(KeyMask raw, uint32_t now);
+void timeScan(uint32_t cycle);
+void reportScan();
+void reportBounces();
+void showKey(int key);
+void handleSerial();
+
+//--------------------------------------------------------------------+
+// JSON Lines
+//--------------------------------------------------------------------+
+
+void beginRecord(const char *test)
+{
+  Serial.print("{\"test\":\"");
+  Serial.print(test);
+  Serial.print("\"");
+}
+
+void field(const char *name, uint32_t value)
+{
+  Serial.print(",\"");
+  Serial.print(name);
+  Serial.print("\":");
+  Serial.print(value);
+}
+
+void textField(const char *name, const char *value)
+{
+  Serial.print(",\"");
+  Serial.print(name);
+  Serial.print("\":\"");
+  Serial.print(value);
+  Serial.print("\"");
+}
+
+void boolField(const char *name, bool value)
+{
+  Serial.print(",\"");
+  Serial.print(name);
+  Serial.print(value ? "\":true" : "\":false");
+}
+
+// for a result only someone watching the board can give
+void nullField(const char *name)
+{
+  Serial.print(",\"");
+  Serial.print(name);
+  Serial.print("\":null");
+}
+
+void endRecord()
+{
+  Serial.println("}");
+}
+
+uint32_t cyclesToNs(uint64_t cycles)
+{
+  return cycles * 1000000000ull / rp2040.f_cpu();
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //                                                                            //
@@ -40,35 +151,20 @@ uint8_t builtin_leds[] = {LED_BUILTIN_R, LED_BUILTIN_G, LED_BUILTIN_B};
 ////////////////////////////////////////////////////////////////////////////////
 void setup()
 {
-  led_blink_counter = 0;
-#if defined(PIN_NEOPIXEL_POWER)
-  pinMode(PIN_NEOPIXEL_POWER, OUTPUT);
-  digitalWrite(PIN_NEOPIXEL_POWER, 1);
-#endif
-
-  // Setup LEDs
-  pinMode(LED0, OUTPUT);
-  digitalWrite(LED0, 0); // turn on
-  pinMode(LED1, OUTPUT);
-  digitalWrite(LED1, 1); // turn off
-  pinMode(LED2, OUTPUT);
-  digitalWrite(LED2, 1); // turn off
-  pinMode(LED_BUILTIN_R, OUTPUT);
-  digitalWrite(LED_BUILTIN_R, 1); // turn off
-  pinMode(LED_BUILTIN_G, OUTPUT);
-  digitalWrite(LED_BUILTIN_G, 1); // turn off
-  pinMode(LED_BUILTIN_B, OUTPUT);
-  digitalWrite(LED_BUILTIN_B, 1); // turn off
-
-  // Neopixel
+  Serial.begin(115200);
+  // give the serial monitor a moment, but run the tests without one too
+  while (!Serial && millis() < 5000)
+    ;
+
+  pinMode(NEOPIXEL_POWER, OUTPUT);
+  digitalWrite(NEOPIXEL_POWER, 1);
   pixels.begin();
   pixels.setBrightness(20); // out of 255
 
-  for (uint8_t i = 0; i < 3; i++)
-  {
-    pinMode(cols[i], OUTPUT);
-    pinMode(rows[i], INPUT_PULLDOWN);
-  }
+  scanner.begin(cols, rows, MATRIX_SETTLE_US);
+
+  testLeds();
+  testSettle();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -77,90 +173,255 @@ void setup()
 //                                                                            //
 ////////////////////////////////////////////////////////////////////////////////
 
+// No delays here: the loop is one scan pass and the bookkeeping, so its
+// timing is the scan timing.
 void loop()
 {
-  // poll gpio once each 2 ms
-  delay(2);
+  uint32_t cycle = rp2040.getCycleCount();
+  scanner.scan();
+  trackBounce(scanner.state(), micros());
+  timeScan(cycle);
+  handleSerial();
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
 
-  // Count loops
-  led_blink_counter += 1U;
-  // reset the count at 32
-  led_blink_counter = (led_blink_counter < 32)? led_blink_counter : 0;
-  // when the counter is 0, change color
-  if (led_blink_counter == 0)
+// Turns each LED on and off and reads its pin back, which catches a pin
+// shorted to a rail or its neighbour. The NeoPixel can't be read back, so
+// it goes red, green and blue for the eye. Its show() is timed, but that
+// says nothing about whether it lit.
+void testLeds()
+{
+  const char *names[] = {"LED1", "LED2", "LED3", "LED_R", "LED_G", "LED_B"};
+  uint8_t pins[] = {leds[0], leds[1], leds[2], rgbLeds[0], rgbLeds[1], rgbLeds[2]};
+  for (int i = 0; i < 6; i++)
   {
-    // loop over all builtin LEDs turning them all off - this could be much more efficient
-    for (uint8_t i = 0; i < sizeof(builtin_leds); i++)
-    {
-      digitalWrite(builtin_leds[i], 1); // turn off all builtin LEDS
-    }
-    // the value of led_index (0, 1, or 2) tells us which buildin LED to turn on
-    digitalWrite(builtin_leds[led_index], 0); // turn on the one we want
-    // increment the led index for next time
-    led_index += 1U;
-    // wrap the led index back to 0 after 2 since there are only three of them
-    led_index = (led_index < 3)? led_index : 0;
+    pinMode(pins[i], OUTPUT);
+    digitalWrite(pins[i], 0); // turn on
+    delay(150);
+    bool on = !digitalRead(pins[i]);
+    digitalWrite(pins[i], 1); // turn off
+    delayMicroseconds(10);
+    bool off = digitalRead(pins[i]);
+
+    beginRecord("led");
+    textField("name", names[i]);
+    field("pin", pins[i]);
+    boolField("ok", on && off);
+    endRecord();
+  }
+
+  uint32_t colors[] = {0xff0000, 0x00ff00, 0x0000ff, 0};
+  uint32_t slowest = 0;
+  for (auto color : colors)
+  {
+    pixels.fill(color);
+    uint32_t start = micros();
+    pixels.show();
+    slowest = max(slowest, (uint32_t)(micros() - start));
+    delay(300);
+  }
+  beginRecord("neopixel");
+  field("show_us", slowest);
+  field("theory_us", NEOPIXEL_THEORY_US);
+  nullField("ok");
+  boolField("visual", true);
+  endRecord();
+}
+
+// times the rows and any held keys, and scans with the result from then on
+void testSettle()
+{
+  settle = scanner.calibrate();
+  if (settle.settleUs)
+    scanner.setSettle(settle.settleUs);
+
+  beginRecord("settle");
+  field("poll_ns", settle.pollNs);
+  field("settle_us", scanner.settleUs);
+  boolField("ok", settle.settleUs != 0);
+  endRecord();
+  for (int r = 0; r < 3; r++)
+  {
+    beginRecord("row");
+    field("row", r + 1);
+    field("fall_ns", settle.fallNs[r]);
+    endRecord();
+  }
+  for (int k = 0; k < 9; k++)
+  {
+    if (!(settle.held & (1 << k)))
+      continue;
+    beginRecord("rise");
+    field("key", k + 1);
+    field("rise_ns", settle.riseNs[k]);
+    endRecord();
   }
 
-  for (uint8_t i = 0; i < 3; i++)
+  // the scan timing starts over with the new settle time
+  scanTiming = {};
+  scanTiming.minCycles = UINT32_MAX;
+  scanTiming.reportMs = millis();
+}
+
+//--------------------------------------------------------------------+
+// Bounce
+//--------------------------------------------------------------------+
+
+// Every edge on a key that isn't bouncing starts a bounce, every edge
+// after that stretches it, and it's over once the key is quiet for
+// BOUNCE_QUIET_US. The raw snapshots come straight from the scanner.
+void trackBounce(KeyMask raw, uint32_t now)
+{
+  KeyMask changed = raw ^ lastRaw;
+  lastRaw = raw;
+  for (int k = 0; k < 9; k++)
   {
-    // go through each column
-    for (uint8_t h = 0; h < 3; h++)
+    Bounce &b = bounces[k];
+    if (changed & (1 << k))
     {
-      // set the active column to 1, otherwise 0.
-      if (h == i)
+      if (!b.active)
       {
-        digitalWrite(cols[i], 1);
+        b.active = true;
+        b.press = raw & (1 << k);
+        b.firstUs = now;
+        b.edges = 0;
+        if (b.press)
+          showKey(k);
+      }
+      b.lastUs = now;
+      b.edges++;
+    }
+    else if (b.active && now - b.lastUs >= BOUNCE_QUIET_US)
+    {
+      b.active = false;
+      bool glitch = (bool)(raw & (1 << k)) != b.press;
+      uint32_t us = b.lastUs - b.firstUs;
+      if (glitch)
+      {
+        b.glitches++;
       }
       else
       {
-        digitalWrite(cols[h], 0);
+        b.count++;
+        b.totalUs += us;
+        b.maxUs = max(b.maxUs, us);
       }
-      delay(2);
+
+      beginRecord("bounce");
+      field("key", k + 1);
+      textField("edge", b.press ? "press" : "release");
+      field("bounce_us", us);
+      field("edges", b.edges);
+      boolField("glitch", glitch);
+      endRecord();
+      scanTiming.lastCycle = 0; // printing made this pass slow
     }
+  }
+}
 
-    for (uint8_t j = 0; j < 3; j++)
+void reportBounces()
+{
+  for (int k = 0; k < 9; k++)
+  {
+    Bounce &b = bounces[k];
+    beginRecord("bounce_summary");
+    field("key", k + 1);
+    field("count", b.count);
+    field("max_us", b.maxUs);
+    field("mean_us", b.count ? b.totalUs / b.count : 0);
+    field("glitches", b.glitches);
+    endRecord();
+  }
+}
+
+// the old key check: the top row lights its column's LED, the others
+// colour the NeoPixel
+void showKey(int key)
+{
+  static const uint32_t colors[9] = {0, 0, 0, 0xff0000, 0x00ff00, 0x0000ff, 0xffff00, 0x00ffff, 0xff00ff};
+  if (key < 3)
+  {
+    for (int i = 0; i < 3; i++)
     {
-      // check each row
-      if (digitalRead(rows[j]))
-      {
-        if (j == 0) // top row
-        {
-          if (i == 0) // left column 
-            digitalWrite(LED0, 0); // turn on
-          else
-            digitalWrite(LED0, 1); // turn off
-          if (i == 1) // middle column
-            digitalWrite(LED1, 0); // turn on
-          else
-            digitalWrite(LED1, 1); // turn off
-          if (i == 2) // right column
-            digitalWrite(LED2, 0); // turn on
-          else
-            digitalWrite(LED2, 1); // turn off
-        }
-        else if (j == 1) // middle row
-        {
-          if (i == 0) // left column
-            pixels.fill(0xff0000);
-          if (i == 1) // middle column
-            pixels.fill(0x00ff00);
-          if (i == 2) // right column
-            pixels.fill(0x0000ff);
-          pixels.show();
-        }
-        else if (j == 2) // bottom row
-        {
-          if (i == 0) // left column
-            pixels.fill(0xffff00);
-          if (i == 1) // middle column
-            pixels.fill(0x00ffff);
-          if (i == 2) // right column
-            pixels.fill(0xff00ff);
-          pixels.show();
-        }
-      }
+      digitalWrite(leds[i], i != key); // LEDs are on when low
     }
+    return;
+  }
+  pixels.fill(colors[key]);
+  pixels.show();
+  scanTiming.lastCycle = 0;
+}
+
+//--------------------------------------------------------------------+
+// Scan Timing
+//--------------------------------------------------------------------+
+
+// the time from one pass to the next, which is the scan rate the keypad
+// would get if it did nothing else
+void timeScan(uint32_t cycle)
+{
+  ScanTiming &t = scanTiming;
+  if (t.lastCycle)
+  {
+    uint32_t cycles = cycle - t.lastCycle;
+    t.passes++;
+    t.total += cycles;
+    t.squares += (double)cycles * cycles;
+    t.minCycles = min(t.minCycles, cycles);
+    t.maxCycles = max(t.maxCycles, cycles);
+  }
+  t.lastCycle = cycle;
+
+  if (millis() - t.reportMs >= SCAN_REPORT_MS)
+  {
+    reportScan();
+    t = {};
+    t.minCycles = UINT32_MAX;
+    t.reportMs = millis();
   }
+}
+
+// The theory is the settle time for each column, plus one pin access
+// (as timed by the calibration) for every column write and row read.
+void reportScan()
+{
+  ScanTiming &t = scanTiming;
+  if (!t.passes)
+    return;
+  double mean = (double)t.total / t.passes;
+  double variance = t.squares / t.passes - mean * mean;
+  uint32_t theory = 3 * scanner.settleUs * 1000 + (3 * 3 + 3 * 3 + 3) * settle.pollNs;
+
+  beginRecord("scan");
+  field("passes", t.passes);
+  field("mean_ns", cyclesToNs(mean));
+  field("min_ns", cyclesToNs(t.minCycles));
+  field("max_ns", cyclesToNs(t.maxCycles));
+  field("stddev_ns", cyclesToNs(variance > 0 ? sqrt(variance) : 0));
+  field("theory_ns", theory);
+  endRecord();
+}
 
-}
\ No newline at end of file
+// single letter commands from the serial monitor
+void handleSerial()
+{
+  if (!Serial.available())
+    return;
+
+  switch (Serial.read())
+  {
+  case 'l':
+    testLeds();
+    break;
+  case 's':
+    testSettle();
+    break;
+  case 'b':
+    reportBounces();
+    break;
+  }
+  scanTiming.lastCycle = 0;
+}
@@ -1,43 +0,0 @@
-/*********************************************************************
- See main.cpp for full header-text.
-
- MIT license, check LICENSE for more information
- Copyright (c) 2022 John Scimone
- All text above must be included in any redistribution
-*********************************************************************/
-
-#ifndef XIAORP2040_H_
-#define XIAORP2040_H_
-
-#define D0  26U
-#define A0  26U
-#define LED0 26U
-#define D1  27U
-#define A1  27U
-#define D2  28U
-#define A2  28U
-#define D3  29U
-#define A3  29U
-#define D4  6U
-#define SDA 6U
-#define D5  7U
-#define SCL 7U
-#define D6  0U
-#define TX  0U
-#define LED1 0U
-#define D7  1U
-#define RX  1U
-#define LED2 1U
-#define D8  2U
-#define SCK 2U
-#define D9  4U
-#define MISO 4U
-#define D10 3U
-#define MOSI 3U
-#define LED_BUILTIN_R 17U
-#define LED_BUILTIN_G 16U
-#define LED_BUILTIN_B 25U
-#define PIN_NEOPIXEL 12U
-#define PIN_NEOPIXEL_POWER 11U
-
-#endif
\ No newline at end of file